@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <cstring>
+#include "crc32c.hpp"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+    #include <nmmintrin.h>
+    #define CRC32C_SSE42 1
+    #define CRC32C_SSE42_TARGET __attribute__((target("sse4.2")))
+#elif (defined(_M_X64) || defined(_M_IX86)) && defined(_MSC_VER)
+    #include <intrin.h>
+    #include <nmmintrin.h>
+    #define CRC32C_SSE42 1
+    #define CRC32C_SSE42_TARGET
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+    // Only used when the compiler has been told the target has the CRC instructions, as
+    // they're optional in ARMv8.0.
+    #include <arm_acle.h>
+    #define CRC32C_ARM64 1
+#endif
+
+namespace crc32c {
+
+// Reversed Castagnoli polynomial
+static constexpr uint32_t kPolynomial = 0x82F63B78;
+
+// Tables for the "slicing-by-8" algorithm. tables[0] is the usual byte-at-a-time table;
+// tables[k][b] is the CRC of byte b followed by k zero bytes.
+struct Tables {
+    uint32_t t[8][256];
+};
+
+static constexpr Tables MakeTables() {
+    Tables tables{};
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j++) {
+            crc = (crc >> 1) ^ ((crc & 1) ? kPolynomial : 0);
+        }
+        tables.t[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int k = 1; k < 8; k++) {
+            auto prev = tables.t[k-1][i];
+            tables.t[k][i] = (prev >> 8) ^ tables.t[0][prev & 0xFF];
+        }
+    }
+    return tables;
+}
+
+static constexpr Tables kTables = MakeTables();
+
+static inline uint32_t LoadLE32(const uint8_t* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+uint32_t ExtendPortable(uint32_t crc, const void* data, size_t length) {
+    const auto& t = kTables.t;
+    auto p = static_cast<const uint8_t*>(data);
+    crc = ~crc;
+
+    while (length >= 8) {
+        auto lo = crc ^ LoadLE32(p);
+        auto hi = LoadLE32(p + 4);
+        crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+              t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+        p += 8;
+        length -= 8;
+    }
+
+    while (length-- > 0) {
+        crc = t[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+
+    return ~crc;
+}
+
+#if defined(CRC32C_SSE42)
+
+CRC32C_SSE42_TARGET
+static uint32_t ExtendHardware(uint32_t crc, const void* data, size_t length) {
+    auto p = static_cast<const uint8_t*>(data);
+    crc = ~crc;
+
+#if defined(__x86_64__) || defined(_M_X64)
+    uint64_t crc64 = crc;
+    while (length >= 8) {
+        uint64_t v;
+        std::memcpy(&v, p, sizeof(v));
+        crc64 = _mm_crc32_u64(crc64, v);
+        p += 8;
+        length -= 8;
+    }
+    crc = (uint32_t)crc64;
+#endif
+    while (length >= 4) {
+        uint32_t v;
+        std::memcpy(&v, p, sizeof(v));
+        crc = _mm_crc32_u32(crc, v);
+        p += 4;
+        length -= 4;
+    }
+    while (length-- > 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+
+    return ~crc;
+}
+
+static bool HaveHardware() {
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 20)) != 0;
+#else
+    return __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#elif defined(CRC32C_ARM64)
+
+static uint32_t ExtendHardware(uint32_t crc, const void* data, size_t length) {
+    auto p = static_cast<const uint8_t*>(data);
+    crc = ~crc;
+
+    while (length >= 8) {
+        uint64_t v;
+        std::memcpy(&v, p, sizeof(v));
+        crc = __crc32cd(crc, v);
+        p += 8;
+        length -= 8;
+    }
+    while (length-- > 0) {
+        crc = __crc32cb(crc, *p++);
+    }
+
+    return ~crc;
+}
+
+static bool HaveHardware() {
+    return true;
+}
+
+#else
+
+static uint32_t ExtendHardware(uint32_t crc, const void* data, size_t length) {
+    return ExtendPortable(crc, data, length);
+}
+
+static bool HaveHardware() {
+    return false;
+}
+
+#endif
+
+bool IsHardwareAccelerated() {
+    static const bool have_hardware = HaveHardware();
+    return have_hardware;
+}
+
+uint32_t Extend(uint32_t crc, const void* data, size_t length) {
+    if (IsHardwareAccelerated()) {
+        return ExtendHardware(crc, data, length);
+    }
+    return ExtendPortable(crc, data, length);
+}
+
+} // namespace crc32c
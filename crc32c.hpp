@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef PSICASHLIB_CRC32C_H
+#define PSICASHLIB_CRC32C_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+/// CRC-32C (Castagnoli), as used by iSCSI, ext4, etc. Uses the SSE4.2 or ARMv8 CRC
+/// instructions when they're available, and a table-driven implementation otherwise.
+namespace crc32c {
+
+/// Returns the CRC of the concatenation of the data that produced `crc` and `data`.
+/// Start with a `crc` of 0.
+uint32_t Extend(uint32_t crc, const void* data, size_t length);
+
+/// Returns the CRC of `data`.
+inline uint32_t Value(std::string_view data) { return Extend(0, data.data(), data.length()); }
+
+/// The table-driven implementation. Exposed for testing.
+uint32_t ExtendPortable(uint32_t crc, const void* data, size_t length);
+
+/// Returns true if Extend uses CPU CRC instructions.
+bool IsHardwareAccelerated();
+
+} // namespace crc32c
+
+#endif //PSICASHLIB_CRC32C_H
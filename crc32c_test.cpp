@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <string>
+#include "gtest/gtest.h"
+#include "crc32c.hpp"
+
+using namespace std;
+
+TEST(TestCRC32C, Values)
+{
+    // Test vectors: https://tools.ietf.org/html/rfc3720#appendix-B.4
+    ASSERT_EQ(crc32c::Value(string(32, '\x00')), 0x8A9136AA);
+    ASSERT_EQ(crc32c::Value(string(32, '\xFF')), 0x62A8AB43);
+
+    string ascending, descending;
+    for (int i = 0; i < 32; i++) {
+        ascending += (char)i;
+        descending += (char)(31 - i);
+    }
+    ASSERT_EQ(crc32c::Value(ascending), 0x46DD794E);
+    ASSERT_EQ(crc32c::Value(descending), 0x113FDB5C);
+
+    ASSERT_EQ(crc32c::Value("123456789"), 0xE3069283);
+    ASSERT_EQ(crc32c::Value(""), 0);
+}
+
+TEST(TestCRC32C, Extend)
+{
+    string s;
+    for (int i = 0; i < 1000; i++) {
+        s += (char)(i * 7);
+    }
+    auto want = crc32c::Value(s);
+
+    // Every split point, to cover unaligned and odd-length pieces
+    for (size_t split = 0; split <= 20; split++) {
+        auto crc = crc32c::Extend(0, s.data(), split);
+        crc = crc32c::Extend(crc, s.data() + split, s.length() - split);
+        ASSERT_EQ(crc, want) << split;
+    }
+}
+
+TEST(TestCRC32C, PortableMatchesHardware)
+{
+    string s;
+    for (int i = 0; i < 4099; i++) {
+        s += (char)(i * 13 + (i >> 3));
+    }
+
+    for (size_t offset = 0; offset < 9; offset++) {
+        for (size_t length : {0, 1, 3, 7, 8, 9, 15, 16, 100, 4090}) {
+            ASSERT_EQ(crc32c::ExtendPortable(0, s.data() + offset, length),
+                      crc32c::Extend(0, s.data() + offset, length)) << offset << " " << length;
+        }
+    }
+}
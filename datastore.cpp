@@ -22,35 +22,191 @@
 #include <cstdio>
 #include <mutex>
 #include <functional>
+#include <chrono>
+#include <sstream>
+#include <string_view>
+#include <algorithm>
+#include <cctype>
+#include <array>
+#include <optional>
+#include <limits>
+#include <map>
+#include <fcntl.h>
 #include "datastore.hpp"
 #include "utils.hpp"
 #include "base64.hpp"
+#include "crc32c.hpp"
 #include "vendor/nlohmann/json.hpp"
 
-using json = nlohmann::json;
+#ifdef _WIN32
+    #include <io.h>
+#else
+    #include <unistd.h>
+#endif
 
 namespace psicash {
 
+using json = DatastoreJson;
+
 using namespace std;
 using namespace error;
 
+using JournalChanges = vector<pair<json::json_pointer, json>>;
+
 static string FilePath(const string& file_root, const string& suffix);
-static Result<json> LoadDatastore(const string& file_path);
-static Error SaveDatastore(const string& file_path, const json& json);
+static string SlotPath(const string& file_path, int slot);
+static Result<json> LoadDatastore(const string& file_path, int& o_slot, uint64_t& o_generation);
+using EncodedSubtrees = std::map<string, string>;
+static Error SaveDatastore(const string& slot_path, const json& json, uint64_t generation, bool sync,
+                           EncodedSubtrees* encoded_subtrees=nullptr);
+static Result<json> LoadDatastoreAndJournals(const string& file_path, int& o_slot, uint64_t& o_generation,
+                                             uint64_t& o_journal_size, bool& o_compaction_needed);
+static Error AppendJournalRecord(const string& journal_path, const JournalChanges& changes, uint64_t& io_journal_size, bool sync);
+static Error RemoveJournals(const string& file_path);
+static Error SyncFile(const string& path);
+static Error SyncDirectory(const string& file_path);
+
+static constexpr auto JOURNAL_EXT = ".journal";
+static constexpr auto COMPACTING_JOURNAL_EXT = ".journal.compacting";
+
+#if defined(__cpp_lib_atomic_shared_ptr)
+#define LOAD_SNAPSHOT() snapshot_.load()
+#define STORE_SNAPSHOT(v) snapshot_.store(v)
+#else
+#define LOAD_SNAPSHOT() std::atomic_load(&snapshot_)
+#define STORE_SNAPSHOT(v) std::atomic_store(&snapshot_, std::shared_ptr<const json>(v))
+#endif
+
+/// Snapshots pinned by live ConsistentRead instances on this thread.
+struct PinnedSnapshot {
+    const Datastore* datastore;
+    shared_ptr<const json> snapshot;
+    /// Zero if the pinned state isn't a published snapshot.
+    uint64_t generation;
+};
+static thread_local vector<PinnedSnapshot> t_pinned_snapshots;
+
+/// The most recent snapshot this thread has read from a datastore, with its generation.
+/// Lets repeated reads of an unchanged datastore avoid the cost of copying the shared
+/// snapshot pointer. Generations are unique across all datastores, so a stale entry
+/// (including one for a destroyed datastore) can never be mistaken for a current one.
+struct Datastore::ThreadSnapshot {
+    const Datastore* datastore;
+    uint64_t generation;
+    shared_ptr<const json> snapshot;
+    /// The values of slotted keys in the snapshot, as they're resolved.
+    std::array<std::optional<nonstd::expected<int64_t, DatastoreGetError>>, kMaxDatastoreKeySlots> slots;
+};
+static constexpr size_t MAX_CACHED_SNAPSHOTS = 4;
+
+static atomic<uint64_t> g_snapshot_generation(0);
+
+/// The paths changed by a commit, for subscribers, or a request for the notification
+/// thread to stop.
+struct ChangeNotification {
+    vector<string> paths;
+    bool stop;
+};
+
+/// A multiple-producer, single-consumer queue of change notifications. Pushing never
+/// blocks, so that committing isn't held up by the notification thread.
+class Datastore::ChangeQueue {
+public:
+    ChangeQueue() : head_(nullptr) {}
+
+    ~ChangeQueue() {
+        auto node = head_.load();
+        while (node) {
+            auto next = node->next;
+            delete node;
+            node = next;
+        }
+    }
+
+    void Push(ChangeNotification notification) {
+        auto node = new Node{std::move(notification), head_.load(std::memory_order_relaxed)};
+        while (!head_.compare_exchange_weak(node->next, node, std::memory_order_release,
+                                            std::memory_order_relaxed)) {
+        }
+        head_.notify_one();
+    }
+
+    /// Waits until there are notifications, then removes and returns them all, oldest
+    /// first. Must only be called by one thread.
+    vector<ChangeNotification> PopAll() {
+        head_.wait(nullptr, std::memory_order_acquire);
+        auto node = head_.exchange(nullptr, std::memory_order_acquire);
+        vector<ChangeNotification> notifications;
+        while (node) {
+            notifications.push_back(std::move(node->notification));
+            auto next = node->next;
+            delete node;
+            node = next;
+        }
+        std::reverse(notifications.begin(), notifications.end());
+        return notifications;
+    }
+
+private:
+    struct Node {
+        ChangeNotification notification;
+        Node* next;
+    };
+    atomic<Node*> head_;
+};
+
+// The depth to which ChangeGeneration tracks changes. The top level of the datastore
+// holds a few objects ("user", "instance"), and they hold the values callers watch.
+static constexpr int kChangeTrackingDepth = 2;
 
 Datastore::Datastore()
         : initialized_(false), explicit_lock_(mutex_, std::defer_lock),
-          transaction_depth_(0), transaction_dirty_(false), json_(json::object()) {
+          transaction_depth_(0), transaction_dirty_(false),
+          snapshot_(make_shared<const json>(json::object())),
+          snapshot_generation_(++g_snapshot_generation),
+          reset_generation_(snapshot_generation_), change_queue_(std::make_unique<ChangeQueue>()),
+          has_subscribers_(false), next_subscription_id_(1), newest_slot_(0), generation_(0),
+          newest_slot_unsynced_(false), journal_unsynced_(false), directory_unsynced_(false),
+          transaction_start_pending_(0), write_pending_(false), journal_size_(0),
+          write_requested_(false), stop_writer_(false) {
+}
+
+Datastore::~Datastore() {
+    StopNotifier();
+    StopWriter();
+    if (initialized_) {
+        (void)Flush();
+    }
+    WaitForCompaction();
 }
 
-Error Datastore::Init(const string& file_root, const string& suffix) {
-    SYNCHRONIZE(mutex_);
+Error Datastore::Init(const string& file_root, const string& suffix, const DatastoreOptions& options) {
+    SYNCHRONIZE_EXCLUSIVE(mutex_);
+    options_ = options;
     file_path_ = FilePath(file_root, suffix);
-    auto res = LoadDatastore(file_path_);
+
+    bool compaction_needed = false;
+    auto res = LoadDatastoreAndJournals(file_path_, newest_slot_, generation_, journal_size_, compaction_needed);
     if (!res) {
         return PassError(res.error());
     }
-    json_ = *res;
+    Publish(std::move(*res));
+
+    // A journal left behind by an interrupted compaction or a damaged append, or one that
+    // exists while journaling is disabled, gets folded into the datastore files now.
+    if (compaction_needed
+        || (journal_size_ > 0 && (!options_.journal || journal_size_ >= options_.journal_compaction_threshold))) {
+        if (auto err = Compact()) {
+            return WrapError(err, "journal compaction failed");
+        }
+    }
+
+    if ((options_.async_writes || options_.durability == DatastoreDurability::kGroupCommit)
+        && !writer_.joinable()) {
+        stop_writer_ = false;
+        writer_ = std::thread(&Datastore::WriterLoop, this);
+    }
+
     initialized_ = true;
     return error::nullerr;
 }
@@ -58,13 +214,35 @@ Error Datastore::Init(const string& file_root, const string& suffix) {
 #define MUST_BE_INITIALIZED     if (!initialized_) { return MakeCriticalError("must only be called on an initialized datastore"); }
 
 Error Datastore::Reset(const string& file_path, json new_value) {
-    SYNCHRONIZE(mutex_);
+    SYNCHRONIZE_EXCLUSIVE(mutex_);
+    WaitForCompaction();
     transaction_depth_ = 0;
     transaction_dirty_ = false;
-    if (auto err = SaveDatastore(file_path, new_value)) {
+    // The journals must go first, otherwise they could be replayed on top of the new value.
+    if (auto err = RemoveJournals(file_path)) {
         return PassError(err);
     }
-    json_ = new_value;
+    // Both slots get the new value, so that there's nothing older to fall back to. Resets
+    // are rare, so they're synced right away with either durability policy.
+    const bool sync = (options_.durability != DatastoreDurability::kNone);
+    for (int slot : {0, 1}) {
+        if (auto err = SaveDatastore(SlotPath(file_path, slot), new_value, generation_ + 1, sync)) {
+            return PassError(err);
+        }
+    }
+    if (sync) {
+        if (auto err = SyncDirectory(file_path)) {
+            return PassError(err);
+        }
+    }
+    generation_++;
+    newest_slot_ = 0;
+    newest_slot_unsynced_ = journal_unsynced_ = directory_unsynced_ = false;
+    Publish(std::move(new_value));
+    pending_changes_.clear();
+    transaction_start_pending_ = 0;
+    write_pending_ = false;
+    journal_size_ = 0;
     return error::nullerr;
 }
 
@@ -73,24 +251,25 @@ Error Datastore::Reset(const string& file_root, const string& suffix, json new_v
 }
 
 Error Datastore::Reset(json new_value) {
-    SYNCHRONIZE(mutex_);
+    SYNCHRONIZE_EXCLUSIVE(mutex_);
     MUST_BE_INITIALIZED;
     return PassError(Reset(file_path_, new_value));
 }
 
 void Datastore::BeginTransaction() {
     // We only acquire a non-local lock if we're starting an outermost transaction.
-    SYNCHRONIZE(mutex_);
+    SYNCHRONIZE_EXCLUSIVE(mutex_);
     // We got a local lock, so we know there's no transaction in progress in any other thread.
     if (transaction_depth_ == 0) {
         transaction_dirty_ = false;
+        transaction_start_pending_ = pending_changes_.size();
         explicit_lock_.lock();
     }
     transaction_depth_++;
 }
 
 Error Datastore::EndTransaction(bool commit) {
-    SYNCHRONIZE(mutex_);
+    SYNCHRONIZE_EXCLUSIVE(mutex_);
     MUST_BE_INITIALIZED;
     if (transaction_depth_ <= 0) {
         assert(false);
@@ -106,7 +285,7 @@ Error Datastore::EndTransaction(bool commit) {
 
     // We need to release the explicit lock on exit from this function, no matter what.
     // We will "adopt" the lock into this lock_guard to ensure the unlock happens when it goes out of scope.
-    std::lock_guard<std::unique_lock<std::recursive_mutex>> lock_releaser(explicit_lock_, std::adopt_lock);
+    std::lock_guard<std::unique_lock<utils::RecursiveMutex>> lock_releaser(explicit_lock_, std::adopt_lock);
 
     if (!transaction_dirty_) {
         // No actual substantive changes were made during this transaction, so we will avoid
@@ -115,26 +294,445 @@ Error Datastore::EndTransaction(bool commit) {
     }
 
     if (commit) {
-        return PassError(SaveDatastore(file_path_, json_));
+        // The changes are visible to readers even if writing them fails.
+        Publish();
+        write_pending_ = true;
+        if (options_.async_writes) {
+            RequestWrite();
+            return nullerr;
+        }
+        if (auto err = WritePending()) {
+            return PassError(err);
+        }
+        if (options_.durability == DatastoreDurability::kGroupCommit) {
+            // The background writer will sync this along with any other commits made
+            // before it gets to it.
+            RequestWrite();
+        }
+        return nullerr;
     }
 
-    // We're rolling back -- revert to what's on disk
-    auto res = LoadDatastore(file_path_);
-    if (!res) {
-        return PassError(res.error());
+    // We're rolling back. The transaction's changes were only ever made to the working
+    // copy, so discarding it reverts to the last committed state, with no I/O.
+    working_.reset();
+    working_pointers_.clear();
+    pending_changes_.erase(pending_changes_.begin() + transaction_start_pending_, pending_changes_.end());
+    return nullerr;
+}
+
+Error Datastore::Flush() {
+    SYNCHRONIZE_EXCLUSIVE(mutex_);
+    MUST_BE_INITIALIZED;
+    if (auto err = WritePending()) {
+        return PassError(err);
+    }
+    return PassError(Sync());
+}
+
+Error Datastore::WritePending() {
+    if (!write_pending_) {
+        return nullerr;
+    }
+    if (auto err = Persist()) {
+        return PassError(err);
     }
-    json_ = *res;
+    write_pending_ = false;
     return nullerr;
 }
 
 error::Result<nlohmann::json> Datastore::Get() const {
-    SYNCHRONIZE(mutex_);
-    MUST_BE_INITIALIZED;
-    return json_;
+    auto state = ReadStateShared();
+    if (!state) {
+        return MakeCriticalError("must only be called on an initialized datastore");
+    }
+    return nlohmann::json(*state);
+}
+
+const json* Datastore::ReadState(uint64_t* o_generation/*=nullptr*/) const {
+    if (o_generation) {
+        *o_generation = 0;
+    }
+    if (!initialized_) {
+        return nullptr;
+    }
+
+    // A thread inside a transaction must see its own changes. (It holds the lock, so it
+    // can safely look at working_.)
+    if (mutex_.OwnedByThisThread()) {
+        return working_ ? working_.get() : CachedSnapshot(o_generation).get();
+    }
+
+    for (const auto& pinned : t_pinned_snapshots) {
+        if (pinned.datastore == this) {
+            if (o_generation) {
+                *o_generation = pinned.generation;
+            }
+            return pinned.snapshot.get();
+        }
+    }
+
+    return CachedSnapshot(o_generation).get();
+}
+
+shared_ptr<const json> Datastore::ReadStateShared(uint64_t* o_generation/*=nullptr*/) const {
+    if (o_generation) {
+        *o_generation = 0;
+    }
+    if (!initialized_) {
+        return nullptr;
+    }
+
+    if (mutex_.OwnedByThisThread()) {
+        return working_ ? working_ : CachedSnapshot(o_generation);
+    }
+
+    for (const auto& pinned : t_pinned_snapshots) {
+        if (pinned.datastore == this) {
+            if (o_generation) {
+                *o_generation = pinned.generation;
+            }
+            return pinned.snapshot;
+        }
+    }
+
+    return CachedSnapshot(o_generation);
+}
+
+const shared_ptr<const json>& Datastore::CachedSnapshot(uint64_t* o_generation/*=nullptr*/) const {
+    auto& cached = CurrentThreadSnapshot();
+    if (o_generation) {
+        *o_generation = cached.generation;
+    }
+    return cached.snapshot;
+}
+
+Datastore::ThreadSnapshot& Datastore::CurrentThreadSnapshot() const {
+    static thread_local vector<ThreadSnapshot> t_snapshots;
+
+    // The generation is updated after the snapshot, so the snapshot we load is at least
+    // as new as the generation we tag it with.
+    auto generation = snapshot_generation_.load(std::memory_order_acquire);
+    for (auto& cached : t_snapshots) {
+        if (cached.datastore == this) {
+            if (cached.generation != generation) {
+                cached.snapshot = LOAD_SNAPSHOT();
+                cached.generation = generation;
+                cached.slots.fill(std::nullopt);
+            }
+            return cached;
+        }
+    }
+
+    if (t_snapshots.size() >= MAX_CACHED_SNAPSHOTS) {
+        t_snapshots.erase(t_snapshots.begin());
+    }
+    t_snapshots.push_back({this, generation, LOAD_SNAPSHOT(), {}});
+    return t_snapshots.back();
+}
+
+nonstd::expected<int64_t, Datastore::DatastoreGetError>
+Datastore::GetSlot(int slot, std::string_view path, SlotDecoder decode) const {
+    if (!initialized_) {
+        return nonstd::make_unexpected(DatastoreGetError::kDatastoreUninitialized);
+    }
+
+    // Slots only hold values from the latest snapshot, so a thread looking at anything else
+    // (see ReadState) has to decode the value itself.
+    bool latest = !mutex_.OwnedByThisThread() || !working_;
+    for (const auto& pinned : t_pinned_snapshots) {
+        latest = latest && (pinned.datastore != this);
+    }
+    if (!latest) {
+        return decode(*ReadState(), path);
+    }
+
+    auto& cached = CurrentThreadSnapshot();
+    auto& value = cached.slots[slot];
+    if (!value) {
+        value = decode(*cached.snapshot, path);
+    }
+    return *value;
+}
+
+const json* Datastore::Find(const json& state, std::string_view path) {
+    // See RFC 6901
+    const json* current = &state;
+    string unescaped;
+    while (!path.empty()) {
+        if (path.front() != '/') {
+            return nullptr;
+        }
+        path.remove_prefix(1);
+        auto token = path.substr(0, path.find('/'));
+        path.remove_prefix(token.length());
+
+        if (token.find('~') != std::string_view::npos) {
+            unescaped.clear();
+            for (size_t i = 0; i < token.length(); i++) {
+                if (token[i] == '~' && i + 1 < token.length() && (token[i+1] == '0' || token[i+1] == '1')) {
+                    unescaped += (token[++i] == '0') ? '~' : '/';
+                }
+                else {
+                    unescaped += token[i];
+                }
+            }
+            token = unescaped;
+        }
+
+        if (current->is_object()) {
+            auto it = current->find(token);
+            if (it == current->end()) {
+                return nullptr;
+            }
+            current = &*it;
+        }
+        else if (current->is_array()) {
+            if (token.empty() || token.length() > 9 || (token.length() > 1 && token.front() == '0')
+                || !std::all_of(token.begin(), token.end(), [](char c) { return c >= '0' && c <= '9'; })) {
+                return nullptr;
+            }
+            auto index = std::stoul(string(token));
+            if (index >= current->size()) {
+                return nullptr;
+            }
+            current = &(*current)[index];
+        }
+        else {
+            return nullptr;
+        }
+    }
+    return current;
+}
+
+shared_ptr<const void> Datastore::LookupTyped(const TypedCacheKey& key, uint64_t generation) const {
+    std::shared_lock<std::shared_mutex> lock(typed_cache_mutex_);
+    auto it = typed_cache_.find(key);
+    // An entry decoded from a newer snapshot than the one being read (which would be
+    // pinned) may not match it.
+    if (it == typed_cache_.end() || it->second.generation > generation) {
+        return nullptr;
+    }
+    return it->second.value;
+}
+
+void Datastore::StoreTyped(TypedCacheKey key, uint64_t generation, shared_ptr<const void> value) const {
+    std::unique_lock<std::shared_mutex> lock(typed_cache_mutex_);
+    // If a newer snapshot has been published since the value was read, it may have
+    // changed the value (and invalidation has already happened).
+    if (snapshot_generation_.load(std::memory_order_relaxed) != generation) {
+        return;
+    }
+    typed_cache_[std::move(key)] = {generation, std::move(value)};
+}
+
+// True if `a` and `b` are the same JSON pointer, or if one refers to something inside what
+// the other refers to.
+static bool PointersOverlap(std::string_view a, std::string_view b) {
+    auto shorter = (a.length() < b.length()) ? a : b;
+    auto longer = (a.length() < b.length()) ? b : a;
+    return longer.compare(0, shorter.length(), shorter) == 0
+           && (longer.length() == shorter.length() || longer[shorter.length()] == '/');
 }
 
-Error Datastore::Set(const json::json_pointer& p, json v, bool write_store/*=true*/) {
-    SYNCHRONIZE(mutex_);
+Datastore::ConsistentRead::ConsistentRead(const Datastore& datastore)
+        : datastore_(datastore), pinned_(false) {
+    for (const auto& pinned : t_pinned_snapshots) {
+        if (pinned.datastore == &datastore_) {
+            // This is an inner instance.
+            return;
+        }
+    }
+    uint64_t generation = 0;
+    auto snapshot = datastore_.ReadStateShared(&generation);
+    t_pinned_snapshots.push_back({&datastore_, std::move(snapshot), generation});
+    pinned_ = true;
+}
+
+Datastore::ConsistentRead::~ConsistentRead() {
+    if (!pinned_) {
+        return;
+    }
+    for (auto it = t_pinned_snapshots.begin(); it != t_pinned_snapshots.end(); ++it) {
+        if (it->datastore == &datastore_) {
+            t_pinned_snapshots.erase(it);
+            break;
+        }
+    }
+}
+
+const json& Datastore::Current() const {
+    if (working_) {
+        return *working_;
+    }
+    // Only writers replace the snapshot, and we're the writer, so it will stay alive.
+    return *LOAD_SNAPSHOT();
+}
+
+json& Datastore::Mutable() {
+    if (!working_) {
+        working_ = make_shared<json>(*LOAD_SNAPSHOT());
+    }
+    return *working_;
+}
+
+void Datastore::Publish() {
+    if (!working_) {
+        return;
+    }
+
+    std::unique_lock<std::shared_mutex> lock(typed_cache_mutex_);
+    auto generation = ++g_snapshot_generation;
+    STORE_SNAPSHOT(std::move(working_));
+    working_.reset();
+    auto changed = [&](const string& cached) {
+        return std::any_of(working_pointers_.begin(), working_pointers_.end(),
+                           [&](const string& p) { return PointersOverlap(p, cached); });
+    };
+    for (auto it = typed_cache_.begin(); it != typed_cache_.end(); ) {
+        it = changed(it->first.first) ? typed_cache_.erase(it) : std::next(it);
+    }
+    for (auto it = encoded_subtrees_.begin(); it != encoded_subtrees_.end(); ) {
+        it = changed(it->first) ? encoded_subtrees_.erase(it) : std::next(it);
+    }
+    for (const auto& p : working_pointers_) {
+        // Cut the pointer short after kChangeTrackingDepth reference tokens.
+        size_t end = 0;
+        for (int depth = 0; depth < kChangeTrackingDepth && end != string::npos; depth++) {
+            end = p.find('/', end + 1);
+        }
+        change_generations_[p.substr(0, end)] = generation;
+    }
+    if (has_subscribers_.load(std::memory_order_relaxed)) {
+        change_queue_->Push({std::move(working_pointers_), false});
+    }
+    working_pointers_.clear();
+    snapshot_generation_.store(generation, std::memory_order_release);
+}
+
+void Datastore::Publish(json new_state) {
+    std::unique_lock<std::shared_mutex> lock(typed_cache_mutex_);
+    working_.reset();
+    working_pointers_.clear();
+    STORE_SNAPSHOT(make_shared<const json>(std::move(new_state)));
+    typed_cache_.clear();
+    encoded_subtrees_.clear();
+    auto generation = ++g_snapshot_generation;
+    change_generations_.clear();
+    reset_generation_ = generation;
+    if (has_subscribers_.load(std::memory_order_relaxed)) {
+        // The root pointer overlaps every path.
+        change_queue_->Push({{""}, false});
+    }
+    snapshot_generation_.store(generation, std::memory_order_release);
+}
+
+uint64_t Datastore::ChangeGeneration(std::string_view path) const {
+    std::shared_lock<std::shared_mutex> lock(typed_cache_mutex_);
+    auto generation = reset_generation_;
+    for (const auto& changed : change_generations_) {
+        if (changed.second > generation && PointersOverlap(changed.first, path)) {
+            generation = changed.second;
+        }
+    }
+    return generation;
+}
+
+uint64_t Datastore::ReadChangeGeneration(std::string_view path) const {
+    uint64_t snapshot_generation = 0;
+    if (!ReadState(&snapshot_generation) || snapshot_generation == 0) {
+        return 0;
+    }
+    // A snapshot pinned by a ConsistentRead might predate the change.
+    auto generation = ChangeGeneration(path);
+    return (generation <= snapshot_generation) ? generation : 0;
+}
+
+uint64_t Datastore::ResetGeneration() const {
+    std::shared_lock<std::shared_mutex> lock(typed_cache_mutex_);
+    return reset_generation_;
+}
+
+Datastore::SubscriptionID Datastore::Subscribe(vector<string> paths, ChangeCallback callback) {
+    std::lock_guard<std::mutex> lock(subscriptions_mutex_);
+    auto id = next_subscription_id_++;
+    subscriptions_[id] = make_shared<const Subscription>(Subscription{std::move(paths), std::move(callback)});
+    has_subscribers_ = true;
+    if (!notifier_.joinable()) {
+        notifier_ = std::thread(&Datastore::NotifierLoop, this);
+    }
+    return id;
+}
+
+void Datastore::Unsubscribe(SubscriptionID id) {
+    std::thread::id notifier_id;
+    {
+        std::lock_guard<std::mutex> lock(subscriptions_mutex_);
+        subscriptions_.erase(id);
+        has_subscribers_ = !subscriptions_.empty();
+        notifier_id = notifier_.get_id();
+    }
+    // A callback that unsubscribes is already inside the delivery.
+    if (std::this_thread::get_id() != notifier_id) {
+        std::lock_guard<std::mutex> delivery_lock(delivery_mutex_);
+    }
+}
+
+void Datastore::NotifierLoop() {
+    while (true) {
+        // Changes that were queued while we were busy are delivered together.
+        vector<string> changed_paths;
+        bool stop = false;
+        for (auto& notification : change_queue_->PopAll()) {
+            stop = stop || notification.stop;
+            for (auto& p : notification.paths) {
+                if (std::find(changed_paths.begin(), changed_paths.end(), p) == changed_paths.end()) {
+                    changed_paths.push_back(std::move(p));
+                }
+            }
+        }
+        if (!changed_paths.empty()) {
+            NotifySubscribers(changed_paths);
+        }
+        if (stop) {
+            return;
+        }
+    }
+}
+
+void Datastore::NotifySubscribers(const vector<string>& changed_paths) {
+    std::lock_guard<std::mutex> delivery_lock(delivery_mutex_);
+    vector<shared_ptr<const Subscription>> subscriptions;
+    {
+        std::lock_guard<std::mutex> lock(subscriptions_mutex_);
+        for (const auto& it : subscriptions_) {
+            subscriptions.push_back(it.second);
+        }
+    }
+
+    for (const auto& subscription : subscriptions) {
+        vector<string> changed;
+        for (const auto& p : subscription->paths) {
+            if (std::any_of(changed_paths.begin(), changed_paths.end(),
+                            [&](const string& c) { return PointersOverlap(c, p); })) {
+                changed.push_back(p);
+            }
+        }
+        if (!changed.empty()) {
+            subscription->callback(changed);
+        }
+    }
+}
+
+void Datastore::StopNotifier() {
+    if (!notifier_.joinable()) {
+        return;
+    }
+    change_queue_->Push({{}, true});
+    notifier_.join();
+}
+
+Error Datastore::Set(const json_pointer& p, json v, bool write_store/*=true*/) {
+    SYNCHRONIZE_EXCLUSIVE(mutex_);
     MUST_BE_INITIALIZED;
 
     // We will use the transaction mechanism to do the writing. It will also help prevent
@@ -143,17 +741,32 @@ Error Datastore::Set(const json::json_pointer& p, json v, bool write_store/*=tru
         BeginTransaction();
     }
 
-    // Avoid modifying the datastore if the value is the same as what's already there.
-    bool changed = true;
-    try {
-        changed = (json_.at(p) != v);
+    if (SetValue(p, std::move(v)) && transaction_depth_ == 0) {
+        // Not in a transaction, so the change is committed to memory right away.
+        Publish();
     }
-    catch (json::out_of_range&) {
-        // The key doesn't exist, so continue to set it.
+
+    if (write_store) {
+        return PassError(EndTransaction(true));
+    }
+    return nullerr;
+}
+
+Error Datastore::SetMany(vector<pair<json_pointer, json>>&& values, bool write_store/*=true*/) {
+    SYNCHRONIZE_EXCLUSIVE(mutex_);
+    MUST_BE_INITIALIZED;
+
+    if (write_store) {
+        BeginTransaction();
     }
 
-    json_[p] = v;
-    transaction_dirty_ = changed;
+    bool changed = false;
+    for (auto& value : values) {
+        changed = SetValue(value.first, std::move(value.second)) || changed;
+    }
+    if (changed && transaction_depth_ == 0) {
+        Publish();
+    }
 
     if (write_store) {
         return PassError(EndTransaction(true));
@@ -161,6 +774,244 @@ Error Datastore::Set(const json::json_pointer& p, json v, bool write_store/*=tru
     return nullerr;
 }
 
+bool Datastore::SetValue(const json_pointer& p, json&& v) {
+    auto path = p.to_string();
+
+    // Avoid modifying the datastore if the value is the same as what's already there.
+    auto existing = path.empty() ? &Current() : Find(Current(), path);
+    if (existing && *existing == v) {
+        return false;
+    }
+
+    json::json_pointer pointer(path);
+    if (options_.journal) {
+        pending_changes_.emplace_back(pointer, v);
+    }
+    Mutable()[pointer] = std::move(v);
+    working_pointers_.push_back(std::move(path));
+    transaction_dirty_ = true;
+    return true;
+}
+
+Error Datastore::Persist() {
+    // Only committed state gets written. If this thread is in a transaction, its changes
+    // aren't committed yet.
+    if (!options_.journal) {
+        return PassError(Save());
+    }
+
+    auto committed = (transaction_depth_ > 0) ? transaction_start_pending_ : pending_changes_.size();
+    if (committed == 0) {
+        return nullerr;
+    }
+
+    // Appending to an existing journal only changes its data, but creating one changes the
+    // directory too.
+    const bool creating_journal = (journal_size_ == 0);
+    const bool sync = (options_.durability == DatastoreDurability::kSyncOnCommit);
+    Error err;
+    if (committed == pending_changes_.size()) {
+        err = AppendJournalRecord(file_path_ + JOURNAL_EXT, pending_changes_, journal_size_, sync);
+    }
+    else {
+        JournalChanges committed_changes(pending_changes_.begin(), pending_changes_.begin() + committed);
+        err = AppendJournalRecord(file_path_ + JOURNAL_EXT, committed_changes, journal_size_, sync);
+    }
+    if (err) {
+        return WrapError(err, "failed to append journal record");
+    }
+    if (sync && creating_journal && (err = SyncDirectory(file_path_))) {
+        return PassError(err);
+    }
+    else if (options_.durability == DatastoreDurability::kGroupCommit) {
+        journal_unsynced_ = true;
+        directory_unsynced_ = directory_unsynced_ || creating_journal;
+    }
+    pending_changes_.erase(pending_changes_.begin(), pending_changes_.begin() + committed);
+    transaction_start_pending_ -= std::min(transaction_start_pending_, committed);
+
+    if (journal_size_ < options_.journal_compaction_threshold) {
+        return nullerr;
+    }
+
+    if (compaction_.valid() && compaction_.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+        // The previous compaction is still running. We'll try again after the next commit.
+        return nullerr;
+    }
+    WaitForCompaction();
+
+    // The slot that isn't being compacted into must be on disk, as it'll be the fallback.
+    if (auto err = Sync()) {
+        return PassError(err);
+    }
+
+    const auto compacting_path = file_path_ + COMPACTING_JOURNAL_EXT;
+    if (utils::FileExists(compacting_path)) {
+        // A previous background compaction failed to write the datastore files, so we
+        // can't set aside the current journal. Fold everything in right now instead.
+        return PassError(Compact());
+    }
+
+    // Set the current journal aside; new commits will start a fresh one. The in-memory
+    // datastore reflects every record in the set-aside journal, so once a snapshot of it
+    // has been saved the set-aside journal can be deleted. If we're interrupted before
+    // then, the journal will be replayed on the next load, which is harmless.
+    int rename_err;
+    if ((rename_err = std::rename((file_path_ + JOURNAL_EXT).c_str(), compacting_path.c_str())) != 0) {
+        return MakeCriticalError(utils::Stringer("renaming journal failed; err=", rename_err, "; errno=", errno));
+    }
+    journal_size_ = 0;
+
+    try {
+        // The snapshot is immutable, so it can be saved without copying or locking.
+        // We claim the slot now. If the write fails, the slot keeps its older contents (the
+        // write is atomic), so loading will still use the other slot plus the set-aside
+        // journal.
+        // With either durability policy, the new slot is synced before the set-aside journal
+        // is removed; this is off the commit path, so there's no reason to defer it.
+        auto slot = 1 - newest_slot_;
+        auto generation = generation_ + 1;
+        const bool sync = (options_.durability != DatastoreDurability::kNone);
+        compaction_ = std::async(std::launch::async,
+                                 [file_path = file_path_, slot, generation, sync, snapshot = LOAD_SNAPSHOT()]() {
+            // If this fails, the set-aside journal is retained and the next compaction
+            // will take care of it.
+            if (SaveDatastore(SlotPath(file_path, slot), *snapshot, generation, sync)) {
+                return;
+            }
+            if (sync && SyncDirectory(file_path)) {
+                return;
+            }
+            (void)std::remove((file_path + COMPACTING_JOURNAL_EXT).c_str());
+        });
+        newest_slot_ = slot;
+        generation_ = generation;
+    }
+    catch (std::system_error&) {
+        // Unable to start a thread; do the work here.
+        return PassError(Compact());
+    }
+
+    return nullerr;
+}
+
+Error Datastore::Save() {
+    // Overwrite the older slot, so the newest one remains to fall back on. But with group
+    // commit, if the newest slot hasn't been synced it might not survive a crash, so it
+    // gets overwritten instead and the older (synced) slot remains the fallback.
+    auto slot = newest_slot_unsynced_ ? newest_slot_ : 1 - newest_slot_;
+    const bool sync = (options_.durability == DatastoreDurability::kSyncOnCommit);
+    if (auto err = SaveDatastore(SlotPath(file_path_, slot), *LOAD_SNAPSHOT(), generation_ + 1, sync,
+                                 &encoded_subtrees_)) {
+        return PassError(err);
+    }
+    newest_slot_ = slot;
+    generation_++;
+
+    if (sync) {
+        // The file's data was synced before it was renamed into place; this syncs the rename.
+        return PassError(SyncDirectory(file_path_));
+    }
+    else if (options_.durability == DatastoreDurability::kGroupCommit) {
+        newest_slot_unsynced_ = directory_unsynced_ = true;
+    }
+    return nullerr;
+}
+
+Error Datastore::Sync() {
+    if (newest_slot_unsynced_) {
+        if (auto err = SyncFile(SlotPath(file_path_, newest_slot_))) {
+            return PassError(err);
+        }
+        newest_slot_unsynced_ = false;
+    }
+    // The journal may since have been set aside or removed by compaction, in which case
+    // there's nothing to sync (compaction syncs the datastore file that replaces it).
+    if (journal_unsynced_ && utils::FileExists(file_path_ + JOURNAL_EXT)) {
+        if (auto err = SyncFile(file_path_ + JOURNAL_EXT)) {
+            return PassError(err);
+        }
+    }
+    journal_unsynced_ = false;
+    if (directory_unsynced_) {
+        if (auto err = SyncDirectory(file_path_)) {
+            return PassError(err);
+        }
+        directory_unsynced_ = false;
+    }
+    return nullerr;
+}
+
+Error Datastore::Compact() {
+    WaitForCompaction();
+    if (auto err = Save()) {
+        return PassError(err);
+    }
+    // The journals mustn't be removed until what replaces them is on disk.
+    if (auto err = Sync()) {
+        return PassError(err);
+    }
+    // Changes made by an ongoing transaction on this thread aren't in the snapshot.
+    auto committed = (transaction_depth_ > 0) ? transaction_start_pending_ : pending_changes_.size();
+    pending_changes_.erase(pending_changes_.begin(), pending_changes_.begin() + committed);
+    transaction_start_pending_ -= std::min(transaction_start_pending_, committed);
+    journal_size_ = 0;
+    return PassError(RemoveJournals(file_path_));
+}
+
+void Datastore::WaitForCompaction() {
+    if (compaction_.valid()) {
+        compaction_.get();
+    }
+}
+
+void Datastore::WriterLoop() {
+    std::unique_lock<std::mutex> lock(writer_mutex_);
+    while (true) {
+        writer_cv_.wait(lock, [this]{ return write_requested_ || stop_writer_; });
+        if (stop_writer_) {
+            return;
+        }
+
+        // Let further commits accumulate, so they all go out in one write.
+        writer_cv_.wait_for(lock, options_.write_interval, [this]{ return stop_writer_; });
+        if (stop_writer_) {
+            // The final flush is done by the destructor.
+            return;
+        }
+        write_requested_ = false;
+
+        // Don't hold writer_mutex_ while waiting for the datastore lock, as RequestWrite
+        // is called with the datastore lock held.
+        lock.unlock();
+        auto err = Flush();
+        lock.lock();
+
+        if (err) {
+            // Try again after another interval.
+            write_requested_ = true;
+        }
+    }
+}
+
+void Datastore::RequestWrite() {
+    std::lock_guard<std::mutex> lock(writer_mutex_);
+    write_requested_ = true;
+    writer_cv_.notify_one();
+}
+
+void Datastore::StopWriter() {
+    if (!writer_.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(writer_mutex_);
+        stop_writer_ = true;
+        writer_cv_.notify_one();
+    }
+    writer_.join();
+}
+
 static string FilePath(const string& file_root, const string& suffix) {
     return file_root + "/psicashdatastore" + suffix;
 }
@@ -170,10 +1021,17 @@ More-robust file saving will be achieved like this...
 
 When writing to file:
 1. Write data to a new file `file_path.temp` (overwrite if exists)
-2. Delete `file_path.commit`, if it exists (this should not happen, as the last read should have removed it)
-3. Rename new file to `file_path.commit`
-4. Delete existing `file_path` file
-5. Rename `file_path.commit` to `file_path`
+2. If the durability policy calls for it, sync `file_path.temp`
+3. Rename `file_path.temp` to `file_path`, atomically replacing it
+
+On Windows, where rename can't replace an existing file, step 3 instead is:
+  a. Delete `file_path.commit`, if it exists (this should not happen, as the last read should have removed it)
+  b. Rename new file to `file_path.commit`
+  c. Delete existing `file_path` file
+  d. Rename `file_path.commit` to `file_path`
+
+With kSyncOnCommit durability, the directory is then synced once per commit, to make the
+rename durable. With kGroupCommit, the file and directory syncs are done in the background.
 
 When reading from file:
 1. Check if `file_path.commit` exists
@@ -181,12 +1039,32 @@ When reading from file:
   b. Rename `file_path.commit` to `file_path`
 2. Read `file_path`
 
-Additionally, two identical files are written: the "main" and "backup" datastore files.
-These files contain the JSON an a checksum/hash of the JSON data. Then enables us to
-detect and recover from file corruption.
-(Unless both files are corrupted. But the the probability of that should be very low. And
-if the storage device is so broken that multiple files are simultaneously getting corrupted,
-then there's very little we can do.)
+There are two datastore file slots: the "main" file (slot 0) and the "backup" file (slot 1,
+with the `.2` extension). Each save writes only the slot with the older contents, stamped
+with a generation number one greater than the newest. When loading, the newest slot with a
+good checksum is used. So if the latest write is corrupted, we fall back to the previous
+one. (Unless both files are corrupted. But the the probability of that should be very low.
+And if the storage device is so broken that multiple files are simultaneously getting
+corrupted, then there's very little we can do.) Note that if journaling is enabled, falling
+back to the older slot loses the changes compacted into the newer one.
+
+Resetting the datastore writes both slots.
+
+Datastore files are written in a binary format:
+  - 4 bytes: the magic value "\x89PCD" (which can't be the start of a JSON text file)
+  - 1 byte: the format version (currently 3)
+  - 8 bytes: the big-endian generation number (only in version 3)
+  - 1 byte: the length of the checksum
+  - the checksum
+  - the payload: the CBOR-encoded datastore
+In version 3 the checksum is the 4-byte big-endian CRC-32C of the generation bytes followed
+by the payload. In version 2 it was the CRC-32C of the payload. In version 1 it was the
+base64 std::hash of the payload (see LegacyChecksumString).
+Older datastore files are text: the compact ASCII JSON, an empty line, and the legacy
+checksum of the JSON (which may be absent in very old files). Older files are treated as
+generation 0. They are still read, and are replaced by current files as they are written.
+Before slots, both files were written with identical contents each time, so migration
+needs no special handling: the first save goes to the slot that wasn't loaded.
 */
 
 static constexpr auto TEMP_EXT = ".temp";
@@ -195,11 +1073,16 @@ static constexpr auto BACKUP_EXT = ".2";
 // Note that the "main" datastore file doesn't get a special extension for backwards
 // compatiblity/migration reasons.
 
-// Write the contents of a single datastore file. The checksum will be written after the
-// contents, separated by an empty line. The contents must not contain an empty line.
-static Error WriteFileContents(const string& file_path, const string& contents, const string& checksum) {
+static constexpr std::string_view BINARY_MAGIC = "\x89PCD";
+static constexpr uint8_t BINARY_FORMAT_VERSION = 3;
+static constexpr uint8_t UNSLOTTED_BINARY_FORMAT_VERSION = 2;
+static constexpr uint8_t LEGACY_BINARY_FORMAT_VERSION = 1;
+
+// Write the contents of a single datastore file, made up of the concatenation of `parts`.
+// If `sync` is true, the data is synced to the storage device before the file is renamed into
+// place. (The caller must sync the directory to make the rename itself durable.)
+static Error WriteFileContents(const string& file_path, std::initializer_list<std::string_view> parts, bool sync) {
     const auto temp_file_path = file_path + TEMP_EXT;
-    const auto commit_file_path = file_path + COMMIT_EXT;
 
     /*
     Write to the temp file
@@ -212,7 +1095,9 @@ static Error WriteFileContents(const string& file_path, const string& contents,
     }
 
     try {
-        f << contents << "\n\n" << checksum;
+        for (const auto& part : parts) {
+            f.write(part.data(), part.size());
+        }
     }
     catch (std::exception& e) {
         return MakeCriticalError(utils::Stringer("file write failed: ", e.what()));
@@ -224,11 +1109,22 @@ static Error WriteFileContents(const string& file_path, const string& contents,
         return MakeCriticalError(utils::Stringer("temp_file_path close failed; errno=", errno));
     }
 
+    if (sync) {
+        if (auto err = SyncFile(temp_file_path)) {
+            return WrapError(err, "temp_file_path sync failed");
+        }
+    }
+
+    int err;
+
+#ifdef _WIN32
+    // rename can't replace an existing file on Windows, so we go via the commit file.
+    const auto commit_file_path = file_path + COMMIT_EXT;
+
     /*
     Rename temp to commit
     */
 
-    int err;
     if (utils::FileExists(commit_file_path) && (err = std::remove(commit_file_path.c_str())) != 0) {
         return MakeCriticalError(utils::Stringer("removing commit_file_path failed; err=", err, "; errno=", errno));
     }
@@ -248,15 +1144,83 @@ static Error WriteFileContents(const string& file_path, const string& contents,
     if ((err = std::rename(commit_file_path.c_str(), file_path.c_str())) != 0) {
         return MakeCriticalError(utils::Stringer("renaming commit_file_path to file_path failed; err=", err, "; errno=", errno));
     }
+#else
+    // POSIX rename atomically replaces the existing file.
+    if ((err = std::rename(temp_file_path.c_str(), file_path.c_str())) != 0) {
+        return MakeCriticalError(utils::Stringer("renaming temp_file_path to file_path failed; err=", err, "; errno=", errno));
+    }
+#endif
 
     return nullerr;
 }
 
-// Create a checksum for the given string (i.e., stringified JSON). This checksum is not
-// portable between platforms. (Because the C++ hash implementation is likely different
-// and because there's no endian-ness check. Local consistency is all that matters.)
-static string ChecksumString(const string& s) {
-    size_t hash = std::hash<std::string>{}(s);
+// Flushes the file's data to the storage device.
+static Error SyncFile(const string& path) {
+#ifdef _WIN32
+    int fd = _open(path.c_str(), _O_RDWR | _O_BINARY);
+    if (fd < 0) {
+        return MakeCriticalError(utils::Stringer("sync open failed; errno=", errno));
+    }
+    int res = _commit(fd);
+    int sync_errno = errno;
+    _close(fd);
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return MakeCriticalError(utils::Stringer("sync open failed; errno=", errno));
+    }
+#if defined(__APPLE__)
+    // fsync doesn't make macOS flush the drive's cache; F_FULLFSYNC does, but isn't
+    // supported by all filesystems.
+    int res = fcntl(fd, F_FULLFSYNC);
+    if (res != 0) {
+        res = fsync(fd);
+    }
+#elif defined(__linux__)
+    // The file's metadata (other than its size) doesn't matter, so avoid syncing it.
+    int res = fdatasync(fd);
+#else
+    int res = fsync(fd);
+#endif
+    int sync_errno = errno;
+    close(fd);
+#endif
+    if (res != 0) {
+        return MakeCriticalError(utils::Stringer("file sync failed; errno=", sync_errno));
+    }
+    return nullerr;
+}
+
+// Flushes the directory containing `file_path` to the storage device, which makes renames,
+// creations, and removals of the files in it durable. Does nothing on Windows, where
+// directories can't be synced (and NTFS journals metadata changes).
+static Error SyncDirectory(const string& file_path) {
+#ifdef _WIN32
+    (void)file_path;
+#else
+    auto slash = file_path.find_last_of('/');
+    auto dir = (slash == string::npos) ? string(".") : file_path.substr(0, slash + 1);
+    int fd = open(dir.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return MakeCriticalError(utils::Stringer("directory open failed; errno=", errno));
+    }
+    int res = fsync(fd);
+    int sync_errno = errno;
+    close(fd);
+    if (res != 0) {
+        return MakeCriticalError(utils::Stringer("directory sync failed; errno=", sync_errno));
+    }
+#endif
+    return nullerr;
+}
+
+// The checksum used by text-format and version 1 datastore files, and older journal
+// records. Note that std::hash is implementation-defined, so these checksums aren't
+// portable between platforms (or even standard library versions). It is only used to
+// verify existing data.
+static string LegacyChecksumString(std::string_view s) {
+    // This is the same as std::hash<std::string>, which older files were checksummed with.
+    size_t hash = std::hash<std::string_view>{}(s);
     const size_t hash_size = sizeof(hash);
 
     // Convert the size_t value into a vector of bytes
@@ -268,41 +1232,342 @@ static string ChecksumString(const string& s) {
     return base64::B64Encode(checksum);
 }
 
-// Write the datastore to disk
-static Error SaveDatastore(const string& file_path, const json& json) {
-    string json_string;
+// Output adapter for the json serializers that collects the output in a string and
+// computes its CRC-32C as it goes. The CRC is computed a block at a time, while the data
+// is still in cache, rather than in a separate pass over the whole output.
+class ChecksummingStringAdapter : public nlohmann::detail::output_adapter_protocol<char> {
+public:
+    /// `crc` can be the CRC of data that logically precedes the output.
+    explicit ChecksummingStringAdapter(string& s, uint32_t crc=0) : str_(s), crc_(crc), crc_pos_(s.length()) {}
+
+    void write_character(char c) override {
+        str_.push_back(c);
+        MaybeUpdate();
+    }
+
+    void write_characters(const char* s, std::size_t length) override {
+        str_.append(s, length);
+        MaybeUpdate();
+    }
+
+    /// Returns the CRC of everything written.
+    uint32_t Checksum() {
+        Update();
+        return crc_;
+    }
+
+private:
+    static constexpr size_t kBlockSize = 4096;
+
+    void MaybeUpdate() {
+        if (str_.length() - crc_pos_ >= kBlockSize) {
+            Update();
+        }
+    }
+
+    void Update() {
+        crc_ = crc32c::Extend(crc_, str_.data() + crc_pos_, str_.length() - crc_pos_);
+        crc_pos_ = str_.length();
+    }
+
+    string& str_;
+    uint32_t crc_;
+    size_t crc_pos_;
+};
+
+// Serializes `j` as compact ASCII JSON into `o_dump`, and returns its CRC-32C.
+// Throws json::exception on failure.
+static uint32_t ChecksummedDump(const json& j, string& o_dump) {
+    auto adapter = std::make_shared<ChecksummingStringAdapter>(o_dump);
+    nlohmann::detail::serializer<json> serializer(adapter, ' ', nlohmann::detail::error_handler_t::strict);
+    serializer.dump(j, /*pretty_print=*/false, /*ensure_ascii=*/true, 0);
+    return adapter->Checksum();
+}
+
+// Serializes `j` as CBOR into `o_cbor`, and returns its CRC-32C extended from `crc`.
+// Throws json::exception on failure.
+static uint32_t ChecksummedCBOR(const json& j, string& o_cbor, uint32_t crc) {
+    auto adapter = std::make_shared<ChecksummingStringAdapter>(o_cbor, crc);
+    nlohmann::detail::binary_writer<json, char>(adapter).write_cbor(j);
+    return adapter->Checksum();
+}
+
+// Big-endian bytes of `v`.
+template<typename T>
+static string BigEndianBytes(T v) {
+    string res(sizeof(v), '\0');
+    for (size_t i = 0; i < sizeof(v); i++) {
+        res[i] = (char)(v >> (8 * (sizeof(v) - 1 - i)));
+    }
+    return res;
+}
+
+static string ChecksumBytes(uint32_t crc) {
+    return BigEndianBytes(crc);
+}
+
+static string ChecksumHex(uint32_t crc) {
+    static constexpr char hex[] = "0123456789abcdef";
+    string res(8, '0');
+    for (size_t i = 0; i < 8; i++) {
+        res[i] = hex[(crc >> (28 - 4 * i)) & 0xF];
+    }
+    return res;
+}
+
+static string SlotPath(const string& file_path, int slot) {
+    return (slot == 0) ? file_path : file_path + BACKUP_EXT;
+}
+
+// The depth of the subtrees whose encodings are reused between saves. The top level of
+// the datastore holds a few objects ("user", "instance"), and they hold the actual values,
+// some of which (like the purchases) are large and rarely change.
+static constexpr int kEncodedSubtreeDepth = 2;
+
+// Writes the CBOR encoding of `j` -- which is at the JSON pointer `path` -- to `writer`,
+// reusing the encodings of unchanged subtrees from `io_encoded` and adding the encodings of
+// new ones. The output is identical to that of json::to_cbor. Throws json::exception on
+// failure.
+static void WriteIncrementalCBOR(const json& j, const string& path, int depth,
+                                 nlohmann::detail::output_adapter_t<char> out, EncodedSubtrees& io_encoded) {
+    nlohmann::detail::binary_writer<json, char> writer(out);
+    if (depth == kEncodedSubtreeDepth || !j.is_object()) {
+        auto found = io_encoded.find(path);
+        if (found == io_encoded.end()) {
+            string encoded;
+            nlohmann::detail::binary_writer<json, char>(
+                    std::make_shared<nlohmann::detail::output_string_adapter<char>>(encoded)).write_cbor(j);
+            found = io_encoded.emplace(path, std::move(encoded)).first;
+        }
+        out->write_characters(found->second.data(), found->second.length());
+        return;
+    }
+
+    // This must match binary_writer::write_cbor for objects
+    const auto size = j.size();
+    if (size <= 0x17) {
+        out->write_character((char)(0xA0 + size));
+    }
+    else if (size <= std::numeric_limits<uint8_t>::max()) {
+        out->write_character((char)0xB8);
+        out->write_character((char)size);
+    }
+    else if (size <= std::numeric_limits<uint16_t>::max()) {
+        out->write_character((char)0xB9);
+        auto bytes = BigEndianBytes((uint16_t)size);
+        out->write_characters(bytes.data(), bytes.length());
+    }
+    else if (size <= std::numeric_limits<uint32_t>::max()) {
+        out->write_character((char)0xBA);
+        auto bytes = BigEndianBytes((uint32_t)size);
+        out->write_characters(bytes.data(), bytes.length());
+    }
+    else {
+        out->write_character((char)0xBB);
+        auto bytes = BigEndianBytes((uint64_t)size);
+        out->write_characters(bytes.data(), bytes.length());
+    }
+
+    for (const auto& item : j.items()) {
+        writer.write_cbor(item.key());
+        // The cache is keyed by the same escaped form that Set's pointers are invalidated by.
+        string child_path = path + "/";
+        for (char c : item.key()) {
+            child_path += (c == '~') ? "~0" : (c == '/') ? "~1" : string(1, c);
+        }
+        WriteIncrementalCBOR(item.value(), child_path, depth + 1, out, io_encoded);
+    }
+}
+
+// Write the datastore to a single slot on disk. If `encoded_subtrees` is given, it must
+// hold encodings made from `json` or from earlier states with the same values at those
+// locations; it is updated with the new encodings.
+static Error SaveDatastore(const string& slot_path, const json& json, uint64_t generation, bool sync,
+                           EncodedSubtrees* encoded_subtrees/*=nullptr*/) {
+    auto generation_bytes = BigEndianBytes(generation);
+    string payload;
+    uint32_t crc;
     try {
-        json_string = json.dump(-1, ' ',  // most compact representation
-                                true);    // ensure ASCII
+        if (encoded_subtrees) {
+            auto adapter = std::make_shared<ChecksummingStringAdapter>(payload, crc32c::Value(generation_bytes));
+            WriteIncrementalCBOR(json, "", 0, adapter, *encoded_subtrees);
+            crc = adapter->Checksum();
+        }
+        else {
+            crc = ChecksummedCBOR(json, payload, crc32c::Value(generation_bytes));
+        }
     }
     catch (json::exception& e) {
         return MakeCriticalError(
-                utils::Stringer("json dump failed: ", e.what(), "; id:", e.id));
+                utils::Stringer("json to_cbor failed: ", e.what(), "; id:", e.id));
     }
 
-    // Calculate the datstore checksum
-    auto checksum = ChecksumString(json_string);
+    auto checksum = ChecksumBytes(crc);
 
-    // Write the main datastore file
-    auto err = WriteFileContents(file_path, json_string, checksum);
-    if (err) {
-        return WrapError(err, "failed to write main datastore file");
-    }
+    string header(BINARY_MAGIC);
+    header += (char)BINARY_FORMAT_VERSION;
+    header += generation_bytes;
+    header += (char)checksum.length();
+    header += checksum;
 
-    // Write the backup datastore file
-    err = WriteFileContents(file_path + BACKUP_EXT, json_string, checksum);
-    if (err) {
-        return WrapError(err, "failed to write backup datastore file");
+    if (auto err = WriteFileContents(slot_path, {header, payload}, sync)) {
+        return WrapError(err, "failed to write datastore file");
     }
 
     return nullerr;
 }
 
 struct DatastoreFileContents {
-    string contents_;
+    /// The whole file, or the joined JSON lines of an unusually formatted text file.
+    string buffer_;
+    /// The location of the JSON or CBOR data within buffer_.
+    size_t offset_;
+    size_t length_;
+    bool binary_;
     bool checksum_absent_;
+    /// Zero for files from before there were generations.
+    uint64_t generation_;
+
+    std::string_view Contents() const { return std::string_view(buffer_).substr(offset_, length_); }
 };
 
+// Parses a binary-format datastore file. Returns an error if the file is truncated, has an
+// unknown format version, or if the checksum doesn't match.
+static Result<DatastoreFileContents> ParseBinaryFileContents(string file_contents) {
+    // We know the magic is present
+    size_t pos = BINARY_MAGIC.length();
+
+    if (file_contents.length() < pos + 2) {
+        return MakeCriticalError("datastore file header truncated");
+    }
+
+    auto version = (uint8_t)file_contents[pos++];
+    if (version != BINARY_FORMAT_VERSION && version != UNSLOTTED_BINARY_FORMAT_VERSION
+        && version != LEGACY_BINARY_FORMAT_VERSION) {
+        return MakeCriticalError(utils::Stringer("unsupported datastore format version: ", (int)version));
+    }
+
+    uint64_t generation = 0;
+    std::string_view generation_bytes;
+    if (version == BINARY_FORMAT_VERSION) {
+        if (file_contents.length() < pos + sizeof(generation) + 1) {
+            return MakeCriticalError("datastore file header truncated");
+        }
+        generation_bytes = std::string_view(file_contents).substr(pos, sizeof(generation));
+        for (auto b : generation_bytes) {
+            generation = (generation << 8) | (uint8_t)b;
+        }
+        pos += sizeof(generation);
+    }
+
+    size_t checksum_length = (uint8_t)file_contents[pos++];
+    if (file_contents.length() < pos + checksum_length) {
+        return MakeCriticalError("datastore file checksum truncated");
+    }
+    auto checksum = file_contents.substr(pos, checksum_length);
+    pos += checksum_length;
+
+    DatastoreFileContents res;
+    res.buffer_ = std::move(file_contents);
+    res.offset_ = pos;
+    res.length_ = res.buffer_.length() - pos;
+    res.binary_ = true;
+    res.checksum_absent_ = false;
+    res.generation_ = generation;
+
+    if (res.length_ == 0) {
+        return MakeCriticalError("datastore file empty");
+    }
+
+    string actual_checksum;
+    if (version == LEGACY_BINARY_FORMAT_VERSION) {
+        actual_checksum = LegacyChecksumString(res.Contents());
+    }
+    else {
+        auto payload = res.Contents();
+        auto crc = crc32c::Extend(crc32c::Value(generation_bytes), payload.data(), payload.length());
+        actual_checksum = ChecksumBytes(crc);
+    }
+    if (actual_checksum != checksum) {
+        return MakeCriticalError("datastore file checksum mismatch");
+    }
+
+    return res;
+}
+
+static std::string_view TrimView(std::string_view s) {
+    auto is_space = [](char c) { return std::isspace((unsigned char)c) != 0; };
+    while (!s.empty() && is_space(s.front())) {
+        s.remove_prefix(1);
+    }
+    while (!s.empty() && is_space(s.back())) {
+        s.remove_suffix(1);
+    }
+    return s;
+}
+
+// Parses a text-format datastore file.
+static Result<DatastoreFileContents> ParseTextFileContents(string file_contents) {
+    // When there's a checksum, it should be after the strigified JSON, separated by a
+    // blank line. If there is no checksum (such as when migrating from a pre-checksum
+    // datastore), then there must be no empty line before the end.
+    // Lines are trimmed, and the JSON lines are joined. We normally write the JSON as a
+    // single line, so we look at the lines in place and only copy if there's more than one.
+    const std::string_view file_view(file_contents);
+    vector<std::string_view> json_lines;
+    std::string_view checksum_line;
+    bool capture_checksum = false;
+    for (size_t pos = 0; pos < file_view.length(); ) {
+        auto eol = file_view.find('\n', pos);
+        if (eol == std::string_view::npos) {
+            eol = file_view.length();
+        }
+        auto line = TrimView(file_view.substr(pos, eol - pos));
+        pos = eol + 1;
+
+        if (line.length() == 0) {
+            capture_checksum = true;
+        }
+        else if (capture_checksum) {
+            checksum_line = line;
+            break;
+        }
+        else {
+            json_lines.push_back(line);
+        }
+    }
+
+    DatastoreFileContents res;
+    res.binary_ = false;
+    res.checksum_absent_ = checksum_line.empty();
+    res.generation_ = 0;
+    string checksum(checksum_line);
+
+    if (json_lines.empty()) {
+        return MakeCriticalError("datastore file empty");
+    }
+    else if (json_lines.size() == 1) {
+        res.offset_ = json_lines[0].data() - file_view.data();
+        res.length_ = json_lines[0].length();
+        res.buffer_ = std::move(file_contents);
+    }
+    else {
+        string joined;
+        for (const auto& line : json_lines) {
+            joined.append(line);
+        }
+        res.offset_ = 0;
+        res.length_ = joined.length();
+        res.buffer_ = std::move(joined);
+    }
+
+    if (!res.checksum_absent_ && LegacyChecksumString(res.Contents()) != checksum) {
+        return MakeCriticalError("datastore file checksum mismatch");
+    }
+
+    return res;
+}
+
 // Read the contents of a single datastore file. Returns an error if the checksum doesn't
 // match (but not if it's absent) or if the file contents are empty.
 static Result<DatastoreFileContents> ReadFileContents(const string& file_path) {
@@ -321,7 +1586,7 @@ static Result<DatastoreFileContents> ReadFileContents(const string& file_path) {
 
     if (!utils::FileExists(file_path)) {
         // Check that we can write here -- and initialize -- by storing an empty object.
-        if (auto err = WriteFileContents(file_path, "{}", "")) {
+        if (auto err = WriteFileContents(file_path, {"{}\n\n"}, false)) {
             return WrapError(err, "file doesn't exist and FileStore failed");
         }
 
@@ -336,63 +1601,39 @@ static Result<DatastoreFileContents> ReadFileContents(const string& file_path) {
         return MakeCriticalError("file size is zero");
     }
 
-    ifstream f;
-    f.open(file_path, ios::in | ios::binary);
-    if (!f) {
-        return MakeCriticalError(utils::Stringer("file open failed; errno=", errno));
-    }
-
-    // When there's a checksum, it should be after the strigified JSON, separated by a
-    // blank line. If there is no checksum (such as when migrating from a pre-checksum
-    // datastore), then there must be no empty line before the end.
-    vector<string> json_lines;
-    string checksum_line;
-    bool capture_checksum = false;
-    try {
-        for (string line; std::getline(f, line); ) {
-            utils::Trim(line);
-
-            if (line.length() == 0) {
-                capture_checksum = true;
-            }
-            else if (capture_checksum) {
-                checksum_line = line;
-                break;
-            }
-            else {
-                json_lines.push_back(line);
-            }
+    // Read the whole file with a single read into a buffer of the right size. Everything
+    // after this works on the buffer in place.
+    string file_contents;
+    {
+        ifstream f;
+        f.open(file_path, ios::in | ios::binary);
+        if (!f) {
+            return MakeCriticalError(utils::Stringer("file open failed; errno=", errno));
         }
-    }
-    catch (std::exception& e) {
-        return MakeCriticalError(utils::Stringer("file read failed: ", e.what()));
-    }
-
-    DatastoreFileContents res;
-    res.contents_ = utils::Join(json_lines, "");
 
-    if (res.contents_.empty()) {
-        return MakeCriticalError("datastore file empty");
-    }
-
-    res.checksum_absent_ = true;
-    if (!checksum_line.empty()) {
-        res.checksum_absent_ = false;
-        string actual_checksum = ChecksumString(res.contents_);
-        if (checksum_line != actual_checksum) {
-            return MakeCriticalError("datastore file checksum mismatch");
+        try {
+            file_contents.resize(file_size);
+            f.read(&file_contents[0], file_contents.size());
+            file_contents.resize(f.gcount());
+        }
+        catch (std::exception& e) {
+            return MakeCriticalError(utils::Stringer("file read failed: ", e.what()));
         }
     }
 
-    return res;
+    if (file_contents.compare(0, BINARY_MAGIC.length(), BINARY_MAGIC) == 0) {
+        return ParseBinaryFileContents(std::move(file_contents));
+    }
+    return ParseTextFileContents(std::move(file_contents));
 }
 
-// Load the datastore from disk
-static Result<json> LoadDatastore(const string& file_path) {
+// Load the datastore from disk. `o_slot` and `o_generation` are set to the slot that was
+// used and its generation.
+static Result<json> LoadDatastore(const string& file_path, int& o_slot, uint64_t& o_generation) {
     // Read the main datastore file
-    auto file_contents_1 = ReadFileContents(file_path);
+    auto file_contents_1 = ReadFileContents(SlotPath(file_path, 0));
     // Read the backup datastore file
-    auto file_contents_2 = ReadFileContents(file_path + BACKUP_EXT);
+    auto file_contents_2 = ReadFileContents(SlotPath(file_path, 1));
 
     // We won't use a file with a bad checksum, but we will use one with no checksum. This
     // allows us to cleanly migrate from pre-checksum datastores, and to test with edited
@@ -401,23 +1642,35 @@ static Result<json> LoadDatastore(const string& file_path) {
     // file and only the stub empty JSON object (and no checksum) in the second file. In
     // order to ensure the older data is successfully migrated, we need to prefer the
     // first file.
+    // Otherwise, the newest generation wins. (Files from before generations are both 0.)
 
-    string json_string;
+    DatastoreFileContents* file_contents;
     if (!file_contents_1 && !file_contents_2) {
         return PassError(file_contents_1.error());
     }
-    else if (!file_contents_1 || (file_contents_2 && !file_contents_2->checksum_absent_)) {
-        // Either file_contents_1 is in an error state or file_contents_2 has a good checksum
-        json_string = std::move(file_contents_2->contents_);
+    else if (!file_contents_1
+             || (file_contents_2 && file_contents_2->generation_ > file_contents_1->generation_)
+             || (file_contents_2 && file_contents_2->generation_ == file_contents_1->generation_
+                 && !file_contents_2->checksum_absent_)) {
+        // Either file_contents_1 is in an error state, or file_contents_2 is newer, or
+        // they're the same generation and file_contents_2 has a good checksum
+        file_contents = &*file_contents_2;
+        o_slot = 1;
     }
     else {
         // If the checksum is absent, we prefer the main datastore file
-        json_string = std::move(file_contents_1->contents_);
+        file_contents = &*file_contents_1;
+        o_slot = 0;
     }
+    o_generation = file_contents->generation_;
 
-    // At this point we know we have a non-empty json_string
+    // At this point we know we have non-empty contents
     try {
-        return json::parse(json_string);
+        auto contents = file_contents->Contents();
+        if (file_contents->binary_) {
+            return json::from_cbor(contents.data(), contents.data() + contents.length());
+        }
+        return json::parse(contents.data(), contents.data() + contents.length());
     }
     catch (json::exception& e) {
         return MakeCriticalError(
@@ -425,4 +1678,157 @@ static Result<json> LoadDatastore(const string& file_path) {
     }
 }
 
+/*
+Journal
+
+When journaling is enabled, a commit appends a single record to `file_path.journal`
+rather than rewriting the datastore files. A record is one line: the JSON array of
+`[json_pointer, value]` changes, a tab, and the checksum of the JSON. The checksum is the
+CRC-32C as 8 hex digits (older records have the legacy base64 checksum instead).
+
+When the journal grows past the compaction threshold, it is renamed to
+`file_path.journal.compacting` and a snapshot of the in-memory datastore is written to the
+datastore files in the background. When that's done, the set-aside journal is deleted.
+
+When loading, the datastore files are read and then the set-aside journal and the current
+journal are replayed on top, in that order. Replaying a record that's already reflected
+in the datastore files is harmless, as records only ever set values.
+*/
+
+// Appends a record of the given changes to the journal file.
+static Error AppendJournalRecord(const string& journal_path, const JournalChanges& changes, uint64_t& io_journal_size, bool sync) {
+    json record = json::array();
+    for (const auto& c : changes) {
+        record.push_back({c.first.to_string(), c.second});
+    }
+
+    string line;
+    try {
+        auto crc = ChecksummedDump(record, line);
+        // The ASCII-only JSON dump can't contain a tab or newline.
+        line += "\t" + ChecksumHex(crc) + "\n";
+    }
+    catch (json::exception& e) {
+        return MakeCriticalError(
+                utils::Stringer("json dump failed: ", e.what(), "; id:", e.id));
+    }
+
+    ofstream f;
+    f.open(journal_path, ios::out | ios::app | ios::binary);
+    if (!f.is_open()) {
+        return MakeCriticalError(utils::Stringer("journal_path not f.is_open; errno=", errno));
+    }
+
+    try {
+        f << line;
+    }
+    catch (std::exception& e) {
+        return MakeCriticalError(utils::Stringer("journal write failed: ", e.what()));
+    }
+
+    f.close();
+
+    if (f.fail()) {
+        return MakeCriticalError(utils::Stringer("journal_path close failed; errno=", errno));
+    }
+
+    if (sync) {
+        if (auto err = SyncFile(journal_path)) {
+            return WrapError(err, "journal sync failed");
+        }
+    }
+
+    io_journal_size += line.length();
+    return nullerr;
+}
+
+// Applies the records in the journal file to `j`. Replay stops at the first record that is
+// incomplete or has a bad checksum (which would be the result of an interrupted append);
+// in that case `o_damaged` is set.
+static Error ReplayJournal(const string& journal_path, json& j, uint64_t& o_size, bool& o_damaged) {
+    o_size = 0;
+    o_damaged = false;
+
+    if (!utils::FileExists(journal_path)) {
+        return nullerr;
+    }
+
+    ifstream f;
+    f.open(journal_path, ios::in | ios::binary);
+    if (!f) {
+        return MakeCriticalError(utils::Stringer("journal open failed; errno=", errno));
+    }
+
+    try {
+        for (string line; std::getline(f, line); ) {
+            auto tab = line.rfind('\t');
+            if (tab == string::npos || f.eof()) {
+                // No checksum, or no terminating newline
+                o_damaged = true;
+                break;
+            }
+
+            auto record_string = std::string_view(line).substr(0, tab);
+            auto checksum = std::string_view(line).substr(tab + 1);
+            auto actual_checksum = (checksum.length() == 8)
+                    ? ChecksumHex(crc32c::Value(record_string))
+                    : LegacyChecksumString(record_string);
+            if (actual_checksum != checksum) {
+                o_damaged = true;
+                break;
+            }
+
+            auto record = json::parse(record_string.data(), record_string.data() + record_string.length());
+            for (const auto& c : record) {
+                j[json::json_pointer(c.at(0).get<string>())] = c.at(1);
+            }
+
+            o_size += line.length() + 1;
+        }
+    }
+    catch (json::exception& e) {
+        return MakeCriticalError(
+                utils::Stringer("journal json parse failed: ", e.what(), "; id:", e.id));
+    }
+    catch (std::exception& e) {
+        return MakeCriticalError(utils::Stringer("journal read failed: ", e.what()));
+    }
+
+    return nullerr;
+}
+
+static Error RemoveJournals(const string& file_path) {
+    for (const auto& journal_path : {file_path + COMPACTING_JOURNAL_EXT, file_path + JOURNAL_EXT}) {
+        int err;
+        if (utils::FileExists(journal_path) && (err = std::remove(journal_path.c_str())) != 0) {
+            return MakeCriticalError(utils::Stringer("removing journal failed; err=", err, "; errno=", errno));
+        }
+    }
+    return nullerr;
+}
+
+// Load the datastore from disk, including any journaled changes. `o_journal_size` is set
+// to the size of the current journal. `o_compaction_needed` is set if there is a set-aside
+// journal or if either journal is damaged.
+static Result<json> LoadDatastoreAndJournals(const string& file_path, int& o_slot, uint64_t& o_generation,
+                                             uint64_t& o_journal_size, bool& o_compaction_needed) {
+    auto res = LoadDatastore(file_path, o_slot, o_generation);
+    if (!res) {
+        return PassError(res.error());
+    }
+
+    uint64_t compacting_size = 0;
+    bool compacting_damaged = false, journal_damaged = false;
+    if (auto err = ReplayJournal(file_path + COMPACTING_JOURNAL_EXT, *res, compacting_size, compacting_damaged)) {
+        return WrapError(err, "failed to replay set-aside journal");
+    }
+    if (auto err = ReplayJournal(file_path + JOURNAL_EXT, *res, o_journal_size, journal_damaged)) {
+        return WrapError(err, "failed to replay journal");
+    }
+
+    o_compaction_needed = utils::FileExists(file_path + COMPACTING_JOURNAL_EXT)
+                          || compacting_damaged || journal_damaged;
+    return res;
+}
+
 } // namespace psicash
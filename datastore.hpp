@@ -21,7 +21,23 @@
 #define PSICASHLIB_DATASTORE_H
 
 #include <string>
+#include <memory>
+#include <atomic>
 #include <mutex>
+#include <shared_mutex>
+#include <future>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <vector>
+#include <array>
+#include <map>
+#include <string_view>
+#include <initializer_list>
+#include <stdexcept>
+#include <typeindex>
+#include <type_traits>
+#include <functional>
 #include "error.hpp"
 #include "utils.hpp"
 #include "vendor/nonstd/expected.hpp"
@@ -29,10 +45,96 @@
 
 namespace psicash {
 
+/// How hard the datastore works to make sure that written changes survive an OS crash or
+/// power loss. (Once written, changes always survive the app crashing.)
+enum class DatastoreDurability {
+    /// Changes are left in the OS's cache, to be written to the device whenever it likes.
+    kNone = 0,
+    /// Each write is synced to the storage device before the commit returns.
+    kSyncOnCommit,
+    /// Writes are synced to the storage device in the background, at most once per
+    /// write_interval. A crash may lose the changes made since the last sync, but it
+    /// won't lose anything older.
+    kGroupCommit
+};
+
+/// Controls how the datastore persists changes. The defaults give the original behaviour,
+/// where every commit rewrites the full datastore files.
+struct DatastoreOptions {
+    /// If true, each commit appends a small checksummed record of the changed values to a
+    /// journal file, rather than rewriting the whole datastore. The journal is replayed
+    /// on top of the datastore files when loading.
+    bool journal = false;
+    /// When the journal grows beyond this many bytes, it will be compacted into the main
+    /// datastore files in the background.
+    uint64_t journal_compaction_threshold = 64 * 1024;
+    /// If true, commits update memory and return immediately, and a background thread
+    /// writes the changes to disk. Writes are coalesced, so that there is at most one
+    /// per write_interval. Use Datastore::Flush() when the changes must be on disk.
+    bool async_writes = false;
+    /// The minimum time between background writes, when async_writes is true, and
+    /// between syncs, when durability is kGroupCommit.
+    std::chrono::milliseconds write_interval = std::chrono::milliseconds(1000);
+    DatastoreDurability durability = DatastoreDurability::kNone;
+};
+
+/// The JSON type that the datastore holds its state in. Objects are utils::FlatMaps rather
+/// than std::maps, so that each object is one allocation instead of one per member. This
+/// matters because every commit copies the state. Values convert implicitly to and from
+/// nlohmann::json, which the rest of the library uses. Each conversion copies the value.
+using DatastoreJson = nlohmann::basic_json<utils::FlatMap>;
+
+/// The number of slots available to DatastoreKeys.
+constexpr int kMaxDatastoreKeySlots = 32;
+
+/// Describes a datastore value -- its location (as a JSON pointer) and type -- so that a
+/// schema can be defined at compile time, e.g.:
+///   constexpr DatastoreKey<int64_t> kBalanceKey{"/user/balance", 3};
+/// The JSON remains the backing store (snapshots, transactions, the journal and migration
+/// all operate on it); a key only saves the runtime pointer parsing and, for Get, the
+/// second tree walk that a contains()/at() pair costs.
+/// Keys of integral types may be given a slot, which is a cache of the decoded value,
+/// not a separate store: the value of a slotted key is decoded at most once per published
+/// snapshot (per thread), after which Gets of it are a load from that thread's copy of the
+/// snapshot. Slots must be unique within a datastore; see DatastoreKeySlotsUnique.
+template<typename T>
+struct DatastoreKey {
+    using value_type = T;
+
+    constexpr DatastoreKey(std::string_view path, int slot=-1)
+        : path(path),
+          slot((slot < 0 || (std::is_integral_v<T> && slot < kMaxDatastoreKeySlots))
+               ? slot : throw std::logic_error("invalid DatastoreKey slot")) {
+    }
+
+    nlohmann::json::json_pointer Pointer() const {
+        return nlohmann::json::json_pointer(std::string(path));
+    }
+
+    std::string_view path;
+    int slot;
+};
+
+/// For checking a schema with static_assert.
+constexpr bool DatastoreKeySlotsUnique(std::initializer_list<int> slots) {
+    for (auto i = slots.begin(); i != slots.end(); ++i) {
+        for (auto j = i + 1; j != slots.end(); ++j) {
+            if (*i >= 0 && *i == *j) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
 /// Extremely simplistic key-value store.
-/// Datastore operations are threadsafe.
+/// Datastore operations are threadsafe. Writes are exclusive; each commit publishes an
+/// immutable snapshot of the datastore, which Gets read without taking any lock. A thread
+/// inside a transaction sees its own uncommitted changes; other threads see the last
+/// committed state.
 class Datastore {
-    using json = nlohmann::json;
+    using json = DatastoreJson;
+    using json_pointer = nlohmann::json::json_pointer;
 
 public:
     enum class DatastoreGetError {
@@ -43,12 +145,14 @@ public:
 
 public:
     Datastore();
+    ~Datastore();
 
     /// Must be called exactly once.
     /// The fileRoot directory must already exist.
     /// suffix should be used to disambiguate different datastores. Optional (can be null).
     /// Returns false if there's an unrecoverable error (such as an inability to use the filesystem).
-    error::Error Init(const std::string& file_root, const std::string& suffix);
+    error::Error Init(const std::string& file_root, const std::string& suffix,
+                      const DatastoreOptions& options=DatastoreOptions());
 
     /// Resets the in-memory structure and the persistent file, setting it to `new_value`
     /// (which may be an empty object).
@@ -62,71 +166,451 @@ public:
     /// Init() must have already been called, successfully.
     error::Error Reset(json new_value);
 
-    /// Locks the read/write mutex and stops writing of updates to disk until
+    /// Exclusively locks the read/write mutex and stops writing of updates to disk until
     /// EndTransaction is called. Transactions are re-enterable, but not nested.
     /// NOTE: Failing to call EndTransaction will result in undefined behaviour.
     void BeginTransaction();
-    /// Ends an ongoing transaction. If commit is true, it writes the changes immediately;
-    /// if false it discards the changes.
+    /// Ends an ongoing transaction. If commit is true, it writes the changes immediately
+    /// (or schedules them to be written, with async_writes); if false it discards the
+    /// changes, reverting to the last committed state. Rolling back doesn't touch the disk.
     /// Committing or rolling back inner transactions does nothing. Any errors during
     /// inner transactions that require the outermost transaction to be rolled back must
     /// be handled by the caller.
     error::Error EndTransaction(bool commit);
 
     /// Returns the value, or an error indicating the failure reason.
+    /// Values of class types (other than strings and json) are decoded once and cached
+    /// (see GetShared), so this only costs a copy. (They're decoded from a copy of the
+    /// value converted to nlohmann::json, which is what their from_json functions take.)
     template<typename T>
-    nonstd::expected<T, DatastoreGetError> Get(const json::json_pointer& p) const {
-        try {
-            // Not returning inside the synchronize block to avoid compiler warning about
-            // "control reached end of non-void function without returning a value".
-            T val;
-            SYNCHRONIZE_BLOCK(mutex_) {
-                // Not using MUST_BE_INITIALIZED so we don't need it in the header.
-                if (!initialized_) {
-                    return nonstd::make_unexpected(DatastoreGetError::kDatastoreUninitialized);
-                }
+    nonstd::expected<T, DatastoreGetError> Get(const json_pointer& p) const {
+        if constexpr (kTypedCacheable<T>) {
+            auto v = GetShared<T>(p);
+            if (!v) {
+                return nonstd::make_unexpected(v.error());
+            }
+            return **v;
+        }
+        else {
+            auto state = ReadState();
+            if (!state) {
+                return nonstd::make_unexpected(DatastoreGetError::kDatastoreUninitialized);
+            }
+            return GetFrom<T>(*state, p.to_string());
+        }
+    }
 
-                if (p.empty() || !json_.contains(p)) {
-                    return nonstd::make_unexpected(DatastoreGetError::kNotFound);
+    /// Returns the value for the key, or an error indicating the failure reason.
+    /// The value of a slotted key is resolved only once per snapshot.
+    template<typename T>
+    nonstd::expected<T, DatastoreGetError> Get(const DatastoreKey<T>& key) const {
+        if constexpr (std::is_integral_v<T>) {
+            if (key.slot >= 0) {
+                auto v = GetSlot(key.slot, key.path, &DecodeSlot<T>);
+                if (!v) {
+                    return nonstd::make_unexpected(v.error());
                 }
-
-                val = json_.at(p).get<T>();
+                return static_cast<T>(*v);
             }
-            return val;
         }
-        catch (json::type_error&) {
-            return nonstd::make_unexpected(DatastoreGetError::kTypeMismatch);
+        if constexpr (kTypedCacheable<T>) {
+            auto v = GetSharedAt<T>(key.path);
+            if (!v) {
+                return nonstd::make_unexpected(v.error());
+            }
+            return **v;
         }
-        catch (json::out_of_range&) {
-            // This should be avoided by the explicit check above. But we'll be safe.
-            return nonstd::make_unexpected(DatastoreGetError::kNotFound);
+        else {
+            auto state = ReadState();
+            if (!state) {
+                return nonstd::make_unexpected(DatastoreGetError::kDatastoreUninitialized);
+            }
+            return GetFrom<T>(*state, key.path);
         }
     }
 
+    /// Like Get, but returns a shared reference to the decoded value, which is cached. The
+    /// cached value is reused until a Set touches `p`, one of its ancestors, or something
+    /// inside it. (Values read by a thread inside a transaction with uncommitted changes
+    /// aren't cached.)
+    template<typename T>
+    nonstd::expected<std::shared_ptr<const T>, DatastoreGetError> GetShared(const json_pointer& p) const {
+        return GetSharedAt<T>(p.to_string());
+    }
+
+    template<typename T>
+    nonstd::expected<std::shared_ptr<const T>, DatastoreGetError> GetShared(const DatastoreKey<T>& key) const {
+        return GetSharedAt<T>(key.path);
+    }
+
+    /// Calls `fn` with a reference to the value at `p` -- without copying or decoding it --
+    /// and returns what `fn` returns, or an error indicating why the value couldn't be read.
+    /// `fn` must take a DatastoreJson, or the value will be converted (copied) after all.
+    /// The value comes from the same state that Get would see. The reference is only valid
+    /// during the call. The state is held for the duration of the call, so `fn` may call
+    /// into the datastore, but any changes it makes won't be reflected in the reference.
+    template<typename Fn>
+    auto Read(const json_pointer& p, Fn&& fn) const {
+        return ReadAt(p.to_string(), std::forward<Fn>(fn));
+    }
+
+    template<typename T, typename Fn>
+    auto Read(const DatastoreKey<T>& key, Fn&& fn) const {
+        return ReadAt(key.path, std::forward<Fn>(fn));
+    }
+
+    /// While an instance of this class is alive, all Gets on the datastore made by the
+    /// creating thread will see the same state, even if other threads commit changes in
+    /// the meantime. This allows a consistent set of values to be read.
+    /// Can be nested -- inner instances do nothing. Must be destroyed on the thread that
+    /// created it.
+    class ConsistentRead {
+    public:
+        explicit ConsistentRead(const Datastore& datastore);
+        ~ConsistentRead();
+        ConsistentRead(const ConsistentRead&) = delete;
+        ConsistentRead& operator=(const ConsistentRead&) = delete;
+    private:
+        const Datastore& datastore_;
+        bool pinned_;
+    };
+
     error::Result<nlohmann::json> Get() const;
 
+    /// Writes any committed changes that have not yet been written to disk, and syncs any
+    /// writes that haven't been synced yet (with kGroupCommit durability). With
+    /// async_writes or kGroupCommit, this must be called when changes need to be durable;
+    /// otherwise it only retries a previously failed write. Changes made by an ongoing
+    /// transaction on this thread are not written.
+    /// The destructor also flushes.
+    error::Error Flush();
+
     /// Sets the value v in the datastore at path p.
     /// If write_store is false, the change will stored in memory but not written to disk.
     /// However, the dirty flag will be set and the change will be in the next write.
     /// NOTE: Set is not atomic. If the file operation fails, the intermediate object will still be
     /// updated. We may want this to be otherwise in the future, but for now I think that it's preferable.
     /// Returns false if the file operation failed.
-    error::Error Set(const json::json_pointer& p, json v, bool write_store=true);
+    error::Error Set(const json_pointer& p, json v, bool write_store=true);
+
+    /// Sets the value for the key. See the other Set for details.
+    template<typename T>
+    error::Error Set(const DatastoreKey<T>& key, const std::type_identity_t<T>& v, bool write_store=true) {
+        return Set(key.Pointer(), ToJson(v), write_store);
+    }
+
+    /// Sets all of `values`, in order, taking the lock once. The values are moved into the
+    /// datastore. Values that are the same as what's already there are skipped. Outside of
+    /// a transaction, the changes are committed together (and, if write_store is true,
+    /// written together). See Set for the meaning of write_store.
+    error::Error SetMany(std::vector<std::pair<json_pointer, json>>&& values, bool write_store=true);
+
+    /// Returns a number that increases each time a commit changes the value at the JSON
+    /// pointer `path` -- including by changing something inside it, or one of its
+    /// ancestors. Comparing it with a previously returned number is a cheap way to tell
+    /// whether the value needs to be read again. Changes are only tracked to a depth of
+    /// two levels, so a deeper path also sees changes to its neighbours.
+    uint64_t ChangeGeneration(std::string_view path) const;
+
+    /// Like ChangeGeneration, but for the value that this thread's Gets see. Returns zero
+    /// if that might not be the latest committed value -- because the thread has
+    /// uncommitted changes in a transaction, or is reading an older snapshot (see
+    /// ConsistentRead). A value derived from what Gets return can be cached against a
+    /// non-zero result.
+    uint64_t ReadChangeGeneration(std::string_view path) const;
+
+    /// Returns a number that increases each time the whole state is replaced (by Init or
+    /// Reset) rather than changed by Sets.
+    uint64_t ResetGeneration() const;
+
+    using SubscriptionID = uint64_t;
+    /// Receives the subscribed paths whose values have changed.
+    using ChangeCallback = std::function<void(const std::vector<std::string>& changed_paths)>;
+
+    /// Calls `callback` after commits that change the value at any of `paths` (in the
+    /// sense of ChangeGeneration). Calls are made from a notification thread, so a slow
+    /// callback never holds up commits; changes committed while callbacks are running are
+    /// combined into the next call.
+    /// Returns the ID to pass to Unsubscribe.
+    SubscriptionID Subscribe(std::vector<std::string> paths, ChangeCallback callback);
+
+    /// Removes a subscription. After this returns, its callback won't be called again. If
+    /// a callback is running on the notification thread, this waits for it to finish, so
+    /// it must not be called while holding anything a callback might wait for.
+    void Unsubscribe(SubscriptionID id);
 
 protected:
+    /// Returns the state that Gets by the current thread should see, or null if the
+    /// datastore is not initialized. Does not lock. The result is only valid until the
+    /// current thread next calls into this datastore.
+    /// If `o_generation` is given, it's set to the generation of the returned snapshot, or
+    /// to zero if the state is this thread's uncommitted changes.
+    const json* ReadState(uint64_t* o_generation=nullptr) const;
+    /// Like ReadState, but the result remains valid for as long as it is held.
+    std::shared_ptr<const json> ReadStateShared(uint64_t* o_generation=nullptr) const;
+    /// Returns the latest published snapshot, via this thread's cache.
+    const std::shared_ptr<const json>& CachedSnapshot(uint64_t* o_generation=nullptr) const;
+    /// This thread's cached view of the latest published snapshot. (Defined in the .cpp.)
+    struct ThreadSnapshot;
+    ThreadSnapshot& CurrentThreadSnapshot() const;
+
+    /// Types whose decoded values are worth caching. Decoding scalars and strings is about
+    /// as cheap as a cache lookup.
+    template<typename T>
+    static constexpr bool kTypedCacheable = std::is_class_v<T> && !std::is_same_v<T, std::string>
+                                            && !nlohmann::detail::is_basic_json<T>::value;
+    /// Class types (other than strings and json) have their to_json and from_json defined
+    /// for nlohmann::json, so they're converted via that.
+    template<typename T>
+    static constexpr bool kConvertedViaNlohmann = kTypedCacheable<T>;
+
+    using TypedCacheKey = std::pair<std::string, std::type_index>;
+    /// Returns the cached value for `key`, if there is one that's valid for the snapshot with
+    /// the given generation.
+    std::shared_ptr<const void> LookupTyped(const TypedCacheKey& key, uint64_t generation) const;
+    /// Caches a value decoded from the snapshot with the given generation. Does nothing if
+    /// that snapshot is no longer current.
+    void StoreTyped(TypedCacheKey key, uint64_t generation, std::shared_ptr<const void> value) const;
+
+    /// Returns the value at the JSON pointer `path` in `state`, or null if there isn't one.
+    /// Unlike contains() followed by at(), this walks the tree only once.
+    static const json* Find(const json& state, std::string_view path);
+
+    template<typename T>
+    static nonstd::expected<T, DatastoreGetError> GetFrom(const json& state, std::string_view path) {
+        auto found = path.empty() ? nullptr : Find(state, path);
+        if (!found) {
+            return nonstd::make_unexpected(DatastoreGetError::kNotFound);
+        }
+        try {
+            if constexpr (kConvertedViaNlohmann<T>) {
+                return nlohmann::json(*found).get<T>();
+            }
+            else {
+                return found->get<T>();
+            }
+        }
+        catch (json::type_error&) {
+            return nonstd::make_unexpected(DatastoreGetError::kTypeMismatch);
+        }
+    }
+
+    template<typename T>
+    static json ToJson(const T& v) {
+        if constexpr (kConvertedViaNlohmann<T>) {
+            return json(nlohmann::json(v));
+        }
+        else {
+            return json(v);
+        }
+    }
+
+    template<typename T>
+    nonstd::expected<std::shared_ptr<const T>, DatastoreGetError> GetSharedAt(std::string_view path) const {
+        uint64_t generation = 0;
+        auto state = ReadState(&generation);
+        if (!state) {
+            return nonstd::make_unexpected(DatastoreGetError::kDatastoreUninitialized);
+        }
+
+        TypedCacheKey key(std::string(path), typeid(T));
+        if (generation != 0) {
+            if (auto cached = LookupTyped(key, generation)) {
+                return std::static_pointer_cast<const T>(cached);
+            }
+        }
+
+        auto v = GetFrom<T>(*state, path);
+        if (!v) {
+            return nonstd::make_unexpected(v.error());
+        }
+        auto shared = std::make_shared<const T>(std::move(*v));
+        if (generation != 0) {
+            StoreTyped(std::move(key), generation, shared);
+        }
+        return shared;
+    }
+
+    template<typename Fn>
+    auto ReadAt(std::string_view path, Fn&& fn) const
+            -> nonstd::expected<std::invoke_result_t<Fn, const json&>, DatastoreGetError> {
+        auto state = ReadStateShared();
+        if (!state) {
+            return nonstd::make_unexpected(DatastoreGetError::kDatastoreUninitialized);
+        }
+        auto found = path.empty() ? state.get() : Find(*state, path);
+        if (!found) {
+            return nonstd::make_unexpected(DatastoreGetError::kNotFound);
+        }
+        if constexpr (std::is_void_v<std::invoke_result_t<Fn, const json&>>) {
+            std::forward<Fn>(fn)(*found);
+            return {};
+        }
+        else {
+            return std::forward<Fn>(fn)(*found);
+        }
+    }
+
+    /// Decodes the value at `path` for a slot. Integral values of all types fit in int64_t.
+    using SlotDecoder = nonstd::expected<int64_t, DatastoreGetError> (*)(const json& state, std::string_view path);
+    template<typename T>
+    static nonstd::expected<int64_t, DatastoreGetError> DecodeSlot(const json& state, std::string_view path) {
+        auto v = GetFrom<T>(state, path);
+        if (!v) {
+            return nonstd::make_unexpected(v.error());
+        }
+        return static_cast<int64_t>(*v);
+    }
+    /// Returns the value of the slotted key, resolving it with `decode` if this thread hasn't
+    /// already done so for the current snapshot.
+    nonstd::expected<int64_t, DatastoreGetError> GetSlot(int slot, std::string_view path, SlotDecoder decode) const;
+
+    /// The current state, as seen by writers. Must be called with the exclusive lock held.
+    const json& Current() const;
+    /// The current state, for modification. Copies the published snapshot if there are
+    /// no unpublished changes yet. Must be called with the exclusive lock held.
+    json& Mutable();
+    /// Sets the value at `p` in the working state, unless it's already there. Returns true if
+    /// anything changed. Doesn't publish. Must be called with the exclusive lock held.
+    bool SetValue(const json_pointer& p, json&& v);
+
+    /// Publishes any changes made via Mutable() as the new snapshot.
+    void Publish();
+    /// Replaces the snapshot, discarding any unpublished changes.
+    void Publish(json new_state);
+
     /// Helper for the public Reset methods
     error::Error Reset(const std::string& file_path, json new_value);
 
+    /// Persists the committed changes, if there are any that haven't been written.
+    error::Error WritePending();
+
+    /// Writes the changes made since the last write to disk, either as a journal record
+    /// or by rewriting the datastore files.
+    error::Error Persist();
+
+    /// Syncs the files written since the last sync, and the directory, to the storage
+    /// device. Only has anything to do with kGroupCommit durability.
+    error::Error Sync();
+
+    /// Writes the latest snapshot to the older of the two datastore file slots. (Or, with
+    /// kGroupCommit, to the newest slot if it hasn't been synced yet, so that the other
+    /// remains a durable fallback.)
+    error::Error Save();
+
+    /// Writes the whole in-memory datastore to the datastore files and removes the journals.
+    error::Error Compact();
+
+    /// Waits for any background journal compaction to finish.
+    void WaitForCompaction();
+
+    /// Body of the background writer thread used with async_writes and kGroupCommit.
+    void WriterLoop();
+    /// Wakes the background writer to flush and sync changes.
+    void RequestWrite();
+    /// Stops the background writer thread, if it's running.
+    void StopWriter();
+
+    /// Body of the thread that delivers change notifications to subscribers.
+    void NotifierLoop();
+    /// Calls the callbacks of the subscriptions affected by the changes at `changed_paths`.
+    void NotifySubscribers(const std::vector<std::string>& changed_paths);
+    /// Stops the notification thread, if it's running, after it delivers any queued changes.
+    void StopNotifier();
+
 private:
-    bool initialized_;
+    std::atomic<bool> initialized_;
+    DatastoreOptions options_;
 
-    mutable std::recursive_mutex mutex_;
-    std::unique_lock<std::recursive_mutex> explicit_lock_;
+    /// Writers and transactions take the exclusive lock. Reads of the published snapshot
+    /// don't lock.
+    mutable utils::RecursiveMutex mutex_;
+    std::unique_lock<utils::RecursiveMutex> explicit_lock_;
     int transaction_depth_;
     bool transaction_dirty_;
 
     std::string file_path_;
-    json json_;
+
+    /// The last committed state. Never null, and never modified once published.
+#if defined(__cpp_lib_atomic_shared_ptr)
+    std::atomic<std::shared_ptr<const json>> snapshot_;
+#else
+    /// Only accessed via std::atomic_load/std::atomic_store.
+    std::shared_ptr<const json> snapshot_;
+#endif
+    /// Incremented (from a process-wide counter) each time a snapshot is published, so that
+    /// readers can cheaply tell whether a snapshot they already hold is still current.
+    std::atomic<uint64_t> snapshot_generation_;
+    /// Changes not yet published, if any. Only accessed with the exclusive lock held.
+    std::shared_ptr<json> working_;
+    /// The pointers Set in working_. Cached values for them are invalidated on publishing.
+    std::vector<std::string> working_pointers_;
+
+    /// Decoded values, keyed by pointer and type. Each entry is valid for every snapshot
+    /// from the one it was decoded from up to the current one, as publishing removes the
+    /// entries that it changes. Publishing takes the lock exclusively, so that snapshot_ and
+    /// snapshot_generation_ change together as far as the cache is concerned.
+    struct TypedCacheEntry {
+        uint64_t generation;
+        std::shared_ptr<const void> value;
+    };
+    mutable std::shared_mutex typed_cache_mutex_;
+    mutable std::map<TypedCacheKey, TypedCacheEntry> typed_cache_;
+
+    /// The generation of the last commit that changed each path, with the paths cut
+    /// short at the tracked depth, and of the last commit that replaced the whole state.
+    /// Guarded by typed_cache_mutex_.
+    std::map<std::string, uint64_t> change_generations_;
+    uint64_t reset_generation_;
+
+    /// Passes the paths changed by each commit to the notification thread. Only used
+    /// while there are subscribers. (Defined in the .cpp.)
+    class ChangeQueue;
+    std::unique_ptr<ChangeQueue> change_queue_;
+    std::atomic<bool> has_subscribers_;
+
+    struct Subscription {
+        std::vector<std::string> paths;
+        ChangeCallback callback;
+    };
+    std::mutex subscriptions_mutex_;
+    std::map<SubscriptionID, std::shared_ptr<const Subscription>> subscriptions_;
+    SubscriptionID next_subscription_id_;
+    /// Held by the notification thread while it's calling callbacks.
+    std::mutex delivery_mutex_;
+    std::thread notifier_;
+
+    /// The CBOR encodings of the latest snapshot's subtrees, keyed by JSON pointer, kept
+    /// so that saves only have to encode what has changed. Publishing removes the entries
+    /// that it changes. Only accessed with the exclusive lock held.
+    std::map<std::string, std::string> encoded_subtrees_;
+
+    /// Which datastore file slot has the newest contents, and their generation. The next
+    /// save goes to the other slot.
+    int newest_slot_;
+    uint64_t generation_;
+
+    /// With kGroupCommit: whether the newest slot, the journal, or the directory have been
+    /// written since the last sync.
+    bool newest_slot_unsynced_;
+    bool journal_unsynced_;
+    bool directory_unsynced_;
+
+    /// Changes made since the last write, in order. Only used in journal mode.
+    std::vector<std::pair<json::json_pointer, json>> pending_changes_;
+    /// The number of pending_changes_ made before the current transaction began. Only
+    /// these may be written while the transaction is ongoing.
+    size_t transaction_start_pending_;
+    /// True if there are committed changes that have not been written to disk.
+    bool write_pending_;
+    uint64_t journal_size_;
+    std::future<void> compaction_;
+
+    std::thread writer_;
+    std::mutex writer_mutex_;
+    std::condition_variable writer_cv_;
+    bool write_requested_;
+    bool stop_writer_;
 };
 
 } // namespace psicash
@@ -18,13 +18,20 @@
  */
 
 #include <cstdlib>
+#include <algorithm>
 #include <ctime>
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 #include <filesystem>
 
 #include "gtest/gtest.h"
 #include "test_helpers.hpp"
 #include "datastore.hpp"
+#include "base64.hpp"
+#include "crc32c.hpp"
 
 using namespace std;
 using namespace psicash;
@@ -36,6 +43,22 @@ class TestDatastore : public ::testing::Test, public TempDir
 {
   public:
     TestDatastore() = default;
+
+    // The most recent modification time of the two datastore file slots.
+    std::filesystem::file_time_type LatestWriteTime(const string& ds_path) {
+        return std::max(std::filesystem::last_write_time(ds_path),
+                        std::filesystem::last_write_time(BackupDatastoreFile(ds_path)));
+    }
+
+    // Computes the checksum found in text-format datastore files.
+    static string TextFormatChecksum(const string& s) {
+        size_t hash = std::hash<std::string>{}(s);
+        vector<uint8_t> checksum(sizeof(hash));
+        for (size_t i = 0; i < sizeof(hash); i++) {
+            checksum[sizeof(hash)-1-i] = (hash >> (i * 8));
+        }
+        return base64::B64Encode(checksum);
+    }
 };
 
 TEST_F(TestDatastore, InitSimple)
@@ -50,19 +73,7 @@ TEST_F(TestDatastore, InitCorrupt)
     const auto k = "/k"_json_pointer;
 
     // Note that the underlying implementation of std::hash differs between platforms, so we can't just hardcode known datastore values and checksums. We'll need to compute a real value.
-    string kv_checksum;
-    {
-        auto temp_dir = GetTempDir();
-        Datastore ds;
-        auto err = ds.Init(temp_dir, GetSuffix(true));
-        ASSERT_FALSE(err);
-        ASSERT_FALSE(ds.Set(k, "v"s));
-
-        auto ds_contents = ReadFile(DatastoreFilepath(temp_dir, true));
-        ASSERT_TRUE(ds_contents);
-        auto close_brace = ds_contents->find_last_of("}");
-        kv_checksum = utils::TrimCopy(ds_contents->substr(close_brace+1));
-    }
+    string kv_checksum = TextFormatChecksum(R"({"k":"v"})");
 
     const string checksum_match = R"({"k":"v"})"s + "\n\n" + kv_checksum;
     const string checksum_mismatch = R"({"k":"z"})"s + "\n\n" + kv_checksum;
@@ -180,6 +191,179 @@ TEST_F(TestDatastore, InitCorrupt)
     }
 }
 
+TEST_F(TestDatastore, InitCorruptBinary)
+{
+    const auto k = "/k"_json_pointer;
+
+    auto temp_dir = GetTempDir();
+    auto ds_file = DatastoreFilepath(temp_dir, true);
+    {
+        Datastore ds;
+        auto err = ds.Init(temp_dir, GetSuffix(true));
+        ASSERT_FALSE(err);
+        ASSERT_FALSE(ds.Set(k, "v"s));
+    }
+
+    // The first save after init goes to the backup slot
+    auto good_contents = ReadFile(BackupDatastoreFile(ds_file));
+    ASSERT_TRUE(good_contents);
+    auto bad_contents = *good_contents;
+    bad_contents.back() ^= 0x01;
+    auto truncated_contents = good_contents->substr(0, 5);
+
+    // The main datastore file is corrupt
+    {
+        ASSERT_TRUE(WriteFile(ds_file, bad_contents));
+        ASSERT_TRUE(WriteFile(BackupDatastoreFile(ds_file), *good_contents));
+
+        Datastore ds;
+        auto err = ds.Init(temp_dir, GetSuffix(true));
+        ASSERT_FALSE(err);
+        auto val = ds.Get<string>(k);
+        ASSERT_TRUE(val);
+        ASSERT_EQ(*val, "v");
+    }
+
+    // The backup datastore file is truncated
+    {
+        ASSERT_TRUE(WriteFile(ds_file, *good_contents));
+        ASSERT_TRUE(WriteFile(BackupDatastoreFile(ds_file), truncated_contents));
+
+        Datastore ds;
+        auto err = ds.Init(temp_dir, GetSuffix(true));
+        ASSERT_FALSE(err);
+        auto val = ds.Get<string>(k);
+        ASSERT_TRUE(val);
+        ASSERT_EQ(*val, "v");
+    }
+
+    // Both are bad
+    {
+        ASSERT_TRUE(WriteFile(ds_file, bad_contents));
+        ASSERT_TRUE(WriteFile(BackupDatastoreFile(ds_file), truncated_contents));
+
+        Datastore ds;
+        auto err = ds.Init(temp_dir, GetSuffix(true));
+        ASSERT_TRUE(err);
+    }
+}
+
+TEST_F(TestDatastore, AlternatingSlots)
+{
+    const auto k = "/k"_json_pointer;
+
+    auto temp_dir = GetTempDir();
+    auto ds_file = DatastoreFilepath(temp_dir, true);
+    auto backup_file = BackupDatastoreFile(ds_file);
+    {
+        Datastore ds;
+        auto err = ds.Init(temp_dir, GetSuffix(true));
+        ASSERT_FALSE(err);
+
+        // Each save writes only the older slot
+        ASSERT_FALSE(ds.Set(k, "v1"s));
+        auto main_contents = ReadFile(ds_file);
+        ASSERT_TRUE(main_contents);
+        ASSERT_FALSE(ds.Set(k, "v2"s));
+        ASSERT_NE(*ReadFile(ds_file), *main_contents);
+        main_contents = ReadFile(ds_file);
+        auto backup_contents = ReadFile(backup_file);
+        ASSERT_TRUE(backup_contents);
+        ASSERT_FALSE(ds.Set(k, "v3"s));
+        ASSERT_EQ(*ReadFile(ds_file), *main_contents);
+        ASSERT_NE(*ReadFile(backup_file), *backup_contents);
+    }
+
+    // The newest generation wins
+    {
+        Datastore ds;
+        auto err = ds.Init(temp_dir, GetSuffix(true));
+        ASSERT_FALSE(err);
+        ASSERT_EQ(*ds.Get<string>(k), "v3");
+    }
+
+    // If the newest slot is corrupt, the previous commit is loaded
+    auto contents = ReadFile(backup_file);
+    ASSERT_TRUE(contents);
+    contents->back() ^= 0x01;
+    ASSERT_TRUE(WriteFile(backup_file, *contents));
+    {
+        Datastore ds;
+        auto err = ds.Init(temp_dir, GetSuffix(true));
+        ASSERT_FALSE(err);
+        ASSERT_EQ(*ds.Get<string>(k), "v2");
+
+        // And the next save replaces the corrupt slot, not the good one
+        ASSERT_FALSE(ds.Set(k, "v4"s));
+    }
+    {
+        Datastore ds;
+        auto err = ds.Init(temp_dir, GetSuffix(true));
+        ASSERT_FALSE(err);
+        ASSERT_EQ(*ds.Get<string>(k), "v4");
+    }
+
+    // Remove the corrupt slot's replacement to check the good one was kept
+    ASSERT_EQ(std::remove(backup_file.c_str()), 0);
+    {
+        Datastore ds;
+        auto err = ds.Init(temp_dir, GetSuffix(true));
+        ASSERT_FALSE(err);
+        ASSERT_EQ(*ds.Get<string>(k), "v2");
+    }
+}
+
+TEST_F(TestDatastore, InitMigrateTextFormat)
+{
+    auto temp_dir = GetTempDir();
+    auto ds_file = DatastoreFilepath(temp_dir, true);
+    const string json_string = R"({"k":"v"})";
+    ASSERT_TRUE(Write(temp_dir, true, json_string + "\n\n" + TextFormatChecksum(json_string)));
+
+    Datastore ds;
+    auto err = ds.Init(temp_dir, GetSuffix(true));
+    ASSERT_FALSE(err);
+    auto val = ds.Get<string>("/k"_json_pointer);
+    ASSERT_TRUE(val);
+    ASSERT_EQ(*val, "v");
+
+    // The files are left alone until the next write
+    auto ds_contents = ReadFile(ds_file);
+    ASSERT_TRUE(ds_contents);
+    ASSERT_EQ(ds_contents->front(), '{');
+
+    err = ds.Set("/k2"_json_pointer, "v2"s);
+    ASSERT_FALSE(err);
+
+    // Only one slot is written per save; the other keeps the old text file
+    int binary_count = 0;
+    for (const auto& f : {ds_file, BackupDatastoreFile(ds_file)}) {
+        ds_contents = ReadFile(f);
+        ASSERT_TRUE(ds_contents);
+        binary_count += (ds_contents->substr(0, 4) == "\x89PCD");
+    }
+    ASSERT_EQ(binary_count, 1);
+
+    err = ds.Set("/k3"_json_pointer, "v3"s);
+    ASSERT_FALSE(err);
+
+    for (const auto& f : {ds_file, BackupDatastoreFile(ds_file)}) {
+        ds_contents = ReadFile(f);
+        ASSERT_TRUE(ds_contents);
+        ASSERT_EQ(ds_contents->substr(0, 4), "\x89PCD");
+    }
+
+    Datastore ds2;
+    err = ds2.Init(temp_dir, GetSuffix(true));
+    ASSERT_FALSE(err);
+    val = ds2.Get<string>("/k"_json_pointer);
+    ASSERT_TRUE(val);
+    ASSERT_EQ(*val, "v");
+    val = ds2.Get<string>("/k2"_json_pointer);
+    ASSERT_TRUE(val);
+    ASSERT_EQ(*val, "v2");
+}
+
 TEST_F(TestDatastore, InitBadDir)
 {
     auto bad_dir = GetTempDir() + "/a/b/c/d/f/g";
@@ -566,127 +750,766 @@ TEST_F(TestDatastore, NestedTransactions)
     ASSERT_FALSE(got);
 }
 
-TEST_F(TestDatastore, TransactionRaceConditionBug)
+TEST_F(TestDatastore, RollbackMatchesDisk)
 {
-    // Before we added "transactions" to the datastore, it only provided the ability to
-    // "pause" writing. But this still left the possibility that a set of updates that
-    // are only coherent together (like setting "is account" and the "account username")
-    // could be read when only partially updated (each individual Set is threadsafe, but
-    // multiple of them could be read separately).
+    // Rolling back used to reload the datastore from disk. Check that the in-memory
+    // rollback ends up in the same state that reloading would give.
+    for (bool journal : {false, true}) {
+        auto temp_dir = GetTempDir();
+        DatastoreOptions options;
+        options.journal = journal;
+
+        Datastore ds;
+        auto err = ds.Init(temp_dir, ds_suffix, options);
+        ASSERT_FALSE(err);
+
+        auto disk_state = [&]() {
+            Datastore disk;
+            EXPECT_FALSE(disk.Init(temp_dir, ds_suffix, options));
+            return *disk.Get();
+        };
+
+        for (int i = 0; i < 20; i++) {
+            const auto n = to_string(i);
+            bool commit = (i % 3 == 0);
+
+            ds.BeginTransaction();
+            // New keys, changed keys, nested values, and replaced ancestors
+            ASSERT_FALSE(ds.Set(json::json_pointer("/k" + n), i));
+            ASSERT_FALSE(ds.Set("/shared"_json_pointer, n));
+            ASSERT_FALSE(ds.Set(json::json_pointer("/obj/" + n + "/deep"), {{"i", i}}));
+            if (i % 4 == 1) {
+                ASSERT_FALSE(ds.Set("/obj"_json_pointer, json::object()));
+            }
+            if (i % 5 == 2) {
+                // A committed inner transaction doesn't survive the outer rollback
+                ds.BeginTransaction();
+                ASSERT_FALSE(ds.Set("/inner"_json_pointer, n));
+                ASSERT_FALSE(ds.EndTransaction(true));
+            }
+            ASSERT_FALSE(ds.EndTransaction(commit));
+
+            ASSERT_EQ(*ds.Get(), disk_state()) << "journal=" << journal << " i=" << i;
+        }
+        ASSERT_TRUE(ds.Get<int>("/k0"_json_pointer));
+        ASSERT_FALSE(ds.Get<int>("/k1"_json_pointer));
+    }
+}
+
+TEST_F(TestDatastore, RollbackWithoutIO)
+{
+    auto temp_dir = GetTempDir();
+    auto ds_path = DatastoreFilepath(temp_dir, ds_suffix);
 
     Datastore ds;
-    auto err = ds.Init(GetTempDir(), ds_suffix);
+    auto err = ds.Init(temp_dir, ds_suffix);
     ASSERT_FALSE(err);
-
-    const auto k = "/k"_json_pointer;
-    const string k_want1 = "kv";
-    err = ds.Set(k, k_want1);
+    err = ds.Set("/k"_json_pointer, "committed");
     ASSERT_FALSE(err);
 
-    const auto j = "/j"_json_pointer;
-    const string j_want1 = "jv";
-    err = ds.Set(j, j_want1);
-    ASSERT_FALSE(err);
+    // With the files gone, a rollback that went to the disk would lose the committed state
+    ASSERT_EQ(std::remove(ds_path.c_str()), 0);
+    ASSERT_EQ(std::remove(BackupDatastoreFile(ds_path).c_str()), 0);
 
-    const string k_want2 = "kv2", j_want2 = "jv2";
+    ds.BeginTransaction();
+    err = ds.Set("/k"_json_pointer, "rolled back");
+    ASSERT_FALSE(err);
+    err = ds.EndTransaction(false);
+    ASSERT_FALSE(err);
 
-    std::thread t([&](){
-        ds.BeginTransaction();
+    ASSERT_EQ(*ds.Get<string>("/k"_json_pointer), "committed");
+    ASSERT_FALSE(utils::FileExists(ds_path));
+    ASSERT_FALSE(utils::FileExists(BackupDatastoreFile(ds_path)));
+}
 
-        err = ds.Set(k, k_want2);
+TEST_F(TestDatastore, RollbackKeepsNoStoreChanges)
+{
+    // Unlike reloading from disk, rolling back keeps changes made with write_store=false
+    // before the transaction. They're committed in memory, and are written with the next
+    // write.
+    auto temp_dir = GetTempDir();
+    {
+        Datastore ds;
+        auto err = ds.Init(temp_dir, ds_suffix);
         ASSERT_FALSE(err);
-
-        // Give the main-thread code a chance to read k
-        std::this_thread::sleep_for(std::chrono::milliseconds(200));
-
-        err = ds.Set(j, j_want2);
+        err = ds.Set("/nostore"_json_pointer, "v", false);
         ASSERT_FALSE(err);
 
-        ds.EndTransaction(true);
-    });
+        ds.BeginTransaction();
+        err = ds.Set("/k"_json_pointer, "rolled back");
+        ASSERT_FALSE(err);
+        err = ds.EndTransaction(false);
+        ASSERT_FALSE(err);
 
-    // Give the thread a chance to start and set k
-    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        ASSERT_EQ(*ds.Get<string>("/nostore"_json_pointer), "v");
+        ASSERT_FALSE(ds.Get<string>("/k"_json_pointer));
 
-    // With proper transaction isolation, this Get should wait on the mutex until the thread is done
-    auto k_got = ds.Get<string>(k);
-    ASSERT_TRUE(k_got);
-    auto j_got = ds.Get<string>(j);
-    ASSERT_TRUE(j_got) << (int)j_got.error();
-    // If we have a race condition, k will have been updated, but j won't be
-    ASSERT_EQ(*k_got, k_want2);
-    ASSERT_EQ(*j_got, j_want2) << "transaction isolation fail!";
+        err = ds.Set("/x"_json_pointer, "y");
+        ASSERT_FALSE(err);
+    }
 
-    t.join();
+    Datastore ds;
+    auto err = ds.Init(temp_dir, ds_suffix);
+    ASSERT_FALSE(err);
+    ASSERT_EQ(*ds.Get<string>("/nostore"_json_pointer), "v");
 }
 
-TEST_F(TestDatastore, SetSimple)
+TEST_F(TestDatastore, IncrementalEncoding)
 {
+    // Saves reuse the encodings of unchanged subtrees, and must produce exactly what
+    // encoding the whole datastore would.
+    auto temp_dir = GetTempDir();
+    auto ds_file = DatastoreFilepath(temp_dir, true);
+    auto newest_payload = [&]() -> string {
+        string newest;
+        for (const auto& path : {ds_file, BackupDatastoreFile(ds_file)}) {
+            auto contents = ReadFile(path);
+            if (contents && contents->substr(0, 4) == "\x89PCD"s
+                    && (newest.empty() || contents->substr(5, 8) > newest.substr(5, 8))) {
+                newest = *contents;
+            }
+        }
+        return newest.substr(18);
+    };
+    auto cbor = [](const json& j) {
+        auto bytes = json::to_cbor(j);
+        return string(bytes.begin(), bytes.end());
+    };
+
     Datastore ds;
-    auto err = ds.Init(GetTempDir(), ds_suffix);
+    auto err = ds.Init(temp_dir, GetSuffix(true));
     ASSERT_FALSE(err);
 
-    auto k = "/k"_json_pointer;
-    string want = "v";
-    err = ds.Set(k, want);
+    json purchases = json::array();
+    for (int i = 0; i < 10; i++) {
+        purchases.push_back({{"id", "id" + to_string(i)}, {"class", "speed-boost"}});
+    }
+    json big = json::object();
+    for (int i = 0; i < 300; i++) {
+        big["k" + to_string(i)] = {{"v", i}};
+    }
+
+    const vector<pair<json::json_pointer, json>> changes = {
+        {"/user/purchases"_json_pointer, purchases},
+        {"/user/balance"_json_pointer, 100},
+        {"/instance/id"_json_pointer, "instance"},
+        {"/top"_json_pointer, "scalar"},
+        {"/big"_json_pointer, big},
+        {"/user/a~1b"_json_pointer, "slash"},
+        {"/user/c~0d"_json_pointer, "tilde"},
+        // Descendants of encoded subtrees
+        {"/user/purchases/3/class"_json_pointer, "changed"},
+        {"/big/k200/v"_json_pointer, -1},
+        // Escaped keys
+        {"/user/a~1b"_json_pointer, "slash changed"},
+        {"/user/c~0d"_json_pointer, json::array({1, 2})},
+        // Siblings
+        {"/user/balance"_json_pointer, 200},
+        {"/instance/locale"_json_pointer, "en"},
+        // Ancestors
+        {"/user"_json_pointer, {{"balance", 300}, {"purchases", purchases}}},
+        {"/top"_json_pointer, {{"now", {{"an", "object"}}}}},
+        {"/top/now/an"_json_pointer, "object again"},
+    };
+    for (const auto& change : changes) {
+        err = ds.Set(change.first, change.second);
+        ASSERT_FALSE(err);
+        ASSERT_EQ(newest_payload(), cbor(*ds.Get())) << change.first.to_string();
+    }
+
+    // A rolled-back transaction leaves the encodings as they were
+    ds.BeginTransaction();
+    err = ds.Set("/user/balance"_json_pointer, 400);
     ASSERT_FALSE(err);
+    err = ds.EndTransaction(false);
+    ASSERT_FALSE(err);
+    err = ds.Set("/instance/id"_json_pointer, "after rollback");
+    ASSERT_FALSE(err);
+    ASSERT_EQ(newest_payload(), cbor(*ds.Get()));
 
-    auto got = ds.Get<string>(k);
-    ASSERT_TRUE(got);
-    ASSERT_EQ(*got, want);
+    // As does a reset
+    err = ds.Reset({{"user", {{"balance", 500}}}});
+    ASSERT_FALSE(err);
+    err = ds.Set("/user/isAccount"_json_pointer, true);
+    ASSERT_FALSE(err);
+    ASSERT_EQ(newest_payload(), cbor(*ds.Get()));
+
+    Datastore ds2;
+    err = ds2.Init(temp_dir, GetSuffix(true));
+    ASSERT_FALSE(err);
+    ASSERT_EQ(*ds2.Get(), *ds.Get());
 }
 
-TEST_F(TestDatastore, SetDeep)
+TEST_F(TestDatastore, ChangeGeneration)
 {
     Datastore ds;
     auto err = ds.Init(GetTempDir(), ds_suffix);
     ASSERT_FALSE(err);
 
-    auto key1 = "/key1"_json_pointer, key2 = "/key2"_json_pointer;
-    string want = "want";
-    err = ds.Set(key1/key2, want);
+    auto balance = ds.ChangeGeneration("/user/balance");
+    auto purchases = ds.ChangeGeneration("/user/purchases");
+    auto user = ds.ChangeGeneration("/user");
+
+    err = ds.Set("/user/balance"_json_pointer, 1);
     ASSERT_FALSE(err);
+    ASSERT_GT(ds.ChangeGeneration("/user/balance"), balance);
+    ASSERT_GT(ds.ChangeGeneration("/user"), user);
+    ASSERT_EQ(ds.ChangeGeneration("/user/purchases"), purchases);
+    balance = ds.ChangeGeneration("/user/balance");
+    user = ds.ChangeGeneration("/user");
 
-    // Try to get key1 and then get key2 from it
-    auto gotShallow = ds.Get<json>(key1);
-    ASSERT_TRUE(gotShallow);
+    // Changes deeper than the tracked depth count as changes to their second-level ancestor
+    err = ds.Set("/user/purchases"_json_pointer, json::array({{{"id", "a"}}, {{"id", "b"}}}));
+    ASSERT_FALSE(err);
+    purchases = ds.ChangeGeneration("/user/purchases");
+    err = ds.Set("/user/purchases/1/id"_json_pointer, "c");
+    ASSERT_FALSE(err);
+    ASSERT_GT(ds.ChangeGeneration("/user/purchases"), purchases);
+    ASSERT_GT(ds.ChangeGeneration("/user/purchases/0"), purchases);
+    ASSERT_EQ(ds.ChangeGeneration("/user/balance"), balance);
+    purchases = ds.ChangeGeneration("/user/purchases");
 
-    string gotDeep = gotShallow->at(key2).get<string>();
-    ASSERT_EQ(gotDeep, want);
+    // Setting the same value again, or rolling back, isn't a change
+    err = ds.Set("/user/balance"_json_pointer, 1);
+    ASSERT_FALSE(err);
+    ds.BeginTransaction();
+    err = ds.Set("/user/balance"_json_pointer, 2);
+    ASSERT_FALSE(err);
+    err = ds.EndTransaction(false);
+    ASSERT_FALSE(err);
+    ASSERT_EQ(ds.ChangeGeneration("/user/balance"), balance);
 
-    // Then try to get /key1/key2 directly
-    auto gotDeep2 = ds.Get<string>(key1/key2);
-    ASSERT_TRUE(gotDeep2);
-    ASSERT_EQ(gotDeep2, want);
+    // Replacing an ancestor changes everything inside it
+    err = ds.Set("/user"_json_pointer, {{"balance", 1}});
+    ASSERT_FALSE(err);
+    ASSERT_GT(ds.ChangeGeneration("/user/balance"), balance);
+    ASSERT_GT(ds.ChangeGeneration("/user/purchases"), purchases);
+    balance = ds.ChangeGeneration("/user/balance");
+    auto other = ds.ChangeGeneration("/other");
+
+    // As does a reset
+    err = ds.Reset({{"user", {{"balance", 1}}}});
+    ASSERT_FALSE(err);
+    ASSERT_GT(ds.ChangeGeneration("/user/balance"), balance);
+    ASSERT_GT(ds.ChangeGeneration("/other"), other);
 }
 
-TEST_F(TestDatastore, SetAndClear)
+TEST_F(TestDatastore, Subscribe)
 {
     Datastore ds;
     auto err = ds.Init(GetTempDir(), ds_suffix);
     ASSERT_FALSE(err);
 
-    map<string, string> want = {{"a", "a"}, {"b", "b"}};
-    auto k = "/k"_json_pointer;
-    err = ds.Set(k, want);
-    ASSERT_FALSE(err);
+    std::mutex mutex;
+    std::condition_variable cv;
+    vector<vector<string>> calls;
+    auto wait_for_calls = [&](size_t count) {
+        std::unique_lock<std::mutex> lock(mutex);
+        return cv.wait_for(lock, std::chrono::seconds(5), [&]{ return calls.size() >= count; });
+    };
 
-    auto got = ds.Get<map<string, string>>(k);
-    ASSERT_TRUE(got);
-    ASSERT_EQ(got->size(), want.size());
+    auto id = ds.Subscribe({"/user/balance", "/user/purchases"}, [&](const vector<string>& changed) {
+        std::lock_guard<std::mutex> lock(mutex);
+        calls.push_back(changed);
+        cv.notify_all();
+    });
 
-    want.clear();
-    err = ds.Set(k, want);
+    err = ds.Set("/user/balance"_json_pointer, 1);
     ASSERT_FALSE(err);
+    ASSERT_TRUE(wait_for_calls(1));
 
-    got = ds.Get<map<string, string>>(k);
-    ASSERT_TRUE(got);
-    ASSERT_EQ(got->size(), 0);
-}
+    // Changes to other paths don't notify
+    err = ds.Set("/user/other"_json_pointer, 1);
+    ASSERT_FALSE(err);
+    err = ds.Set("/user/purchases/0"_json_pointer, "p");
+    ASSERT_FALSE(err);
+    ASSERT_TRUE(wait_for_calls(2));
 
-TEST_F(TestDatastore, SetTypes)
-{
-    // Test some types other than just string
+    // A commit that changes an ancestor changes every subscribed path
+    err = ds.Set("/user"_json_pointer, json::object());
+    ASSERT_FALSE(err);
+    ASSERT_TRUE(wait_for_calls(3));
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ASSERT_EQ(calls.size(), 3);
+        ASSERT_EQ(calls[0], vector<string>({"/user/balance"}));
+        ASSERT_EQ(calls[1], vector<string>({"/user/purchases"}));
+        ASSERT_EQ(calls[2], vector<string>({"/user/balance", "/user/purchases"}));
+    }
+
+    ds.Unsubscribe(id);
+    err = ds.Set("/user/balance"_json_pointer, 2);
+    ASSERT_FALSE(err);
+
+    // A callback that unsubscribes itself doesn't deadlock
+    std::atomic<int> self_calls(0);
+    Datastore::SubscriptionID self_id = 0;
+    std::promise<void> unsubscribed;
+    self_id = ds.Subscribe({"/user/balance"}, [&](const vector<string>&) {
+        if (self_calls++ == 0) {
+            ds.Unsubscribe(self_id);
+            unsubscribed.set_value();
+        }
+    });
+    err = ds.Set("/user/balance"_json_pointer, 3);
+    ASSERT_FALSE(err);
+    ASSERT_EQ(unsubscribed.get_future().wait_for(std::chrono::seconds(5)), std::future_status::ready);
+    err = ds.Set("/user/balance"_json_pointer, 4);
+    ASSERT_FALSE(err);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    ASSERT_EQ(calls.size(), 3);
+    ASSERT_EQ(self_calls, 1);
+}
+
+TEST_F(TestDatastore, SlowSubscriber)
+{
+    // A subscriber that's slow to return doesn't hold up commits, and the changes made in
+    // the meantime are combined into one call.
+    Datastore ds;
+    auto err = ds.Init(GetTempDir(), ds_suffix);
+    ASSERT_FALSE(err);
+
+    std::promise<void> entered, release;
+    auto release_future = release.get_future();
+    std::atomic<int> calls(0);
+    ds.Subscribe({"/a", "/b"}, [&](const vector<string>&) {
+        if (calls++ == 0) {
+            entered.set_value();
+            release_future.wait();
+        }
+    });
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    vector<string> last_changed;
+    ds.Subscribe({"/b"}, [&](const vector<string>& changed) {
+        std::lock_guard<std::mutex> lock(mutex);
+        last_changed = changed;
+        cv.notify_all();
+    });
+
+    err = ds.Set("/a"_json_pointer, 0);
+    ASSERT_FALSE(err);
+    ASSERT_EQ(entered.get_future().wait_for(std::chrono::seconds(5)), std::future_status::ready);
+
+    for (int i = 1; i <= 100; i++) {
+        err = ds.Set("/a"_json_pointer, i);
+        ASSERT_FALSE(err);
+    }
+    err = ds.Set("/b"_json_pointer, 1);
+    ASSERT_FALSE(err);
+    ASSERT_EQ(*ds.Get<int>("/a"_json_pointer), 100);
+
+    release.set_value();
+    std::unique_lock<std::mutex> lock(mutex);
+    ASSERT_TRUE(cv.wait_for(lock, std::chrono::seconds(5), [&]{ return !last_changed.empty(); }));
+    ASSERT_EQ(last_changed, vector<string>({"/b"}));
+    ASSERT_EQ(calls, 2);
+}
+
+TEST_F(TestDatastore, TransactionRaceConditionBug)
+{
+    // Before we added "transactions" to the datastore, it only provided the ability to
+    // "pause" writing. But this still left the possibility that a set of updates that
+    // are only coherent together (like setting "is account" and the "account username")
+    // could be read when only partially updated (each individual Set is threadsafe, but
+    // multiple of them could be read separately).
+
+    Datastore ds;
+    auto err = ds.Init(GetTempDir(), ds_suffix);
+    ASSERT_FALSE(err);
+
+    const auto k = "/k"_json_pointer;
+    const string k_want1 = "kv";
+    err = ds.Set(k, k_want1);
+    ASSERT_FALSE(err);
+
+    const auto j = "/j"_json_pointer;
+    const string j_want1 = "jv";
+    err = ds.Set(j, j_want1);
+    ASSERT_FALSE(err);
+
+    const string k_want2 = "kv2", j_want2 = "jv2";
+
+    std::thread t([&](){
+        ds.BeginTransaction();
+
+        err = ds.Set(k, k_want2);
+        ASSERT_FALSE(err);
+
+        // Give the main-thread code a chance to read k
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+        err = ds.Set(j, j_want2);
+        ASSERT_FALSE(err);
+
+        ds.EndTransaction(true);
+    });
+
+    // Give the thread a chance to start and set k
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    // With proper transaction isolation, these Gets won't see the uncommitted changes
+    auto k_got = ds.Get<string>(k);
+    ASSERT_TRUE(k_got);
+    auto j_got = ds.Get<string>(j);
+    ASSERT_TRUE(j_got) << (int)j_got.error();
+    // If we have a race condition, k will have been updated, but j won't be
+    ASSERT_EQ(*k_got, k_want1);
+    ASSERT_EQ(*j_got, j_want1) << "transaction isolation fail!";
+
+    t.join();
+
+    // Now the changes are committed
+    k_got = ds.Get<string>(k);
+    ASSERT_TRUE(k_got);
+    ASSERT_EQ(*k_got, k_want2);
+    j_got = ds.Get<string>(j);
+    ASSERT_TRUE(j_got);
+    ASSERT_EQ(*j_got, j_want2);
+}
+
+TEST_F(TestDatastore, ConsistentRead)
+{
+    Datastore ds;
+    auto err = ds.Init(GetTempDir(), ds_suffix);
+    ASSERT_FALSE(err);
+
+    const auto k = "/k"_json_pointer, j = "/j"_json_pointer;
+    err = ds.Set(k, "kv1");
+    ASSERT_FALSE(err);
+    err = ds.Set(j, "jv1");
+    ASSERT_FALSE(err);
+
+    auto set_in_thread = [&](const string& k_val, const string& j_val) {
+        std::thread t([&]() {
+            ds.BeginTransaction();
+            ASSERT_FALSE(ds.Set(k, k_val));
+            ASSERT_FALSE(ds.Set(j, j_val));
+            ASSERT_FALSE(ds.EndTransaction(true));
+        });
+        t.join();
+    };
+
+    {
+        Datastore::ConsistentRead read(ds);
+        ASSERT_EQ(*ds.Get<string>(k), "kv1");
+
+        // Another thread commits a change between our reads
+        set_in_thread("kv2", "jv2");
+
+        // We still see the state as it was when the ConsistentRead started
+        ASSERT_EQ(*ds.Get<string>(j), "jv1");
+        ASSERT_EQ(ds.Get()->at("k").get<string>(), "kv1");
+
+        {
+            // Inner instances don't change the pinned state
+            Datastore::ConsistentRead inner_read(ds);
+            ASSERT_EQ(*ds.Get<string>(k), "kv1");
+        }
+        ASSERT_EQ(*ds.Get<string>(k), "kv1");
+
+        // Our own transaction sees the latest state and our changes
+        ds.BeginTransaction();
+        ASSERT_EQ(*ds.Get<string>(k), "kv2");
+        ASSERT_FALSE(ds.Set(k, "kv3"));
+        ASSERT_EQ(*ds.Get<string>(k), "kv3");
+        ASSERT_FALSE(ds.EndTransaction(true));
+
+        // Back to the pinned state
+        ASSERT_EQ(*ds.Get<string>(k), "kv1");
+    }
+
+    // Now unpinned
+    ASSERT_EQ(*ds.Get<string>(k), "kv3");
+    ASSERT_EQ(*ds.Get<string>(j), "jv2");
+
+    // Other threads were never pinned
+    std::thread t([&]() {
+        Datastore::ConsistentRead read(ds);
+        ASSERT_EQ(*ds.Get<string>(k), "kv3");
+    });
+    t.join();
+}
+
+TEST_F(TestDatastore, TypedCache)
+{
+    Datastore ds;
+    auto err = ds.Init(GetTempDir(), ds_suffix);
+    ASSERT_FALSE(err);
+
+    const auto ab = "/a/b"_json_pointer;
+    err = ds.Set(ab, vector<int>{1, 2});
+    ASSERT_FALSE(err);
+
+    auto v1 = ds.GetShared<vector<int>>(ab);
+    ASSERT_TRUE(v1);
+    ASSERT_EQ(**v1, vector<int>({1, 2}));
+    auto v2 = ds.GetShared<vector<int>>(ab);
+    ASSERT_TRUE(v2);
+    ASSERT_EQ(*v1, *v2);
+    ASSERT_EQ(*ds.Get<vector<int>>(ab), vector<int>({1, 2}));
+
+    // The cache is per type
+    auto d = ds.GetShared<vector<double>>(ab);
+    ASSERT_TRUE(d);
+    ASSERT_EQ(**d, vector<double>({1, 2}));
+
+    // Errors aren't cached
+    ASSERT_EQ(ds.GetShared<vector<string>>(ab).error(), Datastore::DatastoreGetError::kTypeMismatch);
+    ASSERT_EQ(ds.GetShared<vector<int>>("/a/x"_json_pointer).error(), Datastore::DatastoreGetError::kNotFound);
+    err = ds.Set("/a/x"_json_pointer, vector<int>{3});
+    ASSERT_FALSE(err);
+    ASSERT_EQ(**ds.GetShared<vector<int>>("/a/x"_json_pointer), vector<int>({3}));
+
+    // Setting unrelated values doesn't invalidate the cached value
+    err = ds.Set("/a/c"_json_pointer, 1);
+    ASSERT_FALSE(err);
+    err = ds.Set("/a/bc"_json_pointer, 1);
+    ASSERT_FALSE(err);
+    ASSERT_EQ(*ds.GetShared<vector<int>>(ab), *v1);
+
+    // Setting the value, something inside it, or an ancestor does
+    err = ds.Set(ab, vector<int>{3, 4});
+    ASSERT_FALSE(err);
+    v2 = ds.GetShared<vector<int>>(ab);
+    ASSERT_NE(*v2, *v1);
+    ASSERT_EQ(**v2, vector<int>({3, 4}));
+    ASSERT_EQ(**v1, vector<int>({1, 2}));
+
+    err = ds.Set("/a/b/0"_json_pointer, 5);
+    ASSERT_FALSE(err);
+    ASSERT_EQ(**ds.GetShared<vector<int>>(ab), vector<int>({5, 4}));
+
+    err = ds.Set("/a"_json_pointer, json::object({{"b", {6}}}));
+    ASSERT_FALSE(err);
+    ASSERT_EQ(**ds.GetShared<vector<int>>(ab), vector<int>({6}));
+
+    err = ds.Reset({{"a", {{"b", {7}}}}});
+    ASSERT_FALSE(err);
+    ASSERT_EQ(**ds.GetShared<vector<int>>(ab), vector<int>({7}));
+
+    // A transaction sees its own changes, and rolled back changes don't stick
+    ds.BeginTransaction();
+    err = ds.Set(ab, vector<int>{8});
+    ASSERT_FALSE(err);
+    ASSERT_EQ(**ds.GetShared<vector<int>>(ab), vector<int>({8}));
+    err = ds.EndTransaction(false);
+    ASSERT_FALSE(err);
+    ASSERT_EQ(**ds.GetShared<vector<int>>(ab), vector<int>({7}));
+}
+
+TEST_F(TestDatastore, TypedCacheConsistentRead)
+{
+    Datastore ds;
+    auto err = ds.Init(GetTempDir(), ds_suffix);
+    ASSERT_FALSE(err);
+
+    const auto k = "/k"_json_pointer;
+    err = ds.Set(k, vector<int>{1});
+    ASSERT_FALSE(err);
+
+    auto get_in_thread = [&]() {
+        vector<int> result;
+        std::thread t([&]() { result = *ds.Get<vector<int>>(k); });
+        t.join();
+        return result;
+    };
+
+    Datastore::ConsistentRead read(ds);
+    ASSERT_EQ(*ds.Get<vector<int>>(k), vector<int>({1}));
+
+    std::thread t([&]() { ASSERT_FALSE(ds.Set(k, vector<int>{2})); });
+    t.join();
+
+    // Another thread caches the new value, but the pinned state still has the old one
+    ASSERT_EQ(get_in_thread(), vector<int>({2}));
+    ASSERT_EQ(*ds.Get<vector<int>>(k), vector<int>({1}));
+}
+
+TEST_F(TestDatastore, Keys)
+{
+    static constexpr DatastoreKey<int64_t> kSlotted{"/a/n", 0};
+    static constexpr DatastoreKey<bool> kSlottedBool{"/a/b", 1};
+    static constexpr DatastoreKey<int64_t> kUnslotted{"/a/n"};
+    static constexpr DatastoreKey<string> kString{"/a/s"};
+    static constexpr DatastoreKey<vector<int>> kVector{"/v"};
+    static constexpr DatastoreKey<int> kArrayItem{"/v/1"};
+    static constexpr DatastoreKey<string> kEscaped{"/e~1f/g~0h"};
+    static_assert(DatastoreKeySlotsUnique({kSlotted.slot, kSlottedBool.slot, kUnslotted.slot}));
+    static_assert(!DatastoreKeySlotsUnique({kSlotted.slot, 1, 0}));
+
+    Datastore ds;
+    ASSERT_EQ(ds.Get(kSlotted).error(), Datastore::DatastoreGetError::kDatastoreUninitialized);
+    auto err = ds.Init(GetTempDir(), ds_suffix);
+    ASSERT_FALSE(err);
+
+    ASSERT_EQ(ds.Get(kSlotted).error(), Datastore::DatastoreGetError::kNotFound);
+    ASSERT_EQ(ds.Get(kString).error(), Datastore::DatastoreGetError::kNotFound);
+
+    err = ds.Set(kSlotted, 1);
+    ASSERT_FALSE(err);
+    err = ds.Set(kSlottedBool, true);
+    ASSERT_FALSE(err);
+    err = ds.Set(kString, "str");
+    ASSERT_FALSE(err);
+    err = ds.Set(kVector, {1, 2, 3});
+    ASSERT_FALSE(err);
+    err = ds.Set(kEscaped, "escaped");
+    ASSERT_FALSE(err);
+
+    ASSERT_EQ(*ds.Get(kSlotted), 1);
+    ASSERT_EQ(*ds.Get(kSlotted), 1);
+    ASSERT_EQ(*ds.Get(kUnslotted), 1);
+    ASSERT_EQ(*ds.Get(kSlottedBool), true);
+    ASSERT_EQ(*ds.Get(kString), "str");
+    ASSERT_EQ(*ds.Get(kVector), vector<int>({1, 2, 3}));
+    ASSERT_EQ(*ds.Get(kArrayItem), 2);
+    ASSERT_EQ(*ds.Get(kEscaped), "escaped");
+    ASSERT_EQ(*ds.Get<string>("/e~1f/g~0h"_json_pointer), "escaped");
+    ASSERT_EQ(ds.Get()->at("e/f").at("g~h"), "escaped");
+
+    ASSERT_EQ(ds.Get(DatastoreKey<int>{"/v/3"}).error(), Datastore::DatastoreGetError::kNotFound);
+    ASSERT_EQ(ds.Get(DatastoreKey<int>{"/v/01"}).error(), Datastore::DatastoreGetError::kNotFound);
+    ASSERT_EQ(ds.Get(DatastoreKey<int>{"/v/-"}).error(), Datastore::DatastoreGetError::kNotFound);
+    ASSERT_EQ(ds.Get(DatastoreKey<int>{"/a/s/x"}).error(), Datastore::DatastoreGetError::kNotFound);
+    ASSERT_EQ(ds.Get(DatastoreKey<int>{""}).error(), Datastore::DatastoreGetError::kNotFound);
+    ASSERT_EQ(ds.Get(DatastoreKey<int>{"/a/s"}).error(), Datastore::DatastoreGetError::kTypeMismatch);
+    ASSERT_EQ(ds.Get(DatastoreKey<bool>{"/a/n", 2}).error(), Datastore::DatastoreGetError::kTypeMismatch);
+
+    // Slotted values follow changes, whether made through the key or not
+    err = ds.Set(kSlotted, 2);
+    ASSERT_FALSE(err);
+    ASSERT_EQ(*ds.Get(kSlotted), 2);
+    err = ds.Set("/a"_json_pointer, {{"n", 3}});
+    ASSERT_FALSE(err);
+    ASSERT_EQ(*ds.Get(kSlotted), 3);
+    ASSERT_EQ(ds.Get(kSlottedBool).error(), Datastore::DatastoreGetError::kNotFound);
+    err = ds.Reset({{"a", {{"n", 4}}}});
+    ASSERT_FALSE(err);
+    ASSERT_EQ(*ds.Get(kSlotted), 4);
+
+    // A transaction sees its own changes; others don't until it commits
+    ds.BeginTransaction();
+    err = ds.Set(kSlotted, 5);
+    ASSERT_FALSE(err);
+    ASSERT_EQ(*ds.Get(kSlotted), 5);
+    std::thread([&]() { ASSERT_EQ(*ds.Get(kSlotted), 4); }).join();
+    err = ds.EndTransaction(true);
+    ASSERT_FALSE(err);
+    std::thread([&]() { ASSERT_EQ(*ds.Get(kSlotted), 5); }).join();
+
+    // Pinned state is respected
+    {
+        Datastore::ConsistentRead read(ds);
+        std::thread([&]() { ASSERT_FALSE(ds.Set(kSlotted, 6)); }).join();
+        ASSERT_EQ(*ds.Get(kSlotted), 5);
+    }
+    ASSERT_EQ(*ds.Get(kSlotted), 6);
+}
+
+TEST_F(TestDatastore, SnapshotsUnaffectedByWrites)
+{
+    // A copy of the full datastore taken before a write must not see the write, and
+    // rolled-back changes must never be visible to other threads.
+    Datastore ds;
+    auto err = ds.Init(GetTempDir(), ds_suffix);
+    ASSERT_FALSE(err);
+
+    err = ds.Set("/k"_json_pointer, "v1");
+    ASSERT_FALSE(err);
+
+    auto before = ds.Get();
+    ASSERT_TRUE(before);
+
+    ds.BeginTransaction();
+    err = ds.Set("/k"_json_pointer, "v2");
+    ASSERT_FALSE(err);
+    string other_thread_got;
+    std::thread t([&]() { other_thread_got = *ds.Get<string>("/k"_json_pointer); });
+    t.join();
+    ASSERT_EQ(other_thread_got, "v1");
+    err = ds.EndTransaction(false);
+    ASSERT_FALSE(err);
+
+    ASSERT_EQ(before->at("k").get<string>(), "v1");
+    ASSERT_EQ(*ds.Get<string>("/k"_json_pointer), "v1");
+
+    err = ds.Set("/k"_json_pointer, "v3", false);
+    ASSERT_FALSE(err);
+    ASSERT_EQ(*ds.Get<string>("/k"_json_pointer), "v3");
+    ASSERT_EQ(before->at("k").get<string>(), "v1");
+}
+
+TEST_F(TestDatastore, SetSimple)
+{
+    Datastore ds;
+    auto err = ds.Init(GetTempDir(), ds_suffix);
+    ASSERT_FALSE(err);
+
+    auto k = "/k"_json_pointer;
+    string want = "v";
+    err = ds.Set(k, want);
+    ASSERT_FALSE(err);
+
+    auto got = ds.Get<string>(k);
+    ASSERT_TRUE(got);
+    ASSERT_EQ(*got, want);
+}
+
+TEST_F(TestDatastore, SetDeep)
+{
+    Datastore ds;
+    auto err = ds.Init(GetTempDir(), ds_suffix);
+    ASSERT_FALSE(err);
+
+    auto key1 = "/key1"_json_pointer, key2 = "/key2"_json_pointer;
+    string want = "want";
+    err = ds.Set(key1/key2, want);
+    ASSERT_FALSE(err);
+
+    // Try to get key1 and then get key2 from it
+    auto gotShallow = ds.Get<json>(key1);
+    ASSERT_TRUE(gotShallow);
+
+    string gotDeep = gotShallow->at(key2).get<string>();
+    ASSERT_EQ(gotDeep, want);
+
+    // Then try to get /key1/key2 directly
+    auto gotDeep2 = ds.Get<string>(key1/key2);
+    ASSERT_TRUE(gotDeep2);
+    ASSERT_EQ(gotDeep2, want);
+}
+
+TEST_F(TestDatastore, SetAndClear)
+{
+    Datastore ds;
+    auto err = ds.Init(GetTempDir(), ds_suffix);
+    ASSERT_FALSE(err);
+
+    map<string, string> want = {{"a", "a"}, {"b", "b"}};
+    auto k = "/k"_json_pointer;
+    err = ds.Set(k, want);
+    ASSERT_FALSE(err);
+
+    auto got = ds.Get<map<string, string>>(k);
+    ASSERT_TRUE(got);
+    ASSERT_EQ(got->size(), want.size());
+
+    want.clear();
+    err = ds.Set(k, want);
+    ASSERT_FALSE(err);
+
+    got = ds.Get<map<string, string>>(k);
+    ASSERT_TRUE(got);
+    ASSERT_EQ(got->size(), 0);
+}
+
+TEST_F(TestDatastore, SetTypes)
+{
+    // Test some types other than just string
 
     Datastore ds;
     auto err = ds.Init(GetTempDir(), ds_suffix);
@@ -708,187 +1531,1041 @@ TEST_F(TestDatastore, SetTypes)
     err = ds.Set(wantBoolKey, wantBool);
     ASSERT_FALSE(err);
 
-    auto gotBool = ds.Get<bool>(wantBoolKey);
-    ASSERT_TRUE(gotBool);
-    ASSERT_EQ(*gotBool, wantBool);
+    auto gotBool = ds.Get<bool>(wantBoolKey);
+    ASSERT_TRUE(gotBool);
+    ASSERT_EQ(*gotBool, wantBool);
+
+    // int
+    int wantInt = 5273482;
+    auto wantIntKey = "/wantIntKey"_json_pointer;
+    err = ds.Set(wantIntKey, wantInt);
+    ASSERT_FALSE(err);
+
+    auto gotInt = ds.Get<int>(wantIntKey);
+    ASSERT_TRUE(gotInt);
+    ASSERT_EQ(*gotInt, wantInt);
+}
+
+TEST_F(TestDatastore, SetNoStore)
+{
+    auto temp_dir = GetTempDir();
+    auto ds_path = DatastoreFilepath(temp_dir, ds_suffix);
+
+    auto k = "/k"_json_pointer;
+    auto v = "a";
+
+    {
+        Datastore ds;
+        auto err = ds.Init(temp_dir, ds_suffix);
+        ASSERT_FALSE(err);
+
+        // Set without writing to disk
+        err = ds.Set(k, v, false);
+        ASSERT_FALSE(err);
+        // Should be accessible
+        auto got = ds.Get<string>(k);
+        ASSERT_TRUE(got);
+        ASSERT_EQ(*got, v);
+    }
+    {
+        Datastore ds;
+        auto err = ds.Init(temp_dir, ds_suffix);
+        ASSERT_FALSE(err);
+
+        // Value should not have been stored
+        auto got = ds.Get<string>(k);
+        ASSERT_FALSE(got);
+
+        // Set without writing to disk
+        err = ds.Set(k, v, false);
+        ASSERT_FALSE(err);
+        // Should be accessible
+        got = ds.Get<string>(k);
+        ASSERT_TRUE(got);
+        ASSERT_EQ(*got, v);
+
+        // Write another value that is stored, prompting the storage of k
+        err = ds.Set("/x"_json_pointer, "y"s, true);
+        ASSERT_FALSE(err);
+    }
+    {
+        Datastore ds;
+        auto err = ds.Init(temp_dir, ds_suffix);
+        ASSERT_FALSE(err);
+
+        // Value should have been stored this time
+        auto got = ds.Get<string>(k);
+        ASSERT_TRUE(got);
+        ASSERT_EQ(*got, v);
+    }
+}
+
+TEST_F(TestDatastore, SetMany)
+{
+    auto temp_dir = GetTempDir();
+    auto ds_path = DatastoreFilepath(temp_dir, ds_suffix);
+    DatastoreOptions options;
+    options.journal = true;
+    auto journal_lines = [&]() {
+        auto journal = ReadFile(ds_path + ".journal");
+        return journal ? std::count(journal->begin(), journal->end(), '\n') : 0;
+    };
+
+    {
+        Datastore ds;
+        auto err = ds.Init(temp_dir, ds_suffix, options);
+        ASSERT_FALSE(err);
+        err = ds.Set("/same"_json_pointer, "s");
+        ASSERT_FALSE(err);
+        auto same_generation = ds.ChangeGeneration("/same");
+        auto lines = journal_lines();
+
+        // All the values are committed and written together, and unchanged values are skipped
+        vector<pair<json::json_pointer, DatastoreJson>> values;
+        values.emplace_back("/a"_json_pointer, 1);
+        values.emplace_back("/b/c"_json_pointer, json::array({1, 2, 3}));
+        values.emplace_back("/same"_json_pointer, "s");
+        values.emplace_back("/a"_json_pointer, 2);
+        err = ds.SetMany(std::move(values));
+        ASSERT_FALSE(err);
+        ASSERT_EQ(*ds.Get<int>("/a"_json_pointer), 2);
+        ASSERT_EQ(*ds.Get<vector<int>>("/b/c"_json_pointer), vector<int>({1, 2, 3}));
+        ASSERT_EQ(journal_lines(), lines + 1);
+        ASSERT_EQ(ds.ChangeGeneration("/a"), ds.ChangeGeneration("/b"));
+        ASSERT_EQ(ds.ChangeGeneration("/same"), same_generation);
+
+        // Nothing is written if nothing changed
+        err = ds.SetMany({{"/a"_json_pointer, 2}, {"/same"_json_pointer, "s"}});
+        ASSERT_FALSE(err);
+        ASSERT_EQ(journal_lines(), lines + 1);
+
+        // Without storing, the changes are still committed together
+        auto generation = ds.ChangeGeneration("/a");
+        err = ds.SetMany({{"/a"_json_pointer, 3}, {"/nostore"_json_pointer, true}}, false);
+        ASSERT_FALSE(err);
+        ASSERT_EQ(journal_lines(), lines + 1);
+        ASSERT_GT(ds.ChangeGeneration("/a"), generation);
+        ASSERT_EQ(ds.ChangeGeneration("/a"), ds.ChangeGeneration("/nostore"));
+
+        // Within a transaction, the changes can be rolled back
+        ds.BeginTransaction();
+        err = ds.SetMany({{"/a"_json_pointer, 4}, {"/rolledback"_json_pointer, true}});
+        ASSERT_FALSE(err);
+        ASSERT_EQ(*ds.Get<int>("/a"_json_pointer), 4);
+        err = ds.EndTransaction(false);
+        ASSERT_FALSE(err);
+        ASSERT_EQ(*ds.Get<int>("/a"_json_pointer), 3);
+        ASSERT_FALSE(ds.Get<bool>("/rolledback"_json_pointer));
+
+        // The unstored changes go out with the next write
+        err = ds.Set("/x"_json_pointer, 1);
+        ASSERT_FALSE(err);
+    }
+
+    Datastore ds;
+    auto err = ds.Init(temp_dir, ds_suffix, options);
+    ASSERT_FALSE(err);
+    ASSERT_EQ(*ds.Get<int>("/a"_json_pointer), 3);
+    ASSERT_EQ(*ds.Get<bool>("/nostore"_json_pointer), true);
+}
+
+TEST_F(TestDatastore, SetWriteDedup)
+{
+    auto temp_dir = GetTempDir();
+    auto ds_path = DatastoreFilepath(temp_dir, ds_suffix);
+
+    Datastore ds;
+    auto err = ds.Init(temp_dir, ds_suffix);
+    ASSERT_FALSE(err);
+
+    auto k = "/k"_json_pointer;
+    err = ds.Set(k, "a"s);
+    ASSERT_FALSE(err);
+    auto file_time1 = LatestWriteTime(ds_path);
+
+    // Make sure there could be a file time difference, regardless of last_write_time resolution.
+    // This is necessary when running under Docker or GitHub Actions.
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+
+    // Try setting the same value again
+    err = ds.Set(k, "a"s);
+    ASSERT_FALSE(err);
+    auto file_time2 = LatestWriteTime(ds_path);
+
+    // The file time should not have changed after setting the same value
+    ASSERT_EQ(file_time1, file_time2);
+
+    // Make sure there could be a file time difference, regardless of last_write_time resolution.
+    // This is necessary when running under Docker or GitHub Actions.
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+
+    // Change to a different value
+    err = ds.Set(k, "b"s);
+    ASSERT_FALSE(err);
+    auto file_time3 = LatestWriteTime(ds_path);
+
+    // The file should have been updated, so its time should be newer
+    ASSERT_GT(file_time3, file_time1);
+}
+
+TEST_F(TestDatastore, TransactionWriteDedup)
+{
+    auto temp_dir = GetTempDir();
+    auto ds_path = DatastoreFilepath(temp_dir, ds_suffix);
+
+    Datastore ds;
+    auto err = ds.Init(temp_dir, ds_suffix);
+    ASSERT_FALSE(err);
+
+    auto k1 = "/k1"_json_pointer;
+    auto k2 = "/k2"_json_pointer;
+    err = ds.Set(k1, "a"s);
+    ASSERT_FALSE(err);
+    err = ds.Set(k2, "a"s);
+    ASSERT_FALSE(err);
+    auto file_time1 = LatestWriteTime(ds_path);
+
+    // Make sure there could be a file time difference, regardless of last_write_time resolution.
+    // This is necessary when running under Docker or GitHub Actions.
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+
+    ds.BeginTransaction();
+
+    // Try setting the same values again
+    err = ds.Set(k1, "a"s);
+    ASSERT_FALSE(err);
+    err = ds.Set(k2, "a"s);
+    ASSERT_FALSE(err);
+
+    err = ds.EndTransaction(true);
+    ASSERT_FALSE(err);
+    auto file_time2 = LatestWriteTime(ds_path);
+
+    // The file time should not have changed after setting the same values
+    ASSERT_EQ(file_time1, file_time2);
+
+    // Make sure there could be a file time difference, regardless of last_write_time resolution.
+    // This is necessary when running under Docker or GitHub Actions.
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+
+    ds.BeginTransaction();
+
+    // Change to a different value
+    err = ds.Set(k1, "b"s);
+    ASSERT_FALSE(err);
+    err = ds.Set(k2, "b"s);
+    ASSERT_FALSE(err);
+
+    err = ds.EndTransaction(true);
+    ASSERT_FALSE(err);
+    auto file_time3 = LatestWriteTime(ds_path);
+
+    // The file should have been updated, so its time should be newer
+    ASSERT_GT(file_time3, file_time1);
+
+    // Make sure there could be a file time difference, regardless of last_write_time resolution.
+    // This is necessary when running under Docker or GitHub Actions.
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+
+    ds.BeginTransaction();
+
+    // Changing and then rolling back should still work as expected
+    err = ds.Set(k1, "c"s);
+    ASSERT_FALSE(err);
+    err = ds.Set(k2, "c"s);
+    ASSERT_FALSE(err);
+
+    err = ds.EndTransaction(false);
+    ASSERT_FALSE(err);
+    auto file_time4 = LatestWriteTime(ds_path);
+
+    // Should not have changed
+    ASSERT_EQ(file_time3, file_time4);
+}
+
+TEST_F(TestDatastore, Journal)
+{
+    auto temp_dir = GetTempDir();
+    auto ds_path = DatastoreFilepath(temp_dir, ds_suffix);
+    auto journal_path = ds_path + ".journal";
+
+    DatastoreOptions options;
+    options.journal = true;
+
+    auto k1 = "/k1"_json_pointer, k2 = "/k2"_json_pointer, k3 = "/k3"_json_pointer;
+
+    {
+        Datastore ds;
+        auto err = ds.Init(temp_dir, ds_suffix, options);
+        ASSERT_FALSE(err);
+        auto ds_contents_before = ReadFile(ds_path);
+        ASSERT_TRUE(ds_contents_before);
+
+        err = ds.Set(k1, "a"s);
+        ASSERT_FALSE(err);
+
+        ds.BeginTransaction();
+        err = ds.Set(k2, "b"s);
+        ASSERT_FALSE(err);
+        err = ds.Set(k3/"deep", "c"s);
+        ASSERT_FALSE(err);
+        err = ds.EndTransaction(true);
+        ASSERT_FALSE(err);
+
+        // Rolled back changes must not reach the journal
+        ds.BeginTransaction();
+        err = ds.Set(k1, "nope"s);
+        ASSERT_FALSE(err);
+        err = ds.EndTransaction(false);
+        ASSERT_FALSE(err);
+        auto got = ds.Get<string>(k1);
+        ASSERT_TRUE(got);
+        ASSERT_EQ(*got, "a");
+
+        // The changes went to the journal, and the datastore file is untouched
+        ASSERT_TRUE(utils::FileExists(journal_path));
+        auto ds_contents_after = ReadFile(ds_path);
+        ASSERT_TRUE(ds_contents_after);
+        ASSERT_EQ(*ds_contents_before, *ds_contents_after);
+    }
+
+    // Reopen in journal mode; the journal should be replayed
+    {
+        Datastore ds;
+        auto err = ds.Init(temp_dir, ds_suffix, options);
+        ASSERT_FALSE(err);
+
+        auto got = ds.Get<string>(k1);
+        ASSERT_TRUE(got);
+        ASSERT_EQ(*got, "a");
+        got = ds.Get<string>(k2);
+        ASSERT_TRUE(got);
+        ASSERT_EQ(*got, "b");
+        got = ds.Get<string>(k3/"deep");
+        ASSERT_TRUE(got);
+        ASSERT_EQ(*got, "c");
+    }
+
+    // Reopen without journal mode; the journal should be folded into the datastore file
+    {
+        Datastore ds;
+        auto err = ds.Init(temp_dir, ds_suffix);
+        ASSERT_FALSE(err);
+        ASSERT_FALSE(utils::FileExists(journal_path));
+
+        auto got = ds.Get<string>(k2);
+        ASSERT_TRUE(got);
+        ASSERT_EQ(*got, "b");
+    }
+}
+
+TEST_F(TestDatastore, JournalCompaction)
+{
+    auto temp_dir = GetTempDir();
+    auto ds_path = DatastoreFilepath(temp_dir, ds_suffix);
+
+    DatastoreOptions options;
+    options.journal = true;
+    options.journal_compaction_threshold = 200;
+
+    const int count = 50;
+    {
+        Datastore ds;
+        auto err = ds.Init(temp_dir, ds_suffix, options);
+        ASSERT_FALSE(err);
+
+        for (int i = 0; i < count; i++) {
+            err = ds.Set(json::json_pointer("/k" + to_string(i)), i);
+            ASSERT_FALSE(err);
+        }
+    }
 
-    // int
-    int wantInt = 5273482;
-    auto wantIntKey = "/wantIntKey"_json_pointer;
-    err = ds.Set(wantIntKey, wantInt);
-    ASSERT_FALSE(err);
+    // At least one compaction must have made it into a datastore file slot
+    auto ds_contents = ReadFile(ds_path);
+    auto backup_contents = ReadFile(BackupDatastoreFile(ds_path));
+    ASSERT_TRUE(ds_contents);
+    ASSERT_TRUE(backup_contents);
+    ASSERT_TRUE(ds_contents->find("k0") != string::npos || backup_contents->find("k0") != string::npos);
 
-    auto gotInt = ds.Get<int>(wantIntKey);
-    ASSERT_TRUE(gotInt);
-    ASSERT_EQ(*gotInt, wantInt);
+    // Everything must be there, whether it was compacted or not
+    {
+        Datastore ds;
+        auto err = ds.Init(temp_dir, ds_suffix, options);
+        ASSERT_FALSE(err);
+        for (int i = 0; i < count; i++) {
+            auto got = ds.Get<int>(json::json_pointer("/k" + to_string(i)));
+            ASSERT_TRUE(got);
+            ASSERT_EQ(*got, i);
+        }
+
+        // An oversized journal is compacted when loading
+        uint64_t journal_size = 0;
+        if (utils::FileExists(ds_path + ".journal")) {
+            ASSERT_FALSE(utils::FileSize(ds_path + ".journal", journal_size));
+        }
+        ASSERT_LT(journal_size, options.journal_compaction_threshold);
+    }
+
+    // Simulate being interrupted during compaction: the set-aside journal must be replayed
+    {
+        Datastore ds;
+        auto err = ds.Init(temp_dir, ds_suffix, options);
+        ASSERT_FALSE(err);
+        err = ds.Set("/interrupted"_json_pointer, true);
+        ASSERT_FALSE(err);
+    }
+    ASSERT_EQ(std::rename((ds_path + ".journal").c_str(), (ds_path + ".journal.compacting").c_str()), 0);
+    {
+        Datastore ds;
+        auto err = ds.Init(temp_dir, ds_suffix, options);
+        ASSERT_FALSE(err);
+        auto got = ds.Get<bool>("/interrupted"_json_pointer);
+        ASSERT_TRUE(got);
+        ASSERT_TRUE(*got);
+        ASSERT_FALSE(utils::FileExists(ds_path + ".journal.compacting"));
+    }
 }
 
-TEST_F(TestDatastore, SetNoStore)
+TEST_F(TestDatastore, JournalDamaged)
 {
     auto temp_dir = GetTempDir();
     auto ds_path = DatastoreFilepath(temp_dir, ds_suffix);
+    auto journal_path = ds_path + ".journal";
 
-    auto k = "/k"_json_pointer;
-    auto v = "a";
+    DatastoreOptions options;
+    options.journal = true;
 
     {
         Datastore ds;
-        auto err = ds.Init(temp_dir, ds_suffix);
+        auto err = ds.Init(temp_dir, ds_suffix, options);
         ASSERT_FALSE(err);
+        err = ds.Set("/k"_json_pointer, "v"s);
+        ASSERT_FALSE(err);
+    }
 
-        // Set without writing to disk
-        err = ds.Set(k, v, false);
+    // An interrupted append leaves an incomplete record at the end
+    ASSERT_TRUE(AppendFile(journal_path, R"([["/k","partial)"));
+    {
+        Datastore ds;
+        auto err = ds.Init(temp_dir, ds_suffix, options);
         ASSERT_FALSE(err);
-        // Should be accessible
-        auto got = ds.Get<string>(k);
+        auto got = ds.Get<string>("/k"_json_pointer);
         ASSERT_TRUE(got);
-        ASSERT_EQ(*got, v);
+        ASSERT_EQ(*got, "v");
+
+        // The damaged journal was folded in, so new records are readable
+        err = ds.Set("/k2"_json_pointer, "v2"s);
+        ASSERT_FALSE(err);
     }
+
+    // A record with a bad checksum is also ignored
+    ASSERT_TRUE(AppendFile(journal_path, "[[\"/k\",\"bad\"]]\tnotachecksum\n"));
     {
         Datastore ds;
-        auto err = ds.Init(temp_dir, ds_suffix);
+        auto err = ds.Init(temp_dir, ds_suffix, options);
         ASSERT_FALSE(err);
+        auto got = ds.Get<string>("/k"_json_pointer);
+        ASSERT_TRUE(got);
+        ASSERT_EQ(*got, "v");
+        got = ds.Get<string>("/k2"_json_pointer);
+        ASSERT_TRUE(got);
+        ASSERT_EQ(*got, "v2");
+    }
+}
 
-        // Value should not have been stored
-        auto got = ds.Get<string>(k);
-        ASSERT_FALSE(got);
+TEST_F(TestDatastore, LegacyChecksums)
+{
+    // Files and journal records written with the std::hash checksum must still be readable
+    auto temp_dir = GetTempDir();
+    auto ds_path = DatastoreFilepath(temp_dir, ds_suffix);
 
-        // Set without writing to disk
-        err = ds.Set(k, v, false);
+    json ds_json = {{"k", "v"}};
+    string cbor;
+    json::to_cbor(ds_json, cbor);
+    auto legacy_checksum = TextFormatChecksum(cbor);
+    string v1_contents = "\x89PCD"s + '\x01' + (char)legacy_checksum.length() + legacy_checksum + cbor;
+    ASSERT_TRUE(WriteFile(ds_path, v1_contents));
+    ASSERT_TRUE(WriteFile(BackupDatastoreFile(ds_path), v1_contents));
+
+    string record = R"([["/j","w"]])";
+    ASSERT_TRUE(WriteFile(ds_path + ".journal", record + "\t" + TextFormatChecksum(record) + "\n"));
+
+    DatastoreOptions options;
+    options.journal = true;
+    {
+        Datastore ds;
+        auto err = ds.Init(temp_dir, ds_suffix, options);
         ASSERT_FALSE(err);
-        // Should be accessible
-        got = ds.Get<string>(k);
-        ASSERT_TRUE(got);
-        ASSERT_EQ(*got, v);
+        ASSERT_EQ(*ds.Get<string>("/k"_json_pointer), "v");
+        ASSERT_EQ(*ds.Get<string>("/j"_json_pointer), "w");
 
-        // Write another value that is stored, prompting the storage of k
-        err = ds.Set("/x"_json_pointer, "y"s, true);
+        // A new record gets the new checksum
+        err = ds.Set("/i"_json_pointer, "x"s);
         ASSERT_FALSE(err);
     }
+
+    auto journal = ReadFile(ds_path + ".journal");
+    ASSERT_TRUE(journal);
+    record = R"([["/i","x"]])";
+    char crc_hex[9];
+    snprintf(crc_hex, sizeof(crc_hex), "%08x", crc32c::Value(record));
+    ASSERT_NE(journal->find(record + "\t" + crc_hex + "\n"), string::npos);
+
     {
         Datastore ds;
-        auto err = ds.Init(temp_dir, ds_suffix);
+        auto err = ds.Init(temp_dir, ds_suffix, options);
         ASSERT_FALSE(err);
+        ASSERT_EQ(*ds.Get<string>("/k"_json_pointer), "v");
+        ASSERT_EQ(*ds.Get<string>("/j"_json_pointer), "w");
+        ASSERT_EQ(*ds.Get<string>("/i"_json_pointer), "x");
 
-        // Value should have been stored this time
-        auto got = ds.Get<string>(k);
-        ASSERT_TRUE(got);
-        ASSERT_EQ(*got, v);
+        // Rewriting the datastore upgrades it to the CRC-32C format
+        err = ds.Reset({{"r", "s"}});
+        ASSERT_FALSE(err);
     }
+
+    auto contents = ReadFile(ds_path);
+    ASSERT_TRUE(contents);
+    ASSERT_EQ(contents->substr(0, 5), "\x89PCD\x03"s);
+    ASSERT_EQ(contents->substr(13, 1), "\x04"s);
+    auto payload = contents->substr(18);
+    auto crc = crc32c::Value(contents->substr(5, 8) + payload);
+    string crc_bytes = {(char)(crc >> 24), (char)(crc >> 16), (char)(crc >> 8), (char)crc};
+    ASSERT_EQ(contents->substr(14, 4), crc_bytes);
+    ASSERT_EQ(json::from_cbor(payload), json({{"r", "s"}}));
 }
 
-TEST_F(TestDatastore, SetWriteDedup)
+TEST_F(TestDatastore, JournalReset)
 {
     auto temp_dir = GetTempDir();
-    auto ds_path = DatastoreFilepath(temp_dir, ds_suffix);
 
+    DatastoreOptions options;
+    options.journal = true;
+
+    {
+        Datastore ds;
+        auto err = ds.Init(temp_dir, ds_suffix, options);
+        ASSERT_FALSE(err);
+        err = ds.Set("/k"_json_pointer, "v"s);
+        ASSERT_FALSE(err);
+        err = ds.Reset({{"r", "r"}});
+        ASSERT_FALSE(err);
+    }
+
+    // The journal must not be replayed over the reset value
     Datastore ds;
-    auto err = ds.Init(temp_dir, ds_suffix);
+    auto err = ds.Init(temp_dir, ds_suffix, options);
     ASSERT_FALSE(err);
+    auto got = ds.Get<string>("/k"_json_pointer);
+    ASSERT_FALSE(got);
+    got = ds.Get<string>("/r"_json_pointer);
+    ASSERT_TRUE(got);
+    ASSERT_EQ(*got, "r");
+}
+
+// Compares the size and load/save latency of the text and binary datastore file formats.
+// Run with: GTEST_FILTER=*BenchmarkFileFormats ./build/runUnitTests --gtest_also_run_disabled_tests
+TEST_F(TestDatastore, AsyncWrites)
+{
+    auto temp_dir = GetTempDir();
+    DatastoreOptions options;
+    options.async_writes = true;
+    options.write_interval = std::chrono::milliseconds(200);
 
     auto k = "/k"_json_pointer;
-    err = ds.Set(k, "a"s);
-    ASSERT_FALSE(err);
-    auto file_time1 = std::filesystem::last_write_time(ds_path);
 
-    // Make sure there could be a file time difference, regardless of last_write_time resolution.
-    // This is necessary when running under Docker or GitHub Actions.
-    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+    auto stored = [&](const json::json_pointer& p) -> nonstd::optional<string> {
+        Datastore reader;
+        if (reader.Init(temp_dir, ds_suffix)) {
+            return nonstd::nullopt;
+        }
+        auto v = reader.Get<string>(p);
+        return v ? nonstd::optional<string>(*v) : nonstd::nullopt;
+    };
 
-    // Try setting the same value again
-    err = ds.Set(k, "a"s);
+    Datastore ds;
+    auto err = ds.Init(temp_dir, ds_suffix, options);
     ASSERT_FALSE(err);
-    auto file_time2 = std::filesystem::last_write_time(ds_path);
 
-    // The file time should not have changed after setting the same value
-    ASSERT_EQ(file_time1, file_time2);
+    // The change is in memory right away, but not on disk
+    err = ds.Set(k, "v1"s);
+    ASSERT_FALSE(err);
+    ASSERT_EQ(*ds.Get<string>(k), "v1");
+    ASSERT_FALSE(stored(k));
 
-    // Make sure there could be a file time difference, regardless of last_write_time resolution.
-    // This is necessary when running under Docker or GitHub Actions.
-    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+    // Rapid changes get coalesced and written after the interval
+    for (int i = 0; i < 100; i++) {
+        err = ds.Set("/n"_json_pointer, to_string(i));
+        ASSERT_FALSE(err);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(600));
+    ASSERT_EQ(stored(k), "v1");
+    ASSERT_EQ(stored("/n"_json_pointer), "99");
 
-    // Change to a different value
-    err = ds.Set(k, "b"s);
+    // Flush is a barrier
+    err = ds.Set(k, "v2"s);
     ASSERT_FALSE(err);
-    auto file_time3 = std::filesystem::last_write_time(ds_path);
+    ASSERT_EQ(stored(k), "v1");
+    err = ds.Flush();
+    ASSERT_FALSE(err);
+    ASSERT_EQ(stored(k), "v2");
 
-    // The file should have been updated, so its time should be newer
-    ASSERT_GT(file_time3, file_time1);
+    // Rolling back reverts to the last committed state, even though it isn't on disk yet
+    err = ds.Set(k, "v3"s);
+    ASSERT_FALSE(err);
+    ds.BeginTransaction();
+    err = ds.Set(k, "nope"s);
+    ASSERT_FALSE(err);
+    // Flushing inside a transaction only writes committed changes
+    err = ds.Flush();
+    ASSERT_FALSE(err);
+    ASSERT_EQ(stored(k), "v3");
+    err = ds.EndTransaction(false);
+    ASSERT_FALSE(err);
+    ASSERT_EQ(*ds.Get<string>(k), "v3");
 }
 
-TEST_F(TestDatastore, TransactionWriteDedup)
+TEST_F(TestDatastore, AsyncWritesFlushOnDestruction)
 {
     auto temp_dir = GetTempDir();
-    auto ds_path = DatastoreFilepath(temp_dir, ds_suffix);
+
+    for (bool journal : {false, true}) {
+        DatastoreOptions options;
+        options.async_writes = true;
+        options.journal = journal;
+        // Long enough that only the destructor will write
+        options.write_interval = std::chrono::hours(1);
+
+        {
+            Datastore ds;
+            auto err = ds.Init(temp_dir, ds_suffix, options);
+            ASSERT_FALSE(err);
+            err = ds.Set("/k"_json_pointer, journal ? "journal"s : "plain"s);
+            ASSERT_FALSE(err);
+            ds.BeginTransaction();
+            err = ds.Set("/rolledback"_json_pointer, true);
+            ASSERT_FALSE(err);
+            err = ds.EndTransaction(false);
+            ASSERT_FALSE(err);
+        }
+
+        Datastore ds;
+        auto err = ds.Init(temp_dir, ds_suffix);
+        ASSERT_FALSE(err);
+        auto got = ds.Get<string>("/k"_json_pointer);
+        ASSERT_TRUE(got);
+        ASSERT_EQ(*got, journal ? "journal" : "plain");
+        ASSERT_FALSE(ds.Get<bool>("/rolledback"_json_pointer));
+    }
+}
+
+TEST_F(TestDatastore, Durability)
+{
+    for (auto durability : {DatastoreDurability::kNone, DatastoreDurability::kSyncOnCommit, DatastoreDurability::kGroupCommit}) {
+        for (bool journal : {false, true}) {
+            auto temp_dir = GetTempDir();
+
+            DatastoreOptions options;
+            options.durability = durability;
+            options.journal = journal;
+            {
+                Datastore ds;
+                auto err = ds.Init(temp_dir, ds_suffix, options);
+                ASSERT_FALSE(err);
+                for (int i = 0; i < 10; i++) {
+                    err = ds.Set("/k"_json_pointer, i);
+                    ASSERT_FALSE(err);
+                }
+                err = ds.Reset({{"r", 1}});
+                ASSERT_FALSE(err);
+                err = ds.Set("/k"_json_pointer, 10);
+                ASSERT_FALSE(err);
+                err = ds.Flush();
+                ASSERT_FALSE(err);
+            }
+
+            Datastore ds;
+            auto err = ds.Init(temp_dir, ds_suffix);
+            ASSERT_FALSE(err);
+            ASSERT_EQ(*ds.Get<int>("/k"_json_pointer), 10);
+            ASSERT_EQ(*ds.Get<int>("/r"_json_pointer), 1);
+        }
+    }
+}
+
+TEST_F(TestDatastore, GroupCommitKeepsSyncedSlot)
+{
+    auto temp_dir = GetTempDir();
+    auto ds_file = DatastoreFilepath(temp_dir, ds_suffix);
+    const vector<string> slot_files = {ds_file, BackupDatastoreFile(ds_file)};
+    auto read_slots = [&]() {
+        return vector<string>{*ReadFile(slot_files[0]), *ReadFile(slot_files[1])};
+    };
+
+    DatastoreOptions options;
+    options.durability = DatastoreDurability::kGroupCommit;
+    // Long enough that only explicit flushes will sync
+    options.write_interval = std::chrono::hours(1);
 
     Datastore ds;
-    auto err = ds.Init(temp_dir, ds_suffix);
+    auto err = ds.Init(temp_dir, ds_suffix, options);
     ASSERT_FALSE(err);
-
-    auto k1 = "/k1"_json_pointer;
-    auto k2 = "/k2"_json_pointer;
-    err = ds.Set(k1, "a"s);
+    err = ds.Set("/k"_json_pointer, 0);
     ASSERT_FALSE(err);
-    err = ds.Set(k2, "a"s);
+    err = ds.Flush();
     ASSERT_FALSE(err);
-    auto file_time1 = std::filesystem::last_write_time(ds_path);
+    auto synced = read_slots();
 
-    // Make sure there could be a file time difference, regardless of last_write_time resolution.
-    // This is necessary when running under Docker or GitHub Actions.
-    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+    // The first save after a sync goes to the other slot...
+    err = ds.Set("/k"_json_pointer, 1);
+    ASSERT_FALSE(err);
+    auto contents = read_slots();
+    ASSERT_NE(contents, synced);
+    int unsynced_slot = (contents[0] != synced[0]) ? 0 : 1;
+    int synced_slot = 1 - unsynced_slot;
 
-    ds.BeginTransaction();
+    // ...and until the next sync, saves keep going there, leaving the synced slot alone
+    for (int i = 2; i < 5; i++) {
+        err = ds.Set("/k"_json_pointer, i);
+        ASSERT_FALSE(err);
+        contents = read_slots();
+        ASSERT_EQ(contents[synced_slot], synced[synced_slot]);
+    }
 
-    // Try setting the same values again
-    err = ds.Set(k1, "a"s);
+    // After a sync, the other slot gets used again
+    err = ds.Flush();
     ASSERT_FALSE(err);
-    err = ds.Set(k2, "a"s);
+    synced = read_slots();
+    err = ds.Set("/k"_json_pointer, 5);
     ASSERT_FALSE(err);
+    contents = read_slots();
+    ASSERT_NE(contents[synced_slot], synced[synced_slot]);
+    ASSERT_EQ(contents[unsynced_slot], synced[unsynced_slot]);
 
-    err = ds.EndTransaction(true);
+    Datastore ds2;
+    err = ds2.Init(temp_dir, ds_suffix);
     ASSERT_FALSE(err);
-    auto file_time2 = std::filesystem::last_write_time(ds_path);
+    ASSERT_EQ(*ds2.Get<int>("/k"_json_pointer), 5);
+}
 
-    // The file time should not have changed after setting the same values
-    ASSERT_EQ(file_time1, file_time2);
+TEST_F(TestDatastore, DISABLED_BenchmarkFileFormats)
+{
+    using clock = std::chrono::steady_clock;
+    const int reps = 5;
+
+    for (int purchase_count : {1000, 10000}) {
+        json ds_json = {{"v", 2}, {"instance", {{"instanceID", "instanceid_0123456789"}}}, {"user", json::object()}};
+        json purchases = json::array();
+        for (int i = 0; i < purchase_count; i++) {
+            purchases.push_back({
+                {"id", "transactionid_" + to_string(i)},
+                {"class", "speed-boost"},
+                {"distinguisher", "1hr"},
+                {"serverTimeCreated", "2020-07-27T15:14:30.986Z"},
+                {"serverTimeExpiry", "2020-07-27T16:14:30.986Z"},
+                {"localTimeExpiry", "2020-07-27T16:14:32.878Z"},
+                {"authorization", {
+                    {"ID", "authorizationid_" + to_string(i)},
+                    {"AccessType", "speed-boost"},
+                    {"Expires", "2020-07-27T16:14:30.986Z"},
+                    {"Encoded", "eyJBdXRob3JpemF0aW9uIjp7IklEIjoiMHYzN3Z6YmlsWU1DQ0ZIYnBPTFZSVW1uS2J4RWtvN0hPeGVmN1dZcz0ifX0="}}}});
+        }
+        ds_json["/user/purchases"_json_pointer] = purchases;
 
-    // Make sure there could be a file time difference, regardless of last_write_time resolution.
-    // This is necessary when running under Docker or GitHub Actions.
-    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+        auto temp_dir = GetTempDir();
+        auto ds_file = DatastoreFilepath(temp_dir, ds_suffix);
+
+        // Text format
+        auto json_string = ds_json.dump(-1, ' ', true);
+        auto text_contents = json_string + "\n\n" + TextFormatChecksum(json_string);
+        clock::duration text_load(0);
+        for (int i = 0; i < reps; i++) {
+            ASSERT_TRUE(WriteFile(ds_file, text_contents));
+            ASSERT_TRUE(WriteFile(BackupDatastoreFile(ds_file), text_contents));
+            auto start = clock::now();
+            Datastore ds;
+            ASSERT_FALSE(ds.Init(temp_dir, ds_suffix));
+            text_load += clock::now() - start;
+        }
+
+        // Binary format
+        clock::duration binary_save(0), binary_load(0);
+        for (int i = 0; i < reps; i++) {
+            Datastore ds;
+            auto start = clock::now();
+            ASSERT_FALSE(ds.Reset(temp_dir, ds_suffix, ds_json));
+            binary_save += clock::now() - start;
+        }
+        for (int i = 0; i < reps; i++) {
+            auto start = clock::now();
+            Datastore ds;
+            ASSERT_FALSE(ds.Init(temp_dir, ds_suffix));
+            binary_load += clock::now() - start;
+        }
+        uint64_t binary_size = 0;
+        ASSERT_FALSE(utils::FileSize(ds_file, binary_size));
+
+        auto ms = [&](clock::duration d) {
+            return std::chrono::duration<double, std::milli>(d).count() / reps;
+        };
+        std::cout << purchase_count << " purchases:" << std::endl
+                  << "  text:   " << text_contents.length() << " bytes; load " << ms(text_load) << " ms" << std::endl
+                  << "  binary: " << binary_size << " bytes; load " << ms(binary_load) << " ms; save " << ms(binary_save) << " ms" << std::endl;
+    }
+}
 
-    ds.BeginTransaction();
+TEST_F(TestDatastore, DISABLED_BenchmarkCommitLatency)
+{
+    using clock = std::chrono::steady_clock;
+    const int commits = 200;
+
+    const std::vector<pair<DatastoreDurability, string>> durabilities = {
+        {DatastoreDurability::kNone, "none"},
+        {DatastoreDurability::kSyncOnCommit, "sync-on-commit"},
+        {DatastoreDurability::kGroupCommit, "group-commit"}};
+
+    for (const auto& durability : durabilities) {
+        for (bool journal : {false, true}) {
+            DatastoreOptions options;
+            options.durability = durability.first;
+            options.journal = journal;
+            options.write_interval = std::chrono::milliseconds(100);
+
+            Datastore ds;
+            ASSERT_FALSE(ds.Init(GetTempDir(), ds_suffix, options));
+            // Something like a typical datastore, with a few purchases
+            json purchases = json::array();
+            for (int i = 0; i < 10; i++) {
+                purchases.push_back({{"id", "transactionid_" + to_string(i)}, {"class", "speed-boost"},
+                                     {"serverTimeExpiry", "2020-07-27T16:14:30.986Z"}});
+            }
+            ASSERT_FALSE(ds.Set("/user/purchases"_json_pointer, purchases));
+
+            vector<double> latencies;
+            for (int i = 0; i < commits; i++) {
+                auto start = clock::now();
+                ASSERT_FALSE(ds.Set("/user/balance"_json_pointer, i));
+                latencies.push_back(std::chrono::duration<double, std::micro>(clock::now() - start).count());
+            }
+            ASSERT_FALSE(ds.Flush());
+
+            std::sort(latencies.begin(), latencies.end());
+            std::cout << durability.second << (journal ? " (journal)" : "") << ": "
+                      << "p50 " << latencies[commits / 2] << " us; "
+                      << "p99 " << latencies[commits * 99 / 100] << " us" << std::endl;
+        }
+    }
+}
 
-    // Change to a different value
-    err = ds.Set(k1, "b"s);
-    ASSERT_FALSE(err);
-    err = ds.Set(k2, "b"s);
-    ASSERT_FALSE(err);
+TEST_F(TestDatastore, DISABLED_BenchmarkIncrementalSave)
+{
+    using clock = std::chrono::steady_clock;
+    const int saves = 50;
 
-    err = ds.EndTransaction(true);
-    ASSERT_FALSE(err);
-    auto file_time3 = std::filesystem::last_write_time(ds_path);
+    for (int purchase_count : {1000, 10000}) {
+        DatastoreOptions options;
+        options.durability = DatastoreDurability::kNone;
 
-    // The file should have been updated, so its time should be newer
-    ASSERT_GT(file_time3, file_time1);
+        Datastore ds;
+        ASSERT_FALSE(ds.Init(GetTempDir(), ds_suffix, options));
+        json purchases = json::array();
+        for (int i = 0; i < purchase_count; i++) {
+            purchases.push_back({{"id", "transactionid_" + to_string(i)}, {"class", "speed-boost"},
+                                 {"serverTimeExpiry", "2020-07-27T16:14:30.986Z"}});
+        }
+        ASSERT_FALSE(ds.Set("/user/purchases"_json_pointer, purchases));
+
+        auto start = clock::now();
+        for (int i = 0; i < saves; i++) {
+            ASSERT_FALSE(ds.Set("/user/balance"_json_pointer, i));
+        }
+        auto incremental = clock::now() - start;
+
+        // Reset encodes the whole datastore
+        auto state = *ds.Get();
+        start = clock::now();
+        for (int i = 0; i < saves; i++) {
+            state["user"]["balance"] = i;
+            ASSERT_FALSE(ds.Reset(state));
+        }
+        auto full = clock::now() - start;
+
+        auto us = [&](clock::duration d) {
+            return std::chrono::duration<double, std::micro>(d).count() / saves;
+        };
+        std::cout << purchase_count << " purchases: incremental save " << us(incremental)
+                  << " us; full save " << us(full) << " us" << std::endl;
+    }
+}
 
-    // Make sure there could be a file time difference, regardless of last_write_time resolution.
-    // This is necessary when running under Docker or GitHub Actions.
-    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+TEST_F(TestDatastore, DISABLED_BenchmarkSetMany)
+{
+    using clock = std::chrono::steady_clock;
+    const int reps = 500;
+    const int keys = 8;
 
-    ds.BeginTransaction();
+    DatastoreOptions options;
+    options.durability = DatastoreDurability::kNone;
+    Datastore ds;
+    ASSERT_FALSE(ds.Init(GetTempDir(), ds_suffix, options));
+    json purchases = json::array();
+    for (int i = 0; i < 100; i++) {
+        purchases.push_back({{"id", "transactionid_" + to_string(i)}, {"class", "speed-boost"}});
+    }
+    ASSERT_FALSE(ds.Set("/user/purchases"_json_pointer, purchases));
 
-    // Changing and then rolling back should still work as expected
-    err = ds.Set(k1, "c"s);
-    ASSERT_FALSE(err);
-    err = ds.Set(k2, "c"s);
-    ASSERT_FALSE(err);
+    auto start = clock::now();
+    for (int i = 0; i < reps; i++) {
+        ds.BeginTransaction();
+        for (int k = 0; k < keys; k++) {
+            ASSERT_FALSE(ds.Set(json::json_pointer("/user/requestMetadata/k" + to_string(k)), "a" + to_string(i)));
+        }
+        ASSERT_FALSE(ds.EndTransaction(true));
+    }
+    auto transaction = clock::now() - start;
+
+    start = clock::now();
+    for (int i = 0; i < reps; i++) {
+        vector<pair<json::json_pointer, DatastoreJson>> values;
+        for (int k = 0; k < keys; k++) {
+            values.emplace_back("/user/requestMetadata/k" + to_string(k), "b" + to_string(i));
+        }
+        ASSERT_FALSE(ds.SetMany(std::move(values)));
+    }
+    auto set_many = clock::now() - start;
 
-    err = ds.EndTransaction(false);
-    ASSERT_FALSE(err);
-    auto file_time4 = std::filesystem::last_write_time(ds_path);
+    auto us = [&](clock::duration d) {
+        return std::chrono::duration<double, std::micro>(d).count() / reps;
+    };
+    std::cout << keys << " keys: transaction of Sets " << us(transaction) << " us; SetMany "
+              << us(set_many) << " us" << std::endl;
+}
 
-    // Should not have changed
-    ASSERT_EQ(file_time3, file_time4);
+TEST_F(TestDatastore, DISABLED_BenchmarkTypedGet)
+{
+    using clock = std::chrono::steady_clock;
+    using Records = vector<std::map<string, string>>;
+    const int reps = 1000;
+
+    Datastore ds;
+    ASSERT_FALSE(ds.Init(GetTempDir(), ds_suffix));
+    Records records;
+    for (int i = 0; i < 100; i++) {
+        records.push_back({{"id", "transactionid_" + to_string(i)}, {"class", "speed-boost"},
+                           {"serverTimeExpiry", "2020-07-27T16:14:30.986Z"}});
+    }
+    const auto p = "/user/records"_json_pointer;
+    ASSERT_FALSE(ds.Set(p, records));
+
+    auto start = clock::now();
+    for (int i = 0; i < reps; i++) {
+        // Decodes every time, as Get did before the cache
+        auto j = ds.Get<json>(p);
+        ASSERT_EQ(j->get<Records>().size(), records.size());
+    }
+    auto decode = clock::now() - start;
+
+    start = clock::now();
+    for (int i = 0; i < reps; i++) {
+        ASSERT_EQ(ds.Get<Records>(p)->size(), records.size());
+    }
+    auto cached_copy = clock::now() - start;
+
+    start = clock::now();
+    for (int i = 0; i < reps; i++) {
+        ASSERT_EQ((*ds.GetShared<Records>(p))->size(), records.size());
+    }
+    auto cached_shared = clock::now() - start;
+
+    auto us = [&](clock::duration d) {
+        return std::chrono::duration<double, std::micro>(d).count() / reps;
+    };
+    std::cout << "decode: " << us(decode) << " us; cached Get: " << us(cached_copy)
+              << " us; cached GetShared: " << us(cached_shared) << " us" << std::endl;
+}
+
+TEST_F(TestDatastore, DISABLED_BenchmarkKeyGet)
+{
+    using clock = std::chrono::steady_clock;
+    const int reps = 1000000;
+
+    static constexpr DatastoreKey<int64_t> kSlotted{"/user/balance", 0};
+    static constexpr DatastoreKey<int64_t> kUnslotted{"/user/balance"};
+    const auto ptr = "/user/balance"_json_pointer;
+
+    Datastore ds;
+    ASSERT_FALSE(ds.Init(GetTempDir(), ds_suffix));
+    // Something like a typical datastore
+    ASSERT_FALSE(ds.Reset({{"v", 2}, {"instance", {{"instanceID", "instanceid_0123456789"}, {"locale", "en"}}},
+                           {"user", {{"authTokens", json::object()}, {"isAccount", false}, {"balance", 12345},
+                                     {"purchasePrices", json::array()}, {"purchases", json::array()},
+                                     {"lastTransactionID", "txid"}, {"serverTimeDiff", 0}}}}));
+
+    int64_t sum = 0;
+    auto start = clock::now();
+    for (int i = 0; i < reps; i++) {
+        sum += *ds.Get<int64_t>(ptr);
+    }
+    auto pointer_time = clock::now() - start;
+
+    start = clock::now();
+    for (int i = 0; i < reps; i++) {
+        sum += *ds.Get(kUnslotted);
+    }
+    auto unslotted_time = clock::now() - start;
+
+    start = clock::now();
+    for (int i = 0; i < reps; i++) {
+        sum += *ds.Get(kSlotted);
+    }
+    auto slotted_time = clock::now() - start;
+    ASSERT_EQ(sum, 3 * 12345LL * reps);
+
+    auto ns = [&](clock::duration d) {
+        return std::chrono::duration<double, std::nano>(d).count() / reps;
+    };
+    std::cout << "json_pointer: " << ns(pointer_time) << " ns; key: " << ns(unslotted_time)
+              << " ns; slotted key: " << ns(slotted_time) << " ns" << std::endl;
+}
+
+TEST_F(TestDatastore, DISABLED_BenchmarkReadContention)
+{
+    using clock = std::chrono::steady_clock;
+    const int reads_per_thread = 200000;
+
+    Datastore ds;
+    ASSERT_FALSE(ds.Init(GetTempDir(), ds_suffix));
+    ASSERT_FALSE(ds.Set("/user/balance"_json_pointer, 12345));
+    ASSERT_FALSE(ds.Set("/user/isAccount"_json_pointer, true));
+
+    for (int thread_count : {1, 2, 4, 8, 16}) {
+        std::atomic<bool> go(false);
+        std::atomic<int64_t> sum(0);
+        vector<std::thread> threads;
+        for (int t = 0; t < thread_count; t++) {
+            threads.emplace_back([&]() {
+                while (!go) {
+                    std::this_thread::yield();
+                }
+                int64_t local_sum = 0;
+                for (int i = 0; i < reads_per_thread; i++) {
+                    local_sum += *ds.Get<int64_t>("/user/balance"_json_pointer);
+                }
+                sum += local_sum;
+            });
+        }
+
+        auto start = clock::now();
+        go = true;
+        for (auto& t : threads) {
+            t.join();
+        }
+        auto elapsed = std::chrono::duration<double>(clock::now() - start).count();
+
+        ASSERT_EQ(sum, (int64_t)12345 * reads_per_thread * thread_count);
+        std::cout << thread_count << " reader threads: "
+                  << (int64_t)(reads_per_thread * thread_count / elapsed) << " reads/sec" << std::endl;
+    }
 }
 
 TEST_F(TestDatastore, TypeMismatch)
@@ -1036,6 +2713,61 @@ TEST_F(TestDatastore, GetFullDS)
     ASSERT_EQ(j->at("k").get<string>(), want);
 }
 
+TEST_F(TestDatastore, Read)
+{
+    Datastore ds;
+    auto size = [](const DatastoreJson& j) { return j.size(); };
+
+    // Error before Init
+    auto got = ds.Read(""_json_pointer, size);
+    ASSERT_FALSE(got);
+    ASSERT_EQ(got.error(), Datastore::DatastoreGetError::kDatastoreUninitialized);
+
+    auto err = ds.Init(GetTempDir(), ds_suffix);
+    ASSERT_FALSE(err);
+    err = ds.Set("/a"_json_pointer, json::array({1, 2, 3}));
+    ASSERT_FALSE(err);
+
+    got = ds.Read("/a"_json_pointer, size);
+    ASSERT_TRUE(got);
+    ASSERT_EQ(*got, 3);
+    got = ds.Read(""_json_pointer, size);
+    ASSERT_TRUE(got);
+    ASSERT_EQ(*got, 1);
+    got = ds.Read("/nope"_json_pointer, size);
+    ASSERT_FALSE(got);
+    ASSERT_EQ(got.error(), Datastore::DatastoreGetError::kNotFound);
+
+    static constexpr DatastoreKey<vector<int>> kA{"/a"};
+    int sum = 0;
+    auto visited = ds.Read(kA, [&](const DatastoreJson& a) {
+        for (const auto& v : a) {
+            sum += v.get<int>();
+        }
+    });
+    ASSERT_TRUE(visited);
+    ASSERT_EQ(sum, 6);
+
+    // The callback may change the datastore without affecting the value it's reading
+    auto read = ds.Read("/a"_json_pointer, [&](const DatastoreJson& a) {
+        EXPECT_FALSE(ds.Set("/a"_json_pointer, "replaced"));
+        EXPECT_EQ(*ds.Get<string>("/a"_json_pointer), "replaced");
+        return a;
+    });
+    ASSERT_TRUE(read);
+    ASSERT_EQ(*read, DatastoreJson::array({1, 2, 3}));
+
+    // Within a transaction, uncommitted changes are read
+    ds.BeginTransaction();
+    err = ds.Set("/a"_json_pointer, json::array({1}));
+    ASSERT_FALSE(err);
+    got = ds.Read("/a"_json_pointer, size);
+    ASSERT_TRUE(got);
+    ASSERT_EQ(*got, 1);
+    err = ds.EndTransaction(false);
+    ASSERT_FALSE(err);
+}
+
 /*
 This was a failed attempt to trigger a datastore corruption error we sometimes see.
 To run, SaveDatastoreFile and LoadDatastoreFile need to be exported.
@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include <algorithm>
+#include "executor.hpp"
+
+using namespace std;
+
+namespace psicash {
+
+Executor::Executor(size_t max_threads)
+        : max_threads_(std::max<size_t>(max_threads, 1)),
+          thread_count_(0),
+          idle_count_(0),
+          stopping_(false) {
+}
+
+Executor::~Executor() {
+    vector<std::thread> threads;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+        cv_.notify_all();
+        threads = std::move(threads_);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+void Executor::Post(Task task) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks_.push_back(std::move(task));
+    // While stopping, the remaining threads run whatever is queued.
+    if (idle_count_ >= tasks_.size() || thread_count_ >= max_threads_ || stopping_) {
+        cv_.notify_one();
+        return;
+    }
+    thread_count_++;
+    threads_.emplace_back(&Executor::Run, this);
+}
+
+void Executor::SetMaxThreads(size_t max_threads) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    max_threads_ = std::max<size_t>(max_threads, 1);
+    // Idle threads beyond the maximum can stop now.
+    cv_.notify_all();
+}
+
+size_t Executor::ThreadCount() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return thread_count_;
+}
+
+void Executor::Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        if (thread_count_ > max_threads_ && !stopping_) {
+            break;
+        }
+        if (tasks_.empty()) {
+            if (stopping_) {
+                break;
+            }
+            idle_count_++;
+            cv_.wait(lock, [this] {
+                return !tasks_.empty() || stopping_ || thread_count_ > max_threads_;
+            });
+            idle_count_--;
+            continue;
+        }
+
+        auto task = std::move(tasks_.front());
+        tasks_.pop_front();
+        lock.unlock();
+        task();
+        lock.lock();
+    }
+    thread_count_--;
+}
+
+} // namespace psicash
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifndef PSICASHLIB_EXECUTOR_H
+#define PSICASHLIB_EXECUTOR_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace psicash {
+
+/// Runs tasks on a pool of threads. Threads are started as tasks need them, up to the
+/// maximum, and then kept until the executor is destroyed (or the maximum is lowered).
+class Executor {
+public:
+    using Task = std::function<void()>;
+
+    explicit Executor(size_t max_threads);
+    /// Runs the tasks that have been posted (including any that they post), then stops
+    /// the threads. Tasks must not be posted from other threads while this is running.
+    ~Executor();
+
+    Executor(const Executor&) = delete;
+    Executor& operator=(const Executor&) = delete;
+
+    /// Queues `task` to run on one of the threads. Tasks start in the order they're
+    /// posted.
+    void Post(Task task);
+
+    /// Sets the number of threads that may run tasks at once. Must be at least 1. If it's
+    /// lowered, threads beyond the new maximum stop after their current task.
+    void SetMaxThreads(size_t max_threads);
+
+    /// Returns the number of threads currently running. For testing.
+    size_t ThreadCount() const;
+
+private:
+    void Run();
+
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<Task> tasks_;
+    size_t max_threads_;
+    /// The threads that haven't stopped, and how many of them are waiting for a task.
+    size_t thread_count_;
+    size_t idle_count_;
+    bool stopping_;
+    /// Every thread started, including stopped ones, so that they can be joined.
+    std::vector<std::thread> threads_;
+};
+
+} // namespace psicash
+
+#endif //PSICASHLIB_EXECUTOR_H
@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+#include "executor.hpp"
+
+using namespace std;
+using namespace psicash;
+
+TEST(TestExecutor, ThreadsStartAsNeeded)
+{
+    Executor executor(3);
+    ASSERT_EQ(executor.ThreadCount(), 0);
+
+    promise<void> first_done;
+    executor.Post([&] { first_done.set_value(); });
+    ASSERT_EQ(first_done.get_future().wait_for(chrono::seconds(5)), future_status::ready);
+    ASSERT_EQ(executor.ThreadCount(), 1);
+
+    // Tasks that block each other need their own threads, up to the maximum
+    mutex m;
+    condition_variable cv;
+    int started = 0;
+    bool release = false;
+    for (int i = 0; i < 5; i++) {
+        executor.Post([&] {
+            unique_lock<mutex> lock(m);
+            started++;
+            cv.notify_all();
+            cv.wait(lock, [&] { return release; });
+        });
+    }
+    {
+        unique_lock<mutex> lock(m);
+        ASSERT_TRUE(cv.wait_for(lock, chrono::seconds(5), [&] { return started == 3; }));
+    }
+    // No more than the maximum run at once
+    this_thread::sleep_for(chrono::milliseconds(50));
+    {
+        lock_guard<mutex> lock(m);
+        ASSERT_EQ(started, 3);
+        release = true;
+        cv.notify_all();
+    }
+    ASSERT_EQ(executor.ThreadCount(), 3);
+
+    promise<void> last_done;
+    executor.Post([&] { last_done.set_value(); });
+    ASSERT_EQ(last_done.get_future().wait_for(chrono::seconds(5)), future_status::ready);
+    ASSERT_EQ(started, 5);
+}
+
+TEST(TestExecutor, SetMaxThreads)
+{
+    Executor executor(1);
+
+    // With one thread, tasks run one at a time, in order
+    mutex m;
+    vector<int> order;
+    for (int i = 0; i < 10; i++) {
+        executor.Post([&, i] {
+            lock_guard<mutex> lock(m);
+            order.push_back(i);
+        });
+    }
+    promise<void> done;
+    executor.Post([&] { done.set_value(); });
+    ASSERT_EQ(done.get_future().wait_for(chrono::seconds(5)), future_status::ready);
+    ASSERT_EQ(order, (vector<int>{0, 1, 2, 3, 4, 5, 6, 7, 8, 9}));
+    ASSERT_EQ(executor.ThreadCount(), 1);
+
+    // Raising the maximum lets blocking tasks run together
+    executor.SetMaxThreads(4);
+    atomic<int> waiting(0);
+    promise<void> all_started;
+    auto all_started_future = all_started.get_future().share();
+    for (int i = 0; i < 4; i++) {
+        executor.Post([&] {
+            if (++waiting == 4) {
+                all_started.set_value();
+            }
+            all_started_future.wait();
+        });
+    }
+    ASSERT_EQ(all_started_future.wait_for(chrono::seconds(5)), future_status::ready);
+    ASSERT_EQ(executor.ThreadCount(), 4);
+
+    // Lowering it stops the extra threads once they're idle
+    executor.SetMaxThreads(2);
+    for (int i = 0; i < 100 && executor.ThreadCount() > 2; i++) {
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    ASSERT_EQ(executor.ThreadCount(), 2);
+}
+
+TEST(TestExecutor, DestructionRunsQueuedTasks)
+{
+    atomic<int> runs(0);
+    {
+        Executor executor(2);
+        for (int i = 0; i < 20; i++) {
+            executor.Post([&] {
+                this_thread::sleep_for(chrono::milliseconds(1));
+                runs++;
+            });
+        }
+        // A task posted by a task while the executor is stopping still runs
+        executor.Post([&] {
+            this_thread::sleep_for(chrono::milliseconds(20));
+            executor.Post([&] { runs++; });
+        });
+    }
+    ASSERT_EQ(runs, 21);
+}
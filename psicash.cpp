@@ -23,8 +23,14 @@
 #include <chrono>
 #include <thread>
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <random>
 #include "psicash.hpp"
 #include "userdata.hpp"
+#include "scheduler.hpp"
+#include "executor.hpp"
+#include "task.hpp"
 #include "datetime.hpp"
 #include "error.hpp"
 #include "url.hpp"
@@ -67,6 +73,7 @@ static constexpr const char* kAPIServerVersion = "v1";
 static constexpr const char* kLandingPageParamKey = "psicash";
 static constexpr const char* kMethodGET = "GET";
 static constexpr const char* kMethodPOST = "POST";
+static constexpr size_t kDefaultAsyncThreads = 2;
 
 //
 // PsiCash class implementation
@@ -81,15 +88,35 @@ PsiCash::PsiCash()
           initialized_(false),
           server_port_(0),
           user_data_(std::make_unique<UserData>()),
-          make_http_request_fn_(nullptr) {
+          make_http_request_fn_(nullptr),
+          scheduler_(std::make_unique<Scheduler>()),
+          cancel_generation_(0),
+          destroying_(false),
+          executor_(std::make_unique<Executor>(kDefaultAsyncThreads)),
+          async_dispatcher_([this](std::function<void()> work) { executor_->Post(std::move(work)); }),
+          async_ops_(0) {
 }
 
 PsiCash::~PsiCash() {
+    // Let the asynchronous operations finish, without waiting to retry, while everything
+    // they use still exists.
+    {
+        std::lock_guard<std::mutex> lock(retry_mutex_);
+        destroying_ = true;
+    }
+    Cancel();
+    // Cancel has finished the requests in flight, but the operations that were waiting on
+    // them still need the executor to finish on.
+    {
+        std::unique_lock<std::mutex> lock(async_ops_mutex_);
+        async_ops_cv_.wait(lock, [this] { return async_ops_ == 0; });
+    }
+    executor_.reset();
 }
 
 Error PsiCash::Init(const string& user_agent, const string& file_store_root,
                     MakeHTTPRequestFn make_http_request_fn, bool force_reset,
-                    bool test) {
+                    bool test, const DatastoreOptions& datastore_options/*=DatastoreOptions()*/) {
     test_ = test;
     if (test) {
         server_scheme_ = dev::kAPIServerScheme;
@@ -105,6 +132,10 @@ Error PsiCash::Init(const string& user_agent, const string& file_store_root,
         return MakeCriticalError("user_agent is required");
     }
     user_agent_ = user_agent;
+    {
+        std::lock_guard<std::mutex> lock(request_headers_mutex_);
+        request_headers_.reset();
+    }
 
     if (file_store_root.empty()) {
         return MakeCriticalError("file_store_root is required");
@@ -117,7 +148,7 @@ Error PsiCash::Init(const string& user_agent, const string& file_store_root,
     // May still be null.
     make_http_request_fn_ = std::move(make_http_request_fn);
 
-    if (auto err = user_data_->Init(file_store_root, test)) {
+    if (auto err = user_data_->Init(file_store_root, test, datastore_options)) {
         return PassError(err);
     }
 
@@ -126,11 +157,17 @@ Error PsiCash::Init(const string& user_agent, const string& file_store_root,
 }
 
 #define MUST_BE_INITIALIZED     if (!Initialized()) { return MakeCriticalError("PsiCash is uninitialized"); }
+#define CO_MUST_BE_INITIALIZED  if (!Initialized()) { co_return MakeCriticalError("PsiCash is uninitialized"); }
 
 bool PsiCash::Initialized() const {
     return initialized_;
 }
 
+Error PsiCash::Flush() {
+    MUST_BE_INITIALIZED;
+    return PassError(user_data_->Flush());
+}
+
 Error PsiCash::ResetUser() {
     return PassError(user_data_->DeleteUserData(/*is_logged_out_account=*/false));
 }
@@ -159,14 +196,68 @@ void PsiCash::SetHTTPRequestFn(MakeHTTPRequestFn make_http_request_fn) {
     make_http_request_fn_ = std::move(make_http_request_fn);
 }
 
+void PsiCash::SetHTTPRequestAsyncFn(MakeHTTPRequestAsyncFn make_http_request_async_fn) {
+    make_http_request_async_fn_ = std::move(make_http_request_async_fn);
+}
+
+void PsiCash::SetRetryPolicy(const RetryPolicy& policy, const std::string& path/*=""*/) {
+    std::lock_guard<std::mutex> lock(retry_mutex_);
+    if (path.empty()) {
+        default_retry_policy_ = policy;
+    } else {
+        retry_policies_[path] = policy;
+    }
+}
+
+// The state of an HTTP request, shared by the awaiting coroutine, the requester's
+// completion callback and Cancel. Whichever of the callback and Cancel comes first
+// provides the result; the other is ignored. So a request whose requester never calls
+// back still ends when it's cancelled (as on destruction).
+struct PsiCash::PendingRequest {
+    // Set by the first call to Finish.
+    std::atomic<bool> finished{false};
+    // Set by the first of Finish and await_suspend to be done. If that's await_suspend,
+    // the coroutine is suspended and it's up to Finish to resume it.
+    std::atomic<bool> completed{false};
+    // Null if the request was cancelled.
+    optional<HTTPResult> result;
+    std::coroutine_handle<> handle;
+    const Dispatcher* dispatcher = nullptr;
+
+    void Finish(optional<HTTPResult> r) {
+        if (finished.exchange(true)) {
+            return;
+        }
+        result = std::move(r);
+        if (completed.exchange(true)) {
+            auto h = handle;
+            (*dispatcher)([h] { h.resume(); });
+        }
+    }
+};
+
+void PsiCash::Cancel() {
+    vector<uint64_t> pending;
+    vector<shared_ptr<PendingRequest>> requests;
+    {
+        std::lock_guard<std::mutex> lock(retry_mutex_);
+        cancel_generation_++;
+        pending.assign(pending_retries_.begin(), pending_retries_.end());
+        requests.assign(pending_requests_.begin(), pending_requests_.end());
+    }
+    // Cancelling a retry wakes the call waiting for it.
+    for (auto id : pending) {
+        (void)scheduler_->Cancel(id);
+    }
+    // As does finishing a request the requester hasn't.
+    for (const auto& request : requests) {
+        request->Finish(nullopt);
+    }
+}
+
 Error PsiCash::SetRequestMetadataItems(const std::map<std::string, std::string>& items) {
     MUST_BE_INITIALIZED;
-    UserData::Transaction transaction(*user_data_);
-    for (const auto& it : items) {
-        // Errors won't manifest until we commit
-        (void)user_data_->SetRequestMetadataItem(it.first, it.second);
-    }
-    if (auto err = transaction.Commit()) {
+    if (auto err = user_data_->SetRequestMetadataItems(items)) {
         return WrapError(err, "user data write failed");
     }
     return nullerr;
@@ -186,23 +277,19 @@ bool PsiCash::HasTokens() const {
 
     // Trackers and Accounts both require the same token types (for now).
     // (Accounts will also have the "logout" type, but it isn't strictly needed for sane operation.)
-    vector<string> required_token_types = {kEarnerTokenType, kSpenderTokenType, kIndicatorTokenType};
-    auto auth_tokens = user_data_->GetAuthTokens();
-    for (const auto& it : auth_tokens) {
-        auto found = std::find(required_token_types.begin(), required_token_types.end(), it.first);
-        if (found != required_token_types.end()) {
-            required_token_types.erase(found);
-        }
-    }
-
-    return required_token_types.empty();
+    static constexpr TokenTypeMask required_token_types = TokenTypeBit(TokenType::kEarner)
+                                                          | TokenTypeBit(TokenType::kSpender)
+                                                          | TokenTypeBit(TokenType::kIndicator);
+    return user_data_->HasTokenTypes(required_token_types);
 }
 
 /// If the user has no tokens, most actions are disallowed. (This can include being in
 /// the is-logged-out-account state.)
 #define TOKENS_REQUIRED     if (!HasTokens()) { return MakeCriticalError("user has insufficient tokens"); }
+#define CO_TOKENS_REQUIRED  if (!HasTokens()) { co_return MakeCriticalError("user has insufficient tokens"); }
 
 bool PsiCash::IsAccount() const {
+    UserData::ConsistentRead read(*user_data_);
     if (user_data_->GetIsLoggedOutAccount()) {
         return true;
     }
@@ -210,6 +297,7 @@ bool PsiCash::IsAccount() const {
 }
 
 nonstd::optional<std::string> PsiCash::AccountUsername() const {
+    UserData::ConsistentRead read(*user_data_);
     if (user_data_->GetIsLoggedOutAccount() || !user_data_->GetIsAccount()) {
         return nullopt;
     }
@@ -255,16 +343,7 @@ Authorizations PsiCash::GetAuthorizations(bool activeOnly/*=false*/) const {
 }
 
 Purchases PsiCash::GetPurchasesByAuthorizationID(std::vector<std::string> authorization_ids) const {
-    auto purchases = user_data_->GetPurchases();
-
-    auto new_end = std::remove_if(purchases.begin(), purchases.end(), [&authorization_ids](const Purchase& p){
-        return !p.authorization
-            || std::find(authorization_ids.begin(), authorization_ids.end(), p.authorization->id) == authorization_ids.end();
-    });
-
-    purchases.erase(new_end, purchases.end());
-
-    return purchases;
+    return user_data_->GetPurchasesByAuthorizationID(authorization_ids);
 }
 
 optional<Purchase> PsiCash::NextExpiringPurchase() const {
@@ -291,47 +370,25 @@ optional<Purchase> PsiCash::NextExpiringPurchase() const {
 }
 
 Result<Purchases> PsiCash::ExpirePurchases() {
-    auto all_purchases = GetPurchases();
-    Purchases expired_purchases, valid_purchases;
-    for (const auto& p : all_purchases) {
+    vector<TransactionID> expired_ids;
+    for (const auto& p : GetPurchases()) {
         if (IsExpired(p)) {
-            expired_purchases.push_back(p);
-        } else {
-            valid_purchases.push_back(p);
+            expired_ids.push_back(p.id);
         }
     }
 
-    auto err = user_data_->SetPurchases(valid_purchases);
-    if (err) {
-        return WrapError(err, "SetPurchases failed");
+    auto expired_purchases = user_data_->RemovePurchases(expired_ids);
+    if (!expired_purchases) {
+        return WrapError(expired_purchases.error(), "RemovePurchases failed");
     }
 
     return expired_purchases;
 }
 
 error::Result<Purchases> PsiCash::RemovePurchases(const vector<TransactionID>& ids) {
-    auto all_purchases = GetPurchases();
-    Purchases remaining_purchases, removed_purchases;
-    for (const auto& p : all_purchases) {
-        bool match = false;
-        for (const auto& id : ids) {
-            if (p.id == id) {
-                match = true;
-                break;
-            }
-        }
-
-        if (match) {
-            removed_purchases.push_back(p);
-        }
-        else {
-            remaining_purchases.push_back(p);
-        }
-    }
-
-    auto err = user_data_->SetPurchases(remaining_purchases);
-    if (err) {
-        return WrapError(err, "SetPurchases failed");
+    auto removed_purchases = user_data_->RemovePurchases(ids);
+    if (!removed_purchases) {
+        return WrapError(removed_purchases.error(), "RemovePurchases failed");
     }
 
     return removed_purchases;
@@ -450,9 +507,9 @@ Result<string> PsiCash::GetUserMetadataURLPackage(
 
     // Get tokens to include, if indicated
     if (!token_types.empty()) {
-        auto auth_tokens = user_data_->GetAuthTokens();
+        auto token_state = user_data_->GetAuthTokenState();
         for (const auto& tt : token_types) {
-            if (auth_tokens.count(tt) == 0 && error_if_token_missing) {
+            if (token_state->tokens.count(tt) == 0 && error_if_token_missing) {
                 // Missing token for this type
                 return MakeCriticalError(utils::Stringer("token type missing: ", tt));
             }
@@ -487,6 +544,18 @@ Result<string> PsiCash::GetRewardedActivityData() const {
     return GetUserMetadataURLPackage({kEarnerTokenType}, true);
 }
 
+uint64_t PsiCash::ChangeGeneration(StateField field) const {
+    return user_data_->ChangeGeneration(field);
+}
+
+StateSubscriptionID PsiCash::Subscribe(vector<StateField> fields, StateChangeCallback callback) {
+    return user_data_->Subscribe(std::move(fields), std::move(callback));
+}
+
+void PsiCash::Unsubscribe(StateSubscriptionID id) {
+    user_data_->Unsubscribe(id);
+}
+
 json PsiCash::GetDiagnosticInfo(bool lite) const {
     // NOTE: Do not put personal identifiers in this package.
     // TODO: This is still enough info to uniquely identify the user (combined with the
@@ -494,6 +563,9 @@ json PsiCash::GetDiagnosticInfo(bool lite) const {
     // instead either include less data or make sure our retention of this data is
     // aggregated and/or short.
 
+    // All of the values should come from the same state.
+    UserData::ConsistentRead read(*user_data_);
+
     json j = json::object();
 
     j["test"] = test_;
@@ -504,17 +576,23 @@ json PsiCash::GetDiagnosticInfo(bool lite) const {
     j["balance"] = Balance();
     j["serverTimeDiff"] = user_data_->GetServerTimeDiff().count(); // in milliseconds
 
-    // Include a sanitized version of the purchases
+    // Include a sanitized version of the purchases. They're read in place, rather than
+    // decoded, as only two fields are needed.
     j["purchases"] = json::array();
-    for (const auto& p : GetPurchases()) {
-        j["purchases"].push_back({{"class",         p.transaction_class},
-                                  {"distinguisher", p.distinguisher}});
-    }
+    user_data_->ReadPurchases([&](const DatastoreJson& purchases) {
+        for (const auto& p : purchases) {
+            j["purchases"].push_back({{"class",         p.value("class", "")},
+                                      {"distinguisher", p.value("distinguisher", "")}});
+        }
+    });
 
     // The purchase prices are about 800 bytes of the 1000 bytes in a typical diangnostic
     // dump, and they're generally not useful.
     if (!lite) {
-        j["purchasePrices"] = GetPurchasePrices();
+        j["purchasePrices"] = json::array();
+        user_data_->ReadPurchasePrices([&](const DatastoreJson& purchase_prices) {
+            j["purchasePrices"] = purchase_prices;
+        });
     }
 
     return j;
@@ -543,16 +621,157 @@ json PsiCash::GetRequestMetadata(int attempt) const {
     return req_metadata;
 }
 
+RetryPolicy PsiCash::GetRetryPolicy(const std::string& path) const {
+    std::lock_guard<std::mutex> lock(retry_mutex_);
+    auto it = retry_policies_.find(path);
+    return (it != retry_policies_.end()) ? it->second : default_retry_policy_;
+}
+
+// Returns how long to wait before the given retry (the first retry being 1).
+static chrono::milliseconds RetryDelay(const RetryPolicy& policy, int retry) {
+    auto delay = policy.base_delay;
+    for (int i = 1; i < retry && delay < policy.max_delay; i++) {
+        delay *= 2;
+    }
+    delay = std::min(delay, policy.max_delay);
+
+    auto jitter = std::clamp(policy.jitter, 0.0, 1.0);
+    if (jitter > 0 && delay.count() > 0) {
+        thread_local std::mt19937 rng{std::random_device{}()};
+        std::uniform_real_distribution<double> dist(0.0, jitter);
+        delay -= chrono::milliseconds(static_cast<int64_t>(delay.count() * dist(rng)));
+    }
+    return delay;
+}
+
+static bool IsRetryableCode(const RetryPolicy& policy, int code) {
+    return std::any_of(policy.retryable_codes.begin(), policy.retryable_codes.end(),
+                       [code](const pair<int, int>& r) { return code >= r.first && code <= r.second; });
+}
+
+// Awaits the result of an HTTP request, which is null if Cancel is called before it's
+// done (or has been called since the request began, when cancel_generation_ was
+// `cancel_generation`). If the requester completes it before returning, the awaiting
+// coroutine carries on without suspending; otherwise it's resumed via its dispatcher.
+class PsiCash::RequestAwaiter {
+public:
+    RequestAwaiter(PsiCash& psicash, MakeHTTPRequestAsyncFn requester, const HTTPParams& params,
+                   uint64_t cancel_generation)
+            : psicash_(psicash), requester_(std::move(requester)), params_(params),
+              cancel_generation_(cancel_generation), request_(std::make_shared<PendingRequest>()) {}
+
+    bool await_ready() const noexcept { return false; }
+
+    template<typename P>
+    bool await_suspend(std::coroutine_handle<P> h) {
+        request_->handle = h;
+        request_->dispatcher = h.promise().dispatcher;
+        {
+            std::lock_guard<std::mutex> lock(psicash_.retry_mutex_);
+            if (psicash_.cancel_generation_ != cancel_generation_ || psicash_.destroying_) {
+                request_->finished = true;
+                return false;
+            }
+            psicash_.pending_requests_.insert(request_);
+        }
+        // The callback only holds the shared state, so it's harmless if the requester
+        // calls it after the request has been cancelled (and we're gone).
+        requester_(params_, [request = request_](HTTPResult result) {
+            request->Finish(std::move(result));
+        });
+        return !request_->completed.exchange(true);
+    }
+
+    optional<HTTPResult> await_resume() {
+        {
+            std::lock_guard<std::mutex> lock(psicash_.retry_mutex_);
+            psicash_.pending_requests_.erase(request_);
+        }
+        return std::move(request_->result);
+    }
+
+private:
+    PsiCash& psicash_;
+    MakeHTTPRequestAsyncFn requester_;
+    const HTTPParams& params_;
+    uint64_t cancel_generation_;
+    std::shared_ptr<PendingRequest> request_;
+};
+
+// Makes the request with the asynchronous requester, if there is one, or else with the
+// blocking requester, on the current thread.
+PsiCash::RequestAwaiter PsiCash::MakeHTTPRequest(const HTTPParams& params, uint64_t cancel_generation) {
+    if (make_http_request_async_fn_) {
+        return RequestAwaiter(*this, make_http_request_async_fn_, params, cancel_generation);
+    }
+    auto blocking_fn = make_http_request_fn_;
+    return RequestAwaiter(
+            *this,
+            [blocking_fn](const HTTPParams& params, const HTTPRequestDoneFn& done) {
+                done(blocking_fn(params));
+            },
+            params, cancel_generation);
+}
+
+// Awaits the time to make a retry. The result is false if Cancel is called before then
+// (or has been called since the request began, when cancel_generation_ was
+// `cancel_generation`).
+class PsiCash::RetryAwaiter {
+public:
+    RetryAwaiter(PsiCash& psicash, chrono::steady_clock::time_point when, uint64_t cancel_generation)
+            : psicash_(psicash), when_(when), cancel_generation_(cancel_generation),
+              id_(0), cancelled_(false) {}
+
+    bool await_ready() const noexcept { return false; }
+
+    template<typename P>
+    bool await_suspend(std::coroutine_handle<P> h) {
+        auto dispatcher = h.promise().dispatcher;
+        std::lock_guard<std::mutex> lock(psicash_.retry_mutex_);
+        if (psicash_.cancel_generation_ != cancel_generation_ || psicash_.destroying_) {
+            cancelled_ = true;
+            return false;
+        }
+        // The task might run, and resume the coroutine, before the lock is released.
+        // await_resume needs the lock, so it will see id_.
+        id_ = psicash_.scheduler_->Schedule(when_, [this, dispatcher, h](bool cancelled) {
+            cancelled_ = cancelled;
+            (*dispatcher)([h] { h.resume(); });
+        });
+        psicash_.pending_retries_.insert(id_);
+        return true;
+    }
+
+    bool await_resume() {
+        std::lock_guard<std::mutex> lock(psicash_.retry_mutex_);
+        if (id_) {
+            psicash_.pending_retries_.erase(id_);
+        }
+        return !cancelled_ && psicash_.cancel_generation_ == cancel_generation_;
+    }
+
+private:
+    PsiCash& psicash_;
+    chrono::steady_clock::time_point when_;
+    uint64_t cancel_generation_;
+    Scheduler::TaskID id_;
+    bool cancelled_;
+};
+
+PsiCash::RetryAwaiter PsiCash::WaitToRetry(chrono::steady_clock::time_point when, uint64_t cancel_generation) {
+    return RetryAwaiter(*this, when, cancel_generation);
+}
+
 // Makes an HTTP request (with possible retries).
 // HTTPResult.error will always be empty on a non-error return.
-Result<HTTPResult> PsiCash::MakeHTTPRequestWithRetry(
-        const std::string& method, const std::string& path, bool include_auth_tokens,
-        const std::vector<std::pair<std::string, std::string>>& query_params,
-        const optional<json>& body)
+Task<Result<HTTPResult>> PsiCash::MakeHTTPRequestWithRetry(
+        std::string method, std::string path, bool include_auth_tokens,
+        std::vector<std::pair<std::string, std::string>> query_params,
+        optional<json> body)
 {
-    MUST_BE_INITIALIZED;
+    CO_MUST_BE_INITIALIZED;
 
-    if (!make_http_request_fn_) {
+    if (!make_http_request_fn_ && !make_http_request_async_fn_) {
         throw std::runtime_error("make_http_request_fn_ must be set before requests are attempted");
     }
 
@@ -562,31 +781,54 @@ Result<HTTPResult> PsiCash::MakeHTTPRequestWithRetry(
             body_string = body->dump(-1, ' ', true);
         }
         catch (json::exception& e) {
-            return MakeCriticalError(
+            co_return MakeCriticalError(
                     utils::Stringer("body json dump failed: ", e.what(), "; id:", e.id));
         }
     }
 
-    const int max_attempts = 3;
+    uint64_t cancel_generation;
+    {
+        std::lock_guard<std::mutex> lock(retry_mutex_);
+        cancel_generation = cancel_generation_;
+    }
+    const auto policy = GetRetryPolicy(path);
+    const auto max_attempts = std::max(policy.max_attempts, 1);
+    const auto deadline = (policy.deadline.count() > 0)
+                          ? chrono::steady_clock::now() + policy.deadline
+                          : chrono::steady_clock::time_point::max();
     HTTPResult http_result;
 
     for (int i = 0; i < max_attempts; i++) {
         if (i > 0) {
             // Not the first attempt; wait before retrying
-            this_thread::sleep_for(chrono::seconds(i));
+            auto retry_at = chrono::steady_clock::now() + RetryDelay(policy, i);
+            if (retry_at >= deadline) {
+                break;
+            }
+            if (!co_await WaitToRetry(retry_at, cancel_generation)) {
+                co_return MakeNoncriticalError("request cancelled");
+            }
         }
 
         auto req_params = BuildRequestParams(
             method, path, include_auth_tokens, query_params, i + 1, {}, body_string);
         if (!req_params) {
-            return WrapError(req_params.error(), "BuildRequestParams failed");
+            co_return WrapError(req_params.error(), "BuildRequestParams failed");
+        }
+        if (deadline != chrono::steady_clock::time_point::max()) {
+            auto remaining = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now());
+            req_params->timeout_ms = std::max<int64_t>(remaining.count(), 1);
         }
 
-        http_result = make_http_request_fn_(*req_params);
+        auto request_result = co_await MakeHTTPRequest(*req_params, cancel_generation);
+        if (!request_result) {
+            co_return MakeNoncriticalError("request cancelled");
+        }
+        http_result = std::move(*request_result);
 
         // Error state sanity check
         if (http_result.code < 0 && http_result.error.empty()) {
-            return MakeCriticalError("HTTP result code is negative but no error message provided");
+            co_return MakeCriticalError("HTTP result code is negative but no error message provided");
         }
 
         // We just got a fresh server timestamp (Date header), so set the server time diff
@@ -614,27 +856,104 @@ Result<HTTPResult> PsiCash::MakeHTTPRequestWithRetry(
             }
 
             // Unrecoverable error; don't retry.
-            return MakeCriticalError("Request resulted in critical error: "s + http_result.error);
+            co_return MakeCriticalError("Request resulted in critical error: "s + http_result.error);
         }
 
-        if (IsServerError(http_result.code)) {
-            // Server error; retry
+        if (IsRetryableCode(policy, http_result.code)) {
+            // Server error (probably); retry
             continue;
         }
 
-        // We got a response of less than 500. We'll consider that success at this point.
-        return http_result;
+        // We got a response that isn't to be retried. We'll consider that success at this
+        // point. (With the default policy, that means a response of less than 500.)
+        co_return http_result;
     }
 
-    // We exceeded our retry limit.
+    // We exceeded our retry limit (or deadline).
 
     if (http_result.code < 0) {
         // A critical error would have returned above, so this is a non-critical error
-        return MakeNoncriticalError("Request resulted in noncritical error: "s + http_result.error);
+        co_return MakeNoncriticalError("Request resulted in noncritical error: "s + http_result.error);
     }
 
-    // Return the last result (which is a 5xx server error)
-    return http_result;
+    // Return the last result (which is a retryable error, like a 5xx server error)
+    co_return http_result;
+}
+
+// The request headers that come from the user data, built only when that data changes
+// rather than for every request.
+struct PsiCash::RequestHeaders {
+    // The UserData::RequestHeadersGeneration that these were built from.
+    uint64_t generation;
+    string cookie;
+    string auth_tokens;
+    // The serialized items of GetRequestMetadata(0), split around where the "attempt"
+    // item goes. The serialized object keys are sorted, so that place is fixed. If there's
+    // a stored "attempt" item, it's in metadata_attempt.
+    string metadata_before;
+    string metadata_attempt;
+    string metadata_after;
+
+    // Returns the same as GetRequestMetadata(attempt).dump(-1, ' ', true).
+    string Metadata(int attempt) const {
+        const auto attempt_item = (attempt > 0) ? "\"attempt\":" + std::to_string(attempt) : metadata_attempt;
+        string metadata = "{";
+        for (const auto* item : {&metadata_before, &attempt_item, &metadata_after}) {
+            if (item->empty()) {
+                continue;
+            }
+            if (metadata.length() > 1) {
+                metadata += ',';
+            }
+            metadata += *item;
+        }
+        metadata += '}';
+        return metadata;
+    }
+};
+
+// Returns the request headers for the current user data. They're cached until the values
+// they're built from change.
+Result<shared_ptr<const PsiCash::RequestHeaders>> PsiCash::GetRequestHeaders() const {
+    auto generation = user_data_->RequestHeadersGeneration();
+    {
+        std::lock_guard<std::mutex> lock(request_headers_mutex_);
+        if (generation != 0 && request_headers_ && request_headers_->generation == generation) {
+            return request_headers_;
+        }
+    }
+
+    auto headers = std::make_shared<RequestHeaders>();
+    headers->generation = generation;
+    headers->cookie = user_data_->GetCookies();
+    headers->auth_tokens = CommaDelimitTokens({});
+
+    static const string attempt_key = "attempt";
+    auto metadata = GetRequestMetadata(0);
+    try {
+        for (const auto& it : metadata.items()) {
+            auto item = json(it.key()).dump(-1, ' ', true) + ':' + it.value().dump(-1, ' ', true);
+            auto& items = (it.key() < attempt_key) ? headers->metadata_before
+                          : (it.key() == attempt_key) ? headers->metadata_attempt
+                          : headers->metadata_after;
+            if (!items.empty()) {
+                items += ',';
+            }
+            items += item;
+        }
+    }
+    catch (json::exception& e) {
+        return MakeCriticalError(
+                utils::Stringer("metadata json dump failed: ", e.what(), "; id:", e.id));
+    }
+
+    // If the values changed while we were reading them, we might have a mix of old and
+    // new, so only cache what was read from unchanging values.
+    if (generation != 0 && user_data_->RequestHeadersGeneration() == generation) {
+        std::lock_guard<std::mutex> lock(request_headers_mutex_);
+        request_headers_ = headers;
+    }
+    return shared_ptr<const RequestHeaders>(std::move(headers));
 }
 
 // Build the request parameters JSON appropriate for passing to make_http_request_fn_.
@@ -653,24 +972,21 @@ Result<HTTPParams> PsiCash::BuildRequestParams(
     params.path = "/"s + kAPIServerVersion + path;
     params.query = query_params;
 
+    auto headers = GetRequestHeaders();
+    if (!headers) {
+        return PassError(headers.error());
+    }
+
     params.headers = additional_headers;
     params.headers["Accept"] = "application/json";
     params.headers["User-Agent"] = user_agent_;
-    params.headers["Cookie"] = user_data_->GetCookies();
+    params.headers["Cookie"] = (*headers)->cookie;
 
     if (include_auth_tokens) {
-        params.headers["X-PsiCash-Auth"] = CommaDelimitTokens({});
+        params.headers["X-PsiCash-Auth"] = (*headers)->auth_tokens;
     }
 
-    auto metadata = GetRequestMetadata(attempt);
-
-    try {
-        params.headers["X-PsiCash-Metadata"] = metadata.dump(-1, ' ', true);
-    }
-    catch (json::exception& e) {
-        return MakeCriticalError(
-                utils::Stringer("metadata json dump failed: ", e.what(), "; id:", e.id));
-    }
+    params.headers["X-PsiCash-Metadata"] = (*headers)->Metadata(attempt);
 
     params.body = body;
     if (!body.empty()) {
@@ -683,33 +999,46 @@ Result<HTTPParams> PsiCash::BuildRequestParams(
 /// Returns our auth tokens in comma-delimited format. If types is `{}`, all tokens will
 /// be included; otherwise only tokens of the types specified will be included.
 std::string PsiCash::CommaDelimitTokens(const std::vector<std::string>& types) const {
-    vector<string> tokens;
-    for (const auto& at : user_data_->GetAuthTokens()) {
-        if (types.empty() || std::find(types.begin(), types.end(), at.first) != types.end()) {
-            tokens.push_back(at.second.id);
+    auto token_state = user_data_->GetAuthTokenState();
+    if (types.empty()) {
+        return token_state->all_ids;
+    }
+
+    string tokens;
+    bool first = true;
+    for (const auto& at : token_state->tokens) {
+        if (std::find(types.begin(), types.end(), at.first) != types.end()) {
+            if (!first) {
+                tokens += ',';
+            }
+            tokens += at.second.id;
+            first = false;
         }
     }
-    return utils::Join(tokens, ",");
+    return tokens;
 }
 
 // Get new tracker tokens from the server. This effectively gives us a new identity.
-Result<Status> PsiCash::NewTracker() {
-    MUST_BE_INITIALIZED;
+Task<Result<Status>> PsiCash::NewTracker() {
+    CO_MUST_BE_INITIALIZED;
 
-    auto result = MakeHTTPRequestWithRetry(
+    // (The query params are built outside of the co_await expression, as GCC 12 can't
+    // compile braced pairs of string literals inside one.)
+    vector<pair<string, string>> query_items = {{"instanceID", user_data_->GetInstanceID()}};
+    auto result = co_await MakeHTTPRequestWithRetry(
             kMethodPOST,
             "/tracker",
             false,
-            {{"instanceID", user_data_->GetInstanceID()}},
+            std::move(query_items),
             nullopt // body
     );
     if (!result) {
-        return WrapError(result.error(), "MakeHTTPRequestWithRetry failed");
+        co_return WrapError(result.error(), "MakeHTTPRequestWithRetry failed");
     }
 
     if (result->code == kHTTPStatusOK) {
         if (result->body.empty()) {
-            return MakeCriticalError(
+            co_return MakeCriticalError(
                     utils::Stringer("result has no body; code: ", result->code));
         }
 
@@ -720,13 +1049,13 @@ Result<Status> PsiCash::NewTracker() {
             auth_tokens = j.get<AuthTokens>();
         }
         catch (json::exception& e) {
-            return MakeCriticalError(
+            co_return MakeCriticalError(
                     utils::Stringer("json parse failed: ", e.what(), "; id:", e.id));
         }
 
         // Sanity check
         if (auth_tokens.size() < 3) {
-            return MakeCriticalError(
+            co_return MakeCriticalError(
                     utils::Stringer("bad number of tokens received: ", auth_tokens.size()));
         }
 
@@ -736,20 +1065,25 @@ Result<Status> PsiCash::NewTracker() {
         (void)user_data_->SetAuthTokens(auth_tokens, /*is_account=*/false, /*account_username=*/"");
         (void)user_data_->SetBalance(0);
         if (auto err = transaction.Commit()) {
-            return WrapError(err, "user data write failed");
+            co_return WrapError(err, "user data write failed");
         }
 
-        return Status::Success;
+        co_return Status::Success;
     } else if (IsServerError(result->code)) {
-        return Status::ServerError;
+        co_return Status::ServerError;
     }
 
-    return MakeCriticalError(utils::Stringer(
+    co_return MakeCriticalError(utils::Stringer(
             "request returned unexpected result code: ", result->code, "; ",
             result->body, "; ", json(result->headers).dump()));
 }
 
 Result<PsiCash::RefreshStateResponse> PsiCash::RefreshState(bool local_only, const std::vector<std::string>& purchase_classes) {
+    return RunSync(RefreshStateTask(local_only, purchase_classes));
+}
+
+Task<Result<PsiCash::RefreshStateResponse>> PsiCash::RefreshStateTask(
+        bool local_only, std::vector<std::string> purchase_classes) {
     if (local_only) {
         // Our "local only" refresh involves checking tokens for expiry and potentially
         // shifting into a logged-out state.
@@ -759,7 +1093,8 @@ Result<PsiCash::RefreshStateResponse> PsiCash::RefreshState(bool local_only, con
         bool reconnect_required = false;
 
         auto local_now = datetime::DateTime::Now();
-        for (const auto& it : user_data_->GetAuthTokens()) {
+        auto token_state = user_data_->GetAuthTokenState();
+        for (const auto& it : token_state->tokens) {
             if (it.second.server_time_expiry
                 && user_data_->ServerTimeToLocal(*it.second.server_time_expiry) < local_now) {
                     // If any tokens are expired, we consider ourselves to not have a proper set
@@ -771,23 +1106,23 @@ Result<PsiCash::RefreshStateResponse> PsiCash::RefreshState(bool local_only, con
                     reconnect_required = !GetAuthorizations(true).empty();
 
                     if (auto err = user_data_->DeleteUserData(IsAccount())) {
-                        return WrapError(err, "DeleteUserData failed");
+                        co_return WrapError(err, "DeleteUserData failed");
                     }
 
                     break;
             }
         }
 
-        return PsiCash::RefreshStateResponse{ Status::Success, reconnect_required };
+        co_return PsiCash::RefreshStateResponse{ Status::Success, reconnect_required };
     }
 
-    return RefreshState(purchase_classes, true);
+    co_return co_await RefreshState(std::move(purchase_classes), true);
 }
 
 // RefreshState helper that makes recursive calls (to allow for NewTracker and then
 // RefreshState requests).
-Result<PsiCash::RefreshStateResponse> PsiCash::RefreshState(
-    const std::vector<std::string>& purchase_classes, bool allow_recursion) {
+Task<Result<PsiCash::RefreshStateResponse>> PsiCash::RefreshState(
+    std::vector<std::string> purchase_classes, bool allow_recursion) {
     /*
      Logic flow overview:
 
@@ -801,38 +1136,37 @@ Result<PsiCash::RefreshStateResponse> PsiCash::RefreshState(
      6. If there are still no valid tokens, then things are horribly wrong. Return error.
     */
 
-    MUST_BE_INITIALIZED;
+    CO_MUST_BE_INITIALIZED;
 
-    auto auth_tokens = user_data_->GetAuthTokens();
-    if (auth_tokens.empty()) {
+    if (user_data_->GetAuthTokenState()->tokens.empty()) {
         // No tokens.
         if (IsAccount()) {
             // This is a logged-in or logged-out account. We can't just get a new tracker.
             // The app will have to force a login for the user to do anything.
-            return PsiCash::RefreshStateResponse{ Status::Success, false };
+            co_return PsiCash::RefreshStateResponse{ Status::Success, false };
         }
 
         if (!allow_recursion) {
             // We have already recursed and can't do it again. This is an error condition.
             // This is impossible-ish. It requires us to start out with no tokens, make a NewTracker
             // call that appears to succeed, but then _still_ have no tokens.
-            return MakeCriticalError("failed to obtain valid tracker tokens (a)");
+            co_return MakeCriticalError("failed to obtain valid tracker tokens (a)");
         }
 
         // Get new tracker tokens. (Which is effectively getting a new identity.)
-        auto new_tracker_result = NewTracker();
+        auto new_tracker_result = co_await NewTracker();
         if (!new_tracker_result) {
-            return WrapError(new_tracker_result.error(), "NewTracker failed");
+            co_return WrapError(new_tracker_result.error(), "NewTracker failed");
         }
 
         if (*new_tracker_result != Status::Success) {
-            return PsiCash::RefreshStateResponse{ *new_tracker_result, false };
+            co_return PsiCash::RefreshStateResponse{ *new_tracker_result, false };
         }
 
         // Note: NewTracker calls SetAuthTokens and SetBalance.
 
         // Recursive RefreshState call now that we have tokens.
-        return RefreshState(purchase_classes, false);
+        co_return co_await RefreshState(std::move(purchase_classes), false);
     }
 
     // We have tokens. Make the RefreshClientState request.
@@ -845,20 +1179,20 @@ Result<PsiCash::RefreshStateResponse> PsiCash::RefreshState(
     // If LastTransactionID is empty, we'll get all transactions.
     query_items.emplace_back("lastTransactionID", user_data_->GetLastTransactionID());
 
-    auto result = MakeHTTPRequestWithRetry(
+    auto result = co_await MakeHTTPRequestWithRetry(
             kMethodGET,
             "/refresh-state",
             true,
-            query_items,
+            std::move(query_items),
             nullopt // body
     );
     if (!result) {
-        return WrapError(result.error(), "MakeHTTPRequestWithRetry failed");
+        co_return WrapError(result.error(), "MakeHTTPRequestWithRetry failed");
     }
 
     if (result->code == kHTTPStatusOK) {
         if (result->body.empty()) {
-            return MakeCriticalError(
+            co_return MakeCriticalError(
                     utils::Stringer("result has no body; code: ", result->code));
         }
 
@@ -889,7 +1223,7 @@ Result<PsiCash::RefreshStateResponse> PsiCash::RefreshState(
                 auto prev_is_account = IsAccount();
                 auto is_account = j["IsAccount"].get<bool>();
                 if (prev_is_account && !is_account) {
-                    return MakeCriticalError("invalid is-account state");
+                    co_return MakeCriticalError("invalid is-account state");
                 }
 
                 (void)user_data_->SetIsAccount(is_account);
@@ -924,17 +1258,23 @@ Result<PsiCash::RefreshStateResponse> PsiCash::RefreshState(
             }
 
             if (j["Purchases"].is_array()) {
+                Purchases purchases;
+                purchases.reserve(j["Purchases"].size());
                 for (const auto& p : j["Purchases"]) {
                     auto purchase_res = PurchaseFromJSON(p);
                     if (!purchase_res) {
-                        return WrapError(purchase_res.error(), "failed to deserialize purchases");
+                        co_return WrapError(purchase_res.error(), "failed to deserialize purchases");
                     }
 
                     // Authorizations are applied to tunnel connections, which requires a reconnect
                     reconnect_required = reconnect_required || purchase_res->authorization;
 
-                    (void)user_data_->AddPurchase(*purchase_res);
+                    purchases.push_back(std::move(*purchase_res));
                 }
+
+                // Merged with the stored purchases all at once, as a full resync can
+                // bring a lot of them.
+                (void)user_data_->AddPurchases(std::move(purchases));
             }
 
             // If the account tokens just expired, then we need to go into a logged-out state.
@@ -948,22 +1288,22 @@ Result<PsiCash::RefreshStateResponse> PsiCash::RefreshState(
             }
 
             if (auto err = transaction.Commit()) {
-                return WrapError(err, "UserData write failed");
+                co_return WrapError(err, "UserData write failed");
             }
         }
         catch (json::exception& e) {
-            return MakeCriticalError(
+            co_return MakeCriticalError(
                     utils::Stringer("json parse failed: ", e.what(), "; id:", e.id));
         }
 
         if (IsAccount()) {
             // For accounts there's nothing else we can do, regardless of the state of token validity.
-            return PsiCash::RefreshStateResponse{ Status::Success, reconnect_required };
+            co_return PsiCash::RefreshStateResponse{ Status::Success, reconnect_required };
         }
 
         if (HasTokens()) {
             // We have a good tracker state.
-            return PsiCash::RefreshStateResponse{ Status::Success, reconnect_required };
+            co_return PsiCash::RefreshStateResponse{ Status::Success, reconnect_required };
         }
 
         // We started out with tracker tokens, but they're all invalid.
@@ -971,23 +1311,23 @@ Result<PsiCash::RefreshStateResponse> PsiCash::RefreshState(
         // expire -- but we'll still try to recover if we haven't already recursed.
 
         if (!allow_recursion) {
-            return MakeCriticalError("failed to obtain valid tracker tokens (b)");
+            co_return MakeCriticalError("failed to obtain valid tracker tokens (b)");
         }
 
-        return RefreshState(purchase_classes, true);
+        co_return co_await RefreshState(std::move(purchase_classes), true);
     }
     else if (result->code == kHTTPStatusUnauthorized) {
         // This can only happen if the tokens we sent didn't all belong to same user.
         // This really should never happen. We're not checking the return value, as there
         // isn't a sane response to a failure at this point.
         (void)user_data_->Clear();
-        return PsiCash::RefreshStateResponse{ Status::InvalidTokens, false };
+        co_return PsiCash::RefreshStateResponse{ Status::InvalidTokens, false };
     }
     else if (IsServerError(result->code)) {
-        return PsiCash::RefreshStateResponse{ Status::ServerError, false };
+        co_return PsiCash::RefreshStateResponse{ Status::ServerError, false };
     }
 
-    return MakeCriticalError(utils::Stringer(
+    co_return MakeCriticalError(utils::Stringer(
             "request returned unexpected result code: ", result->code, "; ",
             result->body, "; ", json(result->headers).dump()));
 }
@@ -996,22 +1336,28 @@ Result<PsiCash::NewExpiringPurchaseResponse> PsiCash::NewExpiringPurchase(
         const string& transaction_class,
         const string& distinguisher,
         const int64_t expected_price) {
-    TOKENS_REQUIRED;
+    return RunSync(NewExpiringPurchaseTask(transaction_class, distinguisher, expected_price));
+}
+
+Task<Result<PsiCash::NewExpiringPurchaseResponse>> PsiCash::NewExpiringPurchaseTask(
+        string transaction_class, string distinguisher, int64_t expected_price) {
+    CO_TOKENS_REQUIRED;
 
-    auto result = MakeHTTPRequestWithRetry(
+    vector<pair<string, string>> query_items = {
+            {"class",          transaction_class},
+            {"distinguisher",  distinguisher},
+            // Note the conversion from positive to negative: price to amount.
+            {"expectedAmount", to_string(-expected_price)}
+    };
+    auto result = co_await MakeHTTPRequestWithRetry(
             kMethodPOST,
             "/transaction",
             true,
-            {
-                    {"class",          transaction_class},
-                    {"distinguisher",  distinguisher},
-                    // Note the conversion from positive to negative: price to amount.
-                    {"expectedAmount", to_string(-expected_price)}
-            },
+            std::move(query_items),
             nullopt // body
     );
     if (!result) {
-        return WrapError(result.error(), "MakeHTTPRequestWithRetry failed");
+        co_return WrapError(result.error(), "MakeHTTPRequestWithRetry failed");
     }
 
     optional<Purchase> purchase;
@@ -1022,7 +1368,7 @@ Result<PsiCash::NewExpiringPurchaseResponse> PsiCash::NewExpiringPurchase(
         result->code == kHTTPStatusPaymentRequired ||
         result->code == kHTTPStatusConflict) {
         if (result->body.empty()) {
-            return MakeCriticalError(
+            co_return MakeCriticalError(
                     utils::Stringer("result has no body; code: ", result->code));
         }
 
@@ -1031,7 +1377,7 @@ Result<PsiCash::NewExpiringPurchaseResponse> PsiCash::NewExpiringPurchase(
 
             // Set our new data in a single write.
             // Note that any early return will cause updates to roll back.
-            UserData::Transaction transaction(*user_data_);
+            UserData::Transaction transaction(*user_data_, UserData::Shards::kUser);
 
             // Balance is present for all non-error responses
             if (j.at("Balance").is_number_integer()) {
@@ -1042,30 +1388,35 @@ Result<PsiCash::NewExpiringPurchaseResponse> PsiCash::NewExpiringPurchase(
             if (result->code == kHTTPStatusOK) {
                 auto parse_res = PurchaseFromJSON(j, "expiring-purchase");
                 if (!parse_res) {
-                    return WrapError(parse_res.error(), "failed to parse purchase from response JSON");
+                    co_return WrapError(parse_res.error(), "failed to parse purchase from response JSON");
                 }
 
                 purchase = *parse_res;
 
                 if (!purchase->server_time_expiry) {
                     // Purchase expiry is optional, but we're specifically making a New**Expiring**Purchase
-                    return MakeCriticalError("response did not provide valid expiry");
+                    co_return MakeCriticalError("response did not provide valid expiry");
                 }
 
                 // Not checking authorization, as it doesn't apply to all expiring purchases
 
                 if (auto err = user_data_->AddPurchase(*purchase)) {
-                    return WrapError(err, "AddPurchase failed");
+                    co_return WrapError(err, "AddPurchase failed");
                 }
 
             }
 
             if (auto err = transaction.Commit()) {
-                return WrapError(err, "UserData write failed");
+                co_return WrapError(err, "UserData write failed");
+            }
+
+            // The purchase has been paid for, so it must not be lost.
+            if (auto err = user_data_->Flush()) {
+                co_return WrapError(err, "UserData flush failed");
             }
         }
         catch (json::exception& e) {
-            return MakeCriticalError(
+            co_return MakeCriticalError(
                     utils::Stringer("json parse failed: ", e.what(), "; id:", e.id));
         }
     }
@@ -1103,20 +1454,24 @@ Result<PsiCash::NewExpiringPurchaseResponse> PsiCash::NewExpiringPurchase(
         };
     }
     else {
-        return MakeCriticalError(utils::Stringer(
+        co_return MakeCriticalError(utils::Stringer(
                 "request returned unexpected result code: ", result->code, "; ",
                 result->body, "; ", json(result->headers).dump()));
     }
 
     assert(response);
-    return *response;
+    co_return *response;
 }
 
 Result<PsiCash::AccountLogoutResponse> PsiCash::AccountLogout() {
-    TOKENS_REQUIRED;
+    return RunSync(AccountLogoutTask());
+}
+
+Task<Result<PsiCash::AccountLogoutResponse>> PsiCash::AccountLogoutTask() {
+    CO_TOKENS_REQUIRED;
 
     if (!IsAccount()) {
-        return MakeNoncriticalError("user is not account");
+        co_return MakeNoncriticalError("user is not account");
     }
 
     // Authorizations are applied to psiphond connections, so the presence of an active
@@ -1124,7 +1479,7 @@ Result<PsiCash::AccountLogoutResponse> PsiCash::AccountLogout() {
     bool reconnect_required = !GetAuthorizations(true).empty();
 
     Error httpErr;
-    auto result = MakeHTTPRequestWithRetry(
+    auto result = co_await MakeHTTPRequestWithRetry(
             kMethodPOST,
             "/logout",
             true,  // include auth tokens
@@ -1143,24 +1498,29 @@ Result<PsiCash::AccountLogoutResponse> PsiCash::AccountLogout() {
 
     // The localErr is a more significant failure, so check it first.
     if (localErr) {
-        return WrapError(localErr, "local AccountLogout failed");
+        co_return WrapError(localErr, "local AccountLogout failed");
     }
     /*
     // We are not returning an error if the remote request failed. We have already
     // affected the local logout, and we'll have to rely on the next login from this
     // device to invalidate the tokens on the server.
     else if (httpErr) {
-        return WrapError(httpErr, "MakeHTTPRequestWithRetry failed");
+        co_return WrapError(httpErr, "MakeHTTPRequestWithRetry failed");
     }
     */
 
-    return PsiCash::AccountLogoutResponse{ reconnect_required };
+    co_return PsiCash::AccountLogoutResponse{ reconnect_required };
 }
 
 error::Result<PsiCash::AccountLoginResponse> PsiCash::AccountLogin(
         const std::string& utf8_username,
         const std::string& utf8_password) {
-    MUST_BE_INITIALIZED;
+    return RunSync(AccountLoginTask(utf8_username, utf8_password));
+}
+
+Task<Result<PsiCash::AccountLoginResponse>> PsiCash::AccountLoginTask(
+        std::string utf8_username, std::string utf8_password) {
+    CO_MUST_BE_INITIALIZED;
 
     static const vector<string> token_types = {kEarnerTokenType, kSpenderTokenType, kIndicatorTokenType, kLogoutTokenType};
     static const string token_types_str = utils::Join(token_types, ",");
@@ -1180,7 +1540,7 @@ error::Result<PsiCash::AccountLoginResponse> PsiCash::AccountLogin(
             {"oldTokens", old_tokens}
         };
 
-    auto result = MakeHTTPRequestWithRetry(
+    auto result = co_await MakeHTTPRequestWithRetry(
             kMethodPOST,
             "/login",
             false,  // tokens for tracker merge are provided via the request body
@@ -1188,7 +1548,7 @@ error::Result<PsiCash::AccountLoginResponse> PsiCash::AccountLogin(
             body
     );
     if (!result) {
-        return WrapError(result.error(), "MakeHTTPRequestWithRetry failed");
+        co_return WrapError(result.error(), "MakeHTTPRequestWithRetry failed");
     }
 
     if (result->code == kHTTPStatusOK) {
@@ -1196,11 +1556,11 @@ error::Result<PsiCash::AccountLoginResponse> PsiCash::AccountLogin(
         // been merged now (or can't be); if it was an account, we should interpret the
         // login as a desire to no longer be logged in with the previous account.
         if (auto err = ResetUser()) {
-            return PassError(err);
+            co_return PassError(err);
         }
 
         if (result->body.empty()) {
-            return MakeCriticalError(
+            co_return MakeCriticalError(
                     utils::Stringer("result has no body; code: ", result->code));
         }
 
@@ -1217,13 +1577,13 @@ error::Result<PsiCash::AccountLoginResponse> PsiCash::AccountLogin(
             }
         }
         catch (json::exception& e) {
-            return MakeCriticalError(
+            co_return MakeCriticalError(
                     utils::Stringer("json parse failed: ", e.what(), "; id:", e.id));
         }
 
         // Sanity check
         if (auth_tokens.size() < token_types.size()) {
-            return MakeCriticalError(
+            co_return MakeCriticalError(
                     utils::Stringer("bad number of tokens received: ", auth_tokens.size()));
         }
 
@@ -1232,35 +1592,111 @@ error::Result<PsiCash::AccountLoginResponse> PsiCash::AccountLogin(
         (void)user_data_->SetIsLoggedOutAccount(false);
         (void)user_data_->SetAuthTokens(auth_tokens, /*is_account=*/true, /*utf8_username=*/utf8_username);
         if (auto err = transaction.Commit()) {
-            return WrapError(err, "user data write failed");
+            co_return WrapError(err, "user data write failed");
         }
 
-        return PsiCash::AccountLoginResponse{
+        co_return PsiCash::AccountLoginResponse{
             Status::Success,
             last_tracker_merge
         };
     }
     else if (result->code == kHTTPStatusUnauthorized) {
-        return PsiCash::AccountLoginResponse{
+        co_return PsiCash::AccountLoginResponse{
                 Status::InvalidCredentials
         };
     }
     else if (result->code == kHTTPStatusBadRequest) {
-        return PsiCash::AccountLoginResponse{
+        co_return PsiCash::AccountLoginResponse{
                 Status::BadRequest
         };
     }
     else if (IsServerError(result->code)) {
-        return PsiCash::AccountLoginResponse{
+        co_return PsiCash::AccountLoginResponse{
                 Status::ServerError
         };
     }
 
-    return MakeCriticalError(utils::Stringer(
+    co_return MakeCriticalError(utils::Stringer(
             "request returned unexpected result code: ", result->code, "; ",
             result->body, "; ", json(result->headers).dump()));
 }
 
+//
+// Asynchronous API
+//
+
+void PsiCash::SetAsyncThreads(size_t threads) {
+    executor_->SetMaxThreads(threads);
+}
+
+// Starts the coroutine from `op` on the executor, calling `callback` (if set) with its
+// result and then making the result available through the returned future. The
+// operation continues on the executor after each wait.
+template<typename T>
+future<Result<T>> PsiCash::RunAsync(std::function<Task<Result<T>>()> op, AsyncCallback<T> callback) {
+    auto promise = std::make_shared<std::promise<Result<T>>>();
+    auto result_future = promise->get_future();
+    {
+        std::lock_guard<std::mutex> lock(async_ops_mutex_);
+        async_ops_++;
+    }
+    auto done = [this, callback = std::move(callback), promise](
+            std::optional<Result<T>> result, std::exception_ptr exception) {
+        try {
+            if (exception) {
+                // E.g., the requester isn't set
+                std::rethrow_exception(exception);
+            }
+            if (callback) {
+                callback(*result);
+            }
+            promise->set_value(std::move(*result));
+        }
+        catch (...) {
+            promise->set_exception(std::current_exception());
+        }
+        std::lock_guard<std::mutex> lock(async_ops_mutex_);
+        if (--async_ops_ == 0) {
+            async_ops_cv_.notify_all();
+        }
+    };
+    executor_->Post([this, op = std::move(op), done = std::move(done)] {
+        Start<Result<T>>(op(), async_dispatcher_, done);
+    });
+    return result_future;
+}
+
+future<Result<PsiCash::RefreshStateResponse>> PsiCash::RefreshStateAsync(
+        bool local_only, const std::vector<std::string>& purchase_classes,
+        AsyncCallback<RefreshStateResponse> callback/*=nullptr*/) {
+    return RunAsync<RefreshStateResponse>(
+            [this, local_only, purchase_classes] { return RefreshStateTask(local_only, purchase_classes); },
+            std::move(callback));
+}
+
+future<Result<PsiCash::NewExpiringPurchaseResponse>> PsiCash::NewExpiringPurchaseAsync(
+        const std::string& transaction_class, const std::string& distinguisher,
+        const int64_t expected_price, AsyncCallback<NewExpiringPurchaseResponse> callback/*=nullptr*/) {
+    return RunAsync<NewExpiringPurchaseResponse>(
+            [this, transaction_class, distinguisher, expected_price] {
+                return NewExpiringPurchaseTask(transaction_class, distinguisher, expected_price);
+            },
+            std::move(callback));
+}
+
+future<Result<PsiCash::AccountLogoutResponse>> PsiCash::AccountLogoutAsync(
+        AsyncCallback<AccountLogoutResponse> callback/*=nullptr*/) {
+    return RunAsync<AccountLogoutResponse>([this] { return AccountLogoutTask(); }, std::move(callback));
+}
+
+future<Result<PsiCash::AccountLoginResponse>> PsiCash::AccountLoginAsync(
+        const std::string& utf8_username, const std::string& utf8_password,
+        AsyncCallback<AccountLoginResponse> callback/*=nullptr*/) {
+    return RunAsync<AccountLoginResponse>(
+            [this, utf8_username, utf8_password] { return AccountLoginTask(utf8_username, utf8_password); },
+            std::move(callback));
+}
+
 // Enable JSON de/serializing of PurchasePrice.
 // See https://github.com/nlohmann/json#basic-usage
 bool operator==(const PurchasePrice& lhs, const PurchasePrice& rhs) {
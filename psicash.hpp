@@ -21,20 +21,29 @@
 #define PSICASHLIB_PSICASH_H
 
 #include <string>
+#include <chrono>
 #include <functional>
+#include <future>
 #include <vector>
 #include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <set>
 #include "vendor/nonstd/optional.hpp"
 #include "vendor/nlohmann/json.hpp"
 #include "datetime.hpp"
 #include "error.hpp"
 #include "url.hpp"
+#include "datastore.hpp"
 
 
 namespace psicash {
 
 // Forward declarations
 class UserData;
+class Scheduler;
+class Executor;
+template<typename T> class Task;
 
 
 //
@@ -65,6 +74,10 @@ struct HTTPParams {
 
     // body must be omitted if empty
     std::string body;
+
+    // If non-zero, the request should be abandoned (with RECOVERABLE_ERROR) after this
+    // many milliseconds, as the call's deadline will have passed (see RetryPolicy).
+    int64_t timeout_ms = 0;
 };
 // The result from MakeHTTPRequestFn:
 struct HTTPResult {
@@ -93,6 +106,41 @@ struct HTTPResult {
 // In the case of a partial response, a `RECOVERABLE_ERROR` should be returned.
 using MakeHTTPRequestFn = std::function<HTTPResult(const HTTPParams&)>;
 
+// The signature for the asynchronous alternative to MakeHTTPRequestFn (see
+// SetHTTPRequestAsyncFn). The requester must start the request and return without waiting
+// for it. When the request is done, it must call `done` exactly once, from any thread,
+// with the result that a MakeHTTPRequestFn would have returned. (It may be called before
+// the requester returns.) The params are only valid until the requester returns.
+// If `done` is never called, the call making the request doesn't finish until Cancel is
+// called (as it is on destruction). Calls to `done` after the first, or after the request
+// was cancelled, are ignored.
+using HTTPRequestDoneFn = std::function<void(HTTPResult)>;
+using MakeHTTPRequestAsyncFn = std::function<void(const HTTPParams&, HTTPRequestDoneFn done)>;
+
+// How requests to the API server are retried when they fail in ways that might not
+// happen again: with RECOVERABLE_ERROR, or with one of the retryable status codes.
+struct RetryPolicy {
+    // The most attempts to make, including the first.
+    int max_attempts = 3;
+
+    // The wait before the first retry. Each retry after that waits twice as long as the
+    // one before, up to max_delay.
+    std::chrono::milliseconds base_delay = std::chrono::seconds(1);
+    std::chrono::milliseconds max_delay = std::chrono::seconds(8);
+
+    // The fraction of each wait that is random, so that clients that failed together
+    // don't retry together. With 0.25, a 2s wait is between 1.5s and 2s.
+    double jitter = 0.25;
+
+    // The limit on the whole call, including retries, or zero for none. No attempt is
+    // started that would have to wait until after it, and the requester is told how much
+    // time is left via HTTPParams::timeout_ms.
+    std::chrono::milliseconds deadline = std::chrono::milliseconds(0);
+
+    // Inclusive ranges of the HTTP status codes to retry.
+    std::vector<std::pair<int, int>> retryable_codes = {{500, 599}};
+};
+
 struct PurchasePrice {
     std::string transaction_class;
     std::string distinguisher;
@@ -155,6 +203,20 @@ enum class Status {
     ServerError
 };
 
+// The parts of the stored state that can be watched for changes.
+enum class StateField {
+    Balance,
+    Purchases,
+    PurchasePrices,
+    Tokens,          // Affects HasTokens()
+    IsAccount,
+    AccountUsername
+};
+
+using StateSubscriptionID = uint64_t;
+/// Receives the subscribed fields that have changed.
+using StateChangeCallback = std::function<void(const std::vector<StateField>& changed)>;
+
 class PsiCash {
 public:
     PsiCash();
@@ -172,14 +234,31 @@ public:
     /// If `force_reset` is true, the datastore will be completely wiped out and reset.
     /// If `test` is true, then the test server will be used, and other testing interfaces
     /// will be available. Should only be used for testing.
+    /// `datastore_options` controls how the datastore persists changes; the default
+    /// rewrites the datastore files on every change. With `journal` set, each change
+    /// instead appends a small record to a journal file, which is cheaper on slow storage.
+    /// With `async_writes` set, changes are written to disk in the background, at most
+    /// once per `write_interval`; call Flush() when they must be on disk (such as when the
+    /// app is about to be suspended). Purchases are always flushed before they're returned.
+    /// `durability` says how hard writes try to survive an OS crash or power loss: kNone
+    /// leaves them to the OS, kSyncOnCommit syncs each one (which can be slow on some
+    /// devices), and kGroupCommit syncs in the background at most once per `write_interval`,
+    /// never overwriting the last synced data in the meantime. Which is best depends on
+    /// the platform's storage, so it's left to the embedder.
     /// When uninitialized, data accessors will return zero values, and operations (e.g.,
     /// RefreshState and NewExpiringPurchase) will return errors.
     error::Error Init(const std::string& user_agent, const std::string& file_store_root,
-                      MakeHTTPRequestFn make_http_request_fn, bool force_reset, bool test);
+                      MakeHTTPRequestFn make_http_request_fn, bool force_reset, bool test,
+                      const DatastoreOptions& datastore_options=DatastoreOptions());
 
     /// Returns true if the library has been successfully initialized (i.e., Init called).
     bool Initialized() const;
 
+    /// Writes any changes that haven't been written to disk yet, and syncs them. Only
+    /// needed when Init was given DatastoreOptions with async_writes or kGroupCommit
+    /// durability.
+    error::Error Flush();
+
     /// Resets PsiCash data for the current user (Tracker or Account). This will typically
     /// be called when wanting to revert to a Tracker from a previously logged in Account.
     error::Error ResetUser();
@@ -192,6 +271,24 @@ public:
     /// Can be used for updating the HTTP requester function pointer.
     void SetHTTPRequestFn(MakeHTTPRequestFn make_http_request_fn);
 
+    /// Sets an asynchronous HTTP requester, which is used instead of the MakeHTTPRequestFn
+    /// while it's set (null unsets it). With it, the asynchronous operations (see
+    /// RefreshStateAsync, etc.) don't hold a thread while their requests are in flight, or
+    /// while they wait to retry. Destruction cancels the requests still in flight, and
+    /// waits for the operations to finish.
+    void SetHTTPRequestAsyncFn(MakeHTTPRequestAsyncFn make_http_request_async_fn);
+
+    /// Sets how requests to the API server endpoint `path` (e.g., "/refresh-state") are
+    /// retried. If `path` is empty, sets the policy for endpoints without their own.
+    /// May be called before Init().
+    void SetRetryPolicy(const RetryPolicy& policy, const std::string& path="");
+
+    /// Aborts the retries that ongoing requests are waiting to make, and the requests in
+    /// flight with a MakeHTTPRequestAsyncFn. Those calls return an error immediately, or,
+    /// if an attempt is in progress with a MakeHTTPRequestFn, as soon as the requester
+    /// returns. Calls made afterwards aren't affected.
+    void Cancel();
+
     /// Set values that will be included in the request metadata. This includes
     /// client_version, client_region, sponsor_id, and propagation_channel_id.
     error::Error SetRequestMetadataItems(const std::map<std::string, std::string>& items);
@@ -294,6 +391,25 @@ public:
     /// feedback diagnostic data package.
     nlohmann::json GetDiagnosticInfo(bool lite) const;
 
+    //
+    // Change notification
+    //
+
+    /// Returns a number that increases each time the stored value of `field` changes.
+    /// Comparing it with a previously returned number is a much cheaper way to tell
+    /// whether the field needs to be read again than reading it.
+    /// Note that time passing (such as purchases expiring) isn't a change.
+    uint64_t ChangeGeneration(StateField field) const;
+
+    /// Calls `callback` after changes to any of `fields` are committed. Calls are made
+    /// from a separate thread, and changes made while the callback is running are
+    /// combined into the next call. Returns the ID to pass to Unsubscribe.
+    StateSubscriptionID Subscribe(std::vector<StateField> fields, StateChangeCallback callback);
+
+    /// Removes a subscription. After this returns, its callback won't be called again
+    /// (this waits for a callback in progress to finish).
+    void Unsubscribe(StateSubscriptionID id);
+
     //
     // API Server Requests
     //
@@ -480,6 +596,46 @@ public:
             const std::string& utf8_username,
             const std::string& utf8_password);
 
+    //
+    // Asynchronous API
+    //
+
+    /// Sets the number of threads that run the asynchronous methods' operations. With a
+    /// MakeHTTPRequestFn, that's how many of them can be in progress at once, as each holds
+    /// a thread while its requests block; with a MakeHTTPRequestAsyncFn, operations only
+    /// use a thread between requests. The default is 2. Threads are only started when
+    /// operations need them. May be called before Init().
+    void SetAsyncThreads(size_t threads);
+
+    /// Called with the result of an asynchronous operation, on the thread that ran it.
+    template<typename T>
+    using AsyncCallback = std::function<void(const error::Result<T>&)>;
+
+    /// Asynchronous versions of the methods of the same names. Each queues the operation
+    /// to run on an internal thread (see SetAsyncThreads) and returns a future for its
+    /// result. If `callback` is given, it's called with the result before the future is
+    /// made ready. Cancel() applies to these operations as to the synchronous ones.
+    /// Destroying the PsiCash instance waits for the operations to finish (with retries
+    /// cancelled).
+    std::future<error::Result<RefreshStateResponse>> RefreshStateAsync(
+            bool local_only,
+            const std::vector<std::string>& purchase_classes,
+            AsyncCallback<RefreshStateResponse> callback=nullptr);
+
+    std::future<error::Result<NewExpiringPurchaseResponse>> NewExpiringPurchaseAsync(
+            const std::string& transaction_class,
+            const std::string& distinguisher,
+            const int64_t expected_price,
+            AsyncCallback<NewExpiringPurchaseResponse> callback=nullptr);
+
+    std::future<error::Result<AccountLogoutResponse>> AccountLogoutAsync(
+            AsyncCallback<AccountLogoutResponse> callback=nullptr);
+
+    std::future<error::Result<AccountLoginResponse>> AccountLoginAsync(
+            const std::string& utf8_username,
+            const std::string& utf8_password,
+            AsyncCallback<AccountLoginResponse> callback=nullptr);
+
 protected:
     // See implementation for descriptions of non-public methods.
 
@@ -489,10 +645,13 @@ protected:
     error::Result<std::string> AddEarnerTokenToURL(const std::string& url_string, bool query_param_only) const;
 
     nlohmann::json GetRequestMetadata(int attempt) const;
-    error::Result<HTTPResult> MakeHTTPRequestWithRetry(
-            const std::string& method, const std::string& path, bool include_auth_tokens,
-            const std::vector<std::pair<std::string, std::string>>& query_params,
-            const nonstd::optional<nlohmann::json>& body);
+    // The network operations are coroutines, so that an operation waiting for a response
+    // (with a MakeHTTPRequestAsyncFn) or to retry doesn't hold a thread. Their parameters
+    // are taken by value, as they're used after the caller's have gone.
+    Task<error::Result<HTTPResult>> MakeHTTPRequestWithRetry(
+            std::string method, std::string path, bool include_auth_tokens,
+            std::vector<std::pair<std::string, std::string>> query_params,
+            nonstd::optional<nlohmann::json> body);
 
     virtual error::Result<HTTPParams> BuildRequestParams(
             const std::string& method, const std::string& path, bool include_auth_tokens,
@@ -500,10 +659,33 @@ protected:
             const std::map<std::string, std::string>& additional_headers,
             const std::string& body) const;
 
-    error::Result<Status> NewTracker();
+    struct RequestHeaders;
+    error::Result<std::shared_ptr<const RequestHeaders>> GetRequestHeaders() const;
 
-    error::Result<RefreshStateResponse> RefreshState(
-      const std::vector<std::string>& purchase_classes, bool allow_recursion);
+    template<typename T>
+    std::future<error::Result<T>> RunAsync(std::function<Task<error::Result<T>>()> op,
+                                           AsyncCallback<T> callback);
+
+    struct PendingRequest;
+    class RequestAwaiter;
+    RequestAwaiter MakeHTTPRequest(const HTTPParams& params, uint64_t cancel_generation);
+
+    RetryPolicy GetRetryPolicy(const std::string& path) const;
+    class RetryAwaiter;
+    RetryAwaiter WaitToRetry(std::chrono::steady_clock::time_point when, uint64_t cancel_generation);
+
+    Task<error::Result<Status>> NewTracker();
+
+    Task<error::Result<RefreshStateResponse>> RefreshStateTask(
+      bool local_only, std::vector<std::string> purchase_classes);
+    Task<error::Result<RefreshStateResponse>> RefreshState(
+      std::vector<std::string> purchase_classes, bool allow_recursion);
+
+    Task<error::Result<NewExpiringPurchaseResponse>> NewExpiringPurchaseTask(
+            std::string transaction_class, std::string distinguisher, int64_t expected_price);
+    Task<error::Result<AccountLogoutResponse>> AccountLogoutTask();
+    Task<error::Result<AccountLoginResponse>> AccountLoginTask(
+            std::string utf8_username, std::string utf8_password);
 
     // If expected_type is empty, no check will be done.
     error::Result<psicash::Purchase> PurchaseFromJSON(const nlohmann::json& j, const std::string& expected_type="") const;
@@ -520,6 +702,38 @@ protected:
     // This is a pointer rather than an instance to avoid including userdata.h
     std::unique_ptr<UserData> user_data_;
     MakeHTTPRequestFn make_http_request_fn_;
+    MakeHTTPRequestAsyncFn make_http_request_async_fn_;
+
+    // Guards request_headers_, which is the cache used by GetRequestHeaders.
+    mutable std::mutex request_headers_mutex_;
+    mutable std::shared_ptr<const RequestHeaders> request_headers_;
+
+    // Retries wait on the scheduler, so that Cancel can cut them short. (A pointer, like
+    // user_data_, to avoid including scheduler.hpp.)
+    std::unique_ptr<Scheduler> scheduler_;
+    // Guards the members below.
+    mutable std::mutex retry_mutex_;
+    RetryPolicy default_retry_policy_;
+    std::map<std::string, RetryPolicy> retry_policies_;
+    // Incremented by Cancel. Calls are cancelled if it changes while they're ongoing.
+    uint64_t cancel_generation_;
+    // The scheduler tasks that calls are waiting on to retry.
+    std::set<uint64_t> pending_retries_;
+    // The requests that calls are waiting on, which Cancel finishes.
+    std::set<std::shared_ptr<PendingRequest>> pending_requests_;
+    // Set when destruction begins, so that no more retries are waited for.
+    bool destroying_;
+
+    // Runs the asynchronous operations.
+    std::unique_ptr<Executor> executor_;
+    // Continues the asynchronous operations on executor_ after they wait.
+    std::function<void(std::function<void()>)> async_dispatcher_;
+    // The number of asynchronous operations that haven't finished, which destruction
+    // waits for, as they might be waiting on the requester rather than queued on
+    // executor_. Guarded by async_ops_mutex_.
+    std::mutex async_ops_mutex_;
+    std::condition_variable async_ops_cv_;
+    size_t async_ops_;
 };
 
 } // namespace psicash
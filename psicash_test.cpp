@@ -135,6 +135,113 @@ TEST_F(TestPsiCash, InitSimple) {
     }
 }
 
+TEST_F(TestPsiCash, InitDatastoreOptions) {
+    auto journal_file = [this](const string& dir, const string& shard_suffix) {
+        return DatastoreFilepath(dir, GetSuffix(DEV_ENV) + shard_suffix) + ".journal";
+    };
+    auto make_changes = [](PsiCashTester& pc) {
+        // One change in each of the instance and user datastores
+        ASSERT_FALSE(pc.SetLocale("fr"));
+        ASSERT_FALSE(pc.SetRequestMetadataItems({{"k", "v"}}));
+    };
+
+    {
+        // By default, changes rewrite the datastore files
+        auto temp_dir = GetTempDir();
+        PsiCashTester pc;
+        auto err = pc.Init(TestPsiCash::UserAgent(), temp_dir.c_str(), nullptr, false);
+        ASSERT_FALSE(err);
+        make_changes(pc);
+        ASSERT_FALSE(utils::FileExists(journal_file(temp_dir, "")));
+        ASSERT_FALSE(utils::FileExists(journal_file(temp_dir, ".user")));
+    }
+    {
+        // The options apply to both datastores
+        auto temp_dir = GetTempDir();
+        DatastoreOptions options;
+        options.journal = true;
+        PsiCashTester pc;
+        auto err = pc.Init(TestPsiCash::UserAgent(), temp_dir.c_str(), nullptr, false, DEV_ENV, options);
+        ASSERT_FALSE(err);
+        make_changes(pc);
+        ASSERT_TRUE(utils::FileExists(journal_file(temp_dir, "")));
+        ASSERT_TRUE(utils::FileExists(journal_file(temp_dir, ".user")));
+    }
+}
+
+TEST_F(TestPsiCash, InitAsyncWrites) {
+    auto temp_dir = GetTempDir();
+    auto stored_locale = [&]() -> string {
+        Datastore reader;
+        if (reader.Init(temp_dir, GetSuffix(DEV_ENV))) {
+            return "<error>";
+        }
+        auto v = reader.Get<string>("/instance/locale"_json_pointer);
+        return v ? *v : "";
+    };
+
+    DatastoreOptions options;
+    options.async_writes = true;
+    options.write_interval = chrono::hours(1);
+    {
+        PsiCashTester pc;
+        auto err = pc.Init(TestPsiCash::UserAgent(), temp_dir.c_str(), nullptr, false, DEV_ENV, options);
+        ASSERT_FALSE(err);
+
+        // Changes are in memory right away, and on disk once flushed
+        err = pc.SetLocale("fr");
+        ASSERT_FALSE(err);
+        ASSERT_EQ(pc.user_data().GetLocale(), "fr");
+        ASSERT_NE(stored_locale(), "fr");
+        err = pc.Flush();
+        ASSERT_FALSE(err);
+        ASSERT_EQ(stored_locale(), "fr");
+
+        // And they're written on destruction
+        err = pc.SetLocale("de");
+        ASSERT_FALSE(err);
+        ASSERT_EQ(stored_locale(), "fr");
+    }
+    ASSERT_EQ(stored_locale(), "de");
+
+    PsiCashTester uninitialized;
+    ASSERT_TRUE(uninitialized.Flush());
+}
+
+TEST_F(TestPsiCash, InitDurability) {
+    auto temp_dir = GetTempDir();
+    auto read_slots = [&](const string& shard_suffix) {
+        auto file = DatastoreFilepath(temp_dir, GetSuffix(DEV_ENV) + shard_suffix);
+        return vector<string>{*ReadFile(file), *ReadFile(BackupDatastoreFile(file))};
+    };
+
+    DatastoreOptions options;
+    options.durability = DatastoreDurability::kGroupCommit;
+    // Long enough that only explicit flushes will sync
+    options.write_interval = chrono::hours(1);
+    PsiCashTester pc;
+    auto err = pc.Init(TestPsiCash::UserAgent(), temp_dir.c_str(), nullptr, false, DEV_ENV, options);
+    ASSERT_FALSE(err);
+
+    // With group commits, saves between syncs leave the synced slot alone (where
+    // otherwise they would alternate between slots). That goes for both datastores.
+    ASSERT_FALSE(pc.SetLocale("a"));
+    ASSERT_FALSE(pc.SetRequestMetadataItems({{"k", "a"}}));
+    ASSERT_FALSE(pc.Flush());
+    auto instance_synced = read_slots("");
+    auto user_synced = read_slots(".user");
+    for (auto v : {"b", "c", "d"}) {
+        ASSERT_FALSE(pc.SetLocale(v));
+        ASSERT_FALSE(pc.SetRequestMetadataItems({{"k", v}}));
+    }
+    auto instance_now = read_slots("");
+    auto user_now = read_slots(".user");
+    ASSERT_NE(instance_now, instance_synced);
+    ASSERT_NE(user_now, user_synced);
+    ASSERT_TRUE(instance_now[0] == instance_synced[0] || instance_now[1] == instance_synced[1]);
+    ASSERT_TRUE(user_now[0] == user_synced[0] || user_now[1] == user_synced[1]);
+}
+
 TEST_F(TestPsiCash, InitReset) {
     auto temp_dir = GetTempDir();
     string expected_instance_id;
@@ -1283,6 +1390,71 @@ TEST_F(TestPsiCash, CommaDelimitTokens) {
     ASSERT_THAT(res, IsEmpty());
 }
 
+TEST_F(TestPsiCash, BuildRequestParamsHeaders) {
+    PsiCashTester pc;
+    auto err = pc.Init(TestPsiCash::UserAgent(), GetTempDir().c_str(), nullptr, false);
+    ASSERT_FALSE(err) << err;
+
+    // Checks the headers against what's stored, and that the metadata is serialized as
+    // dumping it whole would.
+    auto check_headers = [&](int attempt) {
+        auto params = pc.BuildRequestParams("GET", "/path", true, {}, attempt, {}, "");
+        ASSERT_TRUE(params) << params.error();
+        ASSERT_EQ(params->headers["User-Agent"], TestPsiCash::UserAgent());
+        ASSERT_EQ(params->headers["Cookie"], pc.user_data().GetCookies());
+        ASSERT_EQ(params->headers["X-PsiCash-Auth"], pc.CommaDelimitTokens({}));
+
+        auto want_metadata = pc.user_data().GetRequestMetadata();
+        want_metadata["v"] = 1;
+        want_metadata["user_agent"] = TestPsiCash::UserAgent();
+        if (attempt > 0) {
+            want_metadata["attempt"] = attempt;
+        }
+        ASSERT_EQ(params->headers["X-PsiCash-Metadata"], want_metadata.dump(-1, ' ', true));
+    };
+
+    check_headers(0);
+    check_headers(1);
+
+    // Items that sort before and after "attempt"
+    err = pc.SetRequestMetadataItems({{"aa", "v1"}, {"zz", "v2"}});
+    ASSERT_FALSE(err);
+    check_headers(1);
+    check_headers(2);
+    check_headers(0);
+
+    // A stored "attempt" item is overridden, unless there's no attempt number
+    err = pc.SetRequestMetadataItems({{"attempt", "stored"}});
+    ASSERT_FALSE(err);
+    check_headers(0);
+    check_headers(3);
+
+    err = pc.user_data().SetCookies("k=v");
+    ASSERT_FALSE(err);
+    check_headers(1);
+
+    err = pc.user_data().SetAuthTokens({{kEarnerTokenType, {"e"}}, {kSpenderTokenType, {"s"}}}, false, "");
+    ASSERT_FALSE(err);
+    check_headers(1);
+
+    // Uncommitted changes are seen, and rolling them back is too
+    {
+        UserData::Transaction transaction(pc.user_data());
+        err = pc.SetRequestMetadataItems({{"b", "uncommitted"}});
+        ASSERT_FALSE(err);
+        check_headers(1);
+        err = transaction.Rollback();
+        ASSERT_FALSE(err);
+    }
+    check_headers(1);
+
+    // The metadata is stashed when the user data is deleted
+    err = pc.ResetUser();
+    ASSERT_FALSE(err);
+    check_headers(1);
+    ASSERT_EQ(pc.user_data().GetRequestMetadata()["zz"], "v2");
+}
+
 TEST_F(TestPsiCash, RefreshState) {
     PsiCashTester pc;
     auto err = pc.Init(TestPsiCash::UserAgent(), GetTempDir().c_str(), HTTPRequester, false);
@@ -2391,6 +2563,456 @@ TEST_F(TestPsiCash, HTTPRequestBadResult) {
     ASSERT_NE(refresh_result.error().ToString().find(want_error_message), string::npos) << refresh_result.error().ToString();
 }
 
+TEST_F(TestPsiCash, RetryPolicy) {
+    PsiCashTester pc;
+    auto err = pc.Init(TestPsiCash::UserAgent(), GetTempDir().c_str(), nullptr, false);
+    ASSERT_FALSE(err);
+
+    // Records the time of each request and responds with `code`.
+    vector<chrono::steady_clock::time_point> requests;
+    auto requester = [&](int code) {
+        return [&, code](const HTTPParams& params) -> HTTPResult {
+            requests.push_back(chrono::steady_clock::now());
+            HTTPResult result;
+            result.code = code;
+            if (code < 0) {
+                result.error = "fake error";
+            }
+            return result;
+        };
+    };
+
+    RetryPolicy policy;
+    policy.max_attempts = 4;
+    policy.base_delay = chrono::milliseconds(20);
+    policy.max_delay = chrono::milliseconds(50);
+    policy.jitter = 0;
+    pc.SetRetryPolicy(policy);
+
+    // Server errors are retried, with the delay doubling up to the cap
+    pc.SetHTTPRequestFn(requester(kHTTPStatusInternalServerError));
+    auto refresh_result = pc.RefreshState(false, {});
+    ASSERT_TRUE(refresh_result) << refresh_result.error();
+    ASSERT_EQ(refresh_result->status, Status::ServerError);
+    ASSERT_EQ(requests.size(), 4);
+    ASSERT_GE(requests[1] - requests[0], chrono::milliseconds(20));
+    ASSERT_GE(requests[2] - requests[1], chrono::milliseconds(40));
+    ASSERT_GE(requests[3] - requests[2], chrono::milliseconds(50));
+
+    // As are recoverable errors
+    requests.clear();
+    pc.SetHTTPRequestFn(requester(HTTPResult::RECOVERABLE_ERROR));
+    refresh_result = pc.RefreshState(false, {});
+    ASSERT_FALSE(refresh_result);
+    ASSERT_EQ(requests.size(), 4);
+
+    // Only the policy's codes are retried
+    policy.retryable_codes = {{(int)kHTTPStatusTooManyRequests, (int)kHTTPStatusTooManyRequests}};
+    pc.SetRetryPolicy(policy);
+    requests.clear();
+    pc.SetHTTPRequestFn(requester(kHTTPStatusInternalServerError));
+    refresh_result = pc.RefreshState(false, {});
+    ASSERT_TRUE(refresh_result) << refresh_result.error();
+    ASSERT_EQ(refresh_result->status, Status::ServerError);
+    ASSERT_EQ(requests.size(), 1);
+    requests.clear();
+    pc.SetHTTPRequestFn(requester(kHTTPStatusTooManyRequests));
+    (void)pc.RefreshState(false, {});
+    ASSERT_EQ(requests.size(), 4);
+
+    // An endpoint's own policy takes precedence. (RefreshState without tokens requests
+    // a new tracker.)
+    RetryPolicy tracker_policy = policy;
+    tracker_policy.max_attempts = 2;
+    pc.SetRetryPolicy(tracker_policy, "/tracker");
+    requests.clear();
+    (void)pc.RefreshState(false, {});
+    ASSERT_EQ(requests.size(), 2);
+    pc.SetRetryPolicy(tracker_policy, "/refresh-state");
+    requests.clear();
+    (void)pc.RefreshState(false, {});
+    ASSERT_EQ(requests.size(), 2);
+}
+
+TEST_F(TestPsiCash, RetryDeadline) {
+    PsiCashTester pc;
+    auto err = pc.Init(TestPsiCash::UserAgent(), GetTempDir().c_str(), nullptr, false);
+    ASSERT_FALSE(err);
+
+    vector<int64_t> timeouts;
+    pc.SetHTTPRequestFn([&](const HTTPParams& params) -> HTTPResult {
+        timeouts.push_back(params.timeout_ms);
+        HTTPResult result;
+        result.code = kHTTPStatusServiceUnavailable;
+        return result;
+    });
+
+    RetryPolicy policy;
+    policy.max_attempts = 100;
+    policy.base_delay = chrono::milliseconds(50);
+    policy.max_delay = chrono::milliseconds(50);
+    policy.jitter = 0;
+    policy.deadline = chrono::milliseconds(220);
+    pc.SetRetryPolicy(policy);
+
+    auto start = chrono::steady_clock::now();
+    auto refresh_result = pc.RefreshState(false, {});
+    auto elapsed = chrono::steady_clock::now() - start;
+    ASSERT_TRUE(refresh_result) << refresh_result.error();
+    ASSERT_EQ(refresh_result->status, Status::ServerError);
+
+    // Attempts at about 0, 50, 100, 150 and 200ms, and no more
+    ASSERT_GE(timeouts.size(), 2);
+    ASSERT_LE(timeouts.size(), 5);
+    ASSERT_LT(elapsed, chrono::milliseconds(220));
+    // The requester is told how much time is left
+    ASSERT_LE(timeouts.front(), 220);
+    ASSERT_GT(timeouts.front(), timeouts.back());
+    ASSERT_GT(timeouts.back(), 0);
+
+    // Without a deadline, there's no timeout
+    policy.max_attempts = 1;
+    policy.deadline = chrono::milliseconds(0);
+    pc.SetRetryPolicy(policy);
+    timeouts.clear();
+    (void)pc.RefreshState(false, {});
+    ASSERT_EQ(timeouts, vector<int64_t>{0});
+}
+
+TEST_F(TestPsiCash, CancelRetries) {
+    PsiCashTester pc;
+    auto err = pc.Init(TestPsiCash::UserAgent(), GetTempDir().c_str(), nullptr, false);
+    ASSERT_FALSE(err);
+
+    atomic<int> requests(0);
+    pc.SetHTTPRequestFn([&](const HTTPParams& params) -> HTTPResult {
+        requests++;
+        HTTPResult result;
+        result.code = kHTTPStatusInternalServerError;
+        return result;
+    });
+
+    RetryPolicy policy;
+    policy.base_delay = chrono::hours(1);
+    policy.max_delay = chrono::hours(1);
+    pc.SetRetryPolicy(policy);
+
+    // Cancelling from another thread cuts the retry wait short
+    auto start = chrono::steady_clock::now();
+    thread canceller([&] {
+        this_thread::sleep_for(chrono::milliseconds(100));
+        pc.Cancel();
+    });
+    auto refresh_result = pc.RefreshState(false, {});
+    canceller.join();
+    ASSERT_FALSE(refresh_result);
+    ASSERT_THAT(refresh_result.error().ToString(), HasSubstr("request cancelled"));
+    ASSERT_LT(chrono::steady_clock::now() - start, chrono::seconds(10));
+    ASSERT_EQ(requests, 1);
+
+    // Later calls aren't affected
+    policy.base_delay = chrono::milliseconds(1);
+    pc.SetRetryPolicy(policy);
+    requests = 0;
+    refresh_result = pc.RefreshState(false, {});
+    ASSERT_TRUE(refresh_result) << refresh_result.error();
+    ASSERT_EQ(refresh_result->status, Status::ServerError);
+    ASSERT_EQ(requests, 3);
+}
+
+TEST_F(TestPsiCash, AsyncConcurrency) {
+    PsiCashTester pc;
+    auto err = pc.Init(TestPsiCash::UserAgent(), GetTempDir().c_str(), nullptr, false);
+    ASSERT_FALSE(err);
+
+    // Each request takes a different time, and fails with a server error
+    const vector<chrono::milliseconds> latencies = {
+        chrono::milliseconds(100), chrono::milliseconds(200), chrono::milliseconds(300), chrono::milliseconds(400)};
+    const auto max_latency = chrono::milliseconds(400), sum_latency = chrono::milliseconds(1000);
+    atomic<size_t> next_request(0);
+    pc.SetHTTPRequestFn([&](const HTTPParams& params) -> HTTPResult {
+        this_thread::sleep_for(latencies[next_request++ % latencies.size()]);
+        HTTPResult result;
+        result.code = kHTTPStatusInternalServerError;
+        return result;
+    });
+    RetryPolicy policy;
+    policy.max_attempts = 1;
+    pc.SetRetryPolicy(policy);
+
+    auto run_all = [&]() {
+        next_request = 0;
+        vector<future<error::Result<PsiCash::RefreshStateResponse>>> futures;
+        for (size_t i = 0; i < latencies.size(); i++) {
+            futures.push_back(pc.RefreshStateAsync(false, {}));
+        }
+        for (auto& f : futures) {
+            auto res = f.get();
+            ASSERT_TRUE(res) << res.error();
+            ASSERT_EQ(res->status, Status::ServerError);
+        }
+    };
+
+    // With a thread for each, the operations take about as long as the slowest
+    pc.SetAsyncThreads(latencies.size());
+    auto start = chrono::steady_clock::now();
+    run_all();
+    auto elapsed = chrono::steady_clock::now() - start;
+    ASSERT_GE(elapsed, max_latency);
+    ASSERT_LT(elapsed, max_latency + (sum_latency - max_latency) / 2);
+
+    // With one thread, they take as long as all of them together
+    pc.SetAsyncThreads(1);
+    start = chrono::steady_clock::now();
+    run_all();
+    elapsed = chrono::steady_clock::now() - start;
+    ASSERT_GE(elapsed, sum_latency);
+}
+
+TEST_F(TestPsiCash, AsyncCallbacks) {
+    PsiCashTester pc;
+    auto err = pc.Init(TestPsiCash::UserAgent(), GetTempDir().c_str(), nullptr, false);
+    ASSERT_FALSE(err);
+
+    pc.SetHTTPRequestFn([&](const HTTPParams& params) -> HTTPResult {
+        HTTPResult result;
+        result.code = kHTTPStatusInternalServerError;
+        return result;
+    });
+    RetryPolicy policy;
+    policy.max_attempts = 1;
+    pc.SetRetryPolicy(policy);
+
+    // The callback gets the same result as the future, on another thread
+    auto caller_thread = this_thread::get_id();
+    thread::id callback_thread;
+    nonstd::optional<Status> callback_status;
+    auto refresh_future = pc.RefreshStateAsync(false, {}, [&](const error::Result<PsiCash::RefreshStateResponse>& res) {
+        callback_thread = this_thread::get_id();
+        ASSERT_TRUE(res) << res.error();
+        callback_status = res->status;
+    });
+    auto refresh_result = refresh_future.get();
+    ASSERT_TRUE(refresh_result) << refresh_result.error();
+    ASSERT_EQ(refresh_result->status, Status::ServerError);
+    ASSERT_EQ(callback_status, Status::ServerError);
+    ASSERT_NE(callback_thread, caller_thread);
+
+    // Errors too. (There are no tokens, so purchasing and logging out aren't possible.)
+    bool callback_called = false;
+    auto purchase_result = pc.NewExpiringPurchaseAsync("class", "distinguisher", 1, [&](const auto& res) {
+        callback_called = true;
+        ASSERT_FALSE(res);
+    }).get();
+    ASSERT_FALSE(purchase_result);
+    ASSERT_TRUE(callback_called);
+
+    auto logout_result = pc.AccountLogoutAsync().get();
+    ASSERT_FALSE(logout_result);
+
+    auto login_result = pc.AccountLoginAsync("username", "password").get();
+    ASSERT_TRUE(login_result) << login_result.error();
+    ASSERT_EQ(login_result->status, Status::ServerError);
+
+    // Cancel applies to asynchronous operations
+    policy.max_attempts = 3;
+    policy.base_delay = chrono::hours(1);
+    pc.SetRetryPolicy(policy);
+    auto cancelled_future = pc.RefreshStateAsync(false, {});
+    this_thread::sleep_for(chrono::milliseconds(100));
+    pc.Cancel();
+    ASSERT_EQ(cancelled_future.wait_for(chrono::seconds(10)), future_status::ready);
+    ASSERT_FALSE(cancelled_future.get());
+
+    // A missing requester is reported through the future
+    pc.SetHTTPRequestFn(nullptr);
+    auto no_requester_future = pc.RefreshStateAsync(false, {});
+    ASSERT_THROW(no_requester_future.get(), std::runtime_error);
+}
+
+TEST_F(TestPsiCash, AsyncRequester) {
+    PsiCashTester pc;
+    auto err = pc.Init(TestPsiCash::UserAgent(), GetTempDir().c_str(), nullptr, false);
+    ASSERT_FALSE(err);
+
+    RetryPolicy policy;
+    policy.max_attempts = 1;
+    pc.SetRetryPolicy(policy);
+
+    // The requester holds onto the requests until the test completes them
+    mutex pending_mutex;
+    vector<HTTPRequestDoneFn> pending;
+    pc.SetHTTPRequestAsyncFn([&](const HTTPParams& params, HTTPRequestDoneFn done) {
+        lock_guard<mutex> lock(pending_mutex);
+        pending.push_back(std::move(done));
+    });
+    auto pending_count = [&]() {
+        lock_guard<mutex> lock(pending_mutex);
+        return pending.size();
+    };
+
+    // With one thread, many operations can be waiting for responses at once
+    pc.SetAsyncThreads(1);
+    const size_t count = 1000;
+    vector<future<error::Result<PsiCash::RefreshStateResponse>>> futures;
+    for (size_t i = 0; i < count; i++) {
+        futures.push_back(pc.RefreshStateAsync(false, {}));
+    }
+    auto start = chrono::steady_clock::now();
+    while (pending_count() < count && chrono::steady_clock::now() - start < chrono::seconds(30)) {
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    ASSERT_EQ(pending_count(), count);
+    for (auto& f : futures) {
+        ASSERT_EQ(f.wait_for(chrono::seconds(0)), future_status::timeout);
+    }
+
+    vector<HTTPRequestDoneFn> to_complete;
+    {
+        lock_guard<mutex> lock(pending_mutex);
+        to_complete.swap(pending);
+    }
+    for (auto& done : to_complete) {
+        HTTPResult result;
+        result.code = kHTTPStatusInternalServerError;
+        done(result);
+    }
+    for (auto& f : futures) {
+        auto res = f.get();
+        ASSERT_TRUE(res) << res.error();
+        ASSERT_EQ(res->status, Status::ServerError);
+    }
+
+    // The synchronous API uses it too, with responses from other threads, and retries
+    policy.max_attempts = 2;
+    policy.base_delay = chrono::milliseconds(1);
+    pc.SetRetryPolicy(policy);
+    atomic<int> requests(0);
+    vector<thread> responders;
+    pc.SetHTTPRequestAsyncFn([&](const HTTPParams& params, HTTPRequestDoneFn done) {
+        requests++;
+        responders.emplace_back([done] {
+            HTTPResult result;
+            result.code = kHTTPStatusInternalServerError;
+            done(result);
+        });
+    });
+    auto refresh_result = pc.RefreshState(false, {});
+    ASSERT_TRUE(refresh_result) << refresh_result.error();
+    ASSERT_EQ(refresh_result->status, Status::ServerError);
+    ASSERT_EQ(requests, 2);
+    for (auto& t : responders) {
+        t.join();
+    }
+
+    // Requests can be completed before the requester returns
+    requests = 0;
+    pc.SetHTTPRequestAsyncFn([&](const HTTPParams& params, HTTPRequestDoneFn done) {
+        requests++;
+        HTTPResult result;
+        result.code = kHTTPStatusInternalServerError;
+        done(result);
+    });
+    refresh_result = pc.RefreshStateAsync(false, {}).get();
+    ASSERT_TRUE(refresh_result) << refresh_result.error();
+    ASSERT_EQ(refresh_result->status, Status::ServerError);
+    ASSERT_EQ(requests, 2);
+
+    // Unsetting it goes back to the blocking requester
+    pc.SetHTTPRequestAsyncFn(nullptr);
+    requests = 0;
+    pc.SetHTTPRequestFn([&](const HTTPParams& params) -> HTTPResult {
+        requests++;
+        HTTPResult result;
+        result.code = kHTTPStatusInternalServerError;
+        return result;
+    });
+    refresh_result = pc.RefreshState(false, {});
+    ASSERT_TRUE(refresh_result) << refresh_result.error();
+    ASSERT_EQ(requests, 2);
+}
+
+TEST_F(TestPsiCash, AsyncRequesterCancel) {
+    PsiCashTester pc;
+    auto err = pc.Init(TestPsiCash::UserAgent(), GetTempDir().c_str(), nullptr, false);
+    ASSERT_FALSE(err);
+
+    // A requester that never completes its requests
+    atomic<int> requests(0);
+    pc.SetHTTPRequestAsyncFn([&](const HTTPParams& params, HTTPRequestDoneFn done) {
+        requests++;
+    });
+
+    // Cancelling ends the requests in flight, synchronous and asynchronous
+    auto refresh_future = pc.RefreshStateAsync(false, {});
+    thread canceller([&] {
+        while (requests < 2) {
+            this_thread::sleep_for(chrono::milliseconds(10));
+        }
+        pc.Cancel();
+    });
+    auto refresh_result = pc.RefreshState(false, {});
+    canceller.join();
+    ASSERT_FALSE(refresh_result);
+    ASSERT_FALSE(refresh_result.error().Critical());
+    ASSERT_THAT(refresh_result.error().ToString(), HasSubstr("request cancelled"));
+    ASSERT_EQ(refresh_future.wait_for(chrono::seconds(10)), future_status::ready);
+    refresh_result = refresh_future.get();
+    ASSERT_FALSE(refresh_result);
+    ASSERT_THAT(refresh_result.error().ToString(), HasSubstr("request cancelled"));
+
+    // Later calls aren't affected, and completions after the first are ignored
+    pc.SetHTTPRequestAsyncFn([&](const HTTPParams& params, HTTPRequestDoneFn done) {
+        HTTPResult result;
+        result.code = kHTTPStatusInternalServerError;
+        done(result);
+        done(result);
+    });
+    RetryPolicy policy;
+    policy.max_attempts = 1;
+    pc.SetRetryPolicy(policy);
+    refresh_result = pc.RefreshState(false, {});
+    ASSERT_TRUE(refresh_result) << refresh_result.error();
+    ASSERT_EQ(refresh_result->status, Status::ServerError);
+}
+
+TEST_F(TestPsiCash, AsyncRequesterDestruction) {
+    // Destruction cancels the requests in flight, even if the requester never completes
+    // them, and waits for their operations to finish
+    auto pc = std::make_unique<PsiCashTester>();
+    auto err = pc->Init(TestPsiCash::UserAgent(), GetTempDir().c_str(), nullptr, false);
+    ASSERT_FALSE(err);
+
+    mutex dropped_mutex;
+    vector<HTTPRequestDoneFn> dropped;
+    pc->SetHTTPRequestAsyncFn([&](const HTTPParams& params, HTTPRequestDoneFn done) {
+        lock_guard<mutex> lock(dropped_mutex);
+        dropped.push_back(std::move(done));
+    });
+    auto refresh_future = pc->RefreshStateAsync(false, {});
+    auto start = chrono::steady_clock::now();
+    while (chrono::steady_clock::now() - start < chrono::seconds(10)) {
+        {
+            lock_guard<mutex> lock(dropped_mutex);
+            if (!dropped.empty()) {
+                break;
+            }
+        }
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    pc.reset();
+    ASSERT_EQ(refresh_future.wait_for(chrono::seconds(0)), future_status::ready);
+    auto refresh_result = refresh_future.get();
+    ASSERT_FALSE(refresh_result);
+    ASSERT_THAT(refresh_result.error().ToString(), HasSubstr("request cancelled"));
+
+    // The requester completing the request afterwards is harmless
+    ASSERT_EQ(dropped.size(), 1);
+    HTTPResult result;
+    result.code = kHTTPStatusInternalServerError;
+    dropped[0](result);
+}
+
 TEST_F(TestPsiCash, AccountLoginSimple) {
     // The initial internal release doesn't have Logout, so the tests need to be constrained.
 
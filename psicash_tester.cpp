@@ -23,6 +23,7 @@
 #include <thread>
 #include <iostream>
 #include "psicash_tester.hpp"
+#include "task.hpp"
 #include "utils.hpp"
 #include "http_status_codes.h"
 
@@ -53,8 +54,9 @@ error::Error PsiCashTester::Init(const string& user_agent, const string& file_st
 }
 
 error::Error PsiCashTester::Init(const string& user_agent, const string& file_store_root,
-                                 MakeHTTPRequestFn make_http_request_fn, bool force_reset, bool test) {
-    return PsiCash::Init(user_agent, file_store_root, make_http_request_fn, force_reset, test);
+                                 MakeHTTPRequestFn make_http_request_fn, bool force_reset, bool test,
+                                 const DatastoreOptions& datastore_options) {
+    return PsiCash::Init(user_agent, file_store_root, make_http_request_fn, force_reset, test, datastore_options);
 }
 
 UserData& PsiCashTester::user_data() {
@@ -70,11 +72,11 @@ error::Error PsiCashTester::MakeRewardRequests(const std::string& transaction_cl
             this_thread::sleep_for(chrono::milliseconds(100));
         }
 
-        auto result = MakeHTTPRequestWithRetry(
+        auto result = RunSync(MakeHTTPRequestWithRetry(
                 "POST", "/transaction", true,
                 {{"class",         transaction_class},
                  {"distinguisher", distinguisher}},
-                nonstd::nullopt);
+                nonstd::nullopt));
         if (!result) {
             return WrapError(result.error(), "MakeHTTPRequestWithRetry failed");
         } else if (result->code != kHTTPStatusOK) {
@@ -113,8 +115,8 @@ bool PsiCashTester::MutatorsEnabled() {
     checked = true;
 
     SetRequestMutators({"CheckEnabled"});
-    auto result = MakeHTTPRequestWithRetry(
-            "GET", "/refresh-state", false, {}, nonstd::nullopt);
+    auto result = RunSync(MakeHTTPRequestWithRetry(
+            "GET", "/refresh-state", false, {}, nonstd::nullopt));
     if (!result) {
         throw std::runtime_error("MUTATOR CHECK FAILED: "s + result.error().ToString());
     }
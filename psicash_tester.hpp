@@ -45,7 +45,8 @@ class PsiCashTester : public psicash::PsiCash {
 
     // If the `test` flag really must be set explicitly, use this method.
     psicash::error::Error Init(const std::string& user_agent, const std::string& file_store_root,
-                      psicash::MakeHTTPRequestFn make_http_request_fn, bool force_reset, bool test);
+                      psicash::MakeHTTPRequestFn make_http_request_fn, bool force_reset, bool test,
+                      const psicash::DatastoreOptions& datastore_options=psicash::DatastoreOptions());
 
     psicash::UserData& user_data();
 
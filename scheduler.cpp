@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include <vector>
+#include "scheduler.hpp"
+
+using namespace std;
+
+namespace psicash {
+
+Scheduler::Scheduler()
+        : next_id_(1), running_(false) {
+}
+
+Scheduler::~Scheduler() {
+    CancelAll();
+    // With no tasks left, the thread exits.
+    std::thread thread;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        thread = std::move(thread_);
+    }
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+Scheduler::TaskID Scheduler::Schedule(Clock::time_point when, Task task) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto id = next_id_++;
+    tasks_.emplace(make_pair(when, id), std::move(task));
+    task_times_.emplace(id, when);
+
+    if (running_) {
+        // The new task might be the next one due.
+        cv_.notify_one();
+        return id;
+    }
+
+    // A previous thread has found no tasks and exited (or is about to). It no longer
+    // needs the lock, so it's safe to wait for it here.
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+    running_ = true;
+    thread_ = std::thread(&Scheduler::Run, this);
+    return id;
+}
+
+bool Scheduler::Cancel(TaskID id) {
+    Task task;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto time = task_times_.find(id);
+        if (time == task_times_.end()) {
+            return false;
+        }
+        auto it = tasks_.find(make_pair(time->second, id));
+        task = std::move(it->second);
+        tasks_.erase(it);
+        task_times_.erase(time);
+        // The thread might be waiting for this task, and can exit if it was the last.
+        cv_.notify_one();
+    }
+    task(true);
+    return true;
+}
+
+void Scheduler::CancelAll() {
+    vector<Task> tasks;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& it : tasks_) {
+            tasks.push_back(std::move(it.second));
+        }
+        tasks_.clear();
+        task_times_.clear();
+        cv_.notify_one();
+    }
+    for (auto& task : tasks) {
+        task(true);
+    }
+}
+
+bool Scheduler::HasThread() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return running_;
+}
+
+void Scheduler::Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!tasks_.empty()) {
+        auto next = tasks_.begin();
+        auto when = next->first.first;
+        if (when > Clock::now()) {
+            // Tasks may be added or cancelled while we wait, so look again after.
+            cv_.wait_until(lock, when);
+            continue;
+        }
+
+        auto task = std::move(next->second);
+        task_times_.erase(next->first.second);
+        tasks_.erase(next);
+
+        lock.unlock();
+        task(false);
+        lock.lock();
+    }
+    running_ = false;
+}
+
+} // namespace psicash
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifndef PSICASHLIB_SCHEDULER_H
+#define PSICASHLIB_SCHEDULER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+namespace psicash {
+
+/// Runs tasks at set times. Its thread only exists while there are tasks waiting to run,
+/// so an idle Scheduler holds no thread. Tasks run one at a time on that thread, so they
+/// should be quick -- typically they wake something up or hand work off.
+class Scheduler {
+public:
+    using Clock = std::chrono::steady_clock;
+    using TaskID = uint64_t;
+    /// `cancelled` is true if the task is being run because it was cancelled rather than
+    /// because its time came.
+    using Task = std::function<void(bool cancelled)>;
+
+    Scheduler();
+    /// Cancels the tasks that haven't run. Tasks must not be scheduled from other threads
+    /// while this is running.
+    ~Scheduler();
+
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+
+    /// Schedules `task` to run at `when`, or as soon as possible if that has passed. Tasks
+    /// for the same time run in the order they were scheduled.
+    TaskID Schedule(Clock::time_point when, Task task);
+
+    /// If the task hasn't started running, runs it now, on this thread, as cancelled, and
+    /// returns true. Returns false if it has already run (or is running).
+    bool Cancel(TaskID id);
+
+    /// Cancels all of the tasks that haven't started running.
+    void CancelAll();
+
+    /// Returns true if the scheduler has a thread running. For testing.
+    bool HasThread() const;
+
+private:
+    void Run();
+
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    /// Keyed by time and then ID, so the next task to run is first.
+    std::map<std::pair<Clock::time_point, TaskID>, Task> tasks_;
+    /// The time of each task in tasks_, so that it can be found by ID.
+    std::map<TaskID, Clock::time_point> task_times_;
+    TaskID next_id_;
+    /// True from when thread_ is started until it finds no tasks left and exits.
+    bool running_;
+    std::thread thread_;
+};
+
+} // namespace psicash
+
+#endif //PSICASHLIB_SCHEDULER_H
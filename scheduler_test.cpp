@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+#include "scheduler.hpp"
+
+using namespace std;
+using namespace psicash;
+
+// Waits up to a second for the scheduler's thread to exit.
+static bool WaitForNoThread(const Scheduler& scheduler) {
+    for (int i = 0; i < 100 && scheduler.HasThread(); i++) {
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    return !scheduler.HasThread();
+}
+
+TEST(TestScheduler, RunsInOrder)
+{
+    Scheduler scheduler;
+    ASSERT_FALSE(scheduler.HasThread());
+
+    mutex order_mutex;
+    vector<int> order;
+    promise<void> all_done;
+    auto start = Scheduler::Clock::now();
+    auto record = [&](int n) {
+        return [&, n](bool cancelled) {
+            ASSERT_FALSE(cancelled);
+            ASSERT_GE(Scheduler::Clock::now() - start, chrono::milliseconds(n * 10));
+            lock_guard<mutex> lock(order_mutex);
+            order.push_back(n);
+            if (order.size() == 4) {
+                all_done.set_value();
+            }
+        };
+    };
+
+    (void)scheduler.Schedule(start + chrono::milliseconds(30), record(3));
+    (void)scheduler.Schedule(start + chrono::milliseconds(10), record(1));
+    (void)scheduler.Schedule(start + chrono::milliseconds(20), record(2));
+    // Same time as an earlier one, so runs after it
+    (void)scheduler.Schedule(start + chrono::milliseconds(30), record(3));
+    ASSERT_TRUE(scheduler.HasThread());
+
+    ASSERT_EQ(all_done.get_future().wait_for(chrono::seconds(5)), future_status::ready);
+    ASSERT_EQ(order, (vector<int>{1, 2, 3, 3}));
+
+    // With nothing left to do, the thread goes away
+    ASSERT_TRUE(WaitForNoThread(scheduler));
+}
+
+TEST(TestScheduler, PastTimes)
+{
+    Scheduler scheduler;
+    promise<void> done;
+    (void)scheduler.Schedule(Scheduler::Clock::now() - chrono::hours(1), [&](bool cancelled) {
+        ASSERT_FALSE(cancelled);
+        done.set_value();
+    });
+    ASSERT_EQ(done.get_future().wait_for(chrono::seconds(5)), future_status::ready);
+}
+
+TEST(TestScheduler, Cancel)
+{
+    Scheduler scheduler;
+
+    atomic<int> runs(0), cancels(0);
+    auto task = [&](bool cancelled) { (cancelled ? cancels : runs)++; };
+    auto id = scheduler.Schedule(Scheduler::Clock::now() + chrono::hours(1), task);
+    ASSERT_TRUE(scheduler.HasThread());
+
+    // Cancelling runs the task right away, as cancelled
+    ASSERT_TRUE(scheduler.Cancel(id));
+    ASSERT_EQ(cancels, 1);
+    ASSERT_EQ(runs, 0);
+    ASSERT_FALSE(scheduler.Cancel(id));
+    ASSERT_EQ(cancels, 1);
+
+    // The thread doesn't wait around for the cancelled task's time
+    ASSERT_TRUE(WaitForNoThread(scheduler));
+
+    // A task that has already run can't be cancelled
+    promise<void> done;
+    id = scheduler.Schedule(Scheduler::Clock::now(), [&](bool cancelled) {
+        task(cancelled);
+        done.set_value();
+    });
+    ASSERT_EQ(done.get_future().wait_for(chrono::seconds(5)), future_status::ready);
+    ASSERT_FALSE(scheduler.Cancel(id));
+    ASSERT_EQ(runs, 1);
+    ASSERT_EQ(cancels, 1);
+
+    // Other tasks are unaffected by a cancellation
+    promise<void> other_done;
+    auto cancelled_id = scheduler.Schedule(Scheduler::Clock::now() + chrono::milliseconds(20), task);
+    (void)scheduler.Schedule(Scheduler::Clock::now() + chrono::milliseconds(40), [&](bool cancelled) {
+        task(cancelled);
+        other_done.set_value();
+    });
+    ASSERT_TRUE(scheduler.Cancel(cancelled_id));
+    ASSERT_EQ(other_done.get_future().wait_for(chrono::seconds(5)), future_status::ready);
+    ASSERT_EQ(runs, 2);
+    ASSERT_EQ(cancels, 2);
+}
+
+TEST(TestScheduler, CancelAllAndDestruction)
+{
+    atomic<int> runs(0), cancels(0);
+    auto task = [&](bool cancelled) { (cancelled ? cancels : runs)++; };
+    {
+        Scheduler scheduler;
+        for (int i = 0; i < 3; i++) {
+            (void)scheduler.Schedule(Scheduler::Clock::now() + chrono::hours(1), task);
+        }
+        scheduler.CancelAll();
+        ASSERT_EQ(cancels, 3);
+        ASSERT_TRUE(WaitForNoThread(scheduler));
+
+        for (int i = 0; i < 2; i++) {
+            (void)scheduler.Schedule(Scheduler::Clock::now() + chrono::hours(1), task);
+        }
+        // Destroyed with tasks pending
+    }
+    ASSERT_EQ(cancels, 5);
+    ASSERT_EQ(runs, 0);
+}
+
+TEST(TestScheduler, ScheduleFromTask)
+{
+    Scheduler scheduler;
+    promise<void> done;
+    (void)scheduler.Schedule(Scheduler::Clock::now(), [&](bool) {
+        (void)scheduler.Schedule(Scheduler::Clock::now() + chrono::milliseconds(10), [&](bool cancelled) {
+            ASSERT_FALSE(cancelled);
+            done.set_value();
+        });
+    });
+    ASSERT_EQ(done.get_future().wait_for(chrono::seconds(5)), future_status::ready);
+    ASSERT_TRUE(WaitForNoThread(scheduler));
+}
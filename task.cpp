@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include "task.hpp"
+
+namespace psicash {
+
+RunLoop::RunLoop()
+        : stopped_(false),
+          dispatcher_([this](std::function<void()> work) { Post(std::move(work)); }) {
+}
+
+void RunLoop::Post(std::function<void()> work) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    work_.push_back(std::move(work));
+    cv_.notify_one();
+}
+
+void RunLoop::Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopped_) {
+        if (work_.empty()) {
+            cv_.wait(lock);
+            continue;
+        }
+        auto work = std::move(work_.front());
+        work_.pop_front();
+        lock.unlock();
+        work();
+        lock.lock();
+    }
+}
+
+void RunLoop::Stop() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopped_ = true;
+    cv_.notify_one();
+}
+
+} // namespace psicash
@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifndef PSICASHLIB_TASK_H
+#define PSICASHLIB_TASK_H
+
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <utility>
+
+namespace psicash {
+
+/// Runs work where a coroutine continues after waiting for something that finishes on
+/// another thread (a request, a timer): on an executor's threads, say, or on the thread
+/// waiting in RunSync.
+using Dispatcher = std::function<void(std::function<void()>)>;
+
+/// The result of a coroutine that produces a T. The coroutine doesn't start until the
+/// Task is awaited (or given to Start or RunSync), and the awaiting coroutine continues
+/// when it finishes. An exception thrown by the coroutine is rethrown to the awaiter.
+///
+/// The dispatcher of the outermost coroutine is passed down to those it awaits, so that
+/// the awaitables they use know where to resume them: an awaitable's await_suspend can
+/// get it from the promise of the handle it's given.
+template<typename T>
+class [[nodiscard]] Task {
+public:
+    struct promise_type;
+    using Handle = std::coroutine_handle<promise_type>;
+
+    /// Continues the awaiting coroutine, without growing the stack.
+    struct FinalAwaiter {
+        bool await_ready() const noexcept { return false; }
+        std::coroutine_handle<> await_suspend(Handle h) noexcept {
+            auto continuation = h.promise().continuation;
+            return continuation ? continuation : std::noop_coroutine();
+        }
+        void await_resume() const noexcept {}
+    };
+
+    struct promise_type {
+        std::optional<T> value;
+        std::exception_ptr exception;
+        std::coroutine_handle<> continuation;
+        const Dispatcher* dispatcher = nullptr;
+
+        Task get_return_object() { return Task(Handle::from_promise(*this)); }
+        std::suspend_always initial_suspend() const noexcept { return {}; }
+        FinalAwaiter final_suspend() const noexcept { return {}; }
+        void return_value(T v) { value.emplace(std::move(v)); }
+        void unhandled_exception() { exception = std::current_exception(); }
+    };
+
+    Task(Task&& other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+    Task& operator=(Task&&) = delete;
+    ~Task() {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    template<typename P>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<P> awaiter) noexcept {
+        handle_.promise().continuation = awaiter;
+        handle_.promise().dispatcher = awaiter.promise().dispatcher;
+        return handle_;
+    }
+
+    T await_resume() {
+        auto& promise = handle_.promise();
+        if (promise.exception) {
+            std::rethrow_exception(promise.exception);
+        }
+        return std::move(*promise.value);
+    }
+
+private:
+    explicit Task(Handle handle) : handle_(handle) {}
+
+    Handle handle_;
+};
+
+namespace detail {
+
+/// A coroutine that is started by resuming it, and frees itself when it finishes.
+struct Detached {
+    struct promise_type {
+        const Dispatcher* dispatcher = nullptr;
+
+        Detached get_return_object() {
+            return Detached{std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+        std::suspend_always initial_suspend() const noexcept { return {}; }
+        std::suspend_never final_suspend() const noexcept { return {}; }
+        void return_void() const noexcept {}
+        void unhandled_exception() const noexcept { std::terminate(); }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+template<typename T, typename Done>
+Detached RunDetached(Task<T> task, Done done) {
+    std::optional<T> value;
+    std::exception_ptr exception;
+    try {
+        value.emplace(co_await std::move(task));
+    }
+    catch (...) {
+        exception = std::current_exception();
+    }
+    done(std::move(value), exception);
+}
+
+} // namespace detail
+
+/// Runs `task` on this thread until it first waits, after which it continues via
+/// `dispatcher` (which must outlive it). When it finishes, `done` is called with its
+/// result -- or, if it threw, with nullopt and the exception. `done` must not throw.
+template<typename T>
+void Start(Task<T> task, const Dispatcher& dispatcher,
+           std::function<void(std::optional<T>, std::exception_ptr)> done) {
+    auto detached = detail::RunDetached(std::move(task), std::move(done));
+    detached.handle.promise().dispatcher = &dispatcher;
+    detached.handle.resume();
+}
+
+/// A queue of work that one thread runs until it's stopped. This is the dispatcher that
+/// RunSync uses, so that a coroutine run synchronously continues on the calling thread.
+class RunLoop {
+public:
+    RunLoop();
+
+    RunLoop(const RunLoop&) = delete;
+    RunLoop& operator=(const RunLoop&) = delete;
+
+    const Dispatcher& dispatcher() const { return dispatcher_; }
+
+    /// Queues `work` for Run. May be called from any thread.
+    void Post(std::function<void()> work);
+
+    /// Runs the queued work, waiting for more, until Stop is called. Work that's still
+    /// queued then is left unrun.
+    void Run();
+
+    /// Makes Run return after the work it's doing.
+    void Stop();
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::function<void()>> work_;
+    bool stopped_;
+    Dispatcher dispatcher_;
+};
+
+/// Runs `task` to completion on this thread and returns its result (or rethrows its
+/// exception). The thread waits while the task does, and the task continues on it.
+template<typename T>
+T RunSync(Task<T> task) {
+    RunLoop loop;
+    std::optional<T> value;
+    std::exception_ptr exception;
+    Start<T>(std::move(task), loop.dispatcher(),
+             [&](std::optional<T> v, std::exception_ptr e) {
+                 value = std::move(v);
+                 exception = e;
+                 loop.Stop();
+             });
+    loop.Run();
+    if (exception) {
+        std::rethrow_exception(exception);
+    }
+    return std::move(*value);
+}
+
+} // namespace psicash
+
+#endif //PSICASHLIB_TASK_H
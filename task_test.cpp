@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+#include "task.hpp"
+
+using namespace std;
+using namespace psicash;
+
+// Resumes the awaiting coroutine, via its dispatcher, from a new thread.
+struct ResumeFromThread {
+    thread* t;
+
+    bool await_ready() const noexcept { return false; }
+    template<typename P>
+    void await_suspend(coroutine_handle<P> h) {
+        auto dispatcher = h.promise().dispatcher;
+        *t = thread([dispatcher, h] { (*dispatcher)([h] { h.resume(); }); });
+    }
+    void await_resume() const noexcept {}
+};
+
+Task<int> Add(int a, int b) {
+    co_return a + b;
+}
+
+Task<int> AddTwice(int a, int b) {
+    auto first = co_await Add(a, b);
+    co_return first + co_await Add(a, b);
+}
+
+Task<int> Throw() {
+    throw runtime_error("thrown");
+    co_return 0;
+}
+
+Task<string> CatchThrow() {
+    try {
+        (void)co_await Throw();
+    }
+    catch (const runtime_error& e) {
+        co_return string(e.what());
+    }
+    co_return string();
+}
+
+Task<thread::id> ThreadAfterResume(thread* t) {
+    co_await ResumeFromThread{t};
+    co_return this_thread::get_id();
+}
+
+TEST(TestTask, RunSync)
+{
+    ASSERT_EQ(RunSync(AddTwice(1, 2)), 6);
+
+    // Exceptions propagate to the awaiter, and out of RunSync
+    ASSERT_EQ(RunSync(CatchThrow()), "thrown");
+    ASSERT_THROW(RunSync(Throw()), runtime_error);
+
+    // The coroutine continues on the calling thread
+    thread t;
+    ASSERT_EQ(RunSync(ThreadAfterResume(&t)), this_thread::get_id());
+    t.join();
+}
+
+TEST(TestTask, Start)
+{
+    // A dispatcher that queues the work until the test runs it
+    mutex queue_mutex;
+    deque<function<void()>> queue;
+    Dispatcher dispatcher = [&](function<void()> work) {
+        lock_guard<mutex> lock(queue_mutex);
+        queue.push_back(std::move(work));
+    };
+
+    // Without waiting, the task finishes within Start
+    int result = 0;
+    Start<int>(AddTwice(2, 3), dispatcher, [&](optional<int> value, exception_ptr exception) {
+        ASSERT_FALSE(exception);
+        result = *value;
+    });
+    ASSERT_EQ(result, 10);
+
+    // Tasks that wait don't hold the thread that started them
+    const size_t count = 100;
+    vector<thread> threads(count);
+    size_t done = 0;
+    for (size_t i = 0; i < count; i++) {
+        Start<thread::id>(ThreadAfterResume(&threads[i]), dispatcher,
+                          [&](optional<thread::id> value, exception_ptr exception) {
+                              ASSERT_FALSE(exception);
+                              ASSERT_EQ(*value, this_thread::get_id());
+                              done++;
+                          });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    ASSERT_EQ(done, 0);
+    ASSERT_EQ(queue.size(), count);
+    while (!queue.empty()) {
+        auto work = std::move(queue.front());
+        queue.pop_front();
+        work();
+    }
+    ASSERT_EQ(done, count);
+
+    // Exceptions are passed to `done`
+    bool threw = false;
+    Start<int>(Throw(), dispatcher, [&](optional<int> value, exception_ptr exception) {
+        ASSERT_FALSE(value);
+        threw = (bool)exception;
+    });
+    ASSERT_TRUE(threw);
+}
@@ -17,6 +17,9 @@
  *
  */
 
+#include <algorithm>
+#include <atomic>
+#include <mutex>
 #include "userdata.hpp"
 #include "datastore.hpp"
 #include "psicash.hpp"
@@ -28,45 +31,39 @@ using namespace std;
 
 namespace psicash {
 
-constexpr int kCurrentDatastoreVersion = 2;
+// Version 3 moved /user into its own datastore.
+constexpr int kCurrentDatastoreVersion = 3;
 
-// Datastore keys
-static auto kVersionPtr = "/v"_json_pointer;
+// Datastore keys. The frequently read integral values get slots, so reading them doesn't
+// walk the JSON tree.
+static constexpr DatastoreKey<int> kVersionKey{"/v", 0};
 //
 // Instance-specific data keys
 //
-static auto kInstancePtr = "/instance"_json_pointer;
-static const string INSTANCE_ID = "instanceID";
-static const auto kInstanceIDPtr = kInstancePtr / INSTANCE_ID;
-static constexpr const char* IS_LOGGED_OUT_ACCOUNT = "isLoggedOutAccount";
-static const auto kIsLoggedOutAccountPtr = kInstancePtr / IS_LOGGED_OUT_ACCOUNT;
-static constexpr const char* LOCALE = "locale";
-static const auto kLocalePtr = kInstancePtr / LOCALE;
+static constexpr DatastoreKey<json> kInstanceKey{"/instance"};
+static constexpr DatastoreKey<string> kInstanceIDKey{"/instance/instanceID"};
+static constexpr DatastoreKey<bool> kIsLoggedOutAccountKey{"/instance/isLoggedOutAccount", 1};
+static constexpr DatastoreKey<string> kLocaleKey{"/instance/locale"};
 //
 // User-specific data keys
 //
-static auto kUserPtr = "/user"_json_pointer;
-static constexpr const char* SERVER_TIME_DIFF = "serverTimeDiff";
-static const auto kServerTimeDiffPtr = kUserPtr / SERVER_TIME_DIFF;
-static constexpr const char* AUTH_TOKENS = "authTokens";
-static const auto kAuthTokensPtr = kUserPtr / AUTH_TOKENS;
-static constexpr const char* BALANCE = "balance";
-static const auto kBalancePtr = kUserPtr / BALANCE;
-static constexpr const char* IS_ACCOUNT = "isAccount";
-static const auto kIsAccountPtr = kUserPtr / IS_ACCOUNT;
-static constexpr const char* ACCOUNT_USERNAME = "accountUsername";
-static const auto kAccountUsernamePtr = kUserPtr / ACCOUNT_USERNAME;
-static constexpr const char* PURCHASE_PRICES = "purchasePrices";
-static const auto kPurchasePricesPtr = kUserPtr / PURCHASE_PRICES;
-static constexpr const char* PURCHASES = "purchases";
-static const auto kPurchasesPtr = kUserPtr / PURCHASES;
-static constexpr const char* LAST_TRANSACTION_ID = "lastTransactionID";
-static const auto kLastTransactionIDPtr = kUserPtr / LAST_TRANSACTION_ID;
-static const char* REQUEST_METADATA = "requestMetadata";
-const json::json_pointer kRequestMetadataPtr = kUserPtr / REQUEST_METADATA; // used in header, so not static
-static constexpr const char* COOKIES = "cookies";
-static const auto kCookiesPtr = kUserPtr / COOKIES;
-
+static constexpr DatastoreKey<json> kUserKey{"/user"};
+static constexpr DatastoreKey<int64_t> kServerTimeDiffKey{"/user/serverTimeDiff", 2};
+static constexpr DatastoreKey<AuthTokens> kAuthTokensKey{"/user/authTokens"};
+// The same value as kAuthTokensKey, decoded (and so cached) as an AuthTokenState.
+static constexpr DatastoreKey<AuthTokenState> kAuthTokenStateKey{kAuthTokensKey.path};
+static constexpr DatastoreKey<int64_t> kBalanceKey{"/user/balance", 3};
+static constexpr DatastoreKey<bool> kIsAccountKey{"/user/isAccount", 4};
+static constexpr DatastoreKey<string> kAccountUsernameKey{"/user/accountUsername"};
+static constexpr DatastoreKey<PurchasePrices> kPurchasePricesKey{"/user/purchasePrices"};
+static constexpr DatastoreKey<Purchases> kPurchasesKey{"/user/purchases"};
+static constexpr DatastoreKey<TransactionID> kLastTransactionIDKey{"/user/lastTransactionID"};
+static constexpr std::string_view kRequestMetadataPath = "/user/requestMetadata";
+const json::json_pointer kRequestMetadataPtr{string(kRequestMetadataPath)}; // used in header, so not static
+static constexpr DatastoreKey<string> kCookiesKey{"/user/cookies"};
+
+static_assert(DatastoreKeySlotsUnique({kVersionKey.slot, kIsLoggedOutAccountKey.slot, kServerTimeDiffKey.slot,
+                                       kBalanceKey.slot, kIsAccountKey.slot}));
 
 // These are the possible token types.
 const char* const kEarnerTokenType = "earner";
@@ -75,9 +72,77 @@ const char* const kIndicatorTokenType = "indicator";
 const char* const kAccountTokenType = "account";
 const char* const kLogoutTokenType = "logout";
 
+TokenTypeMask TokenTypeBit(std::string_view type) {
+    static const std::pair<std::string_view, TokenType> kTokenTypes[] = {
+        {kEarnerTokenType, TokenType::kEarner},
+        {kSpenderTokenType, TokenType::kSpender},
+        {kIndicatorTokenType, TokenType::kIndicator},
+        {kAccountTokenType, TokenType::kAccount},
+        {kLogoutTokenType, TokenType::kLogout},
+    };
+    for (const auto& tt : kTokenTypes) {
+        if (tt.first == type) {
+            return TokenTypeBit(tt.second);
+        }
+    }
+    return 0;
+}
+
+
+// Returns the authorization ID of a stored purchase, or null if it has no authorization.
+static const string* StoredAuthorizationID(const DatastoreJson& purchase) {
+    auto authorization = purchase.find("authorization");
+    if (authorization == purchase.end() || !authorization->is_object()) {
+        return nullptr;
+    }
+    auto id = authorization->find("ID");
+    return (id != authorization->end() && id->is_string()) ? id->get_ptr<const string*>() : nullptr;
+}
+
+// Returns the creation time of a stored purchase, defaulting as from_json(Purchase) does.
+static datetime::DateTime StoredServerTimeCreated(const DatastoreJson& purchase) {
+    auto created = purchase.find("serverTimeCreated");
+    if (created == purchase.end()) {
+        return datetime::DateTime(datetime::TimePoint(datetime::DurationFromInt64(1)));
+    }
+    return json(*created).get<datetime::DateTime>();
+}
+
+// Purchases only have to_json and from_json for json, so they're converted via that.
+static Purchase DecodeStoredPurchase(const DatastoreJson& purchase) {
+    return json(purchase).get<Purchase>();
+}
+
+static DatastoreJson EncodeStoredPurchase(const Purchase& purchase) {
+    return DatastoreJson(json(purchase));
+}
+
+// Adds `position` to the ascending positions indexed under `key`.
+static void IndexPosition(std::unordered_map<string, vector<size_t>>& index, const string& key, size_t position) {
+    auto& positions = index[key];
+    positions.insert(std::lower_bound(positions.begin(), positions.end(), position), position);
+}
+
+// Removes `position` from the positions indexed under `key`, if it's there.
+static void UnindexPosition(std::unordered_map<string, vector<size_t>>& index, const string& key, size_t position) {
+    auto found = index.find(key);
+    if (found == index.end()) {
+        return;
+    }
+    auto& positions = found->second;
+    auto it = std::lower_bound(positions.begin(), positions.end(), position);
+    if (it != positions.end() && *it == position) {
+        positions.erase(it);
+    }
+    if (positions.empty()) {
+        index.erase(found);
+    }
+}
 
 UserData::UserData()
-    : stashed_request_metadata_(json::object())
+    : purchase_index_(std::make_shared<PurchaseIndex>()), user_transaction_depth_(0),
+      published_purchase_index_generation_(0), next_subscription_id_(1),
+      stashed_request_metadata_(json::object())
 {
 }
 
@@ -88,47 +153,79 @@ static string DataStoreSuffix(bool dev) {
     return dev ? ".dev" : ".prod";
 }
 
-static auto FreshDatastore() {
+static string UserDataStoreSuffix(bool dev) {
+    return DataStoreSuffix(dev) + ".user";
+}
+
+static auto FreshInstanceDatastore() {
     json ds;
-    ds[kVersionPtr] = kCurrentDatastoreVersion;
-    ds[kUserPtr] = json::object();
-    ds[kInstancePtr] = json::object();
-    ds[kInstanceIDPtr] = "instanceid_"s + utils::RandomID();
+    ds[kVersionKey.Pointer()] = kCurrentDatastoreVersion;
+    ds[kInstanceKey.Pointer()] = json::object();
+    ds[kInstanceIDKey.Pointer()] = "instanceid_"s + utils::RandomID();
 
     return ds;
 }
 
-error::Error UserData::Init(const string& file_store_root, bool dev) {
-    auto err = datastore_.Init(file_store_root, DataStoreSuffix(dev));
+static auto FreshUserDatastore() {
+    json ds;
+    ds[kUserKey.Pointer()] = json::object();
+    return ds;
+}
+
+// Returns true if `path` is in the user datastore.
+static bool IsUserPath(std::string_view path) {
+    return path.substr(0, kUserKey.path.length()) == kUserKey.path
+           && (path.length() == kUserKey.path.length() || path[kUserKey.path.length()] == '/');
+}
+
+error::Error UserData::Init(const string& file_store_root, bool dev, const DatastoreOptions& datastore_options) {
+    auto err = instance_datastore_.Init(file_store_root, DataStoreSuffix(dev), datastore_options);
+    if (err) {
+        return PassError(err);
+    }
+    err = user_datastore_.Init(file_store_root, UserDataStoreSuffix(dev), datastore_options);
     if (err) {
         return PassError(err);
     }
 
-    auto version = datastore_.Get<int>(kVersionPtr);
+    // The instance datastore's version says where the user data is. Until it's updated,
+    // older versions' user data in the instance datastore is authoritative, so an
+    // interrupted migration is simply done again.
+    auto version = instance_datastore_.Get(kVersionKey);
     if (!version) {
-        err = datastore_.Reset(FreshDatastore());
-        if (err) {
+        if ((err = user_datastore_.Reset(FreshUserDatastore()))) {
+            return PassError(err);
+        }
+        if ((err = instance_datastore_.Reset(FreshInstanceDatastore()))) {
             return PassError(err);
         }
     }
-    else if (*version == 1) {
-        // We need to migrate from the structure where all data was at the root
-        // of the object, to one where the object looks like:
-        // {"v":2,"user":{old data},"instance":{new stuff}}
-
-        auto oldDS = datastore_.Get();
+    else if (*version == 1 || *version == 2) {
+        auto oldDS = instance_datastore_.Get();
         if (!oldDS) {
             // This should never happen. The version was successfully returned,
             // so we know there's a structure there and we should have got it.
-            return error::MakeCriticalError("failed to retrieve v1 data");
+            return error::MakeCriticalError("failed to retrieve old datastore");
         }
 
-        json newDS = FreshDatastore();
-        oldDS->erase("v");
-        newDS[kUserPtr] = *oldDS;
+        json newInstanceDS = FreshInstanceDatastore();
+        json newUserDS = FreshUserDatastore();
+        if (*version == 1) {
+            // All data was at the root of the object.
+            oldDS->erase("v");
+            newUserDS[kUserKey.Pointer()] = *oldDS;
+        }
+        else {
+            // The object looked like: {"v":2,"user":{user data},"instance":{instance data}}
+            newInstanceDS[kInstanceKey.Pointer()] = oldDS->value(kInstanceKey.Pointer(), json::object());
+            newUserDS[kUserKey.Pointer()] = oldDS->value(kUserKey.Pointer(), json::object());
+        }
 
-        err = datastore_.Reset(newDS);
-        if (err) {
+        // The user data must be safely stored before the version is updated.
+        if ((err = user_datastore_.Reset(newUserDS))) {
+            return PassError(err);
+        }
+        if ((err = instance_datastore_.Reset(newInstanceDS))) {
             return PassError(err);
         }
     }
@@ -138,31 +235,58 @@ error::Error UserData::Init(const string& file_store_root, bool dev) {
     }
     // else we've loaded a good, current datastore
 
+    // DeleteUserData sets the isLoggedOutAccount flag before it deletes the user data (see
+    // Transaction), so the flag is authoritative: a logged-out account has no tokens. If
+    // there are some, the process died mid-logout, and we finish the job.
+    if (GetIsLoggedOutAccount()) {
+        auto auth_tokens = user_datastore_.Get(kAuthTokensKey);
+        if (auth_tokens && !auth_tokens->empty()) {
+            if ((err = DeleteUserData(true))) {
+                return PassError(err);
+            }
+        }
+    }
+
     return error::nullerr;
 }
 
 error::Error UserData::Clear(const string& file_store_root, bool dev) {
-    return PassError(datastore_.Reset(
-        file_store_root, DataStoreSuffix(dev), FreshDatastore()));
+    if (auto err = user_datastore_.Reset(file_store_root, UserDataStoreSuffix(dev), FreshUserDatastore())) {
+        return PassError(err);
+    }
+    return PassError(instance_datastore_.Reset(
+        file_store_root, DataStoreSuffix(dev), FreshInstanceDatastore()));
 }
 
 error::Error UserData::Clear() {
-    return PassError(datastore_.Reset(FreshDatastore()));
+    if (auto err = user_datastore_.Reset(FreshUserDatastore())) {
+        return PassError(err);
+    }
+    return PassError(instance_datastore_.Reset(FreshInstanceDatastore()));
+}
+
+error::Error UserData::Flush() {
+    if (auto err = user_datastore_.Flush()) {
+        return PassError(err);
+    }
+    return PassError(instance_datastore_.Flush());
 }
 
 error::Error UserData::DeleteUserData(bool isLoggedOutAccount) {
     // We're about to delete the request metadata, so now is the time to stash it.
     SetStashedRequestMetadata(GetRequestMetadata());
 
+    // As the user data has its own datastore, this only rewrites a small file.
     Transaction transaction(*this);
+    InvalidatePurchaseIndex();
     // Not checking return values, since writing is paused.
-    (void)datastore_.Set(kUserPtr, json::object());
+    (void)user_datastore_.Set(kUserKey, json::object());
     (void)SetIsLoggedOutAccount(isLoggedOutAccount);
     return PassError(transaction.Commit());
 }
 
 std::string UserData::GetInstanceID() const {
-    auto v = datastore_.Get<string>(kInstanceIDPtr);
+    auto v = instance_datastore_.Get(kInstanceIDKey);
 
     // This should not happen. The instance ID must be initialized when the datastore is set up.
     assert(!!v);
@@ -171,12 +295,12 @@ std::string UserData::GetInstanceID() const {
 }
 
 bool UserData::HasInstanceID() const {
-    auto v = datastore_.Get<string>(kInstanceIDPtr);
+    auto v = instance_datastore_.Get(kInstanceIDKey);
     return !!v && v->length() > 0;
 }
 
 bool UserData::GetIsLoggedOutAccount() const {
-    auto v = datastore_.Get<bool>(kIsLoggedOutAccountPtr);
+    auto v = instance_datastore_.Get(kIsLoggedOutAccountKey);
     if (!v) {
         return false;
     }
@@ -184,11 +308,11 @@ bool UserData::GetIsLoggedOutAccount() const {
 }
 
 error::Error UserData::SetIsLoggedOutAccount(bool v) {
-    return PassError(datastore_.Set(kIsLoggedOutAccountPtr, v));
+    return PassError(instance_datastore_.Set(kIsLoggedOutAccountKey, v));
 }
 
 datetime::Duration UserData::GetServerTimeDiff() const {
-    auto v = datastore_.Get<int64_t>(kServerTimeDiffPtr);
+    auto v = user_datastore_.Get(kServerTimeDiffKey);
     if (!v) {
         return datetime::DurationFromInt64(0);
     }
@@ -202,7 +326,7 @@ error::Error UserData::SetServerTimeDiff(const datetime::DateTime& serverTimeNow
     // immediately. Also, it is generally done outside of a transaction and then followed
     // by a transaction, so it can lead to rapid datastore updates (which we suspect can
     // cause corruption issues).
-    return PassError(datastore_.Set(kServerTimeDiffPtr, datetime::DurationToInt64(diff), /*write_store=*/false));
+    return PassError(user_datastore_.Set(kServerTimeDiffKey, datetime::DurationToInt64(diff), /*write_store=*/false));
 }
 
 datetime::DateTime UserData::ServerTimeToLocal(const datetime::DateTime& server_time) const {
@@ -263,30 +387,63 @@ void to_json(json& j, const AuthTokens& v) {
     }
 }
 
+void from_json(const json& j, AuthTokenState& v) {
+    v = AuthTokenState();
+    if (!j.is_object()) {
+        return;
+    }
+    // As with from_json for AuthTokens, either format may be stored.
+    for (const auto& it : j.items()) {
+        TokenInfo info;
+        const auto& t = it.value();
+        if (t.is_string()) {
+            info.id = t.get<string>();
+        }
+        else if (t.is_object()) {
+            auto id = t.find("ID");
+            if (id != t.end() && id->is_string()) {
+                info.id = id->get<string>();
+            }
+            auto expiry = t.find("Expiry");
+            if (expiry != t.end() && expiry->is_string()) {
+                info.server_time_expiry = expiry->get<datetime::DateTime>();
+            }
+        }
+
+        if (!v.tokens.empty()) {
+            v.all_ids += ',';
+        }
+        v.all_ids += info.id;
+        v.types |= TokenTypeBit(it.key());
+        v.tokens.emplace(it.key(), std::move(info));
+    }
+}
+
 AuthTokens UserData::GetAuthTokens() const {
-    auto v = datastore_.Get<AuthTokens>(kAuthTokensPtr);
+    return GetAuthTokenState()->tokens;
+}
+
+std::shared_ptr<const AuthTokenState> UserData::GetAuthTokenState() const {
+    // Decoded values are cached by the datastore until the value changes.
+    auto v = user_datastore_.GetShared(kAuthTokenStateKey);
     if (!v) {
-        return AuthTokens();
+        static const auto empty = std::make_shared<const AuthTokenState>();
+        return empty;
     }
     return *v;
 }
 
 error::Error UserData::SetAuthTokens(const AuthTokens& v, bool is_account, const std::string& utf8_username) {
-    Transaction transaction(*this);
-    // Not checking errors while paused, as there's no error that can occur.
-    json json_tokens;
-    to_json(json_tokens, v);
-    (void)datastore_.Set(kAuthTokensPtr, json_tokens);
-    (void)datastore_.Set(kIsAccountPtr, is_account);
-    (void)datastore_.Set(kAccountUsernamePtr, utf8_username);
-
     // We may have request metadata that we stashed when the user data was deleted.
     // Setting auth tokens means we have user data once again, so we should restore that
     // request metadata. GetRequestMetadata automatically incorporates the stashed
     // metadata, so we're just going to get it and store it.
-    datastore_.Set(kRequestMetadataPtr, GetRequestMetadata());
-
-    return PassError(transaction.Commit()); // write
+    vector<pair<json::json_pointer, DatastoreJson>> values;
+    values.emplace_back(kAuthTokensKey.Pointer(), json(v));
+    values.emplace_back(kIsAccountKey.Pointer(), is_account);
+    values.emplace_back(kAccountUsernameKey.Pointer(), utf8_username);
+    values.emplace_back(kRequestMetadataPtr, GetRequestMetadata());
+    return PassError(user_datastore_.SetMany(std::move(values))); // one write
 }
 
 error::Error UserData::CullAuthTokens(const std::map<std::string, bool>& valid_tokens) {
@@ -299,44 +456,49 @@ error::Error UserData::CullAuthTokens(const std::map<std::string, bool>& valid_t
     // We handle _any_ invalid token as reason to blow away _all_ tokens. An incomplete
     // set is effectively the same as no set at all.
 
-    bool all_tokens_okay = true;
-
-    // all_auth_tokens is { "earner": {ID: "ABCD0123", Expiry: <>} } and valid_tokens is { "ABCD0123": true }
-    for (const auto& t : GetAuthTokens()) {
-        bool t_ok = false;
-        for (const auto& vtt : valid_tokens) {
-            if (vtt.first == t.second.id && vtt.second) {
-                t_ok = true;
-                break;
-            }
-        }
-
-        if (!t_ok) {
-            all_tokens_okay = false;
-            break;
-        }
-    }
+    // valid_tokens is keyed by token ID: { "ABCD0123": true }
+    auto token_state = GetAuthTokenState();
+    auto all_tokens_okay = std::all_of(
+            token_state->tokens.begin(), token_state->tokens.end(),
+            [&](const auto& t) {
+                auto valid = valid_tokens.find(t.second.id);
+                return !t.second.id.empty() && valid != valid_tokens.end() && valid->second;
+            });
 
+    // If there are no stored tokens, there's nothing invalid to clear
     if (all_tokens_okay) {
         // All our tokens are good, so there's nothing to do
         return error::nullerr;
     }
 
     // Clear all stored tokens
-    return PassError(datastore_.Set(kAuthTokensPtr, {}));
+    return PassError(user_datastore_.Set(kAuthTokensKey, AuthTokens()));
 }
 
 psicash::TokenTypes UserData::ValidTokenTypes() const {
-    auto auth_tokens = GetAuthTokens();
+    auto token_state = GetAuthTokenState();
     vector<string> valid_token_types;
-    for (const auto& it : auth_tokens) {
+    valid_token_types.reserve(token_state->tokens.size());
+    for (const auto& it : token_state->tokens) {
         valid_token_types.push_back(it.first);
     }
     return valid_token_types;
 }
 
+bool UserData::HasTokenTypes(const TokenTypes& types) const {
+    auto token_state = GetAuthTokenState();
+    return std::all_of(types.begin(), types.end(), [&](const string& type) {
+        auto bit = TokenTypeBit(type);
+        return bit ? (token_state->types & bit) != 0 : token_state->tokens.count(type) != 0;
+    });
+}
+
+bool UserData::HasTokenTypes(TokenTypeMask types) const {
+    return (GetAuthTokenState()->types & types) == types;
+}
+
 bool UserData::GetIsAccount() const {
-    auto v = datastore_.Get<bool>(kIsAccountPtr);
+    auto v = user_datastore_.Get(kIsAccountKey);
     if (!v) {
         return false;
     }
@@ -344,11 +506,11 @@ bool UserData::GetIsAccount() const {
 }
 
 error::Error UserData::SetIsAccount(bool v) {
-    return PassError(datastore_.Set(kIsAccountPtr, v));
+    return PassError(user_datastore_.Set(kIsAccountKey, v));
 }
 
 std::string UserData::GetAccountUsername() const {
-    auto v = datastore_.Get<string>(kAccountUsernamePtr);
+    auto v = user_datastore_.Get(kAccountUsernameKey);
     if (!v) {
         return "";
     }
@@ -356,11 +518,11 @@ std::string UserData::GetAccountUsername() const {
 }
 
 error::Error UserData::SetAccountUsername(const std::string& v) {
-    return PassError(datastore_.Set(kAccountUsernamePtr, v));
+    return PassError(user_datastore_.Set(kAccountUsernameKey, v));
 }
 
 int64_t UserData::GetBalance() const {
-    auto v = datastore_.Get<int64_t>(kBalancePtr);
+    auto v = user_datastore_.Get(kBalanceKey);
     if (!v) {
         return 0;
     }
@@ -368,23 +530,27 @@ int64_t UserData::GetBalance() const {
 }
 
 error::Error UserData::SetBalance(int64_t v) {
-    return PassError(datastore_.Set(kBalancePtr, v));
+    return PassError(user_datastore_.Set(kBalanceKey, v));
 }
 
 PurchasePrices UserData::GetPurchasePrices() const {
-    auto v = datastore_.Get<PurchasePrices>(kPurchasePricesPtr);
+    auto v = user_datastore_.Get(kPurchasePricesKey);
     if (!v) {
         return PurchasePrices();
     }
     return *v;
 }
 
+void UserData::ReadPurchasePrices(const std::function<void(const DatastoreJson&)>& fn) const {
+    (void)user_datastore_.Read(kPurchasePricesKey, fn);
+}
+
 error::Error UserData::SetPurchasePrices(const PurchasePrices& v) {
-    return PassError(datastore_.Set(kPurchasePricesPtr, v));
+    return PassError(user_datastore_.Set(kPurchasePricesKey, v));
 }
 
 Purchases UserData::GetPurchases() const {
-    auto v = datastore_.Get<Purchases>(kPurchasesPtr);
+    auto v = user_datastore_.Get(kPurchasesKey);
     if (!v) {
         v = Purchases();
     }
@@ -393,16 +559,29 @@ Purchases UserData::GetPurchases() const {
     return *v;
 }
 
+void UserData::ReadPurchases(const std::function<void(const DatastoreJson&)>& fn) const {
+    (void)user_datastore_.Read(kPurchasesKey, fn);
+}
+
 error::Error UserData::SetPurchases(const Purchases& v) {
-    return PassError(datastore_.Set(kPurchasesPtr, v));
+    Transaction transaction(*this, Shards::kUser);
+    InvalidatePurchaseIndex();
+    if (auto err = user_datastore_.Set(kPurchasesKey, v)) {
+        return PassError(err);
+    }
+    return PassError(transaction.Commit());
 }
 
 error::Error UserData::AddPurchase(const Purchase& v) {
-    // We're not going to assume too much about the incoming purchase: it might be a
-    // duplicate, or it might not be as new as the newest purchase we already have.
+    return PassError(AddPurchases({v}));
+}
+
+error::Error UserData::AddPurchases(Purchases&& purchases) {
+    // We're not going to assume too much about the incoming purchases: they might be
+    // duplicates, or they might not be as new as the newest purchase we already have.
 
     // Assumption: The purchases vector is already sorted by created date ascending.
-    // Assumption: The ID of our purchase argument should become our LastTransactionID.
+    // Assumption: The ID of the last purchase argument should become our LastTransactionID.
     //   This will be true _even if_ there are purchases in our datastore with later
     //   created dates.
     //   - If this purchase is being added due to, say, NewExpiringPurchase, then the
@@ -413,39 +592,322 @@ error::Error UserData::AddPurchase(const Purchase& v) {
     //     RefreshState is giving us everything, then we need to replace it with the
     //     purchases we're storing, as we store them.
 
-    // TODO: If/when we start dealing with large numbers of purchases being added,
-    // (e.g., when we have a large number of a non-instance-specific purchases and the
-    // user is doing a full retrieve), the work here should be done more efficiently
-    // (like in a batch).
-    // (Of course, we might also have to rethink our datastore at that point.)
+    if (purchases.empty()) {
+        return error::nullerr;
+    }
+    auto last_transaction_id = purchases.back().id;
 
-    auto purchases = GetPurchases();
+    Transaction transaction(*this, Shards::kUser);
+    auto& index = LockedPurchaseIndex();
 
-    for (auto iter = purchases.begin(); ; iter++) {
-        if (iter == purchases.end()) {
-            // We searched to the end and didn't find a duplicate or insertion point.
-            // Put the new purchase at the end.
-            purchases.insert(iter, v);
-            break;
+    // Duplicates of stored purchases replace our stored copies, in case we have bad data.
+    // Within the batch, a later copy of a purchase replaces an earlier one.
+    vector<pair<json::json_pointer, DatastoreJson>> replacements;
+    Purchases added;
+    std::unordered_map<TransactionID, size_t> added_by_id;
+    for (auto& p : purchases) {
+        auto stored = index.by_id.find(p.id);
+        if (stored != index.by_id.end()) {
+            // If we have more than one copy, the first is the one that gets replaced.
+            auto position = stored->second.front();
+            auto pointer = kPurchasesKey.Pointer() / position;
+            (void)user_datastore_.Read(pointer, [&](const DatastoreJson& old) {
+                if (auto auth_id = StoredAuthorizationID(old)) {
+                    UnindexPosition(index.by_authorization_id, *auth_id, position);
+                }
+            });
+            if (p.authorization) {
+                IndexPosition(index.by_authorization_id, p.authorization->id, position);
+            }
+            index.created[position] = p.server_time_created;
+            replacements.emplace_back(std::move(pointer), EncodeStoredPurchase(p));
+            continue;
+        }
+        auto [added_position, inserted] = added_by_id.emplace(p.id, added.size());
+        if (inserted) {
+            added.push_back(std::move(p));
         }
-        else if (iter->id == v.id) {
-            // This is a duplicate. Update our local copy in case we have bad data.
-            *iter = v;
-            break;
+        else {
+            added[added_position->second] = std::move(p);
         }
-        else if (iter->server_time_created > v.server_time_created) {
-            // We have found the sorted insertion point.
-            purchases.insert(iter, v);
-            break;
+    }
+    if (!replacements.empty()) {
+        if (auto err = user_datastore_.SetMany(std::move(replacements))) {
+            return PassError(err);
         }
     }
 
-    // Use transaction to set Purchases and LastTransactionID in one write
-    Transaction transaction(*this);
-    // These don't write, so have no meaningful return
-    (void)SetPurchases(purchases);
-    (void)SetLastTransactionID(v.id);
-    return PassError(transaction.Commit()); // write
+    // Each new purchase goes after any purchases created at the same time.
+    std::stable_sort(added.begin(), added.end(), [](const Purchase& a, const Purchase& b) {
+        return a.server_time_created < b.server_time_created;
+    });
+    const auto stored_count = index.created.size();
+    vector<pair<json::json_pointer, DatastoreJson>> values;
+    auto index_added = [&](const Purchase& p, size_t position) {
+        IndexPosition(index.by_id, p.id, position);
+        if (p.authorization) {
+            IndexPosition(index.by_authorization_id, p.authorization->id, position);
+        }
+    };
+    if (added.empty()) {
+        // Only duplicates
+    }
+    else if (stored_count > 0 && !(added.front().server_time_created < index.created.back())) {
+        // The usual case: the new purchases are the newest, so they're appended.
+        for (auto& p : added) {
+            index_added(p, index.created.size());
+            index.created.push_back(p.server_time_created);
+            values.emplace_back(kPurchasesKey.Pointer() / (index.created.size() - 1), EncodeStoredPurchase(p));
+        }
+    }
+    else {
+        // Merge the new purchases into the stored ones, rewriting the array once.
+        DatastoreJson stored = DatastoreJson::array();
+        (void)user_datastore_.Read(kPurchasesKey, [&](const DatastoreJson& v) {
+            if (v.is_array()) {
+                stored = v;
+            }
+        });
+        DatastoreJson merged = DatastoreJson::array();
+        merged.get_ref<DatastoreJson::array_t&>().reserve(stored_count + added.size());
+        vector<size_t> new_positions(stored_count);
+        vector<datetime::DateTime> created;
+        created.reserve(stored_count + added.size());
+        vector<size_t> added_positions;
+        size_t next_stored = 0;
+        for (const auto& p : added) {
+            while (next_stored < stored_count && !(p.server_time_created < index.created[next_stored])) {
+                new_positions[next_stored] = merged.size();
+                created.push_back(index.created[next_stored]);
+                merged.push_back(std::move(stored[next_stored++]));
+            }
+            added_positions.push_back(merged.size());
+            created.push_back(p.server_time_created);
+            merged.push_back(EncodeStoredPurchase(p));
+        }
+        for (; next_stored < stored_count; next_stored++) {
+            new_positions[next_stored] = merged.size();
+            created.push_back(index.created[next_stored]);
+            merged.push_back(std::move(stored[next_stored]));
+        }
+
+        // The stored purchases keep their order, so each key's positions stay ascending.
+        for (auto* by_key : {&index.by_id, &index.by_authorization_id}) {
+            for (auto& indexed : *by_key) {
+                for (auto& position : indexed.second) {
+                    position = new_positions[position];
+                }
+            }
+        }
+        index.created = std::move(created);
+        for (size_t i = 0; i < added.size(); i++) {
+            index_added(added[i], added_positions[i]);
+        }
+        values.emplace_back(kPurchasesKey.Pointer(), std::move(merged));
+    }
+
+    // Set Purchases and LastTransactionID in one write
+    values.emplace_back(kLastTransactionIDKey.Pointer(), std::move(last_transaction_id));
+    if (auto err = user_datastore_.SetMany(std::move(values))) {
+        return PassError(err);
+    }
+    return PassError(transaction.Commit());
+}
+
+error::Result<Purchases> UserData::RemovePurchases(const vector<TransactionID>& ids) {
+    Transaction transaction(*this, Shards::kUser);
+    auto& index = LockedPurchaseIndex();
+
+    vector<size_t> positions;
+    for (const auto& id : ids) {
+        auto found = index.by_id.find(id);
+        if (found != index.by_id.end()) {
+            positions.insert(positions.end(), found->second.begin(), found->second.end());
+        }
+    }
+    if (positions.empty()) {
+        (void)transaction.Commit();
+        return Purchases();
+    }
+    std::sort(positions.begin(), positions.end());
+    positions.erase(std::unique(positions.begin(), positions.end()), positions.end());
+
+    Purchases removed;
+    DatastoreJson remaining = DatastoreJson::array();
+    auto read = user_datastore_.Read(kPurchasesKey, [&](const DatastoreJson& stored) {
+        auto next_removed = positions.begin();
+        for (size_t i = 0; i < stored.size(); i++) {
+            if (next_removed != positions.end() && *next_removed == i) {
+                removed.push_back(DecodeStoredPurchase(stored[i]));
+                next_removed++;
+            }
+            else {
+                remaining.push_back(stored[i]);
+            }
+        }
+    });
+    if (!read) {
+        return error::MakeCriticalError("failed to read purchases");
+    }
+
+    // Every purchase after a removed one moves up.
+    auto reindex = [&](std::unordered_map<string, vector<size_t>>& by_key) {
+        for (auto it = by_key.begin(); it != by_key.end(); ) {
+            auto& indexed = it->second;
+            size_t kept = 0;
+            for (auto position : indexed) {
+                auto preceding = std::lower_bound(positions.begin(), positions.end(), position);
+                if (preceding != positions.end() && *preceding == position) {
+                    continue;
+                }
+                indexed[kept++] = position - (preceding - positions.begin());
+            }
+            indexed.resize(kept);
+            it = indexed.empty() ? by_key.erase(it) : std::next(it);
+        }
+    };
+    reindex(index.by_id);
+    reindex(index.by_authorization_id);
+    for (auto it = positions.rbegin(); it != positions.rend(); ++it) {
+        index.created.erase(index.created.begin() + *it);
+    }
+
+    if (auto err = user_datastore_.Set(kPurchasesKey.Pointer(), std::move(remaining))) {
+        return WrapError(err, "failed to store remaining purchases");
+    }
+    if (auto err = transaction.Commit()) {
+        return PassError(err);
+    }
+
+    UpdatePurchasesLocalTimeExpiry(removed);
+    return removed;
+}
+
+Purchases UserData::GetPurchasesByAuthorizationID(const vector<string>& authorization_ids) const {
+    // The index and the purchases we read must come from the same state.
+    Datastore::ConsistentRead consistent_read(user_datastore_);
+    auto index = ReadPurchaseIndex();
+
+    vector<size_t> positions;
+    for (const auto& id : authorization_ids) {
+        auto found = index->by_authorization_id.find(id);
+        if (found != index->by_authorization_id.end()) {
+            positions.insert(positions.end(), found->second.begin(), found->second.end());
+        }
+    }
+    std::sort(positions.begin(), positions.end());
+    positions.erase(std::unique(positions.begin(), positions.end()), positions.end());
+
+    Purchases purchases;
+    if (!positions.empty()) {
+        (void)user_datastore_.Read(kPurchasesKey, [&](const DatastoreJson& stored) {
+            for (auto i : positions) {
+                purchases.push_back(DecodeStoredPurchase(stored.at(i)));
+            }
+        });
+    }
+
+    UpdatePurchasesLocalTimeExpiry(purchases);
+    return purchases;
+}
+
+error::Error UserData::EndUserTransaction(bool commit) {
+    if (--user_transaction_depth_ > 0) {
+        return PassError(user_datastore_.EndTransaction(commit));
+    }
+
+    auto changed_index = purchase_index_->uncommitted;
+    if (changed_index) {
+        purchase_index_->uncommitted = false;
+        if (!commit) {
+            InvalidatePurchaseIndex();
+        }
+    }
+    auto err = user_datastore_.EndTransaction(commit);
+    if (commit && changed_index && !err) {
+        // Now that the changes are visible to readers, so is the index. We need the lock
+        // again, so that no other commit gets in before we've tagged it.
+        user_datastore_.BeginTransaction();
+        if (purchase_index_->reset_generation == user_datastore_.ResetGeneration()) {
+            std::lock_guard<std::mutex> lock(published_purchase_index_mutex_);
+            published_purchase_index_ = purchase_index_;
+            published_purchase_index_generation_ = user_datastore_.ChangeGeneration(kPurchasesKey.path);
+        }
+        (void)user_datastore_.EndTransaction(true);
+    }
+    return PassError(err);
+}
+
+UserData::PurchaseIndex UserData::BuildPurchaseIndex() const {
+    PurchaseIndex index;
+    (void)user_datastore_.Read(kPurchasesKey, [&](const DatastoreJson& stored) {
+        if (!stored.is_array()) {
+            return;
+        }
+        index.created.reserve(stored.size());
+        for (size_t i = 0; i < stored.size(); i++) {
+            const auto& purchase = stored[i];
+            index.by_id[purchase.at("id").get<string>()].push_back(i);
+            if (auto auth_id = StoredAuthorizationID(purchase)) {
+                index.by_authorization_id[*auth_id].push_back(i);
+            }
+            index.created.push_back(StoredServerTimeCreated(purchase));
+        }
+    });
+    return index;
+}
+
+UserData::PurchaseIndex& UserData::LockedPurchaseIndex() {
+    {
+        // Readers can't pick up the index while we change it.
+        std::lock_guard<std::mutex> lock(published_purchase_index_mutex_);
+        if (published_purchase_index_ == purchase_index_) {
+            published_purchase_index_.reset();
+        }
+    }
+    // Any readers that still hold it have one of their own.
+    if (purchase_index_.use_count() > 1) {
+        purchase_index_ = std::make_shared<PurchaseIndex>(*purchase_index_);
+    }
+    else {
+        // Pairs with the release of the readers' references.
+        std::atomic_thread_fence(std::memory_order_acquire);
+    }
+
+    auto reset_generation = user_datastore_.ResetGeneration();
+    if (purchase_index_->reset_generation != reset_generation) {
+        *purchase_index_ = BuildPurchaseIndex();
+        purchase_index_->reset_generation = reset_generation;
+    }
+    // Building or changing the index inside the transaction makes it uncommitted.
+    purchase_index_->uncommitted = true;
+    return *purchase_index_;
+}
+
+void UserData::InvalidatePurchaseIndex() {
+    // Readers might be holding the old one.
+    purchase_index_ = std::make_shared<PurchaseIndex>();
+}
+
+std::shared_ptr<const UserData::PurchaseIndex> UserData::ReadPurchaseIndex() const {
+    // Zero if what we see isn't the latest committed state, which we don't cache.
+    auto generation = user_datastore_.ReadChangeGeneration(kPurchasesKey.path);
+    if (generation != 0) {
+        std::lock_guard<std::mutex> lock(published_purchase_index_mutex_);
+        if (published_purchase_index_ && published_purchase_index_generation_ == generation) {
+            return published_purchase_index_;
+        }
+    }
+
+    auto index = std::make_shared<const PurchaseIndex>(BuildPurchaseIndex());
+    if (generation != 0) {
+        std::lock_guard<std::mutex> lock(published_purchase_index_mutex_);
+        if (generation > published_purchase_index_generation_) {
+            published_purchase_index_ = index;
+            published_purchase_index_generation_ = generation;
+        }
+    }
+    return index;
 }
 
 void UserData::UpdatePurchaseLocalTimeExpiry(Purchase& purchase) const {
@@ -463,7 +925,7 @@ void UserData::UpdatePurchasesLocalTimeExpiry(Purchases& purchases) const {
 }
 
 TransactionID UserData::GetLastTransactionID() const {
-    auto v = datastore_.Get<TransactionID>(kLastTransactionIDPtr);
+    auto v = user_datastore_.Get(kLastTransactionIDKey);
     if (!v) {
         return TransactionID();
     }
@@ -471,11 +933,22 @@ TransactionID UserData::GetLastTransactionID() const {
 }
 
 error::Error UserData::SetLastTransactionID(const TransactionID& v) {
-    return PassError(datastore_.Set(kLastTransactionIDPtr, v));
+    return PassError(user_datastore_.Set(kLastTransactionIDKey, v));
+}
+
+error::Error UserData::SetRequestMetadataItems(const std::map<std::string, std::string>& items) {
+    vector<pair<json::json_pointer, DatastoreJson>> values;
+    for (const auto& it : items) {
+        if (it.first.empty()) {
+            return error::MakeCriticalError("Metadata key cannot be empty");
+        }
+        values.emplace_back(kRequestMetadataPtr / it.first, it.second);
+    }
+    return PassError(user_datastore_.SetMany(std::move(values)));
 }
 
 json UserData::GetRequestMetadata() const {
-    auto j = datastore_.Get<json>(kRequestMetadataPtr);
+    auto j = user_datastore_.Get<json>(kRequestMetadataPtr);
     auto stored = json::object();
     if (j) {
         stored = *j;
@@ -491,7 +964,7 @@ json UserData::GetRequestMetadata() const {
 }
 
 std::string UserData::GetLocale() const {
-    auto v = datastore_.Get<string>(kLocalePtr);
+    auto v = instance_datastore_.Get(kLocaleKey);
     if (!v) {
         return "";
     }
@@ -499,11 +972,11 @@ std::string UserData::GetLocale() const {
 }
 
 error::Error UserData::SetLocale(const std::string& v) {
-    return PassError(datastore_.Set(kLocalePtr, v));
+    return PassError(instance_datastore_.Set(kLocaleKey, v));
 }
 
 std::string UserData::GetCookies() const {
-    auto v = datastore_.Get<string>(kCookiesPtr);
+    auto v = user_datastore_.Get(kCookiesKey);
     if (!v) {
         return "";
     }
@@ -511,7 +984,103 @@ std::string UserData::GetCookies() const {
 }
 
 error::Error UserData::SetCookies(const std::string& v) {
-    return PassError(datastore_.Set(kCookiesPtr, v));
+    return PassError(user_datastore_.Set(kCookiesKey, v));
+}
+
+uint64_t UserData::RequestHeadersGeneration() const {
+    // The stashed request metadata only changes along with the stored user data (in
+    // DeleteUserData), so it doesn't need a generation of its own.
+    static constexpr std::string_view kPaths[] = {
+        kCookiesKey.path, kAuthTokensKey.path, kRequestMetadataPath};
+    uint64_t generation = 0;
+    for (auto path : kPaths) {
+        auto g = user_datastore_.ReadChangeGeneration(path);
+        if (g == 0) {
+            return 0;
+        }
+        generation = std::max(generation, g);
+    }
+    return generation;
+}
+
+// Returns the datastore paths of the values that make up `field`.
+static vector<string> StateFieldPaths(StateField field) {
+    switch (field) {
+        case StateField::Balance:
+            return {string(kBalanceKey.path)};
+        case StateField::Purchases:
+            return {string(kPurchasesKey.path)};
+        case StateField::PurchasePrices:
+            return {string(kPurchasePricesKey.path)};
+        case StateField::Tokens:
+            return {string(kAuthTokensKey.path)};
+        case StateField::IsAccount:
+            return {string(kIsAccountKey.path), string(kIsLoggedOutAccountKey.path)};
+        case StateField::AccountUsername:
+            return {string(kAccountUsernameKey.path)};
+    }
+    return {};
+}
+
+uint64_t UserData::ChangeGeneration(StateField field) const {
+    // Generations come from one process-wide counter, so those of different datastores
+    // can be compared.
+    uint64_t generation = 0;
+    for (const auto& path : StateFieldPaths(field)) {
+        const auto& datastore = IsUserPath(path) ? user_datastore_ : instance_datastore_;
+        generation = std::max(generation, datastore.ChangeGeneration(path));
+    }
+    return generation;
+}
+
+StateSubscriptionID UserData::Subscribe(vector<StateField> fields, StateChangeCallback callback) {
+    vector<string> user_paths, instance_paths;
+    for (auto field : fields) {
+        for (auto& path : StateFieldPaths(field)) {
+            (IsUserPath(path) ? user_paths : instance_paths).push_back(std::move(path));
+        }
+    }
+
+    auto on_change = [fields, callback](const vector<string>& changed_paths) {
+        vector<StateField> changed;
+        for (auto field : fields) {
+            for (const auto& path : StateFieldPaths(field)) {
+                if (std::find(changed_paths.begin(), changed_paths.end(), path) != changed_paths.end()) {
+                    changed.push_back(field);
+                    break;
+                }
+            }
+        }
+        callback(changed);
+    };
+
+    std::lock_guard<std::mutex> lock(subscriptions_mutex_);
+    auto id = next_subscription_id_++;
+    auto& subscriptions = subscriptions_[id];
+    if (!user_paths.empty()) {
+        subscriptions.emplace_back(&user_datastore_, user_datastore_.Subscribe(user_paths, on_change));
+    }
+    if (!instance_paths.empty()) {
+        subscriptions.emplace_back(&instance_datastore_, instance_datastore_.Subscribe(instance_paths, on_change));
+    }
+    return id;
+}
+
+void UserData::Unsubscribe(StateSubscriptionID id) {
+    vector<pair<Datastore*, Datastore::SubscriptionID>> subscriptions;
+    {
+        std::lock_guard<std::mutex> lock(subscriptions_mutex_);
+        auto found = subscriptions_.find(id);
+        if (found == subscriptions_.end()) {
+            return;
+        }
+        subscriptions = std::move(found->second);
+        subscriptions_.erase(found);
+    }
+    // Not holding the lock, as this waits for any callback in progress.
+    for (const auto& subscription : subscriptions) {
+        subscription.first->Unsubscribe(subscription.second);
+    }
 }
 
 json UserData::GetStashedRequestMetadata() const {
@@ -21,6 +21,10 @@
 #define PSICASHLIB_USERDATA_H
 
 #include <cstdint>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 #include "datastore.hpp"
 #include "psicash.hpp"
 #include "datetime.hpp"
@@ -44,9 +48,29 @@ extern const char* const kIndicatorTokenType;
 extern const char* const kAccountTokenType;
 extern const char* const kLogoutTokenType;
 
+/// The token types above, interned so that sets of them can be held as bitmasks.
+enum class TokenType { kEarner, kSpender, kIndicator, kAccount, kLogout };
+using TokenTypeMask = uint32_t;
+constexpr TokenTypeMask TokenTypeBit(TokenType type) { return TokenTypeMask(1) << static_cast<int>(type); }
+/// Returns the bit for the named token type, or 0 if it isn't one of the types above.
+TokenTypeMask TokenTypeBit(std::string_view type);
+
+/// The stored auth tokens, decoded along with what most requests need from them.
+struct AuthTokenState {
+    AuthTokens tokens;
+    /// The known types (see TokenType) among the tokens.
+    TokenTypeMask types = 0;
+    /// The IDs of all of the tokens, in type order, comma-delimited.
+    std::string all_ids;
+};
+/// Unlike the AuthTokens from_json, this doesn't throw for malformed tokens -- they're
+/// given empty IDs, so they won't be taken as valid.
+void from_json(const nlohmann::json& j, AuthTokenState& v);
+
 
 /// Storage and retrieval (and some processing) of PsiCash user data/state.
-/// UserData operations are threadsafe (via Datastore).
+/// UserData operations are threadsafe (via Datastore). Use ConsistentRead to read
+/// multiple values from the same state.
 class UserData {
 public:
     UserData();
@@ -55,8 +79,10 @@ public:
 
     /// Must be called once.
     /// dev should be true if this instance is communicating with the dev server.
+    /// datastore_options controls how the datastore persists changes.
     /// Returns false if there's an unrecoverable error (such as an inability to use the filesystem).
-    error::Error Init(const std::string& file_store_root, bool dev);
+    error::Error Init(const std::string& file_store_root, bool dev,
+                      const DatastoreOptions& datastore_options=DatastoreOptions());
 
     /// Clears data and datastore file. Calling this does not change the initialized
     /// state. If the datastore was already initialized with a different file_root+suffix,
@@ -67,26 +93,68 @@ public:
     /// Init() must have already been called, successfully.
     error::Error Clear();
 
+    /// Writes any committed changes that have not yet been written to disk. Needed for
+    /// durability when the datastore is using async_writes.
+    error::Error Flush();
+
+    /// The instance data and the user data are stored separately, each with its own file
+    /// and lock, so that changing one doesn't rewrite (or wait for) the other.
+    enum class Shards { kInstance = 1, kUser = 2, kAll = 3 };
+
     /// Used to wrap datastore "transactions" (paused writing, mutexed access).
     /// Transaction can be nested -- inner instances will do nothing.
+    /// A transaction only needs to include the shards it changes. A transaction over both
+    /// shards commits the instance shard first, so if the process dies before the user
+    /// shard is written, only the instance shard's changes survive. In particular, a
+    /// logout leaves the isLoggedOutAccount flag set with the user data not yet deleted,
+    /// which Init detects and completes.
     class Transaction {
     public:
-        Transaction(UserData& user_data) : user_data_(user_data), in_transaction_(false)
-            { user_data_.datastore_.BeginTransaction(); in_transaction_ = true; };
+        Transaction(UserData& user_data, Shards shards=Shards::kAll)
+            : user_data_(user_data), shards_(shards), in_transaction_(false) {
+            // Always lock in the same order, so that transactions can't deadlock.
+            if (Includes(Shards::kInstance)) { user_data_.instance_datastore_.BeginTransaction(); }
+            if (Includes(Shards::kUser)) {
+                user_data_.user_datastore_.BeginTransaction();
+                user_data_.user_transaction_depth_++;
+            }
+            in_transaction_ = true;
+        }
         ~Transaction() { if (in_transaction_) { (void)Rollback(); } }
         error::Error Commit() { return End(true); }
         error::Error Rollback() { return End(false); }
     private:
+        bool Includes(Shards shard) const { return ((int)shards_ & (int)shard) != 0; }
         error::Error End(bool commit) {
-            if (in_transaction_) {
-                in_transaction_ = false; return user_data_.datastore_.EndTransaction(commit);
+            if (!in_transaction_) {
+                return error::nullerr;
             }
-            return error::nullerr;
+            in_transaction_ = false;
+            error::Error err;
+            if (Includes(Shards::kInstance)) { err = user_data_.instance_datastore_.EndTransaction(commit); }
+            if (Includes(Shards::kUser)) {
+                auto user_err = user_data_.EndUserTransaction(commit);
+                if (!err) { err = user_err; }
+            }
+            return err;
         }
         UserData& user_data_;
+        Shards shards_;
         bool in_transaction_;
     };
 
+    /// While an instance is alive, all reads made by the creating thread see the same
+    /// datastore state, so a set of values read together will be consistent.
+    /// Can be nested -- inner instances will do nothing.
+    class ConsistentRead {
+    public:
+        ConsistentRead(const UserData& user_data)
+            : instance_read_(user_data.instance_datastore_), user_read_(user_data.user_datastore_) {}
+    private:
+        Datastore::ConsistentRead instance_read_;
+        Datastore::ConsistentRead user_read_;
+    };
+
 public:
     /// Deletes the stored user data and sets the isLoggedOutAccount flag.
     error::Error DeleteUserData(bool isLoggedOutAccount);
@@ -106,11 +174,19 @@ public:
     void UpdatePurchaseLocalTimeExpiry(Purchase& purchase) const;
 
     AuthTokens GetAuthTokens() const;
+    /// Returns the stored tokens, decoded. The state is only decoded again after the
+    /// tokens change (by SetAuthTokens, CullAuthTokens, DeleteUserData, etc.), so this
+    /// is cheap enough to call on every request.
+    std::shared_ptr<const AuthTokenState> GetAuthTokenState() const;
     /// `utf8_username` must be set if `is_account` is true.
     error::Error SetAuthTokens(const AuthTokens& v, bool is_account, const std::string& utf8_username);
     /// valid_token_types is of the form {"tokenvalueABCD0123": true, ...}
     error::Error CullAuthTokens(const std::map<std::string, bool>& valid_tokens);
     psicash::TokenTypes ValidTokenTypes() const;
+    /// Returns true if there are stored tokens of all of the given types.
+    bool HasTokenTypes(const TokenTypes& types) const;
+    /// Returns true if there are stored tokens of all of the types in the mask.
+    bool HasTokenTypes(TokenTypeMask types) const;
 
     bool GetIsAccount() const;
     /// Note that setting is-account to true does _not_ populate the account username field.
@@ -123,14 +199,30 @@ public:
     error::Error SetBalance(int64_t v);
 
     PurchasePrices GetPurchasePrices() const;
+    /// Like ReadPurchases, for the purchase prices.
+    void ReadPurchasePrices(const std::function<void(const DatastoreJson&)>& fn) const;
     error::Error SetPurchasePrices(const PurchasePrices& v);
 
     Purchases GetPurchases() const;
+    /// Calls `fn` with the stored purchases JSON, without copying or decoding it. Does
+    /// nothing if there are no stored purchases.
+    void ReadPurchases(const std::function<void(const DatastoreJson&)>& fn) const;
     /// Does not update LastTransactionID. This must only be called when storing a subset
     /// of the already-existing purchases. Also, the vector must still be sorted.
     error::Error SetPurchases(const Purchases& v);
     /// Does update LastTransactionID.
     error::Error AddPurchase(const Purchase& v);
+    /// Adds all of the purchases with one write, as if by calling AddPurchase for each in
+    /// turn: LastTransactionID is set to the last one's ID.
+    error::Error AddPurchases(Purchases&& purchases);
+    /// Removes the purchases with the given transaction IDs, returning the ones that were
+    /// found and removed. Does not update LastTransactionID.
+    /// The purchases are found without a scan, but the stored array is still rewritten,
+    /// so this is O(n) in the number of stored purchases.
+    error::Result<Purchases> RemovePurchases(const std::vector<TransactionID>& ids);
+    /// Returns the purchases with authorizations having the given IDs, in stored order.
+    /// Doesn't take the datastore lock, so it isn't held up by writes.
+    Purchases GetPurchasesByAuthorizationID(const std::vector<std::string>& authorization_ids) const;
 
     TransactionID GetLastTransactionID() const;
     error::Error SetLastTransactionID(const TransactionID& v);
@@ -142,8 +234,10 @@ public:
             return error::MakeCriticalError("Metadata key cannot be empty");
         }
         auto ptr = kRequestMetadataPtr / key;
-        return datastore_.Set(ptr, val);
+        return user_datastore_.Set(ptr, val);
     }
+    /// Sets all of the items in one write.
+    error::Error SetRequestMetadataItems(const std::map<std::string, std::string>& items);
 
     std::string GetLocale() const;
     error::Error SetLocale(const std::string& v);
@@ -151,6 +245,17 @@ public:
     std::string GetCookies() const;
     error::Error SetCookies(const std::string& v);
 
+    /// Returns a number that changes whenever the values that go into request headers
+    /// (cookies, auth tokens, request metadata) change, so that headers built from them
+    /// can be cached. Returns zero if what this thread reads can't be cached against (see
+    /// Datastore::ReadChangeGeneration).
+    uint64_t RequestHeadersGeneration() const;
+
+    /// See the PsiCash methods of the same names.
+    uint64_t ChangeGeneration(StateField field) const;
+    StateSubscriptionID Subscribe(std::vector<StateField> fields, StateChangeCallback callback);
+    void Unsubscribe(StateSubscriptionID id);
+
 protected:
     /// Modifies the purchases in the argument.
     void UpdatePurchasesLocalTimeExpiry(Purchases& purchases) const;
@@ -159,7 +264,65 @@ protected:
     void SetStashedRequestMetadata(const nlohmann::json& j);
 
 private:
-    Datastore datastore_;
+    /// Ends a transaction on the user datastore, first discarding the purchase index if
+    /// it reflects changes that are being rolled back.
+    error::Error EndUserTransaction(bool commit);
+
+    /// Where the stored purchases are in the stored array, so that they can be found
+    /// without scanning (or decoding) all of them.
+    struct PurchaseIndex {
+        /// The user datastore's ResetGeneration when the index was built. Zero if the
+        /// index needs to be rebuilt.
+        uint64_t reset_generation = 0;
+        /// True if the index has been built or changed during the ongoing transaction.
+        bool uncommitted = false;
+        /// The positions of the purchases with each key, in ascending order. The stored
+        /// purchases aren't guaranteed to have distinct IDs.
+        std::unordered_map<TransactionID, std::vector<size_t>> by_id;
+        std::unordered_map<std::string, std::vector<size_t>> by_authorization_id;
+        /// The server_time_created of each stored purchase, in stored (and so ascending)
+        /// order.
+        std::vector<datetime::DateTime> created;
+    };
+
+    /// Builds an index of the stored purchases that this thread sees.
+    PurchaseIndex BuildPurchaseIndex() const;
+    /// Returns the purchase index for the current state, rebuilding it if necessary, for
+    /// the caller to change. Must only be called inside a Transaction that includes the
+    /// user shard.
+    PurchaseIndex& LockedPurchaseIndex();
+    /// Marks the purchase index as needing to be rebuilt. Must be called, inside a
+    /// Transaction, whenever the stored purchases are changed other than by AddPurchase
+    /// or RemovePurchases.
+    void InvalidatePurchaseIndex();
+    /// Returns an index of the stored purchases that this thread sees, without locking
+    /// the datastore. The caller should hold a Datastore::ConsistentRead, so that what it
+    /// reads matches the index.
+    std::shared_ptr<const PurchaseIndex> ReadPurchaseIndex() const;
+
+    /// The version and /instance are in one datastore, and /user is in the other. Each
+    /// holds its section at the same path it would have in a combined document.
+    Datastore instance_datastore_;
+    Datastore user_datastore_;
+
+    /// The index follows the state seen inside the user datastore's transactions,
+    /// uncommitted changes included, so it's only changed with that datastore locked. That
+    /// also guards these members.
+    std::shared_ptr<PurchaseIndex> purchase_index_;
+    int user_transaction_depth_;
+
+    /// The index for the committed purchases with the given ChangeGeneration, for readers.
+    /// After a transaction that changes the purchases commits, purchase_index_ is
+    /// published here (and the writer copies it before changing it again, if a reader
+    /// still holds it).
+    mutable std::mutex published_purchase_index_mutex_;
+    mutable std::shared_ptr<const PurchaseIndex> published_purchase_index_;
+    mutable uint64_t published_purchase_index_generation_;
+
+    /// The datastore subscriptions that make up each of our subscriptions.
+    std::mutex subscriptions_mutex_;
+    std::map<StateSubscriptionID, std::vector<std::pair<Datastore*, Datastore::SubscriptionID>>> subscriptions_;
+    StateSubscriptionID next_subscription_id_;
 
     /// In-memory stash of request metadata. When DeleteUserData is called, the request
     /// metadata is lost. But we want that data available when making a Login request and
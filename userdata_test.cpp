@@ -17,6 +17,8 @@
  *
  */
 
+#include <chrono>
+#include <thread>
 #include "gtest/gtest.h"
 #include "gmock/gmock.h"
 #include "test_helpers.hpp"
@@ -93,6 +95,142 @@ TEST_F(TestUserData, InitBadVersion)
     ASSERT_TRUE(err);
 }
 
+TEST_F(TestUserData, InitUpgradeV2)
+{
+    auto dsDir = GetTempDir();
+    auto instance_suffix = GetSuffix(dev);
+    auto user_suffix = GetSuffix(dev) + ".user";
+
+    // Write a v2 file, which has the user data alongside the instance data.
+    auto ok = TempDir::Write(dsDir, dev, R"({"v":2,"instance":{"instanceID":"instanceid_x","locale":"fr"},"user":{"balance":123,"lastTransactionID":"txid"}})");
+    ASSERT_TRUE(ok) << errno;
+    // And a user datastore left by an interrupted migration, which must be ignored.
+    auto user_file = DatastoreFilepath(dsDir, user_suffix);
+    ASSERT_TRUE(WriteFile(user_file, R"({"user":{"balance":999}})"));
+
+    {
+        UserData ud;
+        auto err = ud.Init(dsDir.c_str(), dev);
+        ASSERT_FALSE(err);
+        ASSERT_EQ(ud.GetInstanceID(), "instanceid_x");
+        ASSERT_EQ(ud.GetLocale(), "fr");
+        ASSERT_EQ(ud.GetBalance(), 123);
+        ASSERT_EQ(ud.GetLastTransactionID(), "txid");
+    }
+
+    // The user data has moved to its own datastore
+    Datastore instance_ds;
+    auto err = instance_ds.Init(dsDir, instance_suffix);
+    ASSERT_FALSE(err);
+    ASSERT_EQ(*instance_ds.Get<int>("/v"_json_pointer), 3);
+    ASSERT_EQ(*instance_ds.Get<string>("/instance/locale"_json_pointer), "fr");
+    ASSERT_FALSE(instance_ds.Get<json>("/user"_json_pointer));
+
+    Datastore user_ds;
+    err = user_ds.Init(dsDir, user_suffix);
+    ASSERT_FALSE(err);
+    ASSERT_EQ(*user_ds.Get<int64_t>("/user/balance"_json_pointer), 123);
+    ASSERT_FALSE(user_ds.Get<json>("/instance"_json_pointer));
+}
+
+TEST_F(TestUserData, ShardsWrittenSeparately)
+{
+    auto dsDir = GetTempDir();
+    auto instance_file = DatastoreFilepath(dsDir, GetSuffix(dev));
+    auto user_file = DatastoreFilepath(dsDir, GetSuffix(dev) + ".user");
+    auto contents = [&](const string& file) {
+        return *ReadFile(file) + *ReadFile(BackupDatastoreFile(file));
+    };
+
+    UserData ud;
+    auto err = ud.Init(dsDir.c_str(), dev);
+    ASSERT_FALSE(err);
+    err = ud.SetPurchases({{"id1", datetime::DateTime(), "tc1", "d1", nullopt, nullopt, nullopt}});
+    ASSERT_FALSE(err);
+
+    // Changing instance data doesn't rewrite the user data
+    auto user_contents = contents(user_file);
+    err = ud.SetLocale("fr");
+    ASSERT_FALSE(err);
+    ASSERT_EQ(contents(user_file), user_contents);
+
+    // And vice versa
+    auto instance_contents = contents(instance_file);
+    err = ud.SetBalance(1);
+    ASSERT_FALSE(err);
+    ASSERT_EQ(contents(instance_file), instance_contents);
+    ASSERT_NE(contents(user_file), user_contents);
+
+    // A user-only transaction doesn't involve the instance datastore
+    {
+        UserData::Transaction transaction(ud, UserData::Shards::kUser);
+        err = ud.SetBalance(2);
+        ASSERT_FALSE(err);
+        err = transaction.Commit();
+        ASSERT_FALSE(err);
+    }
+    ASSERT_EQ(contents(instance_file), instance_contents);
+
+    // Deleting the user data touches both, and keeps the instance data
+    auto instance_id = ud.GetInstanceID();
+    err = ud.DeleteUserData(true);
+    ASSERT_FALSE(err);
+    ASSERT_EQ(ud.GetInstanceID(), instance_id);
+    ASSERT_EQ(ud.GetLocale(), "fr");
+    ASSERT_TRUE(ud.GetIsLoggedOutAccount());
+    ASSERT_EQ(ud.GetBalance(), 0);
+    ASSERT_EQ(ud.GetPurchases().size(), 0);
+}
+
+TEST_F(TestUserData, InterruptedDeleteUserData)
+{
+    auto dsDir = GetTempDir();
+
+    {
+        UserData ud;
+        auto err = ud.Init(dsDir.c_str(), dev);
+        ASSERT_FALSE(err);
+        err = ud.SetAuthTokens({{"k1", {"v1"}}, {"k2", {"v2"}}}, true, "username");
+        ASSERT_FALSE(err);
+        err = ud.SetBalance(123);
+        ASSERT_FALSE(err);
+    }
+
+    // Simulate a crash during DeleteUserData(true), after the instance shard was written
+    // but before the user shard was.
+    {
+        Datastore instance_ds;
+        auto err = instance_ds.Init(dsDir.c_str(), GetSuffix(dev));
+        ASSERT_FALSE(err);
+        err = instance_ds.Set(json::json_pointer("/instance/isLoggedOutAccount"), true);
+        ASSERT_FALSE(err);
+    }
+
+    // The flag is authoritative, so Init completes the deletion
+    UserData ud;
+    auto err = ud.Init(dsDir.c_str(), dev);
+    ASSERT_FALSE(err);
+    ASSERT_TRUE(ud.GetIsLoggedOutAccount());
+    ASSERT_EQ(ud.GetAuthTokens().size(), 0);
+    ASSERT_EQ(ud.GetBalance(), 0);
+
+    // And it has been persisted
+    UserData ud2;
+    err = ud2.Init(dsDir.c_str(), dev);
+    ASSERT_FALSE(err);
+    ASSERT_TRUE(ud2.GetIsLoggedOutAccount());
+    ASSERT_EQ(ud2.GetAuthTokens().size(), 0);
+
+    // A logged-out account with no tokens is left alone
+    err = ud2.SetBalance(1);
+    ASSERT_FALSE(err);
+    UserData ud3;
+    err = ud3.Init(dsDir.c_str(), dev);
+    ASSERT_FALSE(err);
+    ASSERT_TRUE(ud3.GetIsLoggedOutAccount());
+    ASSERT_EQ(ud3.GetBalance(), 1);
+}
+
 TEST_F(TestUserData, Persistence)
 {
     auto want_server_time_diff_ms = 54321;
@@ -475,6 +613,99 @@ TEST_F(TestUserData, ValidTokenTypes) {
     ASSERT_EQ(vtt.size(), 0);
 }
 
+TEST_F(TestUserData, HasTokenTypes) {
+    UserData ud;
+    auto err = ud.Init(GetTempDir().c_str(), dev);
+    ASSERT_FALSE(err);
+
+    ASSERT_TRUE(ud.HasTokenTypes({}));
+    ASSERT_FALSE(ud.HasTokenTypes({"a"}));
+
+    AuthTokens at = {{"a", {"a"}}, {"b", {"b"}}, {"c", {"c"}}};
+    err = ud.SetAuthTokens(at, false, "");
+    ASSERT_FALSE(err);
+    ASSERT_TRUE(ud.HasTokenTypes({}));
+    ASSERT_TRUE(ud.HasTokenTypes({"a"}));
+    ASSERT_TRUE(ud.HasTokenTypes({"c", "a", "b"}));
+    ASSERT_FALSE(ud.HasTokenTypes({"a", "d"}));
+
+    err = ud.SetAuthTokens(AuthTokens(), false, "");
+    ASSERT_FALSE(err);
+    ASSERT_FALSE(ud.HasTokenTypes({"a"}));
+}
+
+TEST_F(TestUserData, AuthTokenState) {
+    auto temp_dir = GetTempDir();
+    UserData ud;
+    auto err = ud.Init(temp_dir.c_str(), dev);
+    ASSERT_FALSE(err);
+
+    auto required = TokenTypeBit(TokenType::kEarner) | TokenTypeBit(TokenType::kSpender);
+    ASSERT_EQ(ud.GetAuthTokenState()->types, 0);
+    ASSERT_EQ(ud.GetAuthTokenState()->all_ids, "");
+    ASSERT_TRUE(ud.HasTokenTypes(TokenTypeMask(0)));
+    ASSERT_FALSE(ud.HasTokenTypes(required));
+
+    AuthTokens at = {{kSpenderTokenType, {"sid"}}, {kEarnerTokenType, {"eid"}}, {"other", {"oid"}}};
+    err = ud.SetAuthTokens(at, false, "");
+    ASSERT_FALSE(err);
+    auto state = ud.GetAuthTokenState();
+    ASSERT_EQ(state->types, required);
+    ASSERT_EQ(state->all_ids, "eid,oid,sid"); // in type order
+    ASSERT_TRUE(AuthTokenSetsEqual(state->tokens, at));
+    ASSERT_TRUE(ud.HasTokenTypes(required));
+    ASSERT_FALSE(ud.HasTokenTypes(required | TokenTypeBit(TokenType::kIndicator)));
+    ASSERT_TRUE(ud.HasTokenTypes({"other", kEarnerTokenType}));
+    ASSERT_EQ(TokenTypeBit("other"), 0);
+    ASSERT_EQ(TokenTypeBit(kLogoutTokenType), TokenTypeBit(TokenType::kLogout));
+
+    // The state is only decoded again when the tokens change
+    err = ud.SetBalance(123);
+    ASSERT_FALSE(err);
+    ASSERT_EQ(ud.GetAuthTokenState(), state);
+
+    // Changes that are rolled back don't stick
+    {
+        UserData::Transaction transaction(ud);
+        err = ud.SetAuthTokens({{kIndicatorTokenType, {"iid"}}}, false, "");
+        ASSERT_FALSE(err);
+        ASSERT_EQ(ud.GetAuthTokenState()->types, TokenTypeBit(TokenType::kIndicator));
+        ASSERT_FALSE(ud.HasTokenTypes(required));
+        err = transaction.Rollback();
+        ASSERT_FALSE(err);
+    }
+    ASSERT_TRUE(ud.HasTokenTypes(required));
+    ASSERT_EQ(ud.GetAuthTokenState()->all_ids, "eid,oid,sid");
+
+    // Culling
+    err = ud.CullAuthTokens({{"eid", true}, {"oid", true}, {"sid", true}});
+    ASSERT_FALSE(err);
+    ASSERT_EQ(ud.GetAuthTokenState(), state);
+    err = ud.CullAuthTokens({{"eid", true}, {"oid", true}, {"sid", false}});
+    ASSERT_FALSE(err);
+    ASSERT_EQ(ud.GetAuthTokenState()->types, 0);
+    ASSERT_THAT(ud.GetAuthTokenState()->tokens, IsEmpty());
+    ASSERT_FALSE(ud.HasTokenTypes(required));
+
+    // Deleting user data
+    err = ud.SetAuthTokens(at, false, "");
+    ASSERT_FALSE(err);
+    ASSERT_TRUE(ud.HasTokenTypes(required));
+    err = ud.DeleteUserData(false);
+    ASSERT_FALSE(err);
+    ASSERT_FALSE(ud.HasTokenTypes(required));
+    ASSERT_EQ(ud.GetAuthTokenState()->all_ids, "");
+
+    // Reloading
+    err = ud.SetAuthTokens(at, false, "");
+    ASSERT_FALSE(err);
+    UserData ud2;
+    err = ud2.Init(temp_dir.c_str(), dev);
+    ASSERT_FALSE(err);
+    ASSERT_TRUE(ud2.HasTokenTypes(required));
+    ASSERT_EQ(ud2.GetAuthTokenState()->all_ids, "eid,oid,sid");
+}
+
 TEST_F(TestUserData, IsAccount)
 {
     UserData ud;
@@ -660,6 +891,344 @@ TEST_F(TestUserData, AddPurchase)
     ASSERT_EQ(ud.GetLastTransactionID(), "id2");
 }
 
+TEST_F(TestUserData, AddPurchases)
+{
+    auto dsDir = GetTempDir();
+    auto user_journal = DatastoreFilepath(dsDir, GetSuffix(dev) + ".user") + ".journal";
+    auto journal_lines = [&]() {
+        auto journal = ReadFile(user_journal);
+        return journal ? std::count(journal->begin(), journal->end(), '\n') : 0;
+    };
+
+    UserData ud;
+    DatastoreOptions options;
+    options.journal = true;
+    auto err = ud.Init(dsDir.c_str(), dev, options);
+    ASSERT_FALSE(err);
+
+    auto now = datetime::DateTime::Now();
+    auto purchase = [&](int i, const string& distinguisher = "d") {
+        return Purchase{"id" + to_string(i), now.Sub(datetime::Duration(100 - i)), "tc", distinguisher, nullopt, nullopt, nullopt};
+    };
+
+    // Nothing happens for an empty batch
+    err = ud.AddPurchases({});
+    ASSERT_FALSE(err);
+    ASSERT_EQ(ud.GetLastTransactionID(), "");
+
+    // Out of order, into an empty store
+    auto lines = journal_lines();
+    err = ud.AddPurchases({purchase(5), purchase(1), purchase(3)});
+    ASSERT_FALSE(err);
+    ASSERT_EQ(journal_lines(), lines + 1);
+    ASSERT_EQ(ud.GetPurchases(), Purchases({purchase(1), purchase(3), purchase(5)}));
+    ASSERT_EQ(ud.GetLastTransactionID(), "id3");
+
+    // Newer purchases, a duplicate of a stored one, and a purchase repeated in the batch
+    lines = journal_lines();
+    err = ud.AddPurchases({purchase(7), purchase(6, "first"), purchase(3, "dup"), purchase(6, "second")});
+    ASSERT_FALSE(err);
+    ASSERT_EQ(journal_lines(), lines + 1);
+    ASSERT_EQ(ud.GetPurchases(), Purchases({purchase(1), purchase(3, "dup"), purchase(5), purchase(6, "second"), purchase(7)}));
+    ASSERT_EQ(ud.GetLastTransactionID(), "id6");
+
+    // Merged in among the stored ones
+    err = ud.AddPurchases({purchase(8), purchase(0), purchase(4), purchase(2)});
+    ASSERT_FALSE(err);
+    Purchases want = {purchase(0), purchase(1), purchase(2), purchase(3, "dup"), purchase(4), purchase(5),
+                      purchase(6, "second"), purchase(7), purchase(8)};
+    ASSERT_EQ(ud.GetPurchases(), want);
+    ASSERT_EQ(ud.GetLastTransactionID(), "id2");
+
+    // The same as adding them one at a time
+    UserData one_at_a_time;
+    err = one_at_a_time.Init(GetTempDir().c_str(), dev);
+    ASSERT_FALSE(err);
+    for (const auto& p : {purchase(5), purchase(1), purchase(3), purchase(7), purchase(6, "first"), purchase(3, "dup"),
+                          purchase(6, "second"), purchase(8), purchase(0), purchase(4), purchase(2)}) {
+        err = one_at_a_time.AddPurchase(p);
+        ASSERT_FALSE(err);
+    }
+    ASSERT_EQ(one_at_a_time.GetPurchases(), want);
+
+    // Still correct when reloaded
+    UserData reloaded;
+    err = reloaded.Init(dsDir.c_str(), dev, options);
+    ASSERT_FALSE(err);
+    ASSERT_EQ(reloaded.GetPurchases(), want);
+}
+
+TEST_F(TestUserData, RemovePurchasesAndGetByAuthorizationID)
+{
+    UserData ud;
+    auto err = ud.Init(GetTempDir().c_str(), dev);
+    ASSERT_FALSE(err);
+
+    auto now = datetime::DateTime::Now();
+    auto purchase = [&](int i, optional<string> auth_id) {
+        optional<Authorization> auth;
+        if (auth_id) {
+            auth = Authorization{*auth_id, "speed-boost", now, "encoded" + *auth_id};
+        }
+        return Purchase{"id" + to_string(i), now.Sub(datetime::Duration(100 - i)), "tc", "d", nullopt, nullopt, auth};
+    };
+
+    // Nothing stored yet
+    ASSERT_TRUE(ud.GetPurchasesByAuthorizationID({"a1"}).empty());
+    auto removed = ud.RemovePurchases({"id1"});
+    ASSERT_TRUE(removed);
+    ASSERT_TRUE(removed->empty());
+
+    Purchases want = {purchase(1, "a1"), purchase(2, nullopt), purchase(3, "a3"), purchase(4, "a4")};
+    for (const auto& p : {want[3], want[0], want[2], want[1]}) {
+        err = ud.AddPurchase(p);
+        ASSERT_FALSE(err);
+    }
+    ASSERT_EQ(ud.GetPurchases(), want);
+
+    // Results are in stored order, and unknown IDs are ignored
+    auto got = ud.GetPurchasesByAuthorizationID({"a4", "nope", "a1"});
+    ASSERT_EQ(got, Purchases({want[0], want[3]}));
+
+    // Replacing a purchase updates its authorization
+    auto replacement = purchase(3, "a3-new");
+    err = ud.AddPurchase(replacement);
+    ASSERT_FALSE(err);
+    want[2] = replacement;
+    ASSERT_TRUE(ud.GetPurchasesByAuthorizationID({"a3"}).empty());
+    ASSERT_EQ(ud.GetPurchasesByAuthorizationID({"a3-new"}), Purchases({replacement}));
+
+    removed = ud.RemovePurchases({"id2", "nope", "id1", "id2"});
+    ASSERT_TRUE(removed);
+    ASSERT_EQ(*removed, Purchases({want[0], want[1]}));
+    want = {want[2], want[3]};
+    ASSERT_EQ(ud.GetPurchases(), want);
+    ASSERT_TRUE(ud.GetPurchasesByAuthorizationID({"a1"}).empty());
+    ASSERT_EQ(ud.GetPurchasesByAuthorizationID({"a4", "a3-new"}), want);
+
+    // Purchases added in a transaction that's rolled back are forgotten
+    {
+        UserData::Transaction transaction(ud);
+        err = ud.AddPurchase(purchase(0, "a0"));
+        ASSERT_FALSE(err);
+        ASSERT_EQ(ud.GetPurchasesByAuthorizationID({"a0"}).size(), 1);
+        err = ud.AddPurchase(purchase(5, "a5"));
+        ASSERT_FALSE(err);
+    }
+    ASSERT_EQ(ud.GetPurchases(), want);
+    ASSERT_TRUE(ud.GetPurchasesByAuthorizationID({"a0", "a5"}).empty());
+    err = ud.AddPurchase(purchase(5, "a5"));
+    ASSERT_FALSE(err);
+    want.push_back(purchase(5, "a5"));
+    ASSERT_EQ(ud.GetPurchases(), want);
+
+    // Purchases changed other ways are seen
+    err = ud.SetPurchases({want[0]});
+    ASSERT_FALSE(err);
+    ASSERT_TRUE(ud.GetPurchasesByAuthorizationID({"a5"}).empty());
+    ASSERT_EQ(ud.GetPurchasesByAuthorizationID({"a3-new"}).size(), 1);
+    err = ud.DeleteUserData(false);
+    ASSERT_FALSE(err);
+    ASSERT_TRUE(ud.GetPurchasesByAuthorizationID({"a3-new"}).empty());
+    err = ud.AddPurchase(purchase(6, "a6"));
+    ASSERT_FALSE(err);
+    err = ud.Clear();
+    ASSERT_FALSE(err);
+    ASSERT_TRUE(ud.GetPurchasesByAuthorizationID({"a6"}).empty());
+    err = ud.AddPurchase(purchase(7, "a7"));
+    ASSERT_FALSE(err);
+    ASSERT_EQ(ud.GetPurchases(), Purchases({purchase(7, "a7")}));
+}
+
+TEST_F(TestUserData, PurchasesSharingKeys)
+{
+    UserData ud;
+    auto err = ud.Init(GetTempDir().c_str(), dev);
+    ASSERT_FALSE(err);
+
+    auto now = datetime::DateTime::Now();
+    auto purchase = [&](const string& id, int i, const string& auth_id) {
+        auto auth = Authorization{auth_id, "speed-boost", now, "encoded" + auth_id};
+        return Purchase{id, now.Sub(datetime::Duration(100 - i)), "tc", "d", nullopt, nullopt, auth};
+    };
+
+    // Two purchases with the same authorization are both found
+    Purchases want = {purchase("id1", 1, "shared"), purchase("id2", 2, "a2"), purchase("id3", 3, "shared")};
+    for (const auto& p : want) {
+        err = ud.AddPurchase(p);
+        ASSERT_FALSE(err);
+    }
+    ASSERT_EQ(ud.GetPurchasesByAuthorizationID({"shared"}), Purchases({want[0], want[2]}));
+    ASSERT_EQ(ud.GetPurchasesByAuthorizationID({"a2", "shared"}), want);
+
+    // ...and replacing one of them leaves the other
+    auto replacement = purchase("id3", 3, "a3");
+    err = ud.AddPurchase(replacement);
+    ASSERT_FALSE(err);
+    ASSERT_EQ(ud.GetPurchasesByAuthorizationID({"shared"}), Purchases({want[0]}));
+    err = ud.AddPurchase(purchase("id3", 3, "shared"));
+    ASSERT_FALSE(err);
+
+    // Stored purchases with the same transaction ID are all removed
+    auto copy = purchase("id1", 4, "a1-copy");
+    err = ud.SetPurchases({want[0], want[1], want[2], copy});
+    ASSERT_FALSE(err);
+    auto removed = ud.RemovePurchases({"id1"});
+    ASSERT_TRUE(removed);
+    ASSERT_EQ(*removed, Purchases({want[0], copy}));
+    ASSERT_EQ(ud.GetPurchases(), Purchases({want[1], want[2]}));
+    ASSERT_EQ(ud.GetPurchasesByAuthorizationID({"shared", "a1-copy"}), Purchases({want[2]}));
+}
+
+TEST_F(TestUserData, GetPurchasesByAuthorizationIDDuringTransaction)
+{
+    UserData ud;
+    auto err = ud.Init(GetTempDir().c_str(), dev);
+    ASSERT_FALSE(err);
+
+    auto now = datetime::DateTime::Now();
+    auto purchase = [&](int i) {
+        auto auth = Authorization{"a" + to_string(i), "speed-boost", now, "encoded"};
+        return Purchase{"id" + to_string(i), now.Sub(datetime::Duration(100 - i)), "tc", "d", nullopt, nullopt, auth};
+    };
+    err = ud.AddPurchase(purchase(1));
+    ASSERT_FALSE(err);
+
+    // Another thread's transaction doesn't hold up the lookup, and its uncommitted
+    // changes aren't seen
+    UserData::Transaction transaction(ud);
+    err = ud.AddPurchase(purchase(2));
+    ASSERT_FALSE(err);
+    Purchases got;
+    std::thread reader([&] { got = ud.GetPurchasesByAuthorizationID({"a1", "a2"}); });
+    reader.join();
+    ASSERT_EQ(got, Purchases({purchase(1)}));
+
+    err = transaction.Commit();
+    ASSERT_FALSE(err);
+    reader = std::thread([&] { got = ud.GetPurchasesByAuthorizationID({"a1", "a2"}); });
+    reader.join();
+    ASSERT_EQ(got, Purchases({purchase(1), purchase(2)}));
+}
+
+TEST_F(TestUserData, DISABLED_BenchmarkPurchases)
+{
+    using clock = std::chrono::steady_clock;
+    const int ops = 20;
+
+    for (int count : {1000, 10000, 100000}) {
+        UserData ud;
+        DatastoreOptions options;
+        options.durability = DatastoreDurability::kNone;
+        options.journal = true;
+        auto err = ud.Init(GetTempDir().c_str(), dev, options);
+        ASSERT_FALSE(err);
+
+        auto start_time = datetime::DateTime::Now();
+        auto purchase = [&](int i) {
+            return Purchase{"id" + to_string(i), start_time.Add(datetime::Duration(i * 2)), "speed-boost", "1hr",
+                            nullopt, nullopt,
+                            Authorization{"auth" + to_string(i), "speed-boost", start_time, "encoded"}};
+        };
+        Purchases purchases;
+        for (int i = 0; i < count; i++) {
+            purchases.push_back(purchase(i));
+        }
+        err = ud.SetPurchases(purchases);
+        ASSERT_FALSE(err);
+        // Build the index and compact the journal, so they're not included in the timings
+        for (int i = 0; i < 3; i++) {
+            ASSERT_FALSE(ud.AddPurchase(purchase(count + i)));
+        }
+
+        auto start = clock::now();
+        for (int i = 3; i < ops + 3; i++) {
+            ASSERT_FALSE(ud.AddPurchase(purchase(count + i)));
+        }
+        auto append = clock::now() - start;
+
+        start = clock::now();
+        for (int i = 0; i < ops; i++) {
+            ASSERT_FALSE(ud.AddPurchase(purchase(i)));
+        }
+        auto duplicate = clock::now() - start;
+
+        start = clock::now();
+        for (int i = 0; i < ops; i++) {
+            ASSERT_EQ(ud.GetPurchasesByAuthorizationID({"auth" + to_string(i * 7), "auth" + to_string(count - i)}).size(), 2);
+        }
+        auto by_authorization = clock::now() - start;
+
+        start = clock::now();
+        for (int i = 0; i < ops; i++) {
+            auto removed = ud.RemovePurchases({"id" + to_string(i * 3 + 1)});
+            ASSERT_TRUE(removed);
+            ASSERT_EQ(removed->size(), 1);
+        }
+        auto remove = clock::now() - start;
+
+        auto us = [&](clock::duration d) {
+            return std::chrono::duration<double, std::micro>(d).count() / ops;
+        };
+        std::cout << count << " purchases: AddPurchase (newest) " << us(append) << " us; AddPurchase (duplicate) "
+                  << us(duplicate) << " us; GetPurchasesByAuthorizationID " << us(by_authorization)
+                  << " us; RemovePurchases " << us(remove) << " us" << std::endl;
+    }
+}
+
+TEST_F(TestUserData, DISABLED_BenchmarkAddPurchases)
+{
+    using clock = std::chrono::steady_clock;
+
+    for (int count : {1000, 10000, 100000}) {
+        auto start_time = datetime::DateTime::Now();
+        Purchases purchases;
+        for (int i = 0; i < count; i++) {
+            purchases.push_back(Purchase{"id" + to_string(i), start_time.Add(datetime::Duration(i * 2)), "speed-boost",
+                                         "1hr", nullopt, nullopt, nullopt});
+        }
+
+        // A full resync, as RefreshState would do it, in the server's (ascending) order
+        // and in the reverse order.
+        for (bool reversed : {false, true}) {
+            auto batch = purchases;
+            if (reversed) {
+                std::reverse(batch.begin(), batch.end());
+            }
+
+            // Adding older purchases one at a time rewrites the array each time, which
+            // takes too long with the most purchases.
+            auto one_at_a_time = clock::duration::zero();
+            if (!reversed || count <= 1000) {
+                UserData ud;
+                ASSERT_FALSE(ud.Init(GetTempDir().c_str(), dev));
+                auto start = clock::now();
+                UserData::Transaction transaction(ud);
+                for (const auto& p : batch) {
+                    ASSERT_FALSE(ud.AddPurchase(p));
+                }
+                ASSERT_FALSE(transaction.Commit());
+                one_at_a_time = clock::now() - start;
+            }
+
+            UserData batched;
+            ASSERT_FALSE(batched.Init(GetTempDir().c_str(), dev));
+            auto start = clock::now();
+            {
+                UserData::Transaction transaction(batched);
+                ASSERT_FALSE(batched.AddPurchases(std::move(batch)));
+                ASSERT_FALSE(transaction.Commit());
+            }
+            auto all_at_once = clock::now() - start;
+            ASSERT_EQ(batched.GetPurchases(), purchases);
+
+            auto ms = [](clock::duration d) { return std::chrono::duration<double, std::milli>(d).count(); };
+            std::cout << count << " purchases" << (reversed ? " (reversed)" : "") << ": AddPurchase each "
+                      << ms(one_at_a_time) << " ms; AddPurchases " << ms(all_at_once) << " ms" << std::endl;
+        }
+    }
+}
+
 TEST_F(TestUserData, Metadata)
 {
     UserData ud;
@@ -823,6 +1392,38 @@ TEST_F(TestUserData, Cookies)
     ASSERT_EQ(v, "");
 }
 
+TEST_F(TestUserData, StateChanges)
+{
+    UserData ud;
+    auto err = ud.Init(GetTempDir().c_str(), dev);
+    ASSERT_FALSE(err);
+
+    std::promise<vector<StateField>> changed_promise;
+    auto id = ud.Subscribe({StateField::Balance, StateField::IsAccount}, [&](const vector<StateField>& changed) {
+        changed_promise.set_value(changed);
+    });
+
+    auto balance = ud.ChangeGeneration(StateField::Balance);
+    auto is_account = ud.ChangeGeneration(StateField::IsAccount);
+    auto purchases = ud.ChangeGeneration(StateField::Purchases);
+
+    // IsAccount also depends on the logged-out account flag
+    err = ud.SetIsLoggedOutAccount(true);
+    ASSERT_FALSE(err);
+    ASSERT_GT(ud.ChangeGeneration(StateField::IsAccount), is_account);
+    ASSERT_EQ(ud.ChangeGeneration(StateField::Balance), balance);
+    ASSERT_EQ(ud.ChangeGeneration(StateField::Purchases), purchases);
+
+    auto changed = changed_promise.get_future();
+    ASSERT_EQ(changed.wait_for(std::chrono::seconds(5)), std::future_status::ready);
+    ASSERT_EQ(changed.get(), vector<StateField>({StateField::IsAccount}));
+    ud.Unsubscribe(id);
+
+    err = ud.SetBalance(123);
+    ASSERT_FALSE(err);
+    ASSERT_GT(ud.ChangeGeneration(StateField::Balance), balance);
+}
+
 TEST_F(TestUserData, Transaction)
 {
     UserData ud;
@@ -24,6 +24,8 @@
 #include <algorithm>
 #include <cctype>
 #include <locale>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include "utils.hpp"
 #include "error.hpp"
 
@@ -128,24 +130,53 @@ string GetCookies(const map<string, vector<string>>& headers) {
     return res.str();
 }
 
-// Adapted from https://stackoverflow.com/a/22986486/729729
 error::Error FileSize(const string& path, uint64_t& o_size) {
     o_size = 0;
 
-    ifstream f;
-    f.open(path, ios::in | ios::binary);
-    if (!f) {
-        return error::MakeCriticalError(utils::Stringer("file open failed; errno=", errno));
+#ifdef _WIN32
+    struct _stat64 st;
+    if (_stat64(path.c_str(), &st) != 0) {
+#else
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+#endif
+        return error::MakeCriticalError(utils::Stringer("file stat failed; errno=", errno));
     }
 
-    f.ignore(numeric_limits<streamsize>::max());
-    auto length = f.gcount();
-    f.close();
-
-    o_size = (uint64_t)length;
+    o_size = (uint64_t)st.st_size;
     return error::nullerr;
 }
 
+bool RecursiveMutex::OwnedByThisThread() const {
+    return owner_.load(std::memory_order_relaxed) == std::this_thread::get_id();
+}
+
+void RecursiveMutex::lock() {
+    if (!OwnedByThisThread()) {
+        mutex_.lock();
+        owner_.store(std::this_thread::get_id(), std::memory_order_relaxed);
+    }
+    depth_++;
+}
+
+bool RecursiveMutex::try_lock() {
+    if (!OwnedByThisThread()) {
+        if (!mutex_.try_lock()) {
+            return false;
+        }
+        owner_.store(std::this_thread::get_id(), std::memory_order_relaxed);
+    }
+    depth_++;
+    return true;
+}
+
+void RecursiveMutex::unlock() {
+    if (--depth_ == 0) {
+        owner_.store(std::thread::id(), std::memory_order_relaxed);
+        mutex_.unlock();
+    }
+}
+
 // From https://stackoverflow.com/a/217605/729729
 void TrimLeft(std::string &s) {
     s.erase(s.begin(), std::find_if(s.begin(), s.end(), [](unsigned char ch) {
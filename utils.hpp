@@ -23,8 +23,16 @@
 #include <string>
 #include <map>
 #include <vector>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <utility>
 #include <sstream>
 #include <iterator>
+#include <atomic>
+#include <mutex>
+#include <thread>
 #include "error.hpp"
 
 
@@ -52,6 +60,35 @@ std::string Stringer(const T& value, const Args& ... args) {
 /// Synchronize the current scope using the given mutex.
 #define SYNCHRONIZE(m) std::lock_guard<std::recursive_mutex> synchronize_lock(m)
 
+/// A re-entrant mutex that can tell whether the current thread holds it (which
+/// std::recursive_mutex can't). It is released when the outermost lock is released.
+/// Satisfies the Lockable requirements, so can be used with std::unique_lock, etc.
+class RecursiveMutex {
+public:
+    RecursiveMutex() : depth_(0) {}
+    RecursiveMutex(const RecursiveMutex&) = delete;
+    RecursiveMutex& operator=(const RecursiveMutex&) = delete;
+
+    void lock();
+    bool try_lock();
+    void unlock();
+
+    /// Returns true if the current thread holds the lock.
+    bool OwnedByThisThread() const;
+
+private:
+    std::mutex mutex_;
+    /// The thread holding the lock, if any. Only ever set to or from the current
+    /// thread's ID by the current thread, so a relaxed load is enough to tell whether
+    /// the current thread is the owner.
+    std::atomic<std::thread::id> owner_;
+    /// Only accessed by the owner thread.
+    int depth_;
+};
+
+/// Synchronize the current scope using the given RecursiveMutex.
+#define SYNCHRONIZE_EXCLUSIVE(m) std::lock_guard<utils::RecursiveMutex> synchronize_lock(m)
+
 /// Tests if the given filepath+name exists.
 bool FileExists(const std::string& filename);
 
@@ -122,6 +159,185 @@ std::string TrimRightCopy(std::string s);
 /// Trim whitespace from both ends of string (copying)
 std::string TrimCopy(std::string s);
 
+/// An ordered map that keeps its elements in one vector, sorted by key, rather than in a
+/// node per element. Lookups are a binary search; inserting or erasing anywhere but the
+/// end moves the following elements. Has as much of std::map's interface as
+/// nlohmann::basic_json needs from its ObjectType, and iterates in the same order.
+/// Unlike std::map, inserting or erasing invalidates iterators and references to the
+/// elements, and the keys aren't const (but must not be changed).
+template<typename Key, typename T, typename Compare = std::less<>,
+         typename Allocator = std::allocator<std::pair<const Key, T>>>
+class FlatMap {
+public:
+    using key_type = Key;
+    using mapped_type = T;
+    using value_type = std::pair<Key, T>;
+    using key_compare = Compare;
+    using allocator_type = typename std::allocator_traits<Allocator>::template rebind_alloc<value_type>;
+    using container_type = std::vector<value_type, allocator_type>;
+    using size_type = typename container_type::size_type;
+    using difference_type = typename container_type::difference_type;
+    using reference = value_type&;
+    using const_reference = const value_type&;
+    using iterator = typename container_type::iterator;
+    using const_iterator = typename container_type::const_iterator;
+
+    FlatMap() = default;
+
+    template<typename InputIt>
+    FlatMap(InputIt first, InputIt last) {
+        insert(first, last);
+    }
+
+    FlatMap(std::initializer_list<value_type> init) : FlatMap(init.begin(), init.end()) {}
+
+    iterator begin() noexcept { return elements_.begin(); }
+    const_iterator begin() const noexcept { return elements_.begin(); }
+    const_iterator cbegin() const noexcept { return elements_.cbegin(); }
+    iterator end() noexcept { return elements_.end(); }
+    const_iterator end() const noexcept { return elements_.end(); }
+    const_iterator cend() const noexcept { return elements_.cend(); }
+
+    bool empty() const noexcept { return elements_.empty(); }
+    size_type size() const noexcept { return elements_.size(); }
+    size_type max_size() const noexcept { return elements_.max_size(); }
+    void clear() noexcept { elements_.clear(); }
+    void reserve(size_type n) { elements_.reserve(n); }
+
+    template<typename K>
+    iterator find(const K& key) {
+        auto it = LowerBound(key);
+        return (it != end() && !compare_(key, it->first)) ? it : end();
+    }
+
+    template<typename K>
+    const_iterator find(const K& key) const {
+        return const_cast<FlatMap*>(this)->find(key);
+    }
+
+    template<typename K>
+    size_type count(const K& key) const {
+        return find(key) == end() ? 0 : 1;
+    }
+
+    T& at(const Key& key) {
+        auto it = find(key);
+        if (it == end()) {
+            throw std::out_of_range("FlatMap::at: key not found");
+        }
+        return it->second;
+    }
+
+    const T& at(const Key& key) const {
+        return const_cast<FlatMap*>(this)->at(key);
+    }
+
+    T& operator[](const Key& key) {
+        return TryEmplace(key).first->second;
+    }
+
+    T& operator[](Key&& key) {
+        return TryEmplace(std::move(key)).first->second;
+    }
+
+    /// As with std::map, does nothing if there's already an element with the key.
+    template<typename... Args>
+    std::pair<iterator, bool> emplace(Args&&... args) {
+        value_type v(std::forward<Args>(args)...);
+        auto it = LowerBound(v.first);
+        if (it != end() && !compare_(v.first, it->first)) {
+            return {it, false};
+        }
+        return {elements_.insert(it, std::move(v)), true};
+    }
+
+    std::pair<iterator, bool> insert(const value_type& v) {
+        return emplace(v);
+    }
+
+    std::pair<iterator, bool> insert(value_type&& v) {
+        return emplace(std::move(v));
+    }
+
+    /// Elements whose keys are already present (or appear earlier in the range) are skipped.
+    template<typename InputIt>
+    void insert(InputIt first, InputIt last) {
+        auto old_size = elements_.size();
+        for (; first != last; ++first) {
+            elements_.emplace_back(*first);
+        }
+        auto by_key = [this](const value_type& a, const value_type& b) { return compare_(a.first, b.first); };
+        if (std::is_sorted(elements_.begin(), elements_.end(), by_key)
+                && std::adjacent_find(elements_.begin(), elements_.end(), [&](const value_type& a, const value_type& b) {
+                       return !by_key(a, b);
+                   }) == elements_.end()) {
+            // Usually the range comes from another ordered map, and goes at the end.
+            return;
+        }
+        // The sort is stable, so the first element with each key is the one kept: the one
+        // that was already here, or else the first in the range.
+        std::stable_sort(elements_.begin() + old_size, elements_.end(), by_key);
+        std::inplace_merge(elements_.begin(), elements_.begin() + old_size, elements_.end(), by_key);
+        elements_.erase(std::unique(elements_.begin(), elements_.end(), [&](const value_type& a, const value_type& b) {
+                            return !by_key(a, b);
+                        }),
+                        elements_.end());
+    }
+
+    iterator erase(iterator pos) {
+        return elements_.erase(pos);
+    }
+
+    iterator erase(const_iterator pos) {
+        return elements_.erase(pos);
+    }
+
+    iterator erase(const_iterator first, const_iterator last) {
+        return elements_.erase(first, last);
+    }
+
+    size_type erase(const Key& key) {
+        auto it = find(key);
+        if (it == end()) {
+            return 0;
+        }
+        elements_.erase(it);
+        return 1;
+    }
+
+    friend bool operator==(const FlatMap& a, const FlatMap& b) {
+        return a.elements_ == b.elements_;
+    }
+
+    friend bool operator<(const FlatMap& a, const FlatMap& b) {
+        return a.elements_ < b.elements_;
+    }
+
+private:
+    template<typename K>
+    iterator LowerBound(const K& key) {
+        // Elements are mostly added in order, so check the end first.
+        if (elements_.empty() || compare_(elements_.back().first, key)) {
+            return elements_.end();
+        }
+        return std::lower_bound(elements_.begin(), elements_.end(), key, [this](const value_type& v, const K& k) {
+            return compare_(v.first, k);
+        });
+    }
+
+    template<typename K>
+    std::pair<iterator, bool> TryEmplace(K&& key) {
+        auto it = LowerBound(key);
+        if (it != end() && !compare_(key, it->first)) {
+            return {it, false};
+        }
+        return {elements_.emplace(it, std::forward<K>(key), T()), true};
+    }
+
+    container_type elements_;
+    [[no_unique_address]] Compare compare_;
+};
+
 }
 
 #endif //PSICASHLIB_UTILS_H
@@ -17,9 +17,12 @@
  *
  */
 
+#include <map>
+#include <thread>
 #include "gtest/gtest.h"
 #include "gmock/gmock.h"
 #include "utils.hpp"
+#include "test_helpers.hpp"
 
 using namespace std;
 using namespace utils;
@@ -94,3 +97,103 @@ TEST(TestGetCookies, Simple) {
     v = GetCookies(headers);
     ASSERT_EQ(v, "x=y");
 }
+
+class TestFileSize : public ::testing::Test, public TempDir {};
+
+TEST_F(TestFileSize, Simple) {
+    auto path = GetTempDir() + "/filesize";
+
+    ASSERT_TRUE(WriteFile(path, ""));
+    uint64_t size = 123;
+    ASSERT_FALSE(FileSize(path, size));
+    ASSERT_EQ(size, 0);
+
+    ASSERT_TRUE(WriteFile(path, string(100000, 'x')));
+    ASSERT_FALSE(FileSize(path, size));
+    ASSERT_EQ(size, 100000);
+
+    ASSERT_TRUE(FileSize(path + ".nope", size));
+}
+
+TEST(TestRecursiveMutex, Reentrant) {
+    RecursiveMutex m;
+    ASSERT_FALSE(m.OwnedByThisThread());
+    m.lock();
+    m.lock();
+    ASSERT_TRUE(m.try_lock());
+    ASSERT_TRUE(m.OwnedByThisThread());
+    m.unlock();
+    m.unlock();
+
+    // Still held by this thread
+    bool got_other = true, owned_other = true;
+    std::thread t1([&]() {
+        owned_other = m.OwnedByThisThread();
+        got_other = m.try_lock();
+        if (got_other) {
+            m.unlock();
+        }
+    });
+    t1.join();
+    ASSERT_FALSE(owned_other);
+    ASSERT_FALSE(got_other);
+
+    m.unlock();
+
+    // Now released
+    ASSERT_FALSE(m.OwnedByThisThread());
+    std::thread t2([&]() {
+        got_other = m.try_lock();
+        if (got_other) {
+            m.unlock();
+        }
+    });
+    t2.join();
+    ASSERT_TRUE(got_other);
+}
+
+TEST(TestFlatMap, Simple) {
+    FlatMap<string, int> m;
+    ASSERT_TRUE(m.empty());
+    ASSERT_TRUE(m.emplace("b", 2).second);
+    ASSERT_TRUE(m.emplace("a", 1).second);
+    m["d"] = 4;
+    m["c"] = 3;
+
+    // A duplicate doesn't replace the existing element
+    auto res = m.emplace("b", 20);
+    ASSERT_FALSE(res.second);
+    ASSERT_EQ(res.first->second, 2);
+
+    // Iterates in key order, like std::map
+    vector<pair<string, int>> got(m.begin(), m.end());
+    ASSERT_EQ(got, (vector<pair<string, int>>{{"a", 1}, {"b", 2}, {"c", 3}, {"d", 4}}));
+
+    ASSERT_EQ(m.count("c"), 1);
+    ASSERT_EQ(m.count(string_view("nope")), 0);
+    ASSERT_EQ(m.at("d"), 4);
+    ASSERT_THROW(m.at("nope"), std::out_of_range);
+
+    ASSERT_EQ(m.erase("b"), 1);
+    ASSERT_EQ(m.erase("b"), 0);
+    auto next = m.erase(m.find("a"));
+    ASSERT_EQ(next->first, "c");
+    ASSERT_EQ(m.size(), 2);
+}
+
+TEST(TestFlatMap, InsertRange) {
+    FlatMap<string, int> m{{"c", 3}, {"a", 1}, {"a", 10}};
+    ASSERT_EQ(m, (FlatMap<string, int>{{"a", 1}, {"c", 3}}));
+
+    // Keys that are already present are skipped, as are later duplicates in the range
+    map<string, int> more{{"b", 2}, {"c", 30}, {"d", 4}};
+    m.insert(more.begin(), more.end());
+    vector<pair<string, int>> got(m.begin(), m.end());
+    ASSERT_EQ(got, (vector<pair<string, int>>{{"a", 1}, {"b", 2}, {"c", 3}, {"d", 4}}));
+
+    // An ordered range going at the end
+    map<string, int> last{{"e", 5}, {"f", 6}};
+    m.insert(last.begin(), last.end());
+    ASSERT_EQ(m.size(), 6);
+    ASSERT_EQ(prev(m.end())->first, "f");
+}